@@ -24,6 +24,14 @@
 #  endif
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define MONGO_UTF8_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define MONGO_UTF8_NEON 1
+#endif
+
 #include "php_mongo.h"
 #include "bson.h"
 #include "mongo_types.h"
@@ -44,19 +52,39 @@ extern zend_class_entry *mongo_ce_BinData,
 ZEND_EXTERN_MODULE_GLOBALS(mongo);
 
 static int get_limit(mongo_cursor *cursor);
-static int prep_obj_for_db(buffer *buf, HashTable *array TSRMLS_DC);
+static int get_more_limit(mongo_cursor *cursor TSRMLS_DC);
+static int prep_obj_for_db(buffer *buf, HashTable *array, int prep TSRMLS_DC);
 #if ZEND_MODULE_API_NO >= 20090115
 static int apply_func_args_wrapper(void **data TSRMLS_DC, int num_args, va_list args, zend_hash_key *key);
 #else
 static int apply_func_args_wrapper(void **data, int num_args, va_list args, zend_hash_key *key);
 #endif /* ZEND_MODULE_API_NO >= 20090115 */
 static int is_utf8(const char *s, int len);
-static int insert_helper(buffer *buf, zval *doc, int max TSRMLS_DC);
+static int insert_helper(buffer *buf, zval *doc, int max, int prep TSRMLS_DC);
 
 
-static int prep_obj_for_db(buffer *buf, HashTable *array TSRMLS_DC) {
+static int prep_obj_for_db(buffer *buf, HashTable *array, int prep TSRMLS_DC) {
   zval temp, **data, *newid;
 
+	if (prep != PREP && zend_hash_find(array, "_id", 4, (void**)&data) == FAILURE) {
+		char id[OID_SIZE];
+
+		generate_id(id TSRMLS_CC);
+		php_mongo_serialize_byte(buf, BSON_OID);
+		php_mongo_serialize_key(buf, "_id", 3, NO_PREP TSRMLS_CC);
+		php_mongo_serialize_bytes(buf, id, OID_SIZE);
+
+		if (prep == PREP_ID_STRING) {
+			MAKE_STD_ZVAL(newid);
+			Z_TYPE_P(newid) = IS_STRING;
+			Z_STRLEN_P(newid) = 2 * OID_SIZE;
+			Z_STRVAL_P(newid) = (char*)emalloc(2 * OID_SIZE + 1);
+			php_mongo_id_to_hex(id, Z_STRVAL_P(newid));
+			zend_hash_add(array, "_id", 4, &newid, sizeof(zval*), NULL);
+		}
+		return EG(exception) ? FAILURE : SUCCESS;
+	}
+
   // if _id field doesn't exist, add it
   if (zend_hash_find(array, "_id", 4, (void**)&data) == FAILURE) {
     // create new MongoId
@@ -99,7 +127,7 @@ int zval_to_bson(buffer *buf, HashTable *hash, int prep TSRMLS_DC) {
 
   if (zend_hash_num_elements(hash) > 0) {
     if (prep) {
-      prep_obj_for_db(buf, hash TSRMLS_CC);
+      prep_obj_for_db(buf, hash, prep TSRMLS_CC);
       num++;
     }
 
@@ -115,6 +143,149 @@ int zval_to_bson(buffer *buf, HashTable *hash, int prep TSRMLS_DC) {
   return EG(exception) ? FAILURE : num;
 }
 
+/*
+ * Estimates the number of bytes php_mongo_serialize_element writes for data,
+ * including the type byte and the key, to reserve the buffer with.
+ */
+static int element_size(char *name, zval **data, int prep TSRMLS_DC) {
+  int size = 1 + strlen(name) + 1;
+
+  if (prep && strcmp(name, "_id") == 0) {
+    return 0;
+  }
+
+  switch (Z_TYPE_PP(data)) {
+  case IS_NULL:
+    return size;
+  case IS_LONG:
+#if SIZEOF_LONG == 8
+    if (MonGlo(native_long)) {
+      return size + INT_64;
+    }
+#endif
+    return size + INT_32;
+  case IS_DOUBLE:
+    return size + DOUBLE_64;
+  case IS_BOOL:
+    return size + 1;
+  case IS_STRING:
+    return size + INT_32 + Z_STRLEN_PP(data) + 1;
+  case IS_ARRAY:
+    return size + zval_to_bson_size(Z_ARRVAL_PP(data), NO_PREP TSRMLS_CC);
+  case IS_OBJECT: {
+    zend_class_entry *clazz = Z_OBJCE_PP(data);
+    zval *z;
+
+    if (clazz == mongo_ce_Id) {
+      mongo_id *id = (mongo_id*)zend_object_store_get_object(*data TSRMLS_CC);
+      return id->id ? size + OID_SIZE : size;
+    }
+    else if (clazz == mongo_ce_Date || clazz == mongo_ce_Timestamp || clazz == mongo_ce_Int64) {
+      return size + INT_64;
+    }
+    else if (clazz == mongo_ce_Int32) {
+      return size + INT_32;
+    }
+    else if (clazz == mongo_ce_MinKey || clazz == mongo_ce_MaxKey) {
+      return size;
+    }
+    else if (clazz == mongo_ce_Regex) {
+      z = zend_read_property(mongo_ce_Regex, *data, "regex", 5, 0 TSRMLS_CC);
+      size += Z_STRLEN_P(z) + 1;
+      z = zend_read_property(mongo_ce_Regex, *data, "flags", 5, 0 TSRMLS_CC);
+      return size + Z_STRLEN_P(z) + 1;
+    }
+    else if (clazz == mongo_ce_Code) {
+      z = zend_read_property(mongo_ce_Code, *data, "code", 4, 0 TSRMLS_CC);
+      size += INT_32 + INT_32 + Z_STRLEN_P(z) + 1;
+      z = zend_read_property(mongo_ce_Code, *data, "scope", 5, 0 TSRMLS_CC);
+      return size + zval_to_bson_size(HASH_P(z), NO_PREP TSRMLS_CC);
+    }
+    else if (clazz == mongo_ce_BinData) {
+      mongo_bin_data *bin = (mongo_bin_data*)php_mongo_native_get(*data TSRMLS_CC);
+      size += bin->type == 2 ? INT_32 + 1 + INT_32 : INT_32 + 1;
+      return size + bin->bin_len;
+    }
+
+    return size + zval_to_bson_size(Z_OBJPROP_PP(data), NO_PREP TSRMLS_CC);
+  }
+  }
+
+  // anything else (resources) isn't serialized at all
+  return 0;
+}
+
+int php_mongo_element_size(char *name, zval **data TSRMLS_DC) {
+  return element_size(name, data, NO_PREP TSRMLS_CC);
+}
+
+int zval_to_bson_size(HashTable *hash, int prep TSRMLS_DC) {
+  HashPosition pointer;
+  zval **data;
+  char *key, name[30];
+  uint key_len;
+  ulong index;
+  // length and trailing \0
+  int size = INT_32 + 1;
+
+  if (zend_hash_num_elements(hash) == 0) {
+    return size;
+  }
+
+  /* the same protection against recursive arrays as zval_to_bson, which
+   * doesn't get to run its own before this pass is done */
+  if (hash->bApplyProtection && hash->nApplyCount++ >= 3) {
+    zend_error(E_ERROR, "Nesting level too deep - recursive dependency?");
+  }
+
+  // prep_obj_for_db writes the _id first, adding a MongoId if there isn't one
+  if (prep) {
+    if (zend_hash_find(hash, "_id", 4, (void**)&data) == SUCCESS) {
+      size += element_size("_id", data, NO_PREP TSRMLS_CC);
+    }
+    else {
+      size += 1 + 4 + OID_SIZE;
+    }
+  }
+
+  for (zend_hash_internal_pointer_reset_ex(hash, &pointer);
+       zend_hash_get_current_data_ex(hash, (void**)&data, &pointer) == SUCCESS;
+       zend_hash_move_forward_ex(hash, &pointer)) {
+
+    if (zend_hash_get_current_key_ex(hash, &key, &key_len, &index, NO_DUP, &pointer) == HASH_KEY_IS_LONG) {
+      snprintf(name, sizeof(name), "%ld", (long)index);
+      key = name;
+    }
+
+    size += element_size(key, data, prep TSRMLS_CC);
+  }
+
+  if (hash->bApplyProtection) {
+    hash->nApplyCount--;
+  }
+
+  return size;
+}
+
+/*
+ * Makes sure buf can take size more bytes without being resized again.
+ */
+static void reserve_buf(buffer *buf, int size) {
+  // the serialize functions grow the buffer when it is exactly full
+  if (BUF_REMAINING <= size) {
+    int used = buf->pos - buf->start;
+
+    buf->start = (char*)erealloc(buf->start, used + size + 1);
+    buf->pos = buf->start + used;
+    buf->end = buf->pos + size + 1;
+  }
+}
+
+int zval_to_bson_presized(buffer *buf, HashTable *hash, int prep TSRMLS_DC) {
+  reserve_buf(buf, zval_to_bson_size(hash, prep TSRMLS_CC));
+  return zval_to_bson(buf, hash, prep TSRMLS_CC);
+}
+
 #if ZEND_MODULE_API_NO >= 20090115
 static int apply_func_args_wrapper(void **data TSRMLS_DC, int num_args, va_list args, zend_hash_key *key)
 #else
@@ -167,6 +338,112 @@ static int apply_func_args_wrapper(void **data, int num_args, va_list args, zend
   }
 }
 
+/* Whether the keys of the array are 0 to n-1 in that order, which makes it a
+ * BSON array rather than an object */
+static int is_packed_list(HashTable *hash) {
+	Bucket *p;
+	ulong i = 0;
+
+	for (p = hash->pListHead; p; p = p->pListNext, i++) {
+		if (p->nKeyLength || p->h != i) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Adds one to the decimal number in key, which is key_len digits long */
+static void next_list_key(char *key, int *key_len) {
+	int i = *key_len - 1;
+
+	while (i >= 0 && key[i] == '9') {
+		key[i--] = '0';
+	}
+	if (i >= 0) {
+		key[i]++;
+		return;
+	}
+	memmove(key + 1, key, *key_len + 1);
+	key[0] = '1';
+	(*key_len)++;
+}
+
+/* Writes the type and the key of a list element, which can't be anything
+ * that php_mongo_serialize_key would refuse or change */
+static void serialize_list_key(buffer *buf, char type, char *key, int key_len) {
+	if (BUF_REMAINING <= key_len + 2) {
+		resize_buf(buf, key_len + 2);
+	}
+	*buf->pos = type;
+	memcpy(buf->pos + 1, key, key_len + 1);
+	buf->pos += key_len + 2;
+}
+
+/* Serializes an array for which is_packed_list holds, going through its
+ * buckets rather than zend_hash_apply_with_arguments. The keys are counted
+ * up as strings instead of being converted from the index, and scalars are
+ * written right here. */
+static int list_to_bson(buffer *buf, HashTable *hash TSRMLS_DC) {
+	char key[24] = "0";
+	int key_len = 1;
+	uint start;
+	Bucket *p;
+	zval **data;
+
+	/* the same protection against recursive arrays as zend_hash_apply */
+	if (hash->bApplyProtection && hash->nApplyCount++ >= 3) {
+		zend_error(E_ERROR, "Nesting level too deep - recursive dependency?");
+	}
+
+	if(BUF_REMAINING <= 5) {
+		resize_buf(buf, 5);
+	}
+	start = buf->pos - buf->start;
+	buf->pos += INT_32;
+
+	for (p = hash->pListHead; p && !EG(exception); p = p->pListNext) {
+		data = (zval**)p->pData;
+
+		switch (Z_TYPE_PP(data)) {
+		case IS_LONG:
+#if SIZEOF_LONG == 8
+			if (MonGlo(native_long)) {
+				serialize_list_key(buf, BSON_LONG, key, key_len);
+				php_mongo_serialize_long(buf, Z_LVAL_PP(data));
+				break;
+			}
+#endif
+			serialize_list_key(buf, BSON_INT, key, key_len);
+			php_mongo_serialize_int(buf, Z_LVAL_PP(data));
+			break;
+		case IS_DOUBLE:
+			serialize_list_key(buf, BSON_DOUBLE, key, key_len);
+			php_mongo_serialize_double(buf, Z_DVAL_PP(data));
+			break;
+		case IS_BOOL:
+			serialize_list_key(buf, BSON_BOOL, key, key_len);
+			php_mongo_serialize_bool(buf, Z_BVAL_PP(data));
+			break;
+		case IS_NULL:
+			serialize_list_key(buf, BSON_NULL, key, key_len);
+			break;
+		default:
+			php_mongo_serialize_element(key, data, buf, NO_PREP TSRMLS_CC);
+			break;
+		}
+
+		next_list_key(key, &key_len);
+	}
+
+	if (hash->bApplyProtection) {
+		hash->nApplyCount--;
+	}
+
+	php_mongo_serialize_null(buf);
+	php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
+	return EG(exception) ? FAILURE : SUCCESS;
+}
+
 int php_mongo_serialize_element(char *name, zval **data, buffer *buf, int prep TSRMLS_DC) {
   int name_len = strlen(name);
 
@@ -225,6 +502,13 @@ int php_mongo_serialize_element(char *name, zval **data, buffer *buf, int prep T
 
     //serialize
     PHP_MONGO_SERIALIZE_KEY(BSON_ARRAY);
+    if (is_packed_list(Z_ARRVAL_PP(data))) {
+      if (list_to_bson(buf, Z_ARRVAL_PP(data) TSRMLS_CC) == FAILURE) {
+        return ZEND_HASH_APPLY_STOP;
+      }
+      break;
+    }
+
     num = zval_to_bson(buf, Z_ARRVAL_PP(data), NO_PREP TSRMLS_CC);
     if (EG(exception)) {
       return ZEND_HASH_APPLY_STOP;
@@ -341,44 +625,29 @@ int resize_buf(buffer *buf, int size) {
  */
 void php_mongo_serialize_date(buffer *buf, zval *date TSRMLS_DC) {
   int64_t ms;
-  zval *sec = zend_read_property(mongo_ce_Date, date, "sec", 3, 0 TSRMLS_CC);
-  zval *usec = zend_read_property(mongo_ce_Date, date, "usec", 4, 0 TSRMLS_CC);
+  mongo_date *d = (mongo_date*)php_mongo_native_get(date TSRMLS_CC);
 
-  ms = ((int64_t)Z_LVAL_P(sec) * 1000) + ((int64_t)Z_LVAL_P(usec) / 1000);
+  ms = ((int64_t)d->sec * 1000) + ((int64_t)d->usec / 1000);
   php_mongo_serialize_long(buf, ms);
 }
 
-#if defined(_MSC_VER)
-# define strtoll(s, f, b) _atoi64(s)
-#elif !defined(HAVE_STRTOLL)
-# if defined(HAVE_ATOLL)
-#  define strtoll(s, f, b) atoll(s)
-# else
-#  define strtoll(s, f, b) strtol(s, f, b)
-# endif
-#endif
-
 
 /*
  * create a bson int from an Int32 object
  */
 void php_mongo_serialize_int32(buffer *buf, zval *data TSRMLS_DC) {
-  int value;
-  zval *zvalue = zend_read_property(mongo_ce_Int32, data, "value", 5, 0 TSRMLS_CC);
-  value = strtol(Z_STRVAL_P(zvalue), NULL, 10);
+  mongo_int *i = (mongo_int*)php_mongo_native_get(data TSRMLS_CC);
 
-  php_mongo_serialize_int(buf, value);
+  php_mongo_serialize_int(buf, (int)i->value);
 }
 
 /*
  * create a bson long from an Int64 object
  */
 void php_mongo_serialize_int64(buffer *buf, zval *data TSRMLS_DC) {
-  int64_t value;
-  zval *zvalue = zend_read_property(mongo_ce_Int64, data, "value", 5, 0 TSRMLS_CC);
-  value = strtoll(Z_STRVAL_P(zvalue), NULL, 10);
+  mongo_int *i = (mongo_int*)php_mongo_native_get(data TSRMLS_CC);
 
-  php_mongo_serialize_long(buf, value);
+  php_mongo_serialize_long(buf, i->value);
 }
 
 /*
@@ -437,10 +706,7 @@ void php_mongo_serialize_code(buffer *buf, zval *code TSRMLS_DC) {
  * bindata
  */
 void php_mongo_serialize_bin_data(buffer *buf, zval *bin TSRMLS_DC) {
-  zval *zbin, *ztype;
-
-  zbin = zend_read_property(mongo_ce_BinData, bin, "bin", 3, 0 TSRMLS_CC);
-  ztype = zend_read_property(mongo_ce_BinData, bin, "type", 4, 0 TSRMLS_CC);
+  mongo_bin_data *data = (mongo_bin_data*)php_mongo_native_get(bin TSRMLS_CC);
 
   /*
    * type 2 has the redundant structure:
@@ -454,13 +720,13 @@ void php_mongo_serialize_bin_data(buffer *buf, zval *bin TSRMLS_DC) {
    *
    */
 
-  if (Z_LVAL_P(ztype) == 2) {
+  if (data->type == 2) {
     // length
-    php_mongo_serialize_int(buf, Z_STRLEN_P(zbin)+4);
+    php_mongo_serialize_int(buf, data->bin_len+4);
     // 02
     php_mongo_serialize_byte(buf, 2);
     // length
-    php_mongo_serialize_int(buf, Z_STRLEN_P(zbin));
+    php_mongo_serialize_int(buf, data->bin_len);
   }
   /* other types have
    *
@@ -470,13 +736,13 @@ void php_mongo_serialize_bin_data(buffer *buf, zval *bin TSRMLS_DC) {
    */
   else {
     // length
-    php_mongo_serialize_int(buf, Z_STRLEN_P(zbin));
+    php_mongo_serialize_int(buf, data->bin_len);
     // type
-    php_mongo_serialize_byte(buf, (unsigned char)Z_LVAL_P(ztype));
+    php_mongo_serialize_byte(buf, (unsigned char)data->type);
   }
 
   // bindata
-  php_mongo_serialize_bytes(buf, Z_STRVAL_P(zbin), Z_STRLEN_P(zbin));
+  php_mongo_serialize_bytes(buf, data->bin, data->bin_len);
 }
 
 /*
@@ -634,10 +900,40 @@ int php_mongo_serialize_size(char *start, buffer *buf TSRMLS_DC) {
   return SUCCESS;
 }
 
-static int insert_helper(buffer *buf, zval *doc, int max TSRMLS_DC) {
+/*
+ * Appends a document that is already BSON. Only the framing is checked, the
+ * database validates the rest. No _id is added, the database will do that.
+ */
+static int insert_raw_helper(buffer *buf, zval *doc, int max TSRMLS_DC) {
+  char *bson = Z_STRVAL_P(doc);
+  int len = Z_STRLEN_P(doc);
+
+  if (len < INT_32 + 1 || MONGO_32(*(int*)bson) != len || bson[len - 1] != 0) {
+    zend_throw_exception_ex(mongo_ce_Exception, 19 TSRMLS_CC, "invalid BSON document of %d bytes", len);
+    return FAILURE;
+  }
+  else if (len == INT_32 + 1) {
+    zend_throw_exception_ex(mongo_ce_Exception, 4 TSRMLS_CC, "no elements in doc");
+    return FAILURE;
+  }
+  else if (len > max) {
+    zend_throw_exception_ex(mongo_ce_Exception, 5 TSRMLS_CC, "size of BSON doc is %d bytes, max is %d", len, max);
+    return FAILURE;
+  }
+
+  php_mongo_serialize_bytes(buf, bson, len);
+  return SUCCESS;
+}
+
+static int insert_helper(buffer *buf, zval *doc, int max, int prep TSRMLS_DC) {
   int start = buf->pos - buf->start;
+  int result;
+
+  if (Z_TYPE_P(doc) == IS_STRING) {
+    return insert_raw_helper(buf, doc, max TSRMLS_CC);
+  }
 
-  int result = zval_to_bson(buf, HASH_P(doc), PREP TSRMLS_CC);
+  result = zval_to_bson_presized(buf, HASH_P(doc), prep TSRMLS_CC);
 
   // throw exception if serialization crapped out
   if (EG(exception) || FAILURE == result) {
@@ -665,15 +961,23 @@ int php_mongo_write_insert(buffer *buf, char *ns, zval *doc, int max TSRMLS_DC)
 
   CREATE_HEADER(buf, ns, OP_INSERT);
 
-  if (FAILURE == insert_helper(buf, doc, max TSRMLS_CC)) {
+  if (FAILURE == insert_helper(buf, doc, max, PREP TSRMLS_CC)) {
     return FAILURE;
   }
 
   return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
 }
 
-int php_mongo_write_batch_insert(buffer *buf, char *ns, int flags, zval *docs, int max TSRMLS_DC) {
-  int start = buf->pos - buf->start, count = 0;
+/*
+ * Creates one or more OP_INSERT messages for docs, back to back in buf. A
+ * message is closed as soon as the next document would take it over max (or
+ * the server's 16000000 byte limit on messages) and that document starts the
+ * next message, so a batch never fails for its total size. prep is PREP or
+ * one of the PREP_ID_* modes, for the documents without an _id.
+ */
+int php_mongo_write_batch_insert(buffer *buf, char *ns, int flags, zval *docs, int max, int prep TSRMLS_DC) {
+  int start = buf->pos - buf->start, count = 0, in_message = 0;
+  int limit = max < 16000000 ? max : 16000000;
   HashPosition pointer;
   zval **doc;
   mongo_msg_header header;
@@ -685,17 +989,43 @@ int php_mongo_write_batch_insert(buffer *buf, char *ns, int flags, zval *docs, i
   for(zend_hash_internal_pointer_reset_ex(HASH_P(docs), &pointer);
       zend_hash_get_current_data_ex(HASH_P(docs), (void**)&doc, &pointer) == SUCCESS;
       zend_hash_move_forward_ex(HASH_P(docs), &pointer)) {
+    int doc_start = buf->pos - buf->start;
 
-    if (IS_SCALAR_PP(doc)) {
+    // strings are documents that are already BSON
+    if (IS_SCALAR_PP(doc) && Z_TYPE_PP(doc) != IS_STRING) {
       continue;
     }
 
-    if (FAILURE == insert_helper(buf, *doc, max TSRMLS_CC) ||
-        buf->pos - buf->start >= MonGlo(max_send_size)) {
+    if (FAILURE == insert_helper(buf, *doc, max, prep TSRMLS_CC)) {
       return FAILURE;
     }
 
+    // move the document into a new message if it doesn't fit
+    if (in_message > 0 && buf->pos - (buf->start + start) > limit) {
+      int doc_len = buf->pos - (buf->start + doc_start);
+      char *copy = (char*)emalloc(doc_len);
+
+      memcpy(copy, buf->start + doc_start, doc_len);
+      buf->pos = buf->start + doc_start;
+
+      if (FAILURE == php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC)) {
+        efree(copy);
+        return FAILURE;
+      }
+
+      start = buf->pos - buf->start;
+      if (BUF_REMAINING <= INT_32) {
+        resize_buf(buf, INT_32);
+      }
+      CREATE_HEADER_WITH_OPTS(buf, ns, OP_INSERT, flags);
+      php_mongo_serialize_bytes(buf, copy, doc_len);
+      efree(copy);
+
+      in_message = 0;
+    }
+
     count++;
+    in_message++;
   }
 
   // if there are no elements, don't bother saving
@@ -704,12 +1034,6 @@ int php_mongo_write_batch_insert(buffer *buf, char *ns, int flags, zval *docs, i
     return FAILURE;
   }
 
-  // this is a hard limit in the db server (util/messages.cpp)
-  if (buf->pos - (buf->start + start) > 16000000) {
-    zend_throw_exception_ex(mongo_ce_Exception, 3 TSRMLS_CC, "insert too large: %d, max: 16000000", buf->pos - (buf->start+start));
-    return FAILURE;
-  }
-
   return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
 }
 
@@ -723,7 +1047,7 @@ int php_mongo_write_update(buffer *buf, char *ns, int flags, zval *criteria, zva
 
   if (zval_to_bson(buf, HASH_P(criteria), NO_PREP TSRMLS_CC) == FAILURE ||
       EG(exception) ||
-      zval_to_bson(buf, HASH_P(newobj), NO_PREP TSRMLS_CC) == FAILURE ||
+      zval_to_bson_presized(buf, HASH_P(newobj), NO_PREP TSRMLS_CC) == FAILURE ||
       EG(exception)) {
     return FAILURE;
   }
@@ -767,7 +1091,9 @@ int php_mongo_write_query(buffer *buf, mongo_cursor *cursor TSRMLS_DC) {
   cursor->send.request_id = header.request_id;
 
   php_mongo_serialize_int(buf, cursor->skip);
-  php_mongo_serialize_int(buf, get_limit(cursor));
+	/* the server only takes -1 for a command, the batch size goes in the
+	 * command's cursor document */
+	php_mongo_serialize_int(buf, cursor->command_cursor ? -1 : get_limit(cursor));
 
   if (zval_to_bson(buf, HASH_P(cursor->query), NO_PREP TSRMLS_CC) == FAILURE ||
       EG(exception)) {
@@ -800,7 +1126,7 @@ int php_mongo_write_kill_cursors(buffer *buf, int64_t cursor_id TSRMLS_DC) {
  * Creates a GET_MORE request
  *
  * The following fields of cursor are used:
- *  - ns
+ *  - ns (or cursor_ns, for a command's cursor)
  *  - recv.request_id
  *  - limit
  *  - cursor_id
@@ -809,431 +1135,719 @@ int php_mongo_write_get_more(buffer *buf, mongo_cursor *cursor TSRMLS_DC) {
   mongo_msg_header header;
   int start = buf->pos - buf->start;
 
-  CREATE_RESPONSE_HEADER(buf, cursor->ns, cursor->recv.request_id, OP_GET_MORE);
+  CREATE_RESPONSE_HEADER(buf, cursor->cursor_ns ? cursor->cursor_ns : cursor->ns, cursor->recv.request_id, OP_GET_MORE);
   cursor->send.request_id = header.request_id;
 
-  php_mongo_serialize_int(buf, get_limit(cursor));
+  php_mongo_serialize_int(buf, get_more_limit(cursor TSRMLS_CC));
   php_mongo_serialize_long(buf, cursor->cursor_id);
 
   return php_mongo_serialize_size(buf->start + start, buf TSRMLS_CC);
 }
 
 
-static int get_limit(mongo_cursor *cursor) {
+static int get_limit_for(mongo_cursor *cursor, int batch_size) {
   int lim_at;
 
   if (cursor->limit < 0) {
     return cursor->limit;
   }
-  else if (cursor->batch_size < 0) {
-    return cursor->batch_size;
+  else if (batch_size < 0) {
+    return batch_size;
   }
 
-  lim_at = cursor->limit > cursor->batch_size ? cursor->limit - cursor->at : cursor->limit;
-  if (cursor->batch_size && (!lim_at || cursor->batch_size <= lim_at)) {
-    return cursor->batch_size;
+  lim_at = cursor->limit > batch_size ? cursor->limit - cursor->at : cursor->limit;
+  if (batch_size && (!lim_at || batch_size <= lim_at)) {
+    return batch_size;
   }
-  else if (lim_at && (!cursor->batch_size || lim_at < cursor->batch_size)) {
+  else if (lim_at && (!batch_size || lim_at < batch_size)) {
     return lim_at;
   }
 
   return 0;
 }
 
+static int get_limit(mongo_cursor *cursor) {
+  return get_limit_for(cursor, cursor->batch_size);
+}
 
-char* bson_to_zval(char *buf, HashTable *result TSRMLS_DC) {
-  /*
-   * buf_start is used for debugging
-   *
-   * if the deserializer runs into bson it can't
-   * parse, it will dump the bytes to that point.
-   *
-   * we lose buf's position as we iterate, so we
-   * need buf_start to save it.
-   */
-  char *buf_start = buf;
-  char type;
-
-  if (buf == 0) {
-    return 0;
-  }
-
-  // for size
-  buf += INT_32;
-
-  while ((type = *buf++) != 0) {
-    char *name;
-    zval *value;
-
-    name = buf;
-    // get past field name
-    buf += strlen(buf) + 1;
+/* Once the size of the documents is known, an OP_GET_MORE asks for as many
+ * as fit in cursor->batch_bytes, and no more than fit in what is left of
+ * mongo.cursor_buffer_limit. The first reply always goes by batch_size, as
+ * numberToReturn has special meanings for OP_QUERY. */
+static int get_more_limit(mongo_cursor *cursor TSRMLS_DC) {
+	int batch_size = cursor->batch_size;
+	long fits;
+
+	if (cursor->avg_doc_size <= 0 || batch_size < 0) {
+		return get_limit(cursor);
+	}
+
+	if (cursor->batch_bytes > 0) {
+		batch_size = cursor->batch_bytes / cursor->avg_doc_size;
+		if (batch_size < 1) {
+			batch_size = 1;
+		}
+	}
+	if (cursor->budgeted && MonGlo(cursor_buffer_limit) > 0) {
+		fits = (MonGlo(cursor_buffer_limit) - MonGlo(cursor_buffer_used) + cursor->budget_bytes) / cursor->avg_doc_size;
+		if (fits < 1) {
+			fits = 1;
+		}
+		if (!batch_size || fits < batch_size) {
+			batch_size = fits > INT_MAX ? INT_MAX : (int) fits;
+		}
+	}
+
+	return get_limit_for(cursor, batch_size);
+}
 
-    MAKE_STD_ZVAL(value);
-    ZVAL_NULL(value);
 
-    // get value
-    switch(type) {
-    case BSON_OID: {
-      mongo_id *this_id;
-      zval *str = 0;
+/* Decodes the value of a single element of the given type into value. buf
+ * points just past the element's name, buf_start at the start of the
+ * enclosing document (used for error reporting). Returns the position
+ * after the value, or 0 on failure; the caller owns value either way. */
+char* bson_value_to_zval(char type, char *name, char *buf, char *buf_start, zval *value TSRMLS_DC) {
+  switch(type) {
+  case BSON_OID: {
+    mongo_id *this_id;
 
-      object_init_ex(value, mongo_ce_Id);
+    // $id is filled in by the MongoId handlers when it is first read
+    object_init_ex(value, mongo_ce_Id);
 
-      this_id = (mongo_id*)zend_object_store_get_object(value TSRMLS_CC);
-      this_id->id = estrndup(buf, OID_SIZE);
+    this_id = (mongo_id*)zend_object_store_get_object(value TSRMLS_CC);
+    this_id->id = estrndup(buf, OID_SIZE);
 
-      MAKE_STD_ZVAL(str);
-      ZVAL_NULL(str);
+    buf += OID_SIZE;
+    break;
+  }
+  case BSON_DOUBLE: {
+    double d = *(double*)buf;
+    int64_t i, *i_p;
+    i_p = &i;
 
-      MONGO_METHOD(MongoId, __toString, str, value);
-      zend_update_property(mongo_ce_Id, value, "$id", strlen("$id"), str TSRMLS_CC);
-      zval_ptr_dtor(&str);
+    memcpy(i_p, &d, DOUBLE_64);
+    i = MONGO_64(i);
+    memcpy(&d, i_p, DOUBLE_64);
 
-      buf += OID_SIZE;
-      break;
+    ZVAL_DOUBLE(value, d);
+    buf += DOUBLE_64;
+    break;
+  }
+  case BSON_SYMBOL:
+  case BSON_STRING: {
+    // len includes \0
+    int len = MONGO_32(*((int*)buf));
+    if (INVALID_STRING_LEN(len)) {
+      zend_throw_exception_ex(mongo_ce_CursorException, 0 TSRMLS_CC, "invalid string length for key \"%s\": %d", name, len);
+      return 0;
     }
-    case BSON_DOUBLE: {
-      double d = *(double*)buf;
-      int64_t i, *i_p;
-      i_p = &i;
-
-      memcpy(i_p, &d, DOUBLE_64);
-      i = MONGO_64(i);
-      memcpy(&d, i_p, DOUBLE_64);
+    buf += INT_32;
 
-      ZVAL_DOUBLE(value, d);
-      buf += DOUBLE_64;
-      break;
+    ZVAL_STRINGL(value, buf, len-1, 1);
+    buf += len;
+    break;
+  }
+  case BSON_OBJECT:
+  case BSON_ARRAY: {
+    array_init(value);
+    buf = bson_to_zval(buf, Z_ARRVAL_P(value) TSRMLS_CC);
+    if (EG(exception)) {
+      return 0;
     }
-    case BSON_SYMBOL:
-    case BSON_STRING: {
-      // len includes \0
-      int len = MONGO_32(*((int*)buf));
-      if (INVALID_STRING_LEN(len)) {
-        zval_ptr_dtor(&value);
-        zend_throw_exception_ex(mongo_ce_CursorException, 0 TSRMLS_CC, "invalid string length for key \"%s\": %d", name, len);
-        return 0;
-      }
-      buf += INT_32;
+    break;
+  }
+  case BSON_BINARY: {
+    unsigned char type;
 
-      ZVAL_STRINGL(value, buf, len-1, 1);
-      buf += len;
-      break;
-    }
-    case BSON_OBJECT:
-    case BSON_ARRAY: {
-      array_init(value);
-      buf = bson_to_zval(buf, Z_ARRVAL_P(value) TSRMLS_CC);
-      if (EG(exception)) {
-        zval_ptr_dtor(&value);
-        return 0;
-      }
-      break;
+    int len = MONGO_32(*(int*)buf);
+    if (INVALID_STRING_LEN(len)) {
+      zend_throw_exception_ex(mongo_ce_CursorException, 1 TSRMLS_CC, "invalid binary length for key \"%s\": %d", name, len);
+      return 0;
     }
-    case BSON_BINARY: {
-      unsigned char type;
+    buf += INT_32;
 
-      int len = MONGO_32(*(int*)buf);
-      if (INVALID_STRING_LEN(len)) {
-        zval_ptr_dtor(&value);
-        zend_throw_exception_ex(mongo_ce_CursorException, 1 TSRMLS_CC, "invalid binary length for key \"%s\": %d", name, len);
-        return 0;
-      }
-      buf += INT_32;
+    type = *buf++;
 
-      type = *buf++;
+    /* If the type is 2, check if the binary data
+     * is prefixed by its length.
+     *
+     * There is an infinitesimally small chance that
+     * the first four bytes will happen to be the
+     * length of the rest of the string.  In this
+     * case, the data will be corrupted.
+     */
+    if ((int)type == 2) {
+      int len2 = MONGO_32(*(int*)buf);
 
-      /* If the type is 2, check if the binary data
-       * is prefixed by its length.
-       *
-       * There is an infinitesimally small chance that
-       * the first four bytes will happen to be the
-       * length of the rest of the string.  In this
-       * case, the data will be corrupted.
+      /* if the lengths match, the data is to spec,
+       * so we use len2 as the true length.
        */
-      if ((int)type == 2) {
-        int len2 = MONGO_32(*(int*)buf);
-
-        /* if the lengths match, the data is to spec,
-         * so we use len2 as the true length.
-         */
-        if (len2 == len - 4) {
-          len = len2;
-          buf += INT_32;
-        }
+      if (len2 == len - 4) {
+        len = len2;
+        buf += INT_32;
       }
-
-      object_init_ex(value, mongo_ce_BinData);
-
-      zend_update_property_stringl(mongo_ce_BinData, value, "bin", strlen("bin"), buf, len TSRMLS_CC);
-      zend_update_property_long(mongo_ce_BinData, value, "type", strlen("type"), type TSRMLS_CC);
-
-      buf += len;
-      break;
-    }
-    case BSON_BOOL: {
-      char d = *buf++;
-      ZVAL_BOOL(value, d);
-      break;
-    }
-    case BSON_UNDEF:
-    case BSON_NULL: {
-      ZVAL_NULL(value);
-      break;
-    }
-    case BSON_INT: {
-      ZVAL_LONG(value, MONGO_32(*((int*)buf)));
-      buf += INT_32;
-      break;
     }
-    case BSON_LONG: {
-      if (MonGlo(long_as_object)) {
-        char *buffer;
 
-#ifdef WIN32
-        spprintf(&buffer, 0, "%I64d", (int64_t)MONGO_64(*((int64_t*)buf)));
-#else
-        spprintf(&buffer, 0, "%lld", (long long int)MONGO_64(*((int64_t*)buf)));
-#endif
-        object_init_ex(value, mongo_ce_Int64);
-
-        zend_update_property_string(mongo_ce_Int64, value, "value", strlen("value"), buffer TSRMLS_CC);
+    php_mongo_bin_data_init(value, buf, len, type TSRMLS_CC);
 
-        efree(buffer);
-      } else {
-        if (MonGlo(native_long)) {
+    buf += len;
+    break;
+  }
+  case BSON_BOOL: {
+    char d = *buf++;
+    ZVAL_BOOL(value, d);
+    break;
+  }
+  case BSON_UNDEF:
+  case BSON_NULL: {
+    ZVAL_NULL(value);
+    break;
+  }
+  case BSON_INT: {
+    ZVAL_LONG(value, MONGO_32(*((int*)buf)));
+    buf += INT_32;
+    break;
+  }
+  case BSON_LONG: {
+    if (MonGlo(long_as_object)) {
+      php_mongo_int64_init(value, (int64_t)MONGO_64(*((int64_t*)buf)) TSRMLS_CC);
+    } else {
+      if (MonGlo(native_long)) {
 #if SIZEOF_LONG == 4
-          zend_throw_exception_ex(mongo_ce_CursorException, 1 TSRMLS_CC, "Can not natively represent the long %llu on this platform", (int64_t)MONGO_64(*((int64_t*)buf)));
-          return 0;
+        zend_throw_exception_ex(mongo_ce_CursorException, 1 TSRMLS_CC, "Can not natively represent the long %llu on this platform", (int64_t)MONGO_64(*((int64_t*)buf)));
+        return 0;
 #else
 # if SIZEOF_LONG == 8
-          ZVAL_LONG(value, (long)MONGO_64(*((int64_t*)buf)));
+        ZVAL_LONG(value, (long)MONGO_64(*((int64_t*)buf)));
 # else
 #  error The PHP number size is neither 4 or 8 bytes; no clue what to do with that!
 # endif
 #endif
-        } else {
-          ZVAL_DOUBLE(value, (double)MONGO_64(*((int64_t*)buf)));
-        }
+      } else {
+        ZVAL_DOUBLE(value, (double)MONGO_64(*((int64_t*)buf)));
       }
-      buf += INT_64;
-      break;
     }
-    case BSON_DATE: {
-      int64_t d = MONGO_64(*((int64_t*)buf));
-      buf += INT_64;
+    buf += INT_64;
+    break;
+  }
+  case BSON_DATE: {
+    int64_t d = MONGO_64(*((int64_t*)buf));
+    buf += INT_64;
 
-      object_init_ex(value, mongo_ce_Date);
+    php_mongo_date_init(value, (long)(d/1000), (long)((d*1000)%1000000) TSRMLS_CC);
 
-      zend_update_property_long(mongo_ce_Date, value, "sec", strlen("sec"), (long)(d/1000) TSRMLS_CC);
-      zend_update_property_long(mongo_ce_Date, value, "usec", strlen("usec"), (long)((d*1000)%1000000) TSRMLS_CC);
+    break;
+  }
+  case BSON_REGEX: {
+    char *regex, *flags;
+    int regex_len, flags_len;
 
-      break;
-    }
-    case BSON_REGEX: {
-      char *regex, *flags;
-      int regex_len, flags_len;
+    regex = buf;
+    regex_len = strlen(buf);
+    buf += regex_len+1;
 
-      regex = buf;
-      regex_len = strlen(buf);
-      buf += regex_len+1;
+    flags = buf;
+    flags_len = strlen(buf);
+    buf += flags_len+1;
 
-      flags = buf;
-      flags_len = strlen(buf);
-      buf += flags_len+1;
+    object_init_ex(value, mongo_ce_Regex);
 
-      object_init_ex(value, mongo_ce_Regex);
+    zend_update_property_stringl(mongo_ce_Regex, value, "regex", strlen("regex"), regex, regex_len TSRMLS_CC);
+    zend_update_property_stringl(mongo_ce_Regex, value, "flags", strlen("flags"), flags, flags_len TSRMLS_CC);
 
-      zend_update_property_stringl(mongo_ce_Regex, value, "regex", strlen("regex"), regex, regex_len TSRMLS_CC);
-      zend_update_property_stringl(mongo_ce_Regex, value, "flags", strlen("flags"), flags, flags_len TSRMLS_CC);
+    break;
+  }
+  case BSON_CODE:
+  case BSON_CODE__D: {
+    zval *zcope;
+    int code_len;
+    char *code;
+
+    // CODE has a useless total size field
+    if (type == BSON_CODE) {
+      buf += INT_32;
+    }
 
-      break;
+    // length of code (includes \0)
+    code_len = MONGO_32(*(int*)buf);
+    if (INVALID_STRING_LEN(code_len)) {
+      zend_throw_exception_ex(mongo_ce_CursorException, 2 TSRMLS_CC, "invalid code length for key \"%s\": %d", name, code_len);
+      return 0;
     }
-    case BSON_CODE:
-    case BSON_CODE__D: {
-      zval *zcope;
-      int code_len;
-      char *code;
+    buf += INT_32;
 
-      // CODE has a useless total size field
-      if (type == BSON_CODE) {
-        buf += INT_32;
-      }
+    code = buf;
+    buf += code_len;
+
+    // initialize scope array
+    MAKE_STD_ZVAL(zcope);
+    array_init(zcope);
 
-      // length of code (includes \0)
-      code_len = MONGO_32(*(int*)buf);
-      if (INVALID_STRING_LEN(code_len)) {
-        zval_ptr_dtor(&value);
-        zend_throw_exception_ex(mongo_ce_CursorException, 2 TSRMLS_CC, "invalid code length for key \"%s\": %d", name, code_len);
+    if (type == BSON_CODE) {
+      buf = bson_to_zval(buf, HASH_P(zcope) TSRMLS_CC);
+      if (EG(exception)) {
+        zval_ptr_dtor(&zcope);
         return 0;
       }
-      buf += INT_32;
+    }
+
+    object_init_ex(value, mongo_ce_Code);
+    // exclude \0
+    zend_update_property_stringl(mongo_ce_Code, value, "code", strlen("code"), code, code_len-1 TSRMLS_CC);
+    zend_update_property(mongo_ce_Code, value, "scope", strlen("scope"), zcope TSRMLS_CC);
+    zval_ptr_dtor(&zcope);
 
-      code = buf;
-      buf += code_len;
+    break;
+  }
+  /* DEPRECATED
+   * database reference (12)
+   *   - 4 bytes ns length (includes trailing \0)
+   *   - ns + \0
+   *   - 12 bytes MongoId
+   * This converts the deprecated, old-style db ref type
+   * into the new type (array('$ref' => ..., $id => ...)).
+   */
+  case BSON_DBREF: {
+    int ns_len;
+    char *ns;
+    zval *zoid;
+    mongo_id *this_id;
+
+    // ns
+    ns_len = *(int*)buf;
+    if (INVALID_STRING_LEN(ns_len)) {
+      zend_throw_exception_ex(mongo_ce_CursorException, 3 TSRMLS_CC, "invalid dbref length for key \"%s\": %d", name, ns_len);
+      return 0;
+    }
+    buf += INT_32;
+    ns = buf;
+    buf += ns_len;
 
-      // initialize scope array
-      MAKE_STD_ZVAL(zcope);
-      array_init(zcope);
+    // id
+    MAKE_STD_ZVAL(zoid);
+    object_init_ex(zoid, mongo_ce_Id);
 
-      if (type == BSON_CODE) {
-        buf = bson_to_zval(buf, HASH_P(zcope) TSRMLS_CC);
-        if (EG(exception)) {
-          zval_ptr_dtor(&zcope);
-          return 0;
-        }
-      }
+    this_id = (mongo_id*)zend_object_store_get_object(zoid TSRMLS_CC);
+    this_id->id = estrndup(buf, OID_SIZE);
 
-      object_init_ex(value, mongo_ce_Code);
-      // exclude \0
-      zend_update_property_stringl(mongo_ce_Code, value, "code", strlen("code"), code, code_len-1 TSRMLS_CC);
-      zend_update_property(mongo_ce_Code, value, "scope", strlen("scope"), zcope TSRMLS_CC);
-      zval_ptr_dtor(&zcope);
+    buf += OID_SIZE;
 
-      break;
-    }
-    /* DEPRECATED
-     * database reference (12)
-     *   - 4 bytes ns length (includes trailing \0)
-     *   - ns + \0
-     *   - 12 bytes MongoId
-     * This converts the deprecated, old-style db ref type
-     * into the new type (array('$ref' => ..., $id => ...)).
+    // put it all together
+    array_init(value);
+    add_assoc_stringl(value, "$ref", ns, ns_len-1, 1);
+    add_assoc_zval(value, "$id", zoid);
+    break;
+  }
+  /* MongoTimestamp (17)
+   * 8 bytes total:
+   *  - sec: 4 bytes
+   *  - inc: 4 bytes
+   */
+  case BSON_TIMESTAMP: {
+    object_init_ex(value, mongo_ce_Timestamp);
+    zend_update_property_long(mongo_ce_Timestamp, value, "inc", strlen("inc"), MONGO_32(*(int*)buf) TSRMLS_CC);
+    buf += INT_32;
+    zend_update_property_long(mongo_ce_Timestamp, value, "sec", strlen("sec"), MONGO_32(*(int*)buf) TSRMLS_CC);
+    buf += INT_32;
+    break;
+  }
+  /* max key (127)
+   * max and min keys are used only for sharding, and
+   * cannot be resaved to the database at the moment
+   */
+  case BSON_MINKEY: {
+    object_init_ex(value, mongo_ce_MinKey);
+    break;
+  }
+  /* min key (0)
+   */
+  case BSON_MAXKEY: {
+    object_init_ex(value, mongo_ce_MaxKey);
+    break;
+  }
+  default: {
+    /* if we run into a type we don't recognize, there's
+     * either been some corruption or we've messed up on
+     * the parsing.  Either way, it's helpful to know the
+     * situation that led us here, so this dumps the
+     * buffer up to this point to stdout and returns.
+     *
+     * We can't dump any more of the buffer, unfortunately,
+     * because we don't keep track of the size.  Besides,
+     * if it is corrupt, the size might be messed up, too.
      */
-    case BSON_DBREF: {
-      int ns_len;
-      char *ns;
-      zval *zoid;
-      mongo_id *this_id;
-
-      // ns
-      ns_len = *(int*)buf;
-      if (INVALID_STRING_LEN(ns_len)) {
-        zval_ptr_dtor(&value);
-        zend_throw_exception_ex(mongo_ce_CursorException, 3 TSRMLS_CC, "invalid dbref length for key \"%s\": %d", name, ns_len);
-        return 0;
-      }
-      buf += INT_32;
-      ns = buf;
-      buf += ns_len;
+    char *msg, *pos, *template;
+    int i, width, len;
+    unsigned char t = type;
+
+    template = "type 0x00 not supported:";
+
+    // each byte is " xx" (3 chars)
+    width = 3;
+    len = (buf - buf_start) * width;
+
+    msg = (char*)emalloc(strlen(template)+len+1);
+    memcpy(msg, template, strlen(template));
+    pos = msg+7;
+
+    sprintf(pos++, "%x", t/16);
+    t = t%16;
+    sprintf(pos++, "%x", t);
+    // remove '\0' added by sprintf
+    *(pos) = ' ';
+
+    // jump to end of template
+    pos = msg + strlen(template);
+    for (i=0; i<buf-buf_start; i++) {
+      sprintf(pos, " %02x", (unsigned char)buf_start[i]);
+      pos += width;
+    }
+    // sprintf 0-terminates the string
+
+    zend_throw_exception(mongo_ce_Exception, msg, 17 TSRMLS_CC);
+    efree(msg);
+    return 0;
+  }
+  }
+
+  return buf;
+}
+
+/* Returns the key cache entry for the pos-th field of a document, refilling
+ * it if the document at hand has a different field in that position. */
+static mongo_key_cache_item* key_cache_get(mongo_key_cache *cache, int pos, char *name) {
+  mongo_key_cache_item *item = &cache->items[pos];
+
+  if (item->name && strcmp(item->name, name) == 0) {
+    return item;
+  }
+
+  if (item->name) {
+    efree(item->name);
+  }
+  item->name_len = strlen(name) + 1;
+  item->name = estrndup(name, item->name_len - 1);
 
-      // id
-      MAKE_STD_ZVAL(zoid);
-      object_init_ex(zoid, mongo_ce_Id);
+  item->numeric = php_mongo_is_numeric_key(item->name, item->name_len, &item->h);
+  if (!item->numeric) {
+    item->h = zend_get_hash_value(item->name, item->name_len);
+  }
+
+  return item;
+}
+
+static char* bson_to_zval_internal(char *buf, HashTable *result, mongo_key_cache *cache, HashTable *keep TSRMLS_DC) {
+  /*
+   * buf_start is used for debugging
+   *
+   * if the deserializer runs into bson it can't
+   * parse, it will dump the bytes to that point.
+   *
+   * we lose buf's position as we iterate, so we
+   * need buf_start to save it.
+   */
+  char *buf_start = buf;
+  char type;
+  int pos = 0;
+
+  if (buf == 0) {
+    return 0;
+  }
 
-      this_id = (mongo_id*)zend_object_store_get_object(zoid TSRMLS_CC);
-      this_id->id = estrndup(buf, OID_SIZE);
+  // for size
+  buf += INT_32;
 
-      buf += OID_SIZE;
+  while ((type = *buf++) != 0) {
+    char *name;
+    zval *value, **rule = NULL;
+    mongo_key_cache_item *item = NULL;
 
-      // put it all together
+    name = buf;
+    // get past field name
+    if (cache && pos < MONGO_KEY_CACHE_SIZE) {
+      item = key_cache_get(cache, pos++, name);
+      buf += item->name_len;
+    }
+    else {
+      buf += strlen(buf) + 1;
+    }
+
+    if (keep) {
+      if (zend_hash_find(keep, name, strlen(name)+1, (void**)&rule) == FAILURE) {
+        // skip the whole value, unless it is of a type that can't be skipped
+        // (bson_value_to_zval will complain about it)
+        char *next = bson_skip_value(type, buf);
+        if (next) {
+          buf = next;
+          continue;
+        }
+      }
+      else if (Z_TYPE_PP(rule) != IS_ARRAY || (type != BSON_OBJECT && type != BSON_ARRAY)) {
+        rule = NULL;
+      }
+    }
+
+    MAKE_STD_ZVAL(value);
+    ZVAL_NULL(value);
+
+    if (rule) {
+      // only some of the fields of this subobject are wanted
       array_init(value);
-      add_assoc_stringl(value, "$ref", ns, ns_len-1, 1);
-      add_assoc_zval(value, "$id", zoid);
-      break;
+      buf = bson_to_zval_internal(buf, Z_ARRVAL_P(value), NULL, Z_ARRVAL_PP(rule) TSRMLS_CC);
     }
-    /* MongoTimestamp (17)
-     * 8 bytes total:
-     *  - sec: 4 bytes
-     *  - inc: 4 bytes
-     */
-    case BSON_TIMESTAMP: {
-      object_init_ex(value, mongo_ce_Timestamp);
-      zend_update_property_long(mongo_ce_Timestamp, value, "inc", strlen("inc"), MONGO_32(*(int*)buf) TSRMLS_CC);
-      buf += INT_32;
-      zend_update_property_long(mongo_ce_Timestamp, value, "sec", strlen("sec"), MONGO_32(*(int*)buf) TSRMLS_CC);
-      buf += INT_32;
-      break;
+    else {
+      buf = bson_value_to_zval(type, name, buf, buf_start, value TSRMLS_CC);
     }
-    /* max key (127)
-     * max and min keys are used only for sharding, and
-     * cannot be resaved to the database at the moment
-     */
-    case BSON_MINKEY: {
-      object_init_ex(value, mongo_ce_MinKey);
-      break;
+    if (!buf) {
+      zval_ptr_dtor(&value);
+      return 0;
     }
-    /* min key (0)
-     */
-    case BSON_MAXKEY: {
-      object_init_ex(value, mongo_ce_MaxKey);
-      break;
+
+    if (!item) {
+      zend_symtable_update(result, name, strlen(name)+1, &value, sizeof(zval*), NULL);
     }
-    default: {
-      /* if we run into a type we don't recognize, there's
-       * either been some corruption or we've messed up on
-       * the parsing.  Either way, it's helpful to know the
-       * situation that led us here, so this dumps the
-       * buffer up to this point to stdout and returns.
-       *
-       * We can't dump any more of the buffer, unfortunately,
-       * because we don't keep track of the size.  Besides,
-       * if it is corrupt, the size might be messed up, too.
-       */
-      char *msg, *pos, *template;
-      int i, width, len;
-      unsigned char t = type;
-
-      template = "type 0x00 not supported:";
-
-      // each byte is " xx" (3 chars)
-      width = 3;
-      len = (buf - buf_start) * width;
-
-      msg = (char*)emalloc(strlen(template)+len+1);
-      memcpy(msg, template, strlen(template));
-      pos = msg+7;
-
-      sprintf(pos++, "%x", t/16);
-      t = t%16;
-      sprintf(pos++, "%x", t);
-      // remove '\0' added by sprintf
-      *(pos) = ' ';
-
-      // jump to end of template
-      pos = msg + strlen(template);
-      for (i=0; i<buf-buf_start; i++) {
-        sprintf(pos, " %02x", (unsigned char)buf_start[i]);
-        pos += width;
-      }
-      // sprintf 0-terminates the string
+    else if (item->numeric) {
+      zend_hash_index_update(result, item->h, &value, sizeof(zval*), NULL);
+    }
+    else {
+      zend_hash_quick_update(result, name, item->name_len, item->h, &value, sizeof(zval*), NULL);
+    }
+  }
 
-      zend_throw_exception(mongo_ce_Exception, msg, 17 TSRMLS_CC);
-      efree(msg);
-      return 0;
+  return buf;
+}
+
+char* bson_to_zval(char *buf, HashTable *result TSRMLS_DC) {
+  return bson_to_zval_internal(buf, result, NULL, NULL TSRMLS_CC);
+}
+
+char* bson_to_zval_cached(char *buf, HashTable *result, mongo_key_cache *cache, HashTable *keep TSRMLS_DC) {
+  return bson_to_zval_internal(buf, result, cache, keep TSRMLS_CC);
+}
+
+/* Works out whether key (key_len includes the trailing \0) is stored as an
+ * integer index by zend_symtable_update, just like it does. */
+int php_mongo_is_numeric_key(char *key, int key_len, ulong *index) {
+  ZEND_HANDLE_NUMERIC(key, key_len, { *index = idx; return 1; });
+  return 0;
+}
+
+void mongo_key_cache_free(mongo_key_cache *cache) {
+  int i;
+
+  for (i = 0; i < MONGO_KEY_CACHE_SIZE; i++) {
+    if (cache->items[i].name) {
+      efree(cache->items[i].name);
     }
+  }
+  efree(cache);
+}
+
+/* Returns the position just after a value of the given type, without
+ * decoding it, or 0 if the type is not known. */
+char* bson_skip_value(char type, char *buf) {
+  switch (type) {
+  case BSON_OID:
+    return buf + OID_SIZE;
+  case BSON_DOUBLE:
+  case BSON_DATE:
+  case BSON_TIMESTAMP:
+  case BSON_LONG:
+    return buf + INT_64;
+  case BSON_INT:
+    return buf + INT_32;
+  case BSON_BOOL:
+    return buf + 1;
+  case BSON_UNDEF:
+  case BSON_NULL:
+  case BSON_MINKEY:
+  case BSON_MAXKEY:
+    return buf;
+  case BSON_SYMBOL:
+  case BSON_STRING:
+  case BSON_CODE__D:
+    return buf + INT_32 + MONGO_32(*(int*)buf);
+  case BSON_OBJECT:
+  case BSON_ARRAY:
+  case BSON_CODE:
+    return buf + MONGO_32(*(int*)buf);
+  case BSON_BINARY:
+    return buf + INT_32 + 1 + MONGO_32(*(int*)buf);
+  case BSON_REGEX:
+    buf += strlen(buf) + 1;
+    return buf + strlen(buf) + 1;
+  case BSON_DBREF:
+    return buf + INT_32 + MONGO_32(*(int*)buf) + OID_SIZE;
+  }
+
+  return 0;
+}
+
+/* Finds the element called name in the top level of the document at buf.
+ * Returns a pointer to its (undecoded) value and sets type, or 0 if the
+ * document has no such element. */
+char* bson_find_value(char *buf, char *name, char *type) {
+  char t;
+
+  // for size
+  buf += INT_32;
+
+  while ((t = *buf++) != 0) {
+    char *current = buf;
+
+    buf += strlen(buf) + 1;
+    if (strcmp(current, name) == 0) {
+      *type = t;
+      return buf;
     }
 
-    zend_symtable_update(result, name, strlen(name)+1, &value, sizeof(zval*), NULL);
+    buf = bson_skip_value(t, buf);
+    if (!buf) {
+      return 0;
+    }
   }
 
-  return buf;
+  return 0;
+}
+
+/* Returns the position after the value of the given type at buf, or 0 if it
+ * doesn't end before end (or its type is unknown). Strings have to end
+ * with their terminating NUL. */
+static char* bson_skip_value_within(char type, char *buf, char *end)
+{
+	int len;
+
+	switch (type) {
+		case BSON_SYMBOL:
+		case BSON_STRING:
+		case BSON_CODE__D:
+			if (end - buf < INT_32) {
+				return 0;
+			}
+			len = MONGO_32(*(int*)buf);
+			if (len < 1 || len > end - buf - INT_32 || buf[INT_32 + len - 1] != '\0') {
+				return 0;
+			}
+			return buf + INT_32 + len;
+		case BSON_OBJECT:
+		case BSON_ARRAY:
+		case BSON_CODE:
+			if (end - buf < INT_32) {
+				return 0;
+			}
+			len = MONGO_32(*(int*)buf);
+			if (len < INT_32 + 1 || len > end - buf) {
+				return 0;
+			}
+			return buf + len;
+		case BSON_BINARY:
+		case BSON_DBREF:
+			if (end - buf < INT_32) {
+				return 0;
+			}
+			len = MONGO_32(*(int*)buf);
+			if (len < 0 || len > end - buf - INT_32 - (type == BSON_BINARY ? 1 : OID_SIZE)) {
+				return 0;
+			}
+			return bson_skip_value(type, buf);
+		case BSON_REGEX:
+			if (!(buf = memchr(buf, 0, end - buf)) || !(buf = memchr(buf + 1, 0, end - buf - 1))) {
+				return 0;
+			}
+			return buf + 1;
+	}
+
+	buf = bson_skip_value(type, buf);
+	return buf && buf <= end ? buf : 0;
+}
+
+/* Like bson_find_value, for a document that may be cut short or corrupt:
+ * nothing past end is looked at, and the value that is returned ends before
+ * end as well. */
+char* bson_find_value_within(char *buf, char *end, char *name, char *type)
+{
+	char t, *current;
+
+	if (end - buf < INT_32 + 1) {
+		return 0;
+	}
+	buf += INT_32;
+
+	while (buf < end && (t = *buf++) != 0) {
+		current = buf;
+		if (!(buf = memchr(buf, 0, end - buf))) {
+			return 0;
+		}
+		buf++;
+		if (strcmp(current, name) == 0) {
+			*type = t;
+			return bson_skip_value_within(t, buf, end) ? buf : 0;
+		}
+
+		if (!(buf = bson_skip_value_within(t, buf, end))) {
+			return 0;
+		}
+	}
+
+	return 0;
 }
 
+/*
+ * Checks that s is made up of well formed UTF-8 sequences. Most strings are
+ * mostly ASCII, so runs of ASCII bytes are skipped 16 (SSE2 or NEON) or 8
+ * bytes at a time before falling back to checking one sequence at a time.
+ */
 static int is_utf8(const char *s, int len) {
-  int i;
+  const unsigned char *p = (const unsigned char*)s;
+  const unsigned char *end = p + len;
+
+  while (p < end) {
+#if defined(MONGO_UTF8_SSE2)
+    while (end - p >= 16 && _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p)) == 0) {
+      p += 16;
+    }
+#elif defined(MONGO_UTF8_NEON)
+    while (end - p >= 16 && vmaxvq_u8(vld1q_u8(p)) < 0x80) {
+      p += 16;
+    }
+#endif
+    while (end - p >= 8) {
+      unsigned int w1, w2;
+
+      memcpy(&w1, p, 4);
+      memcpy(&w2, p + 4, 4);
+      if ((w1 | w2) & 0x80808080) {
+        break;
+      }
+      p += 8;
+    }
+
+    if (p >= end) {
+      break;
+    }
 
-  for (i=0; i<len; i++) {
-    if (i+3 < len &&
-        (s[i] & 248) == 240 &&
-        (s[i+1] & 192) == 128 &&
-        (s[i+2] & 192) == 128 &&
-        (s[i+3] & 192) == 128) {
-      i += 3;
-    }
-    else if (i+2 < len &&
-             (s[i] & 240) == 224 &&
-             (s[i+1] & 192) == 128 &&
-             (s[i+2] & 192) == 128) {
-      i += 2;
-    }
-    else if (i+1 < len &&
-             (s[i] & 224) == 192 &&
-             (s[i+1] & 192) == 128) {
-      i += 1;
-    }
-    else if ((s[i] & 128) != 0) {
+    if (*p < 0x80) {
+      p++;
+    }
+    else if ((*p & 0xe0) == 0xc0) {
+      if (end - p < 2 || (p[1] & 0xc0) != 0x80) {
+        return 0;
+      }
+      p += 2;
+    }
+    else if ((*p & 0xf0) == 0xe0) {
+      if (end - p < 3 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80) {
+        return 0;
+      }
+      p += 3;
+    }
+    else if ((*p & 0xf8) == 0xf0) {
+      if (end - p < 4 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80 || (p[3] & 0xc0) != 0x80) {
+        return 0;
+      }
+      p += 4;
+    }
+    else {
       return 0;
     }
   }
@@ -1334,8 +1948,11 @@ PHP_FUNCTION(bson_encode) {
   }
   /* fallthrough for a normal obj */
   case IS_ARRAY: {
-    CREATE_BUF(buf, INITIAL_BUF_SIZE);
-    zval_to_bson(&buf, HASH_P(z), 0 TSRMLS_CC);
+    // measure first, so big documents are written into a single allocation
+    int size = zval_to_bson_size(HASH_P(z), NO_PREP TSRMLS_CC) + 1;
+
+    CREATE_BUF(buf, size);
+    zval_to_bson(&buf, HASH_P(z), NO_PREP TSRMLS_CC);
 
     RETVAL_STRINGL(buf.start, buf.pos-buf.start, 1);
     efree(buf.start);
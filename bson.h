@@ -72,7 +72,7 @@ void php_mongo_serialize_key(buffer*, char*, int, int TSRMLS_DC);
 void php_mongo_serialize_ns(buffer*, char* TSRMLS_DC);
 
 int php_mongo_write_insert(buffer*, char*, zval*, int max TSRMLS_DC);
-int php_mongo_write_batch_insert(buffer*, char*, int flags, zval*, int max TSRMLS_DC);
+int php_mongo_write_batch_insert(buffer*, char*, int flags, zval*, int max, int prep TSRMLS_DC);
 int php_mongo_write_query(buffer*, mongo_cursor* TSRMLS_DC);
 int php_mongo_write_get_more(buffer*, mongo_cursor* TSRMLS_DC);
 int php_mongo_write_delete(buffer*, char*, int, zval* TSRMLS_DC);
@@ -86,8 +86,44 @@ int php_mongo_write_kill_cursors(buffer*, int64_t TSRMLS_DC);
 int resize_buf(buffer*, int);
 
 int zval_to_bson(buffer*, HashTable*, int TSRMLS_DC);
+
+/**
+ * Estimates the number of bytes zval_to_bson writes for hash, which is only
+ * used to reserve the buffer up front: the encoder still grows it if needed.
+ * Recursive arrays end in the same fatal error as in zval_to_bson.
+ */
+int zval_to_bson_size(HashTable*, int TSRMLS_DC);
+
+/**
+ * Estimates the number of bytes the element called name takes up in a
+ * document, including its type byte and name.
+ */
+int php_mongo_element_size(char *name, zval **data TSRMLS_DC);
+
+/**
+ * Same as zval_to_bson, but measures hash first and grows buf (at most once)
+ * so the document is written without any further reallocations.
+ */
+int zval_to_bson_presized(buffer*, HashTable*, int TSRMLS_DC);
 char* bson_to_zval(char*, HashTable* TSRMLS_DC);
 
+/**
+ * Same as bson_to_zval, but reuses the field names (and their hashes) found
+ * by earlier calls with the same cache. Meant for decoding many documents with
+ * the same layout, such as the results of a cursor.
+ *
+ * If keep is not NULL, only the fields that are keys of keep are decoded,
+ * the others are skipped without being looked at. A field whose value in keep
+ * is an array is itself decoded with that array as its keep.
+ */
+char* bson_to_zval_cached(char*, HashTable*, mongo_key_cache*, HashTable *keep TSRMLS_DC);
+void mongo_key_cache_free(mongo_key_cache *cache);
+int php_mongo_is_numeric_key(char *key, int key_len, ulong *index);
+char* bson_value_to_zval(char type, char *name, char *buf, char *buf_start, zval *value TSRMLS_DC);
+char* bson_skip_value(char type, char *buf);
+char* bson_find_value(char *buf, char *name, char *type);
+char* bson_find_value_within(char *buf, char *end, char *name, char *type);
+
 /**
  * Initialize buffer to contain "\0", so mongo_buf_append will start appending
  * at the beginning.
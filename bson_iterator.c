@@ -0,0 +1,299 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <php.h>
+#include <zend_interfaces.h>
+#include <zend_exceptions.h>
+
+#ifdef WIN32
+#  ifndef int64_t
+     typedef __int64 int64_t;
+#  endif
+#endif
+
+#include "php_mongo.h"
+#include "bson.h"
+#include "bson_iterator.h"
+
+extern zend_class_entry *mongo_ce_Exception;
+
+extern zend_object_handlers mongo_default_handlers;
+
+zend_class_entry *mongo_ce_BSONIterator = NULL;
+
+/* Reads up to len bytes, as php_stream_read can return less than asked for
+ * before the end of the stream */
+static int read_fully(php_stream *stream, char *dest, int len TSRMLS_DC)
+{
+	int total = 0, n;
+
+	while (total < len) {
+		n = php_stream_read(stream, dest + total, len - total);
+		if (n <= 0) {
+			break;
+		}
+		total += n;
+	}
+
+	return total;
+}
+
+/* Reads the document at it->offset into it->current, which is left NULL at
+ * the end of the data or when an exception was thrown */
+static void load_next(mongo_bson_iterator *it TSRMLS_DC)
+{
+	char *doc;
+	int len = 0;
+
+	if (it->current) {
+		zval_ptr_dtor(&it->current);
+		it->current = NULL;
+	}
+
+	if (!it->stream) {
+		int available = Z_STRLEN_P(it->source) - it->offset;
+
+		if (available == 0) {
+			return;
+		}
+		if (available < INT_32) {
+			zend_throw_exception_ex(mongo_ce_Exception, 21 TSRMLS_CC, "unexpected end of BSON data at offset %ld", it->offset);
+			return;
+		}
+
+		doc = Z_STRVAL_P(it->source) + it->offset;
+		len = MONGO_32(*(int*)doc);
+
+		if (len < INT_32 + 1 || len > available) {
+			zend_throw_exception_ex(mongo_ce_Exception, 20 TSRMLS_CC, "invalid BSON document length %d at offset %ld", len, it->offset);
+			return;
+		}
+	} else {
+		char header[INT_32];
+		int read = read_fully(it->stream, header, INT_32 TSRMLS_CC);
+
+		if (read == 0) {
+			return;
+		}
+		if (read < INT_32) {
+			zend_throw_exception_ex(mongo_ce_Exception, 21 TSRMLS_CC, "unexpected end of BSON data at offset %ld", it->offset);
+			return;
+		}
+
+		memcpy(&len, header, INT_32);
+		len = MONGO_32(len);
+
+		if (len < INT_32 + 1 || len > MONGO_BSON_ITERATOR_MAX_SIZE) {
+			zend_throw_exception_ex(mongo_ce_Exception, 20 TSRMLS_CC, "invalid BSON document length %d at offset %ld", len, it->offset);
+			return;
+		}
+
+		/* Only one document is held at a time, so memory use is bounded by
+		 * the largest document rather than by the size of the stream */
+		if (len > it->buf_size) {
+			it->buf = (char*)erealloc(it->buf, len);
+			it->buf_size = len;
+		}
+
+		memcpy(it->buf, header, INT_32);
+		if (read_fully(it->stream, it->buf + INT_32, len - INT_32 TSRMLS_CC) < len - INT_32) {
+			zend_throw_exception_ex(mongo_ce_Exception, 21 TSRMLS_CC, "unexpected end of BSON data at offset %ld", it->offset);
+			return;
+		}
+
+		doc = it->buf;
+	}
+
+	if (doc[len - 1] != 0) {
+		zend_throw_exception_ex(mongo_ce_Exception, 20 TSRMLS_CC, "invalid BSON document length %d at offset %ld", len, it->offset);
+		return;
+	}
+
+	/* Dumps are mostly made of documents with the same fields */
+	if (!it->key_cache) {
+		it->key_cache = (mongo_key_cache*)ecalloc(1, sizeof(mongo_key_cache));
+	}
+
+	MAKE_STD_ZVAL(it->current);
+	array_init(it->current);
+	bson_to_zval_cached(doc, Z_ARRVAL_P(it->current), it->key_cache, NULL TSRMLS_CC);
+
+	if (EG(exception)) {
+		zval_ptr_dtor(&it->current);
+		it->current = NULL;
+		return;
+	}
+
+	it->offset += len;
+}
+
+#define PHP_MONGO_GET_BSON_ITERATOR(obj)                                          \
+  it = (mongo_bson_iterator*)zend_object_store_get_object((obj) TSRMLS_CC);       \
+  MONGO_CHECK_INITIALIZED(it->source, MongoBSONIterator);
+
+/* {{{ MongoBSONIterator::__construct(string|resource bson)
+ * Iterates over the BSON documents one after the other in a string, or in a
+ * stream such as a file written by mongodump. */
+PHP_METHOD(MongoBSONIterator, __construct)
+{
+	mongo_bson_iterator *it;
+	zval *source;
+	php_stream *stream = NULL;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &source) == FAILURE) {
+		return;
+	}
+
+	if (Z_TYPE_P(source) == IS_RESOURCE) {
+		php_stream_from_zval(stream, &source);
+	} else if (Z_TYPE_P(source) != IS_STRING) {
+		zend_throw_exception(mongo_ce_Exception, "MongoBSONIterator expects a string or a stream", 23 TSRMLS_CC);
+		return;
+	}
+
+	it = (mongo_bson_iterator*)zend_object_store_get_object(getThis() TSRMLS_CC);
+	if (it->source) {
+		zval_ptr_dtor(&it->source);
+	}
+	it->source = source;
+	zval_add_ref(&source);
+
+	it->stream = stream;
+	it->start = stream ? php_stream_tell(stream) : 0;
+	it->offset = 0;
+}
+/* }}} */
+
+/* {{{ MongoBSONIterator::current()
+ */
+PHP_METHOD(MongoBSONIterator, current)
+{
+	mongo_bson_iterator *it;
+	PHP_MONGO_GET_BSON_ITERATOR(getThis());
+
+	if (!it->current) {
+		RETURN_NULL();
+	}
+	RETURN_ZVAL(it->current, 1, 0);
+}
+/* }}} */
+
+/* {{{ MongoBSONIterator::key()
+ * The position of the current document, counting from 0 */
+PHP_METHOD(MongoBSONIterator, key)
+{
+	mongo_bson_iterator *it;
+	PHP_MONGO_GET_BSON_ITERATOR(getThis());
+
+	RETURN_LONG(it->key);
+}
+/* }}} */
+
+/* {{{ MongoBSONIterator::next()
+ */
+PHP_METHOD(MongoBSONIterator, next)
+{
+	mongo_bson_iterator *it;
+	PHP_MONGO_GET_BSON_ITERATOR(getThis());
+
+	it->key++;
+	load_next(it TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ MongoBSONIterator::rewind()
+ * Rewinding a stream only works if the stream can seek back to where it was
+ * when the iterator was created */
+PHP_METHOD(MongoBSONIterator, rewind)
+{
+	mongo_bson_iterator *it;
+	PHP_MONGO_GET_BSON_ITERATOR(getThis());
+
+	if (it->stream && it->offset != 0 && php_stream_seek(it->stream, it->start, SEEK_SET) != 0) {
+		zend_throw_exception(mongo_ce_Exception, "cannot rewind the BSON stream", 22 TSRMLS_CC);
+		return;
+	}
+
+	it->offset = 0;
+	it->key = 0;
+	load_next(it TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ MongoBSONIterator::valid()
+ */
+PHP_METHOD(MongoBSONIterator, valid)
+{
+	mongo_bson_iterator *it;
+	PHP_MONGO_GET_BSON_ITERATOR(getThis());
+
+	RETURN_BOOL(it->current != NULL);
+}
+/* }}} */
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo___construct, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, bson)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_no_parameters, 0, ZEND_RETURN_VALUE, 0)
+ZEND_END_ARG_INFO()
+
+static zend_function_entry MongoBSONIterator_methods[] = {
+	PHP_ME(MongoBSONIterator, __construct, arginfo___construct, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoBSONIterator, current, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoBSONIterator, key, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoBSONIterator, next, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoBSONIterator, rewind, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoBSONIterator, valid, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	{ NULL, NULL, NULL }
+};
+
+static void php_mongo_bson_iterator_free(void *object TSRMLS_DC)
+{
+	mongo_bson_iterator *it = (mongo_bson_iterator*)object;
+
+	if (it) {
+		if (it->current) {
+			zval_ptr_dtor(&it->current);
+		}
+		if (it->source) {
+			zval_ptr_dtor(&it->source);
+		}
+		if (it->buf) {
+			efree(it->buf);
+		}
+		if (it->key_cache) {
+			mongo_key_cache_free(it->key_cache);
+		}
+
+		zend_object_std_dtor(&it->std TSRMLS_CC);
+		efree(it);
+	}
+}
+
+static zend_object_value php_mongo_bson_iterator_new(zend_class_entry *class_type TSRMLS_DC)
+{
+	php_mongo_obj_new(mongo_bson_iterator);
+}
+
+void mongo_init_MongoBSONIterator(TSRMLS_D)
+{
+	zend_class_entry ce;
+
+	INIT_CLASS_ENTRY(ce, "MongoBSONIterator", MongoBSONIterator_methods);
+	ce.create_object = php_mongo_bson_iterator_new;
+	mongo_ce_BSONIterator = zend_register_internal_class(&ce TSRMLS_CC);
+	zend_class_implements(mongo_ce_BSONIterator TSRMLS_CC, 1, zend_ce_iterator);
+}
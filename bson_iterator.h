@@ -0,0 +1,32 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MONGO_BSON_ITERATOR_H
+#define MONGO_BSON_ITERATOR_H 1
+
+/* The largest document read from a stream, documents in a string can be as
+ * big as the string */
+#define MONGO_BSON_ITERATOR_MAX_SIZE (16 * 1024 * 1024)
+
+void mongo_init_MongoBSONIterator(TSRMLS_D);
+
+PHP_METHOD(MongoBSONIterator, __construct);
+PHP_METHOD(MongoBSONIterator, current);
+PHP_METHOD(MongoBSONIterator, key);
+PHP_METHOD(MongoBSONIterator, next);
+PHP_METHOD(MongoBSONIterator, rewind);
+PHP_METHOD(MongoBSONIterator, valid);
+
+#endif
@@ -24,12 +24,20 @@
 #include "mongo_types.h"
 #include "db.h"
 #include "mcon/manager.h"
+#include "mcon/connections.h"
 #include "mcon/io.h"
+#include "mcon/mini_bson.h"
+#include "mcon/stats.h"
+#include "mcon/trace.h"
+#include "write_result.h"
+#include "result_cache.h"
+#include "util/log.h"
 
 extern zend_class_entry *mongo_ce_Mongo,
   *mongo_ce_DB,
   *mongo_ce_Cursor,
   *mongo_ce_Code,
+  *mongo_ce_Id,
   *mongo_ce_Exception;
 
 extern int le_pconnection,
@@ -43,8 +51,10 @@ zend_class_entry *mongo_ce_Collection = NULL;
 
 static mongo_connection* get_server(mongo_collection *c, int connection_flags TSRMLS_DC);
 static int is_safe_op(zval *options TSRMLS_DC);
-static void safe_op(mongo_con_manager *manager, mongo_connection *connection, zval *cursor_z, buffer *buf, zval *return_value TSRMLS_DC);
+static int is_async_op(zval *options TSRMLS_DC);
+static void safe_op(mongo_con_manager *manager, mongo_connection *connection, zval *cursor_z, buffer *buf, buffer *gle_buf, zval *return_value TSRMLS_DC);
 static zval* append_getlasterror(zval *coll, buffer *buf, zval *options TSRMLS_DC);
+static void connection_deregister_wrapper(mongo_con_manager *manager, mongo_connection *connection TSRMLS_DC);
 
 PHP_METHOD(MongoCollection, __construct) {
   zval *parent, *name, *zns, *w, *wtimeout;
@@ -176,6 +186,62 @@ PHP_METHOD(MongoCollection, setReadPreference)
 }
 /* }}} */
 
+/* {{{ MongoCollection::setCacheTTL(int seconds)
+ * Keeps the results of findOne and count in the result cache for seconds,
+ * which needs mongo.result_cache_size to be set. 0 stops caching them.
+ * The writes of this process through insert, update, remove, save,
+ * batchInsert, findAndModify and drop() drop the results of their
+ * collection. Other writes are not noticed, and the results only expire:
+ * those of other processes, and those of commands that write into a
+ * collection (such as mapReduce or aggregate output) or that are run through
+ * MongoDB::command(). */
+PHP_METHOD(MongoCollection, setCacheTTL)
+{
+	long ttl;
+	mongo_collection *c;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &ttl) == FAILURE) {
+		return;
+	}
+
+	PHP_MONGO_GET_COLLECTION(getThis());
+
+	RETVAL_LONG(c->cache_ttl);
+	c->cache_ttl = ttl < 0 ? 0 : ttl;
+}
+/* }}} */
+
+PHP_METHOD(MongoCollection, getCacheTTL)
+{
+	mongo_collection *c;
+	PHP_MONGO_GET_COLLECTION(getThis());
+	RETURN_LONG(c->cache_ttl);
+}
+
+/* {{{ MongoCollection::invalidateCache()
+ * Drops the cached results of this collection. Writes through this process
+ * do that by themselves, this is for changes made elsewhere. */
+PHP_METHOD(MongoCollection, invalidateCache)
+{
+	mongo_collection *c;
+	PHP_MONGO_GET_COLLECTION(getThis());
+
+	php_mongo_result_cache_invalidate(Z_STRVAL_P(c->ns) TSRMLS_CC);
+}
+/* }}} */
+
+/* The cacheTTL option of a read, or the collection's by default */
+static long get_cache_ttl(mongo_collection *c, zval *options TSRMLS_DC)
+{
+	zval **ttl;
+
+	if (options && zend_hash_find(HASH_P(options), "cacheTTL", strlen("cacheTTL") + 1, (void**)&ttl) == SUCCESS) {
+		convert_to_long_ex(ttl);
+		return Z_LVAL_PP(ttl);
+	}
+	return c->cache_ttl;
+}
+
 PHP_METHOD(MongoCollection, drop) {
   zval *data;
   mongo_collection *c;
@@ -188,6 +254,8 @@ PHP_METHOD(MongoCollection, drop) {
   zval_add_ref(&c->name);
 
   MONGO_CMD(return_value, c->parent);
+	mongo_manager_forget_indexes(MonGlo(manager), Z_STRVAL_P(c->ns));
+	php_mongo_result_cache_invalidate(Z_STRVAL_P(c->ns) TSRMLS_CC);
 
   zval_ptr_dtor(&data);
 }
@@ -213,26 +281,15 @@ PHP_METHOD(MongoCollection, validate) {
   zval_ptr_dtor(&data);
 }
 
-/*
- * this should probably be split into two methods... right now appends the
- * getlasterror query to the buffer and alloc & inits the cursor zval.
- */
-static zval* append_getlasterror(zval *coll, buffer *buf, zval *options TSRMLS_DC) {
-  zval *cmd_ns_z, *cmd, *cursor_z, *temp, *timeout_p;
-  char *cmd_ns, *safe_str = 0;
-  mongo_cursor *cursor;
-  mongo_collection *c = (mongo_collection*)zend_object_store_get_object(coll TSRMLS_CC);
-  mongo_db *db = (mongo_db*)zend_object_store_get_object(c->parent TSRMLS_CC);
-  int response, safe = 0, fsync = 0, timeout = -1;
-	mongo_link *link;
+/* Returns the getlasterror command for the safe, fsync and w options of a
+ * write, and sets *timeout_out to the timeout to wait for its reply with */
+zval* php_mongo_getlasterror_cmd(zval *coll, zval *options, int *timeout_out TSRMLS_DC) {
+  zval *cmd, *timeout_p;
+  char *safe_str = 0;
+  int safe = 0, fsync = 0, timeout = -1;
 
   GET_OPTIONS;
 
-  // get "db.$cmd" zval
-  MAKE_STD_ZVAL(cmd_ns_z);
-  spprintf(&cmd_ns, 0, "%s.$cmd", Z_STRVAL_P(db->name));
-  ZVAL_STRING(cmd_ns_z, cmd_ns, 0);
-
   // get {"getlasterror" : 1} zval
   MAKE_STD_ZVAL(cmd);
   array_init(cmd);
@@ -260,6 +317,30 @@ static zval* append_getlasterror(zval *coll, buffer *buf, zval *options TSRMLS_D
     add_assoc_bool(cmd, "fsync", 1);
   }
 
+  *timeout_out = timeout;
+  return cmd;
+}
+
+/*
+ * this should probably be split into two methods... right now appends the
+ * getlasterror query to the buffer and alloc & inits the cursor zval.
+ */
+static zval* append_getlasterror(zval *coll, buffer *buf, zval *options TSRMLS_DC) {
+  zval *cmd_ns_z, *cmd, *cursor_z, *temp;
+  char *cmd_ns;
+  mongo_cursor *cursor;
+  mongo_collection *c = (mongo_collection*)zend_object_store_get_object(coll TSRMLS_CC);
+  mongo_db *db = (mongo_db*)zend_object_store_get_object(c->parent TSRMLS_CC);
+  int response, timeout;
+	mongo_link *link;
+
+  // get "db.$cmd" zval
+  MAKE_STD_ZVAL(cmd_ns_z);
+  spprintf(&cmd_ns, 0, "%s.$cmd", Z_STRVAL_P(db->name));
+  ZVAL_STRING(cmd_ns_z, cmd_ns, 0);
+
+  cmd = php_mongo_getlasterror_cmd(coll, options, &timeout TSRMLS_CC);
+
   // get cursor
   MAKE_STD_ZVAL(cursor_z);
   object_init_ex(cursor_z, mongo_ce_Cursor);
@@ -270,6 +351,7 @@ static zval* append_getlasterror(zval *coll, buffer *buf, zval *options TSRMLS_D
   zval_ptr_dtor(&temp);
   if (EG(exception)) {
     zval_ptr_dtor(&cmd_ns_z);
+    zval_ptr_dtor(&cmd);
     return 0;
   }
 
@@ -328,6 +410,30 @@ static mongo_connection* get_server(mongo_collection *c, int connection_flags TS
 	return connection;
 }
 
+mongo_connection* php_mongo_collection_get_connection(zval *coll, int connection_flags TSRMLS_DC)
+{
+	mongo_collection *c = (mongo_collection*)zend_object_store_get_object(coll TSRMLS_CC);
+
+	if (!c->ns) {
+		zend_throw_exception(mongo_ce_Exception, "The MongoCollection object has not been correctly initialized by its constructor", 0 TSRMLS_CC);
+		return 0;
+	}
+	return get_server(c, connection_flags TSRMLS_CC);
+}
+
+/* The MongoStats operation of the write in buf, by its opcode */
+static int write_stats_op(buffer *buf)
+{
+	switch (MONGO_32(*(int*)(buf->start + 12))) {
+		case OP_UPDATE:
+			return MONGO_STATS_OP_UPDATE;
+		case OP_DELETE:
+			return MONGO_STATS_OP_REMOVE;
+		default:
+			return MONGO_STATS_OP_INSERT;
+	}
+}
+
 /* Wrapper for sending and wrapping in a safe op */
 static int send_message(zval *this_ptr, mongo_connection *connection, buffer *buf, zval *options, zval *return_value TSRMLS_DC)
 {
@@ -335,6 +441,7 @@ static int send_message(zval *this_ptr, mongo_connection *connection, buffer *bu
 	char *error_message = NULL;
 	mongo_link *link;
 	mongo_collection *c;
+	mongo_stats_probe probe;
 
 	c = (mongo_collection*)zend_object_store_get_object(this_ptr TSRMLS_CC);
 	if (!c->ns) {
@@ -347,21 +454,80 @@ static int send_message(zval *this_ptr, mongo_connection *connection, buffer *bu
 		zend_throw_exception(mongo_ce_Exception, "The MongoCollection object has not been correctly initialized by its constructor", 17 TSRMLS_CC);
 		return 0;
 	}
-
-	if (is_safe_op(options TSRMLS_CC)) {
-		zval *cursor = append_getlasterror(getThis(), buf, options TSRMLS_CC);
+	MONGO_TRACE(link->manager, MONGO_TRACE_SEND_WRITE, MONGO_32(*(int*)(buf->start + 12)), buf->pos - buf->start, connection->socket, 0);
+
+	/* Cached results of the collection may not be what they were */
+	php_mongo_result_cache_invalidate(Z_STRVAL_P(c->ns) TSRMLS_CC);
+
+	if (is_async_op(options TSRMLS_CC)) {
+		buffer gle_buf;
+		zval *cmd;
+		int request_id, timeout;
+		mongo_io_vec pieces[2];
+
+		/* The write and its getlasterror are sent now, the reply is only read
+		 * when the MongoWriteResult is asked for it (or when another request
+		 * on the connection needs the replies ahead of its own) */
+		CREATE_BUF(gle_buf, INITIAL_BUF_SIZE);
+		cmd = php_mongo_getlasterror_cmd(getThis(), options, &timeout TSRMLS_CC);
+		request_id = php_mongo_append_getlasterror_query(getThis(), &gle_buf, cmd TSRMLS_CC);
+		zval_ptr_dtor(&cmd);
+
+		if (request_id) {
+			pieces[0].data = buf->start;
+			pieces[0].len = buf->pos - buf->start;
+			pieces[1].data = gle_buf.start;
+			pieces[1].len = gle_buf.pos - gle_buf.start;
+
+			/* Only the sending is timed, the reply is read whenever */
+			mongo_stats_start(link->manager, &probe, connection);
+			if (mongo_io_flushv(connection, pieces, 2, (char **) &error_message) == -1) {
+				mongo_stats_end(link->manager, &probe, write_stats_op(buf), connection, MONGO_STATS_FAILED);
+				mongo_cursor_throw(connection, 16 TSRMLS_CC, error_message);
+				free(error_message);
+				connection_deregister_wrapper(link->manager, connection TSRMLS_CC);
+				retval = 0;
+			} else {
+				mongo_stats_end(link->manager, &probe, write_stats_op(buf), connection, 0);
+				php_mongo_write_result_init(return_value, connection, request_id, timeout TSRMLS_CC);
+				retval = -1;
+			}
+		} else {
+			retval = 0;
+		}
+		efree(gle_buf.start);
+	} else if (is_safe_op(options TSRMLS_CC)) {
+		buffer gle_buf;
+		zval *cursor;
+
+		/* The getlasterror goes into a buffer of its own, so that a large write
+		 * is not reallocated (and copied) just to append it */
+		CREATE_BUF(gle_buf, INITIAL_BUF_SIZE);
+		cursor = append_getlasterror(getThis(), &gle_buf, options TSRMLS_CC);
 		if (cursor) {
-			safe_op(link->manager, connection, cursor, buf, return_value TSRMLS_CC);
+			safe_op(link->manager, connection, cursor, buf, &gle_buf, return_value TSRMLS_CC);
 			retval = -1;
 		} else {
 			retval = 0;
 		}
-	} else if (mongo_io_send(connection->socket, buf->start, buf->pos - buf->start, (char **) &error_message) == -1) {
-		/* TODO: Find out what to do with the error message here */
-		free(error_message);
-		retval = 0;
+		efree(gle_buf.start);
 	} else {
-		retval = 1;
+		mongo_stats_start(link->manager, &probe, connection);
+		if (MonGlo(write_behind) > 0) {
+			/* Sent along with later writes or the next request on the
+			 * connection, at the latest at the end of the request */
+			if (mongo_io_queue(connection, buf->start, buf->pos - buf->start, MonGlo(write_behind), (char **) &error_message) == -1) {
+				free(error_message);
+				retval = 0;
+			}
+		} else if (mongo_io_flush(connection, buf->start, buf->pos - buf->start, (char **) &error_message) == -1) {
+			/* TODO: Find out what to do with the error message here */
+			free(error_message);
+			retval = 0;
+		} else {
+			retval = 1;
+		}
+		mongo_stats_end(link->manager, &probe, write_stats_op(buf), connection, retval ? 0 : MONGO_STATS_FAILED);
 	}
 	return retval;
 }
@@ -378,6 +544,17 @@ static int is_safe_op(zval *options TSRMLS_DC) {
       Z_BVAL_PP(fsync_pp) == 1));
 }
 
+/* Whether the write should return a MongoWriteResult instead of waiting for
+ * its getlasterror reply */
+static int is_async_op(zval *options TSRMLS_DC)
+{
+	zval **async;
+
+	return options && !IS_SCALAR_P(options) &&
+		zend_hash_find(HASH_P(options), "async", strlen("async") + 1, (void**)&async) == SUCCESS &&
+		zend_is_true(*async);
+}
+
 #if PHP_VERSION_ID >= 50300
 # define MONGO_ERROR_G EG
 #else
@@ -410,19 +587,29 @@ static void connection_deregister_wrapper(mongo_con_manager *manager, mongo_conn
 	MONGO_ERROR_G(error_handling) = orig_error_handling;
 }
 
-static void safe_op(mongo_con_manager *manager, mongo_connection *connection, zval *cursor_z, buffer *buf, zval *return_value TSRMLS_DC)
+static void safe_op(mongo_con_manager *manager, mongo_connection *connection, zval *cursor_z, buffer *buf, buffer *gle_buf, zval *return_value TSRMLS_DC)
 {
   zval *errmsg, **err;
   mongo_cursor *cursor;
 	char *error_message;
+	mongo_io_vec pieces[2];
 
   cursor = (mongo_cursor*)zend_object_store_get_object(cursor_z TSRMLS_CC);
 
 	cursor->connection = connection;
 
-	if (-1 == mongo_io_send(connection->socket, buf->start, buf->pos - buf->start, (char **) &error_message)) {
+	/* the write and its getlasterror, in one go */
+	pieces[0].data = buf->start;
+	pieces[0].len = buf->pos - buf->start;
+	pieces[1].data = gle_buf->start;
+	pieces[1].len = gle_buf->pos - gle_buf->start;
+
+	/* timed until the reply to the getlasterror has been read */
+	php_mongo_cursor_stats_start(cursor, write_stats_op(buf) TSRMLS_CC);
+	if (-1 == mongo_io_flushv(connection, pieces, 2, (char **) &error_message)) {
 		/* TODO: Figure out what to do on FAIL
 		mongo_util_link_failed(cursor->link, server TSRMLS_CC); */
+		php_mongo_cursor_stats_end(cursor, 1 TSRMLS_CC);
 		mongo_manager_log(manager, MLOG_IO, MLOG_WARN, "safe_op: sending data failed, removing connection %s", connection->hash);
 		mongo_cursor_throw(connection, 16 TSRMLS_CC, error_message);
 		connection_deregister_wrapper(manager, connection TSRMLS_CC);
@@ -478,6 +665,112 @@ static void safe_op(mongo_con_manager *manager, mongo_connection *connection, zv
 }
 
 
+/* Appends a getlasterror query for cmd on the database of coll to buf, and
+ * returns its request id */
+int php_mongo_append_getlasterror_query(zval *coll, buffer *buf, zval *cmd TSRMLS_DC)
+{
+	mongo_collection *c = (mongo_collection*)zend_object_store_get_object(coll TSRMLS_CC);
+	mongo_db *db = (mongo_db*)zend_object_store_get_object(c->parent TSRMLS_CC);
+	mongo_cursor cursor;
+	int response;
+
+	memset(&cursor, 0, sizeof(mongo_cursor));
+	spprintf(&cursor.ns, 0, "%s.$cmd", Z_STRVAL_P(db->name));
+	cursor.query = cmd;
+	cursor.limit = -1;
+
+	response = php_mongo_write_query(buf, &cursor TSRMLS_CC);
+	efree(cursor.ns);
+
+	return response == FAILURE ? 0 : cursor.send.request_id;
+}
+
+/* Reads the replies to the getlasterror queries with the given request ids,
+ * which have all been sent on connection already, and adds the documents to
+ * the list in return_value. Returns FAILURE, with an exception thrown, if a
+ * reply could not be read. Replies still have to be read after a write failed,
+ * so that none of them is left on the connection. */
+int php_mongo_read_getlasterror_replies(mongo_connection *connection, int *request_ids, int count, int timeout, zval *return_value TSRMLS_DC)
+{
+	mongo_cursor reader;
+	zval errmsg, *doc;
+	int i, status = SUCCESS;
+
+	memset(&reader, 0, sizeof(mongo_cursor));
+	reader.connection = connection;
+	reader.timeout = timeout;
+	ZVAL_NULL(&errmsg);
+
+	for (i = 0; i < count; i++) {
+		reader.num = 0;
+		reader.send.request_id = request_ids[i];
+
+		if (php_mongo_get_reply(&reader, &errmsg TSRMLS_CC) == FAILURE) {
+			status = FAILURE;
+			break;
+		}
+
+		MAKE_STD_ZVAL(doc);
+		array_init(doc);
+		if (reader.num > 0) {
+			bson_to_zval(reader.buf.pos, Z_ARRVAL_P(doc) TSRMLS_CC);
+		}
+		add_next_index_zval(return_value, doc);
+	}
+
+	if (reader.buf.start) {
+		efree(reader.buf.start);
+	}
+	if (status == FAILURE) {
+		connection_deregister_wrapper(MonGlo(manager), connection TSRMLS_CC);
+	}
+
+	return status;
+}
+
+/* Appends the message for a single operation of MongoCollection::bulkWrite to
+ * buf. Returns FAILURE, with an exception thrown, for an invalid operation. */
+static int append_bulk_op(buffer *buf, char *ns, zval *op, int index, int max_bson_size TSRMLS_DC)
+{
+	zval **kind, **arg1 = NULL, **arg2 = NULL, **arg3 = NULL, **flag;
+	int flags = 0;
+
+	if (Z_TYPE_P(op) != IS_ARRAY ||
+		zend_hash_index_find(Z_ARRVAL_P(op), 0, (void**)&kind) == FAILURE || Z_TYPE_PP(kind) != IS_STRING ||
+		zend_hash_index_find(Z_ARRVAL_P(op), 1, (void**)&arg1) == FAILURE || IS_SCALAR_PP(arg1)) {
+		zend_throw_exception_ex(mongo_ce_Exception, 25 TSRMLS_CC, "invalid operation at index %d", index);
+		return FAILURE;
+	}
+	zend_hash_index_find(Z_ARRVAL_P(op), 2, (void**)&arg2);
+	zend_hash_index_find(Z_ARRVAL_P(op), 3, (void**)&arg3);
+
+	if (strcmp(Z_STRVAL_PP(kind), "insert") == 0) {
+		return php_mongo_write_insert(buf, ns, *arg1, max_bson_size TSRMLS_CC);
+	}
+
+	if (strcmp(Z_STRVAL_PP(kind), "update") == 0 && arg2 && !IS_SCALAR_PP(arg2)) {
+		if (arg3 && !IS_SCALAR_PP(arg3)) {
+			if (zend_hash_find(HASH_PP(arg3), "upsert", strlen("upsert") + 1, (void**)&flag) == SUCCESS) {
+				flags |= Z_BVAL_PP(flag) << 0;
+			}
+			if (zend_hash_find(HASH_PP(arg3), "multiple", strlen("multiple") + 1, (void**)&flag) == SUCCESS) {
+				flags |= Z_BVAL_PP(flag) << 1;
+			}
+		}
+		return php_mongo_write_update(buf, ns, flags, *arg1, *arg2 TSRMLS_CC);
+	}
+
+	if (strcmp(Z_STRVAL_PP(kind), "remove") == 0) {
+		if (arg2 && !IS_SCALAR_PP(arg2) && zend_hash_find(HASH_PP(arg2), "justOne", strlen("justOne") + 1, (void**)&flag) == SUCCESS) {
+			flags = Z_BVAL_PP(flag);
+		}
+		return php_mongo_write_delete(buf, ns, flags, *arg1 TSRMLS_CC);
+	}
+
+	zend_throw_exception_ex(mongo_ce_Exception, 25 TSRMLS_CC, "invalid operation at index %d", index);
+	return FAILURE;
+}
+
 PHP_METHOD(MongoCollection, insert) {
   zval *a, *options = 0;
   mongo_collection *c;
@@ -488,7 +781,10 @@ PHP_METHOD(MongoCollection, insert) {
   if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|z", &a, &options) == FAILURE) {
     return;
   }
-	MUST_BE_ARRAY_OR_OBJECT(1, a);
+  // a string is taken to be a document that is already BSON
+  if (Z_TYPE_P(a) != IS_STRING) {
+    MUST_BE_ARRAY_OR_OBJECT(1, a);
+  }
 
   // old boolean options
   if (options && !IS_SCALAR_P(options)) {
@@ -535,6 +831,7 @@ PHP_METHOD(MongoCollection, batchInsert) {
 	mongo_connection *connection;
   buffer buf;
   int bit_opts = 0;
+	int prep = PREP;
 
   if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|z", &docs, &options) == FAILURE) {
     return;
@@ -545,10 +842,21 @@ PHP_METHOD(MongoCollection, batchInsert) {
    * array("continueOnError" => true);
    */
   if (options) {
-	  zval **continue_on_error = NULL;
+	  zval **continue_on_error = NULL, **ids = NULL;
 
 	  zend_hash_find(HASH_P(options), "continueOnError", strlen("continueOnError")+1, (void**)&continue_on_error);
 	  bit_opts = (continue_on_error ? Z_BVAL_PP(continue_on_error) : 0) << 0;
+
+		/* The _ids that are generated for the documents are MongoIds by default.
+		 * With "ids" => "string" the documents get their hex strings instead, and
+		 * with "ids" => false nothing at all, which saves creating the objects. */
+		if (zend_hash_find(HASH_P(options), "ids", strlen("ids") + 1, (void**)&ids) == SUCCESS) {
+			if (Z_TYPE_PP(ids) == IS_STRING && strcmp(Z_STRVAL_PP(ids), "string") == 0) {
+				prep = PREP_ID_STRING;
+			} else if (!zend_is_true(*ids)) {
+				prep = PREP_ID_NONE;
+			}
+		}
   }
 
   PHP_MONGO_GET_COLLECTION(getThis());
@@ -559,7 +867,7 @@ PHP_METHOD(MongoCollection, batchInsert) {
 
   CREATE_BUF(buf, INITIAL_BUF_SIZE);
 
-	if (php_mongo_write_batch_insert(&buf, Z_STRVAL_P(c->ns), bit_opts, docs, connection->max_bson_size TSRMLS_CC) == FAILURE) {
+	if (php_mongo_write_batch_insert(&buf, Z_STRVAL_P(c->ns), bit_opts, docs, connection->max_bson_size, prep TSRMLS_CC) == FAILURE) {
     efree(buf.start);
     return;
   }
@@ -571,6 +879,78 @@ PHP_METHOD(MongoCollection, batchInsert) {
   efree(buf.start);
 }
 
+/* {{{ proto array|bool MongoCollection::bulkWrite(array ops [, array options])
+   Sends a list of inserts, updates and removes in one go. Each operation is a
+   list of the name and the arguments of the method, e.g.
+   array('update', $criteria, $newobj, array('upsert' => true)). With safe or
+   fsync, every write is followed by its own getlasterror, all of them are sent
+   back to back and the list of their replies is returned. */
+PHP_METHOD(MongoCollection, bulkWrite)
+{
+	zval *ops, *options = NULL, **op, *cmd = NULL;
+	mongo_collection *c;
+	mongo_connection *connection;
+	HashPosition pointer;
+	buffer buf;
+	char *error_message = NULL;
+	int *request_ids = NULL, count = 0, timeout = 0, index = 0;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|a", &ops, &options) == FAILURE) {
+		return;
+	}
+
+	PHP_MONGO_GET_COLLECTION(getThis());
+
+	if ((connection = get_server(c, MONGO_CON_FLAG_WRITE TSRMLS_CC)) == 0) {
+		RETURN_FALSE;
+	}
+
+	if (is_safe_op(options TSRMLS_CC)) {
+		cmd = php_mongo_getlasterror_cmd(getThis(), options, &timeout TSRMLS_CC);
+		request_ids = (int*)safe_emalloc(zend_hash_num_elements(Z_ARRVAL_P(ops)), sizeof(int), 0);
+	}
+
+	CREATE_BUF(buf, INITIAL_BUF_SIZE);
+
+	for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(ops), &pointer);
+		zend_hash_get_current_data_ex(Z_ARRVAL_P(ops), (void**)&op, &pointer) == SUCCESS;
+		zend_hash_move_forward_ex(Z_ARRVAL_P(ops), &pointer), index++) {
+
+		if (append_bulk_op(&buf, Z_STRVAL_P(c->ns), *op, index, connection->max_bson_size TSRMLS_CC) == FAILURE || EG(exception)) {
+			goto cleanup;
+		}
+		if (cmd) {
+			if ((request_ids[count] = php_mongo_append_getlasterror_query(getThis(), &buf, cmd TSRMLS_CC)) == 0) {
+				goto cleanup;
+			}
+			count++;
+		}
+	}
+
+	if (mongo_io_flush(connection, buf.start, buf.pos - buf.start, &error_message) == -1) {
+		mongo_cursor_throw(connection, 16 TSRMLS_CC, error_message);
+		free(error_message);
+		connection_deregister_wrapper(MonGlo(manager), connection TSRMLS_CC);
+		goto cleanup;
+	}
+
+	if (!cmd) {
+		RETVAL_TRUE;
+		goto cleanup;
+	}
+
+	array_init(return_value);
+	php_mongo_read_getlasterror_replies(connection, request_ids, count, timeout, return_value TSRMLS_CC);
+
+cleanup:
+	efree(buf.start);
+	if (cmd) {
+		zval_ptr_dtor(&cmd);
+		efree(request_ids);
+	}
+}
+/* }}} */
+
 PHP_METHOD(MongoCollection, find)
 {
   zval *query = 0, *fields = 0;
@@ -611,26 +991,225 @@ PHP_METHOD(MongoCollection, find)
 }
 
 PHP_METHOD(MongoCollection, findOne) {
-  zval *query = 0, *fields = 0, *cursor;
-  zval temp;
-  zval *limit = &temp;
+  zval *query = 0, *fields = 0, *options = 0;
+  mongo_collection *c;
 
-  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|zz", &query, &fields) == FAILURE) {
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|zza", &query, &fields, &options) == FAILURE) {
     return;
   }
   MUST_BE_ARRAY_OR_OBJECT(1, query);
   MUST_BE_ARRAY_OR_OBJECT(2, fields);
 
-  MAKE_STD_ZVAL(cursor);
-  MONGO_METHOD_BASE(MongoCollection, find)(ZEND_NUM_ARGS(), cursor, NULL, getThis(), 0 TSRMLS_CC);
-  PHP_MONGO_CHECK_EXCEPTION1(&cursor);
+  PHP_MONGO_GET_COLLECTION(getThis());
 
-  ZVAL_LONG(limit, -1);
-  MONGO_METHOD1(MongoCursor, limit, cursor, cursor, limit);
-  MONGO_METHOD(MongoCursor, getNext, return_value, cursor);
+  /* A single document doesn't need a MongoCursor object, nor a place on the
+   * cursor_list, as the database closes the cursor right away */
+  RETVAL_NULL();
+  php_mongo_cursor_find_one(c->link, Z_STRVAL_P(c->ns), query, fields, &c->read_pref, get_cache_ttl(c, options TSRMLS_CC), return_value TSRMLS_CC);
+}
 
-  zend_objects_store_del_ref(cursor TSRMLS_CC);
-  zval_ptr_dtor(&cursor);
+/* findByIds splits the ids over queries of at most this many ids, or of at
+ * most as many bytes of them as fit into the maximum document size of the
+ * server, which leaves MONGO_IDS_QUERY_OVERHEAD for the rest of the query.
+ * Before ismaster has told the size, the smallest that any server has had
+ * (4MB) is used. */
+#define MONGO_IDS_PER_QUERY 1000
+#define MONGO_IDS_DEFAULT_BSON_SIZE (4 * 1024 * 1024)
+#define MONGO_IDS_QUERY_OVERHEAD (16 * 1024)
+
+/* Returns the most bytes of ids that go into a single query, for the
+ * connection that the collection's read preference picks, if there is one
+ * already */
+static int ids_max_bytes(mongo_collection *c, mongo_link *link TSRMLS_DC)
+{
+	mongo_connection *connection;
+	mongo_read_preference rp;
+	char *error_message = NULL;
+	int max_bson_size = MONGO_IDS_DEFAULT_BSON_SIZE;
+
+	mongo_read_preference_copy(&link->servers->read_pref, &rp);
+	mongo_read_preference_replace(&c->read_pref, &link->servers->read_pref);
+	connection = mongo_get_read_write_connection(link->manager, link->servers, MONGO_CON_FLAG_READ | MONGO_CON_FLAG_DONT_CONNECT, &error_message);
+	mongo_read_preference_replace(&rp, &link->servers->read_pref);
+	mongo_read_preference_dtor(&rp);
+	free(error_message);
+
+	if (connection && connection->max_bson_size > MONGO_IDS_QUERY_OVERHEAD) {
+		max_bson_size = connection->max_bson_size;
+	}
+	return max_bson_size - MONGO_IDS_QUERY_OVERHEAD;
+}
+
+/* Creates a cursor for the documents whose _id is in ids, and sends its query
+ * without waiting for the reply. Returns the cursor, or NULL with an
+ * exception thrown. */
+static zval *start_ids_query(mongo_collection *c, mongo_link *link, zval *ids, zval *fields TSRMLS_DC)
+{
+	zval *cursor_zval, *query, *in, temp;
+	mongo_cursor *cursor;
+
+	MAKE_STD_ZVAL(in);
+	array_init(in);
+	add_assoc_zval(in, "$in", ids);
+	zval_add_ref(&ids);
+
+	MAKE_STD_ZVAL(query);
+	array_init(query);
+	add_assoc_zval(query, "_id", in);
+
+	MAKE_STD_ZVAL(cursor_zval);
+	object_init_ex(cursor_zval, mongo_ce_Cursor);
+
+	mongo_read_preference_replace(&c->read_pref, &link->servers->read_pref);
+	MONGO_METHOD4(MongoCursor, __construct, &temp, cursor_zval, c->link, c->ns, query, fields);
+	zval_ptr_dtor(&query);
+
+	cursor = (mongo_cursor*)zend_object_store_get_object(cursor_zval TSRMLS_CC);
+	mongo_read_preference_replace(&c->read_pref, &cursor->read_pref);
+
+	/* each of the documents comes back at most once */
+	cursor->batch_size = zend_hash_num_elements(Z_ARRVAL_P(ids));
+
+	if (EG(exception) || php_mongo_cursor_start(cursor_zval TSRMLS_CC) == FAILURE) {
+		zval_ptr_dtor(&cursor_zval);
+		return NULL;
+	}
+	return cursor_zval;
+}
+
+/* Appends the documents of zcursor to result. Returns FAILURE if an exception
+ * was thrown. */
+static int collect_ids_results(zval *zcursor, zval *result TSRMLS_DC)
+{
+	mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(zcursor TSRMLS_CC);
+	zval ignored;
+
+	/* the reply to the query has to be read before next() looks at it */
+	if (cursor->prefetch_pending && php_mongo_cursor_read_pending(cursor TSRMLS_CC) == FAILURE) {
+		return FAILURE;
+	}
+
+	while (1) {
+		MONGO_METHOD(MongoCursor, next, &ignored, zcursor);
+		if (EG(exception)) {
+			return FAILURE;
+		}
+		if (!cursor->current) {
+			return SUCCESS;
+		}
+
+		zval_add_ref(&cursor->current);
+		add_next_index_zval(result, cursor->current);
+	}
+}
+
+/* {{{ proto array MongoCollection::findByIds(array ids [, array fields])
+   Returns a list of the documents whose _id is one of ids. The list is in
+   the order the replies come back in (not the order of ids), with keys 0,
+   1, 2 and so on: it is NOT keyed by _id, so a document can't be looked up
+   by its id in it. PHP array keys can't tell all _id types apart (5 and
+   "5", or a MongoId and its hex string). Ids that don't match a document
+   are left out. The ids are split over several $in
+   queries, which are all sent before any of the replies is read. */
+PHP_METHOD(MongoCollection, findByIds)
+{
+	zval *ids, *fields = NULL, *chunk = NULL, *cursors, **id, **cursor;
+	mongo_collection *c;
+	mongo_link *link;
+	HashPosition pos;
+	char name[16];
+	int bytes = 0, i = 0, max_bytes;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|z", &ids, &fields) == FAILURE) {
+		return;
+	}
+	MUST_BE_ARRAY_OR_OBJECT(2, fields);
+
+	PHP_MONGO_GET_COLLECTION(getThis());
+	PHP_MONGO_GET_LINK(c->link);
+
+	max_bytes = ids_max_bytes(c, link TSRMLS_CC);
+
+	MAKE_STD_ZVAL(cursors);
+	array_init(cursors);
+
+	if (!fields) {
+		MAKE_STD_ZVAL(fields);
+		array_init(fields);
+	} else {
+		zval_add_ref(&fields);
+	}
+
+	for (
+		zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(ids), &pos);
+		zend_hash_get_current_data_ex(Z_ARRVAL_P(ids), (void**) &id, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(Z_ARRVAL_P(ids), &pos)
+	) {
+		snprintf(name, sizeof(name), "%d", i);
+		bytes += php_mongo_element_size(name, id TSRMLS_CC);
+
+		if (chunk && (i == MONGO_IDS_PER_QUERY || bytes > max_bytes)) {
+			zval *zcursor = start_ids_query(c, link, chunk, fields TSRMLS_CC);
+
+			zval_ptr_dtor(&chunk);
+			chunk = NULL;
+			if (!zcursor) {
+				goto cleanup;
+			}
+			add_next_index_zval(cursors, zcursor);
+
+			i = 0;
+			bytes = php_mongo_element_size("0", id TSRMLS_CC);
+		}
+		if (!chunk) {
+			MAKE_STD_ZVAL(chunk);
+			array_init(chunk);
+		}
+
+		add_next_index_zval(chunk, *id);
+		zval_add_ref(id);
+		i++;
+	}
+	if (chunk) {
+		zval *zcursor = start_ids_query(c, link, chunk, fields TSRMLS_CC);
+
+		zval_ptr_dtor(&chunk);
+		if (!zcursor) {
+			goto cleanup;
+		}
+		add_next_index_zval(cursors, zcursor);
+	}
+
+	array_init(return_value);
+	for (
+		zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(cursors), &pos);
+		zend_hash_get_current_data_ex(Z_ARRVAL_P(cursors), (void**) &cursor, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(Z_ARRVAL_P(cursors), &pos)
+	) {
+		if (collect_ids_results(*cursor, return_value TSRMLS_CC) == FAILURE) {
+			break;
+		}
+	}
+
+cleanup:
+	/* Freeing a cursor whose reply hasn't been read reads and drops it */
+	zval_ptr_dtor(&cursors);
+	zval_ptr_dtor(&fields);
+}
+/* }}} */
+
+/* Runs cmd on the collection's database with php_mongo_cursor_command.
+ * Returns the raw reply, which the caller efrees, or NULL with an exception
+ * thrown. */
+static char *run_command(mongo_collection *c, zval *cmd TSRMLS_DC)
+{
+	mongo_db *db = (mongo_db*)zend_object_store_get_object(c->parent TSRMLS_CC);
+	char *reply = NULL;
+
+	if (php_mongo_cursor_command(c->link, Z_STRVAL_P(db->name), cmd, &reply TSRMLS_CC) == FAILURE) {
+		return NULL;
+	}
+	return reply;
 }
 
 /* {{{ proto array MongoCollection::findAndModify(array query [, array update[, array fields [, array options]]])
@@ -638,7 +1217,8 @@ PHP_METHOD(MongoCollection, findOne) {
 PHP_METHOD(MongoCollection, findAndModify)
 {
 	zval *query, *update = 0, *fields = 0, *options = 0;
-	zval *data, *tmpretval, **values;
+	zval *data;
+	char *reply, *value, type;
 	mongo_collection *c;
 
 	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a!|a!a!a!", &query, &update, &fields, &options) == FAILURE) {
@@ -672,20 +1252,25 @@ PHP_METHOD(MongoCollection, findAndModify)
 		zend_hash_merge(HASH_P(data), HASH_P(options), (void (*)(void*))zval_add_ref, &temp, sizeof(zval*), 1);
 	}
 
-	MAKE_STD_ZVAL(tmpretval);
-	ZVAL_NULL(tmpretval);
-	MONGO_CMD(tmpretval, c->parent);
+	reply = run_command(c, data TSRMLS_CC);
+	zval_ptr_dtor(&data);
+
+	/* Even a failed reply doesn't say that nothing was changed */
+	php_mongo_result_cache_invalidate(Z_STRVAL_P(c->ns) TSRMLS_CC);
+	if (!reply) {
+		return;
+	}
 
-	if (zend_hash_find(Z_ARRVAL_P(tmpretval), "value", strlen("value")+1, (void **)&values) == SUCCESS) {
+	/* Only the document is decoded, not the rest of the reply */
+	value = bson_find_value(reply, "value", &type);
+	if (value) {
 		array_init(return_value);
 		/* We may wind up with a NULL here if there simply aren't any results */
-		if (Z_TYPE_PP(values) == IS_ARRAY) {
-			zend_hash_copy(Z_ARRVAL_P(return_value), Z_ARRVAL_PP(values), (copy_ctor_func_t) zval_add_ref, NULL, sizeof(zval *));
+		if (type == BSON_OBJECT) {
+			bson_to_zval(value, HASH_P(return_value) TSRMLS_CC);
 		}
 	}
-
-	zval_ptr_dtor(&data);
-	zval_ptr_dtor(&tmpretval);
+	efree(reply);
 }
 /* }}} */
 
@@ -819,10 +1404,27 @@ PHP_METHOD(MongoCollection, remove) {
   zval_ptr_dtor(&criteria);
 }
 
+/* Whether the system.indexes insert of ensureIndex() was acknowledged
+ * without an error. A plain write that was sent says nothing about whether
+ * the index could be built (a unique one, for example). */
+static int index_was_ensured(zval *result)
+{
+	zval **err;
+
+	if (Z_TYPE_P(result) == IS_ARRAY) {
+		return zend_hash_find(Z_ARRVAL_P(result), "err", strlen("err") + 1, (void**)&err) == FAILURE || Z_TYPE_PP(err) == IS_NULL;
+	}
+	return 0;
+}
+
 PHP_METHOD(MongoCollection, ensureIndex) {
   zval *keys, *options = 0, *db, *system_indexes, *collection, *data, *key_str;
   mongo_collection *c;
   zend_bool done_name = 0;
+	mongo_connection *connection = NULL;
+	buffer spec;
+
+	spec.start = NULL;
 
   if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|z", &keys, &options) == FAILURE) {
     return;
@@ -938,8 +1540,38 @@ PHP_METHOD(MongoCollection, ensureIndex) {
     zval_add_ref(&key_str);
   }
 
-  // MongoCollection::insert()
-  MONGO_METHOD2(MongoCollection, insert, return_value, collection, data, options);
+	/* With mongo.index_cache_ttl, an index spec that an acknowledged
+	 * ensureIndex() has built on the primary already is not sent again by
+	 * unacknowledged ones until the TTL runs out. Acknowledged ones always
+	 * go to the server, so that their result is a real one. */
+	if (MonGlo(index_cache_ttl) > 0 && !is_async_op(options TSRMLS_CC)) {
+		connection = get_server(c, MONGO_CON_FLAG_WRITE TSRMLS_CC);
+		if (connection) {
+			CREATE_BUF(spec, INITIAL_BUF_SIZE);
+			zval_to_bson(&spec, HASH_P(data), NO_PREP TSRMLS_CC);
+			if (EG(exception)) {
+				efree(spec.start);
+				spec.start = NULL;
+				connection = NULL;
+			}
+		}
+	}
+
+	if (spec.start && !is_safe_op(options TSRMLS_CC) && mongo_connection_index_ensured(connection, Z_STRVAL_P(c->ns), spec.start, spec.pos - spec.start)) {
+		php_mongo_log(MLOG_IO, MLOG_FINE TSRMLS_CC, "ensureIndex: %s already ensured, skipping", Z_STRVAL_P(c->ns));
+		RETVAL_TRUE;
+	} else if (!EG(exception)) {
+		// MongoCollection::insert()
+		MONGO_METHOD2(MongoCollection, insert, return_value, collection, data, options);
+
+		if (spec.start && !EG(exception) && index_was_ensured(return_value)) {
+			mongo_connection_index_remember(connection, Z_STRVAL_P(c->ns), spec.start, spec.pos - spec.start, MonGlo(index_cache_ttl));
+		}
+	}
+
+	if (spec.start) {
+		efree(spec.start);
+	}
 
   zval_ptr_dtor(&options);
   zval_ptr_dtor(&data);
@@ -972,6 +1604,7 @@ PHP_METHOD(MongoCollection, deleteIndex) {
   add_assoc_zval(data, "index", key_str);
 
   MONGO_CMD(return_value, c->parent);
+	mongo_manager_forget_indexes(MonGlo(manager), Z_STRVAL_P(c->ns));
 
   zval_ptr_dtor(&data);
 }
@@ -988,6 +1621,7 @@ PHP_METHOD(MongoCollection, deleteIndexes) {
   add_assoc_string(data, "index", "*", 1);
 
   MONGO_CMD(return_value, c->parent);
+	mongo_manager_forget_indexes(MonGlo(manager), Z_STRVAL_P(c->ns));
 
   zval_ptr_dtor(&data);
 }
@@ -1033,12 +1667,16 @@ PHP_METHOD(MongoCollection, getIndexInfo) {
 }
 
 PHP_METHOD(MongoCollection, count) {
-  zval *response, *data, *query=0;
-  long limit = 0, skip = 0;
+  zval *response, *data, *query=0, *options = 0;
+  long limit = 0, skip = 0, ttl;
   zval **n;
+	char *reply, *cached;
+	double count;
+	buffer cache_key;
+	int cached_len;
   mongo_collection *c;
 
-  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|zll", &query, &limit, &skip) == FAILURE) {
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|zlla", &query, &limit, &skip, &options) == FAILURE) {
     return;
   }
 
@@ -1058,17 +1696,48 @@ PHP_METHOD(MongoCollection, count) {
     add_assoc_long(data, "skip", skip);
   }
 
-  MAKE_STD_ZVAL(response);
-  ZVAL_NULL(response);
+	ttl = get_cache_ttl(c, options TSRMLS_CC);
+	if (ttl > 0 && php_mongo_result_cache_key(&cache_key, 'c', c->link, Z_STRVAL_P(c->ns), data, NULL, NULL TSRMLS_CC) == FAILURE) {
+		ttl = 0;
+	}
+	if (ttl > 0 && (cached = php_mongo_result_cache_find(&cache_key, &cached_len TSRMLS_CC)) && bson_find_field_as_double(cached + INT_32, "n", &count)) {
+		efree(cache_key.start);
+		zval_ptr_dtor(&data);
+		RETURN_LONG((long) count);
+	}
 
-  MONGO_CMD(response, c->parent);
+	reply = run_command(c, data TSRMLS_CC);
+	zval_ptr_dtor(&data);
+	if (!reply) {
+		if (ttl > 0) {
+			efree(cache_key.start);
+		}
+		return;
+	}
 
-  zval_ptr_dtor(&data);
+	/* The server sends n as a double. Anything else, such as an error, is
+	 * decoded and looked at like before. */
+	if (bson_find_field_as_double(reply + INT_32, "n", &count)) {
+		if (ttl > 0) {
+			php_mongo_result_cache_store(&cache_key, Z_STRVAL_P(c->ns), reply, MONGO_32(*(int*)reply), ttl TSRMLS_CC);
+			efree(cache_key.start);
+		}
+		efree(reply);
+		RETURN_LONG((long) count);
+	}
+	if (ttl > 0) {
+		efree(cache_key.start);
+	}
 
-  if (EG(exception) || Z_TYPE_P(response) != IS_ARRAY) {
-    zval_ptr_dtor(&response);
-    return;
-  }
+	MAKE_STD_ZVAL(response);
+	array_init(response);
+	bson_to_zval(reply, HASH_P(response) TSRMLS_CC);
+	efree(reply);
+
+	if (EG(exception)) {
+		zval_ptr_dtor(&response);
+		return;
+	}
 
   if (zend_hash_find(HASH_P(response), "n", 2, (void**)&n) == SUCCESS) {
     convert_to_long(*n);
@@ -1334,13 +2003,107 @@ PHP_METHOD(MongoCollection, aggregate)
 /* }}} */
 
 
+/* {{{ proto MongoCursor MongoCollection::aggregateCursor(array pipeline [, array options])
+   Runs the pipeline as an aggregate command that returns a cursor, which is
+   read in batches of options' batchSize (the server's default if it is not
+   given). The other options are sent as part of the command. */
+PHP_METHOD(MongoCollection, aggregateCursor)
+{
+	zval *pipeline, *options = NULL, *data, *cursor_doc, *ns, temp, **value;
+	mongo_collection *c;
+	mongo_db *db;
+	mongo_link *link;
+	mongo_cursor *cursor;
+	HashPosition pos;
+	char *cmd_ns;
+	long batch_size = 0;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|a", &pipeline, &options) == FAILURE) {
+		return;
+	}
+
+	PHP_MONGO_GET_COLLECTION(getThis());
+	PHP_MONGO_GET_DB(c->parent);
+	PHP_MONGO_GET_LINK(c->link);
+
+	MAKE_STD_ZVAL(data);
+	array_init(data);
+
+	add_assoc_zval(data, "aggregate", c->name);
+	zval_add_ref(&c->name);
+	add_assoc_zval(data, "pipeline", pipeline);
+	zval_add_ref(&pipeline);
+
+	MAKE_STD_ZVAL(cursor_doc);
+	array_init(cursor_doc);
+
+	if (options) {
+		for (
+			zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(options), &pos);
+			zend_hash_get_current_data_ex(Z_ARRVAL_P(options), (void**) &value, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_P(options), &pos)
+		) {
+			char *key;
+			uint key_len;
+			ulong index;
+
+			if (zend_hash_get_current_key_ex(Z_ARRVAL_P(options), &key, &key_len, &index, NO_DUP, &pos) != HASH_KEY_IS_STRING) {
+				continue;
+			}
+			if (strcmp(key, "batchSize") == 0) {
+				zval tmp = **value;
+
+				zval_copy_ctor(&tmp);
+				convert_to_long(&tmp);
+				batch_size = Z_LVAL(tmp);
+				continue;
+			}
+
+			add_assoc_zval_ex(data, key, key_len, *value);
+			zval_add_ref(value);
+		}
+	}
+
+	if (batch_size < 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "The batchSize option must not be negative");
+		zval_ptr_dtor(&cursor_doc);
+		zval_ptr_dtor(&data);
+		RETURN_FALSE;
+	}
+	/* an empty first batch would look like the end of the results */
+	if (batch_size > 0) {
+		add_assoc_long(cursor_doc, "batchSize", batch_size);
+	}
+	add_assoc_zval(data, "cursor", cursor_doc);
+
+	MAKE_STD_ZVAL(ns);
+	spprintf(&cmd_ns, 0, "%s.$cmd", Z_STRVAL_P(db->name));
+	ZVAL_STRING(ns, cmd_ns, 0);
+
+	object_init_ex(return_value, mongo_ce_Cursor);
+	MONGO_METHOD3(MongoCursor, __construct, &temp, return_value, c->link, ns, data);
+
+	zval_ptr_dtor(&ns);
+	zval_ptr_dtor(&data);
+
+	cursor = (mongo_cursor*)zend_object_store_get_object(return_value TSRMLS_CC);
+	cursor->command_cursor = 1;
+	cursor->batch_size = batch_size;
+
+	/* like MongoDB::command, the command goes to the primary */
+	mongo_manager_log(link->manager, MLOG_CON, MLOG_INFO, "forcing primary for command");
+	php_mongo_connection_force_primary(cursor, link TSRMLS_CC);
+}
+/* }}} */
+
 /* {{{ proto array MongoCollection::distinct(string key [, array query])
  * Returns a list of distinct values for the given key across a collection */
 PHP_METHOD(MongoCollection, distinct)
 {
     char *key;
     int key_len;
-    zval *data, **values, *tmp, *query = NULL;
+    zval *data, *query = NULL;
+	char *reply, *values, type;
 	mongo_collection *c;
 
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|a!", &key, &key_len, &query) == FAILURE) {
@@ -1363,22 +2126,21 @@ PHP_METHOD(MongoCollection, distinct)
         zval_add_ref(&query);
     }
 
-    MAKE_STD_ZVAL(tmp);
-    MONGO_CMD(tmp, c->parent);
-
-    if (zend_hash_find(Z_ARRVAL_P(tmp), "values", strlen("values")+1, (void **)&values) == SUCCESS) {
-#ifdef array_init_size
-        array_init_size(return_value, zend_hash_num_elements(Z_ARRVAL_PP(values)));
-#else
-        array_init(return_value);
-#endif
-        zend_hash_copy(Z_ARRVAL_P(return_value), Z_ARRVAL_PP(values), (copy_ctor_func_t) zval_add_ref, NULL, sizeof(zval *));
-    } else {
-        RETVAL_FALSE;
-    }
+	reply = run_command(c, data TSRMLS_CC);
+	zval_ptr_dtor(&data);
+	if (!reply) {
+		return;
+	}
 
-    zval_ptr_dtor(&data);
-    zval_ptr_dtor(&tmp);
+	/* Only the values are decoded, not the stats that come with them */
+	values = bson_find_value(reply, "values", &type);
+	if (values && type == BSON_ARRAY) {
+		array_init(return_value);
+		bson_to_zval(values, HASH_P(return_value) TSRMLS_CC);
+	} else {
+		RETVAL_FALSE;
+	}
+	efree(reply);
 }
 /* }}} */
 
@@ -1541,6 +2303,11 @@ MONGO_ARGINFO_STATIC ZEND_BEGIN_ARG_INFO_EX(arginfo_batchInsert, 0, ZEND_RETURN_
 	ZEND_ARG_ARRAY_INFO(0, options, 0)
 ZEND_END_ARG_INFO()
 
+MONGO_ARGINFO_STATIC ZEND_BEGIN_ARG_INFO_EX(arginfo_bulkWrite, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_ARRAY_INFO(0, operations, 0)
+	ZEND_ARG_ARRAY_INFO(0, options, 1)
+ZEND_END_ARG_INFO()
+
 MONGO_ARGINFO_STATIC ZEND_BEGIN_ARG_INFO_EX(arginfo_find, 0, ZEND_RETURN_VALUE, 0)
 	ZEND_ARG_INFO(0, query)
 	ZEND_ARG_INFO(0, fields)
@@ -1549,6 +2316,16 @@ ZEND_END_ARG_INFO()
 MONGO_ARGINFO_STATIC ZEND_BEGIN_ARG_INFO_EX(arginfo_find_one, 0, ZEND_RETURN_VALUE, 0)
 	ZEND_ARG_INFO(0, query)
 	ZEND_ARG_INFO(0, fields)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
+ZEND_END_ARG_INFO()
+
+MONGO_ARGINFO_STATIC ZEND_BEGIN_ARG_INFO_EX(arginfo_setCacheTTL, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, seconds)
+ZEND_END_ARG_INFO()
+
+MONGO_ARGINFO_STATIC ZEND_BEGIN_ARG_INFO_EX(arginfo_findByIds, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_ARRAY_INFO(0, ids, 0)
+	ZEND_ARG_INFO(0, fields)
 ZEND_END_ARG_INFO()
 
 MONGO_ARGINFO_STATIC ZEND_BEGIN_ARG_INFO_EX(arginfo_findandmodify, 0, ZEND_RETURN_VALUE, 1)
@@ -1582,6 +2359,7 @@ MONGO_ARGINFO_STATIC ZEND_BEGIN_ARG_INFO_EX(arginfo_count, 0, ZEND_RETURN_VALUE,
 	ZEND_ARG_INFO(0, query_AS_array_of_fields_OR_object)
 	ZEND_ARG_INFO(0, limit)
 	ZEND_ARG_INFO(0, skip)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
 ZEND_END_ARG_INFO()
 
 MONGO_ARGINFO_STATIC ZEND_BEGIN_ARG_INFO_EX(arginfo_createDBRef, 0, ZEND_RETURN_VALUE, 1)
@@ -1609,6 +2387,11 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_aggregate, 0, 0, 1)
 	ZEND_ARG_INFO(0, ...)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_aggregateCursor, 0, 0, 1)
+	ZEND_ARG_ARRAY_INFO(0, pipeline, 0)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
+ZEND_END_ARG_INFO()
+
 static zend_function_entry MongoCollection_methods[] = {
   PHP_ME(MongoCollection, __construct, arginfo___construct, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, __toString, arginfo_no_parameters, ZEND_ACC_PUBLIC)
@@ -1618,14 +2401,19 @@ static zend_function_entry MongoCollection_methods[] = {
   PHP_ME(MongoCollection, setSlaveOkay, arginfo_setSlaveOkay, ZEND_ACC_PUBLIC|ZEND_ACC_DEPRECATED)
   PHP_ME(MongoCollection, getReadPreference, arginfo_no_parameters, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, setReadPreference, arginfo_setReadPreference, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCollection, setCacheTTL, arginfo_setCacheTTL, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCollection, getCacheTTL, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCollection, invalidateCache, arginfo_no_parameters, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, drop, arginfo_no_parameters, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, validate, arginfo_validate, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, insert, arginfo_insert, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, batchInsert, arginfo_batchInsert, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCollection, bulkWrite, arginfo_bulkWrite, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, update, arginfo_update, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, remove, arginfo_remove, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, find, arginfo_find, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, findOne, arginfo_find_one, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCollection, findByIds, arginfo_findByIds, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, findAndModify, arginfo_findandmodify, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, ensureIndex, arginfo_ensureIndex, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, deleteIndex, arginfo_deleteIndex, ZEND_ACC_PUBLIC)
@@ -1639,6 +2427,7 @@ static zend_function_entry MongoCollection_methods[] = {
   PHP_ME(MongoCollection, group, arginfo_group, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, distinct, arginfo_distinct, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCollection, aggregate, arginfo_aggregate, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCollection, aggregateCursor, arginfo_aggregateCursor, ZEND_ACC_PUBLIC)
   {NULL, NULL, NULL}
 };
 
@@ -21,6 +21,23 @@
 
 zend_object_value php_mongo_collection_new(zend_class_entry* TSRMLS_DC);
 
+/* Returns a connection for an operation on the collection coll, or NULL with
+ * an exception thrown. connection_flags are the MONGO_CON_FLAG_* ones. */
+mongo_connection* php_mongo_collection_get_connection(zval *coll, int connection_flags TSRMLS_DC);
+
+/* Returns the getlasterror command for a write on coll with options, and sets
+ * timeout_out to the timeout for its reply */
+zval* php_mongo_getlasterror_cmd(zval *coll, zval *options, int *timeout_out TSRMLS_DC);
+
+/* Appends a getlasterror query for cmd on the database of coll to buf, and
+ * returns its request id, or 0 on failure */
+int php_mongo_append_getlasterror_query(zval *coll, buffer *buf, zval *cmd TSRMLS_DC);
+
+/* Reads the replies to the getlasterror queries with the given request ids
+ * into the list in return_value. Returns FAILURE, with an exception thrown,
+ * if a reply could not be read. */
+int php_mongo_read_getlasterror_replies(mongo_connection *connection, int *request_ids, int count, int timeout, zval *return_value TSRMLS_DC);
+
 PHP_METHOD(MongoCollection, __construct);
 PHP_METHOD(MongoCollection, __toString);
 PHP_METHOD(MongoCollection, __get);
@@ -29,14 +46,19 @@ PHP_METHOD(MongoCollection, getSlaveOkay);
 PHP_METHOD(MongoCollection, setSlaveOkay);
 PHP_METHOD(MongoCollection, getReadPreference);
 PHP_METHOD(MongoCollection, setReadPreference);
+PHP_METHOD(MongoCollection, setCacheTTL);
+PHP_METHOD(MongoCollection, getCacheTTL);
+PHP_METHOD(MongoCollection, invalidateCache);
 PHP_METHOD(MongoCollection, drop);
 PHP_METHOD(MongoCollection, validate);
 PHP_METHOD(MongoCollection, insert);
 PHP_METHOD(MongoCollection, batchInsert);
+PHP_METHOD(MongoCollection, bulkWrite);
 PHP_METHOD(MongoCollection, update);
 PHP_METHOD(MongoCollection, remove);
 PHP_METHOD(MongoCollection, find);
 PHP_METHOD(MongoCollection, findOne);
+PHP_METHOD(MongoCollection, findByIds);
 PHP_METHOD(MongoCollection, ensureIndex);
 PHP_METHOD(MongoCollection, deleteIndex);
 PHP_METHOD(MongoCollection, getIndexInfo);
@@ -46,5 +68,6 @@ PHP_METHOD(MongoCollection, createDBRef);
 PHP_METHOD(MongoCollection, getDBRef);
 PHP_METHOD(MongoCollection, toIndexString);
 PHP_METHOD(MongoCollection, group);
+PHP_METHOD(MongoCollection, aggregateCursor);
 
 #endif /* MONGO_COLLECTION_H */
@@ -5,7 +5,7 @@ PHP_MONGO_CFLAGS="-I@ext_builddir@/util"
 
 if test "$PHP_MONGO" != "no"; then
   AC_DEFINE(HAVE_MONGO, 1, [Whether you have Mongo extension])
-  PHP_NEW_EXTENSION(mongo, php_mongo.c mongo.c mongo_types.c bson.c cursor.c collection.c db.c gridfs.c gridfs_stream.c util/hash.c util/log.c mcon/bson_helpers.c mcon/collection.c mcon/connections.c mcon/io.c mcon/manager.c mcon/mini_bson.c mcon/parse.c mcon/read_preference.c mcon/str.c mcon/utils.c, $ext_shared,, $PHP_MONGO_CFLAGS)
+  PHP_NEW_EXTENSION(mongo, php_mongo.c mongo.c mongo_types.c bson.c cursor.c collection.c db.c gridfs.c gridfs_stream.c gridfs_cache.c result_cache.c mongo_stats.c lazy_document.c bson_iterator.c cursor_group.c tailer.c write_result.c util/hash.c util/log.c mcon/bson_helpers.c mcon/collection.c mcon/connections.c mcon/io.c mcon/manager.c mcon/mini_bson.c mcon/parse.c mcon/read_preference.c mcon/resolver.c mcon/stats.c mcon/trace.c mcon/str.c mcon/topology_cache.c mcon/utils.c, $ext_shared,, $PHP_MONGO_CFLAGS)
 
   PHP_ADD_BUILD_DIR([$ext_builddir/util], 1)
   PHP_ADD_INCLUDE([$ext_builddir/util])
@@ -14,6 +14,13 @@ if test "$PHP_MONGO" != "no"; then
   PHP_ADD_INCLUDE([$ext_builddir/mcon])
   PHP_ADD_INCLUDE([$ext_srcdir/mcon])
 
+  dnl zlib is used for wire protocol compression, when it is there
+  PHP_CHECK_LIBRARY(z, compress2, [
+    PHP_ADD_LIBRARY(z, 1, MONGO_SHARED_LIBADD)
+    CFLAGS="$CFLAGS -DMONGO_HAVE_ZLIB"
+  ])
+  PHP_SUBST(MONGO_SHARED_LIBADD)
+
   dnl call acinclude func to check endian-ness
   PHP_C_BIGENDIAN
   if test "$ac_cv_c_bigendian_php" = "yes"; then
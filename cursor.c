@@ -19,7 +19,10 @@
 #include <zend_exceptions.h>
 #include "mcon/io.h"
 #include "mcon/manager.h"
+#include "mcon/connections.h"
 #include "mcon/utils.h"
+#include "mcon/stats.h"
+#include "mcon/trace.h"
 
 #ifdef WIN32
 #  ifndef int64_t
@@ -37,23 +40,26 @@
 #include "cursor.h"
 #include "collection.h"
 #include "mongo_types.h"
+#include "lazy_document.h"
 #include "util/log.h"
-
-#if WIN32
-HANDLE cursor_mutex;
-#else
-static pthread_mutex_t cursor_mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
+#include "result_cache.h"
 
 /* Cursor flags */
 #define CURSOR_FLAG_TAILABLE      2
 #define CURSOR_FLAG_SLAVE_OKAY    4
-#define CURSOR_FLAG_OPLOG_REPLAY  8 /* Don't use */
+#define CURSOR_FLAG_OPLOG_REPLAY  8 /* Internal, see php_mongo_cursor_tail */
 #define CURSOR_FLAG_NO_CURSOR_TO 16
 #define CURSOR_FLAG_AWAIT_DATA   32
-#define CURSOR_FLAG_EXHAUST      64 /* Not implemented */
+#define CURSOR_FLAG_EXHAUST      64
 #define CURSOR_FLAG_PARTIAL     128
 
+/* Reply flags */
+#define REPLY_FLAG_QUERY_FAILURE  2
+
+/* Receive buffers are kept across replies, and only given back when they have
+ * grown larger than this and the next reply is smaller */
+#define MONGO_CURSOR_BUF_HIGH_WATER (4 * 1024 * 1024)
+
 /* Macro to check whether a cursor is dead, and if so, bailout */
 #define MONGO_CURSOR_CHECK_DEAD \
 	if (cursor->dead) { \
@@ -82,6 +88,7 @@ ZEND_EXTERN_MODULE_GLOBALS(mongo);
 
 static zend_object_value php_mongo_cursor_new(zend_class_entry *class_type TSRMLS_DC);
 static void make_special(mongo_cursor *);
+static signed int collect_pending_replies(mongo_connection *con, mongo_cursor *cursor, char **error_message TSRMLS_DC);
 static void kill_cursor(cursor_node *node, zend_rsrc_list_entry *le TSRMLS_DC);
 
 zend_class_entry *mongo_ce_Cursor = NULL;
@@ -98,28 +105,58 @@ zend_class_entry *mongo_ce_Cursor = NULL;
  * -1 on failure, but not critical enough to throw an exception
  * 1.. on failure, and throw an exception. The return value is the error code
  */
-static signed int get_cursor_header(int sock, mongo_cursor *cursor, char **error_message TSRMLS_DC)
+/* Keeps a moving average of the size of the documents in the replies, in
+ * which the most recent reply counts for a quarter */
+static void track_doc_size(mongo_cursor *cursor, int doc_size)
+{
+	if (cursor->avg_doc_size) {
+		cursor->avg_doc_size = (cursor->avg_doc_size * 3 + doc_size) / 4;
+	} else {
+		cursor->avg_doc_size = doc_size;
+	}
+	if (cursor->avg_doc_size < 1) {
+		cursor->avg_doc_size = 1;
+	}
+}
+
+/* Counts the receive buffers of a MongoCursor towards
+ * mongo.cursor_buffer_limit, after they have grown or shrunk */
+static void update_budget(mongo_cursor *cursor TSRMLS_DC)
+{
+	int held;
+
+	if (!cursor->budgeted) {
+		return;
+	}
+	held = cursor->buf_size + cursor->prefetch_buf_size;
+	MonGlo(cursor_buffer_used) += held - cursor->budget_bytes;
+	cursor->budget_bytes = held;
+}
+
+static signed int get_cursor_header(mongo_connection *con, mongo_cursor *cursor, char **error_message TSRMLS_DC)
 {
 	int status = 0;
 	int num_returned = 0;
 	char buf[REPLY_HEADER_LEN];
+	char *recv_error_message = NULL;
 
 	php_mongo_log(MLOG_IO, MLOG_FINE TSRMLS_CC, "getting cursor header");
 
-	/* set a timeout */
-	if (cursor->timeout && cursor->timeout > 0) {
-		status = mongo_io_wait_with_timeout(sock, cursor->timeout, error_message);
+	/* set a timeout, unless (part of) the reply has been read already */
+	if (cursor->timeout && cursor->timeout > 0 && !mongo_io_has_buffered_data(con)) {
+		status = mongo_io_wait_with_timeout(con->socket, cursor->timeout, error_message);
 		if (status != 0) {
 			return status;
 		}
 	}
 
-	status = recv(sock, buf, REPLY_HEADER_LEN, FLAGS);
+	status = mongo_io_recv_buffered(con, buf, REPLY_HEADER_LEN, &recv_error_message);
+	free(recv_error_message);
 	/* socket has been closed */
 	if (status == 0) {
 		*error_message = strdup("socket has been closed");
 		return -1;
-	} else if (status < INT_32*4) {
+	} else if (status < REPLY_HEADER_LEN) {
 		*error_message = strdup("couldn't get response header");
 		return 4;
 	}
@@ -158,44 +195,517 @@ static signed int get_cursor_header(int sock, mongo_cursor *cursor, char **error
 	/* create buf */
 	cursor->recv.length -= REPLY_HEADER_LEN;
 
+	/* for sizing the next OP_GET_MORE, see MongoCursor::batchBytes */
+	if (num_returned > 0) {
+		track_doc_size(cursor, cursor->recv.length / num_returned);
+	}
+
 	return 0;
 }
 
+/* Makes buf (of which size bytes are allocated) hold a reply of len bytes.
+ * The old contents are not kept, so a buffer that is too small is replaced
+ * rather than reallocated. */
+static void reserve_recv_buf(buffer *buf, int *size, int len)
+{
+	if (buf->start && (*size < len || (*size > MONGO_CURSOR_BUF_HIGH_WATER && len <= MONGO_CURSOR_BUF_HIGH_WATER))) {
+		efree(buf->start);
+		buf->start = 0;
+	}
+
+	if (!buf->start) {
+		buf->start = (char*)emalloc(len);
+		*size = len;
+	}
+
+	buf->pos = buf->start;
+	buf->end = buf->start + len;
+}
+
 /* Reads a cursors body
- * Returns 0 on failure or an int indicating the number of bytes read */
-static int get_cursor_body(int sock, mongo_cursor *cursor, char **error_message TSRMLS_DC)
+ * Returns SUCCESS, or FAILURE with error_message set */
+static int get_cursor_body(mongo_connection *con, mongo_cursor *cursor, char **error_message TSRMLS_DC)
 {
 	php_mongo_log(MLOG_IO, MLOG_FINE TSRMLS_CC, "getting cursor body");
 
-	if (cursor->buf.start) {
-		efree(cursor->buf.start);
+	reserve_recv_buf(&cursor->buf, &cursor->buf_size, cursor->recv.length);
+	update_budget(cursor TSRMLS_CC);
+
+	/* finish populating cursor */
+	if (mongo_io_recv_buffered(con, cursor->buf.pos, cursor->recv.length, error_message) != cursor->recv.length) {
+		return FAILURE;
+	}
+	return SUCCESS;
+}
+
+/* Returns whether the raw reply document at buf is an error document: it has
+ * a $err field, or (for getLastError) an err field that is a string */
+static int is_error_document(char *buf)
+{
+	char type;
+
+	if (bson_find_value(buf, "$err", &type)) {
+		return 1;
+	}
+	if (bson_find_value(buf, "err", &type) && type == BSON_STRING) {
+		return 1;
+	}
+	return 0;
+}
+
+/* Reads the number in the element at value of the given type, which is how
+ * a cursor ID or an error code comes back */
+static int64_t raw_number(char type, char *value)
+{
+	switch (type) {
+		case BSON_INT:
+			return MONGO_32(*(int*)value);
+		case BSON_LONG:
+			return MONGO_64(*(int64_t*)value);
+		case BSON_DOUBLE: {
+			double d;
+
+			memcpy(&d, value, sizeof(double));
+			return (int64_t) d;
+		}
+	}
+	return 0;
+}
+
+/* The reply to a command that returns a cursor is one document like
+ * {cursor: {id: ..., ns: ..., firstBatch: [...]}, ok: 1}. This moves the
+ * documents of firstBatch to the front of the cursor's buffer, where the
+ * iteration expects them, and takes over the cursor's ID and namespace, so
+ * that the following batches can be fetched with OP_GET_MORE. Does nothing
+ * if the reply has been unpacked already. Returns FAILURE, with an
+ * exception thrown, if the command failed or the reply is not understood. */
+static int unpack_command_cursor(mongo_cursor *cursor TSRMLS_DC)
+{
+	char *doc = cursor->buf.pos, *end, *value, *value_end, *id, *ns, *batch, *batch_end, *name, *dest, type, id_type, ns_type = 0, batch_type = 0;
+	int num = 0, len;
+
+	if (!cursor->command_cursor || cursor->cursor_ns) {
+		return SUCCESS;
+	}
+
+	if (cursor->num < 1 || cursor->buf.end - doc < INT_32 + 1) {
+		mongo_cursor_throw(cursor->connection, 20 TSRMLS_CC, "no reply to the command");
+		return FAILURE;
+	}
+
+	/* Nothing below is read past the end of the reply */
+	len = MONGO_32(*(int*)doc);
+	if (len < INT_32 + 1 || len > cursor->buf.end - doc) {
+		mongo_cursor_throw(cursor->connection, 21 TSRMLS_CC, "invalid document length in the command's reply: %d", len);
+		return FAILURE;
+	}
+	end = doc + len;
+
+	value = bson_find_value_within(doc, end, "cursor", &type);
+	if (!value || type != BSON_OBJECT) {
+		char *errmsg, *code, errmsg_type = 0, code_type = 0;
+
+		errmsg = bson_find_value_within(doc, end, "errmsg", &errmsg_type);
+		if (!errmsg || errmsg_type != BSON_STRING) {
+			errmsg = bson_find_value_within(doc, end, "$err", &errmsg_type);
+		}
+		code = bson_find_value_within(doc, end, "code", &code_type);
+
+		if (errmsg && errmsg_type == BSON_STRING) {
+			mongo_cursor_throw(cursor->connection, code ? (int) raw_number(code_type, code) : 4 TSRMLS_CC, "%s", errmsg + INT_32);
+		} else {
+			mongo_cursor_throw(cursor->connection, 20 TSRMLS_CC, "the command did not return a cursor");
+		}
+		return FAILURE;
+	}
+	value_end = value + MONGO_32(*(int*)value);
+
+	id = bson_find_value_within(value, value_end, "id", &id_type);
+	ns = bson_find_value_within(value, value_end, "ns", &ns_type);
+	batch = bson_find_value_within(value, value_end, "firstBatch", &batch_type);
+	if (!id || !ns || ns_type != BSON_STRING || !batch || batch_type != BSON_ARRAY) {
+		mongo_cursor_throw(cursor->connection, 20 TSRMLS_CC, "invalid cursor document in the command's reply");
+		return FAILURE;
+	}
+	batch_end = batch + MONGO_32(*(int*)batch);
+
+	/* both are overwritten by the documents below */
+	cursor->cursor_id = raw_number(id_type, id);
+	cursor->cursor_ns = estrdup(ns + INT_32);
+
+	/* The documents only ever move towards the start of the buffer, the
+	 * array's element types and names are dropped */
+	dest = cursor->buf.start;
+	batch += INT_32;
+	while (batch < batch_end && (type = *batch++) != 0) {
+		/* the element's name, then the length of its document */
+		name = memchr(batch, 0, batch_end - batch);
+		len = 0;
+		if (name && batch_end - (name + 1) >= INT_32) {
+			batch = name + 1;
+			len = MONGO_32(*(int*)batch);
+		}
+		if (type != BSON_OBJECT || len < INT_32 + 1 || len > batch_end - batch) {
+			mongo_cursor_throw(cursor->connection, 21 TSRMLS_CC, "invalid document in the command's first batch");
+			return FAILURE;
+		}
+
+		memmove(dest, batch, len);
+		dest += len;
+		batch += len;
+		num++;
 	}
 
-	cursor->buf.start = (char*)emalloc(cursor->recv.length);
-	cursor->buf.end = cursor->buf.start + cursor->recv.length;
 	cursor->buf.pos = cursor->buf.start;
+	cursor->buf.end = dest;
+	cursor->num += num - 1;
 
-	/* finish populating cursor */
-	return mongo_io_recv_data(sock, cursor->buf.pos, cursor->recv.length, error_message);
+	return SUCCESS;
+}
+
+/* Sets value to the BSON of the document at buf as a string. Returns the
+ * position after the document, or 0 (with an exception thrown) if the document
+ * does not fit between buf and end. */
+static char* raw_document(zval *value, char *buf, char *end TSRMLS_DC)
+{
+	int len = 0;
+
+	if (end - buf >= INT_32) {
+		len = MONGO_32(*(int*)buf);
+	}
+
+	if (len < INT_32 + 1 || len > end - buf) {
+		zend_throw_exception_ex(mongo_ce_CursorException, 21 TSRMLS_CC, "invalid document length: %d", len);
+		return 0;
+	}
+
+	ZVAL_STRINGL(value, buf, len, 1);
+	return buf + len;
+}
+
+/* Decodes the document at cursor->buf.pos into a new zval in *doc, as the
+ * cursor was asked to return them: as a raw BSON string, a MongoLazyDocument
+ * or an array limited to cursor->decode_fields. buf.pos is moved past the
+ * document. With check_errors, an error document is always decoded into a
+ * full array, so that it can be checked and attached to an exception.
+ * Returns FAILURE, with an exception thrown, for an invalid document. */
+static int decode_document(mongo_cursor *cursor, zval **doc, zend_bool check_errors TSRMLS_DC)
+{
+	HashTable *keep = NULL;
+	int plain = check_errors && (cursor->raw || cursor->lazy || cursor->decode_fields) && is_error_document(cursor->buf.pos);
+
+	MAKE_STD_ZVAL(*doc);
+	ZVAL_NULL(*doc);
+
+	if (cursor->raw && !plain) {
+		cursor->buf.pos = raw_document(*doc, cursor->buf.pos, cursor->buf.end TSRMLS_CC);
+	} else if (cursor->lazy && !plain) {
+		cursor->buf.pos = php_mongo_lazy_document_init(*doc, cursor->buf.pos, cursor->buf.end TSRMLS_CC);
+	} else {
+		if (!cursor->key_cache) {
+			cursor->key_cache = (mongo_key_cache*)ecalloc(1, sizeof(mongo_key_cache));
+		}
+		if (cursor->decode_fields && !plain) {
+			keep = Z_ARRVAL_P(cursor->decode_fields);
+		}
+
+		array_init(*doc);
+		cursor->buf.pos = bson_to_zval_cached((char*)cursor->buf.pos, Z_ARRVAL_PP(doc), cursor->key_cache, keep TSRMLS_CC);
+	}
+
+	if (EG(exception)) {
+		zval_ptr_dtor(doc);
+		*doc = 0;
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+/* Makes room for len more bytes at the end of buf, keeping its contents, and
+ * returns where they go */
+static char* extend_recv_buf(buffer *buf, int *size, int len)
+{
+	int used = buf->end - buf->start, pos = buf->pos - buf->start;
+
+	if (used + len > *size) {
+		*size = used + len;
+		buf->start = (char*)erealloc(buf->start, *size);
+		buf->pos = buf->start + pos;
+	}
+
+	buf->end = buf->start + used + len;
+	return buf->start + used;
+}
+
+void php_mongo_cursor_queue_pending(mongo_cursor *cursor)
+{
+	mongo_cursor **owner = (mongo_cursor**)&cursor->connection->pending_reply;
+
+	while (*owner) {
+		owner = &(*owner)->next_pending;
+	}
+
+	*owner = cursor;
+	cursor->next_pending = NULL;
+	cursor->prefetch_pending = 1;
+}
+
+/* Takes cursor off the list of owners of replies that are still coming on its
+ * connection */
+static void unqueue_pending(mongo_cursor *cursor)
+{
+	mongo_cursor **owner;
+
+	if (cursor->prefetch_pending && cursor->connection) {
+		for (owner = (mongo_cursor**)&cursor->connection->pending_reply; *owner; owner = &(*owner)->next_pending) {
+			if (*owner == cursor) {
+				*owner = cursor->next_pending;
+				break;
+			}
+		}
+	}
+
+	cursor->next_pending = NULL;
+	cursor->prefetch_pending = 0;
+}
+
+void php_mongo_cursor_stats_start(mongo_cursor *cursor, int op TSRMLS_DC)
+{
+	cursor->stats_op = op;
+	mongo_stats_start(MonGlo(manager), &cursor->stats_probe, cursor->connection);
+}
+
+void php_mongo_cursor_stats_end(mongo_cursor *cursor, int failed TSRMLS_DC)
+{
+	mongo_stats_end(
+		MonGlo(manager), &cursor->stats_probe, cursor->stats_op, cursor->connection,
+		(failed ? MONGO_STATS_FAILED : 0) | (cursor->retry > 0 ? MONGO_STATS_RETRY : 0)
+	);
+}
+
+/* A query on the $cmd collection of a database is a command */
+static int query_stats_op(mongo_cursor *cursor)
+{
+	int len = strlen(cursor->ns);
+
+	if (len > 5 && strcmp(cursor->ns + len - 5, ".$cmd") == 0) {
+		return MONGO_STATS_OP_COMMAND;
+	}
+	return MONGO_STATS_OP_QUERY;
+}
+
+/* An exhaust cursor gets all its replies without asking for them, each in
+ * response to the previous one. Until the last one (with a cursor_id of 0)
+ * has arrived the cursor owns the next reply on its connection, just like a
+ * prefetching cursor does, ahead of any other request on the connection. */
+static void expect_exhaust_reply(mongo_cursor *cursor TSRMLS_DC)
+{
+	if ((cursor->opts & CURSOR_FLAG_EXHAUST) && cursor->cursor_id != 0 && cursor->connection) {
+		cursor->send.request_id = cursor->recv.request_id;
+		cursor->prefetch_pending = 1;
+		cursor->next_pending = (mongo_cursor*)cursor->connection->pending_reply;
+		cursor->connection->pending_reply = cursor;
+		php_mongo_cursor_stats_start(cursor, MONGO_STATS_OP_GETMORE TSRMLS_CC);
+	}
+}
+
+/* Hands the connection of the cursor back to the pool, once there is nothing
+ * left for the cursor to read from it */
+static void release_connection(mongo_cursor *cursor TSRMLS_DC)
+{
+	if (cursor->checked_out) {
+		mongo_manager_connection_checkin(MonGlo(manager), cursor->connection);
+		cursor->checked_out = 0;
+	}
+}
+
+/* Reads the reply to the OP_GET_MORE that cursor sent ahead of time (or the
+ * next reply of an exhaust cursor) into cursor->prefetch_buf, after any reply
+ * that is already waiting there. The replies for the owners ahead of cursor
+ * are set aside first. Like get_cursor_header, it returns 0 on success or an
+ * error code with error_message set. */
+static signed int read_prefetch(mongo_cursor *cursor, char **error_message TSRMLS_DC)
+{
+	signed int status;
+	char *dest;
+
+	status = collect_pending_replies(cursor->connection, cursor, error_message TSRMLS_CC);
+	if (status != 0) {
+		return status;
+	}
+
+	php_mongo_log(MLOG_IO, MLOG_FINE TSRMLS_CC, "reading prefetched batch");
+
+	unqueue_pending(cursor);
+
+	status = get_cursor_header(cursor->connection, cursor, error_message TSRMLS_CC);
+	if (status != 0) {
+		php_mongo_cursor_stats_end(cursor, 1 TSRMLS_CC);
+		return status;
+	}
+
+	if (cursor->send.request_id != cursor->recv.response_to) {
+		*error_message = malloc(256);
+		snprintf(*error_message, 256, "request/cursor mismatch: %d vs %d", cursor->send.request_id, cursor->recv.response_to);
+		php_mongo_cursor_stats_end(cursor, 1 TSRMLS_CC);
+		return 9;
+	}
+
+	if (cursor->prefetch_ready) {
+		dest = extend_recv_buf(&cursor->prefetch_buf, &cursor->prefetch_buf_size, cursor->recv.length);
+	} else {
+		reserve_recv_buf(&cursor->prefetch_buf, &cursor->prefetch_buf_size, cursor->recv.length);
+		dest = cursor->prefetch_buf.start;
+	}
+	update_budget(cursor TSRMLS_CC);
+
+	if (mongo_io_recv_buffered(cursor->connection, dest, cursor->recv.length, error_message) != cursor->recv.length) {
+		free(*error_message);
+		*error_message = strdup("error getting prefetched database response");
+		php_mongo_cursor_stats_end(cursor, 1 TSRMLS_CC);
+		return 12;
+	}
+	php_mongo_cursor_stats_end(cursor, 0 TSRMLS_CC);
+
+	cursor->prefetch_ready = 1;
+	expect_exhaust_reply(cursor TSRMLS_CC);
+	return 0;
+}
+
+/* Reads and drops the replies that are still coming for cursor (a prefetched
+ * OP_GET_MORE, or the rest of an exhaust stream), so that the next reply on
+ * the connection is the one its reader expects */
+void php_mongo_cursor_discard_pending(mongo_cursor *cursor TSRMLS_DC)
+{
+	char *error_message = NULL;
+
+	while (cursor->prefetch_pending) {
+		cursor->prefetch_ready = 0;
+		if (read_prefetch(cursor, &error_message TSRMLS_CC) != 0) {
+			php_mongo_log(MLOG_IO, MLOG_WARN TSRMLS_CC, "discarding prefetched batch failed: %s", error_message);
+			free(error_message);
+			break;
+		}
+	}
+
+	cursor->prefetch_ready = 0;
+}
+
+/* Sends an OP_GET_MORE for cursor without waiting for the reply, which the
+ * cursor then owns. Returns FAILURE with error_message set if the request
+ * could not be sent. */
+static int send_get_more(mongo_cursor *cursor, char **error_message TSRMLS_DC)
+{
+	buffer buf;
+
+	CREATE_BUF(buf, 34 + strlen(cursor->ns));
+	if (FAILURE == php_mongo_write_get_more(&buf, cursor TSRMLS_CC)) {
+		efree(buf.start);
+		*error_message = strdup("couldn't create the get more request");
+		return FAILURE;
+	}
+
+	php_mongo_cursor_stats_start(cursor, MONGO_STATS_OP_GETMORE TSRMLS_CC);
+	if (mongo_io_flush(cursor->connection, buf.start, buf.pos - buf.start, error_message) == -1) {
+		php_mongo_cursor_stats_end(cursor, 1 TSRMLS_CC);
+		efree(buf.start);
+		return FAILURE;
+	}
+	MONGO_TRACE(MonGlo(manager), MONGO_TRACE_SEND_GET_MORE, cursor->send.request_id, buf.pos - buf.start, cursor->connection->socket, 0);
+	efree(buf.start);
+
+	php_mongo_cursor_queue_pending(cursor);
+
+	return SUCCESS;
+}
+
+/* Sends the next OP_GET_MORE once cursor->prefetch of the current batch has
+ * been used, so that its reply is (mostly) there by the time the batch runs
+ * out. Failures are not reported here: hasNext will send the request again
+ * and report them. */
+static void start_prefetch(mongo_cursor *cursor TSRMLS_DC)
+{
+	char *error_message = NULL;
+
+	if (
+		cursor->prefetch <= 0 || cursor->prefetch_pending || cursor->prefetch_ready ||
+		cursor->cursor_id == 0 || !cursor->connection ||
+		(cursor->limit > 0 && cursor->num >= cursor->limit)
+	) {
+		return;
+	}
+
+	if (cursor->buf.pos - cursor->buf.start < cursor->prefetch * (cursor->buf.end - cursor->buf.start)) {
+		return;
+	}
+
+	if (send_get_more(cursor, &error_message TSRMLS_CC) == FAILURE) {
+		php_mongo_log(MLOG_IO, MLOG_WARN TSRMLS_CC, "prefetching the next batch failed: %s", error_message);
+		free(error_message);
+		return;
+	}
+
+	php_mongo_log(MLOG_IO, MLOG_FINE TSRMLS_CC, "prefetching the next batch");
+}
+
+/* Sets aside the replies that other cursors are still expecting on con, so
+ * that the next reply is the one for cursor. Returns 0, or an error code with
+ * error_message set. */
+static signed int collect_pending_replies(mongo_connection *con, mongo_cursor *cursor, char **error_message TSRMLS_DC)
+{
+	signed int status;
+
+	/* Those that nobody waits for anymore came before all of them */
+	if (con->stale_count && !mongo_connection_drain_stale_replies(MonGlo(manager), con, error_message)) {
+		return 4;
+	}
+
+	while (con->pending_reply && con->pending_reply != cursor) {
+		status = read_prefetch((mongo_cursor*)con->pending_reply, error_message TSRMLS_CC);
+		if (status != 0) {
+			return status;
+		}
+	}
+
+	return 0;
 }
 
 /* Cursor helper function */
-int php_mongo_get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC)
+static int get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC)
 {
-	int          sock;
 	unsigned int status;
 	char        *error_message = NULL;
 
 	php_mongo_log(MLOG_IO, MLOG_FINE TSRMLS_CC, "getting reply");
-	sock = cursor->connection->socket;
 
-	status = get_cursor_header(sock, cursor, (char**) &error_message TSRMLS_CC);
+	/* Replies that are read for other cursors first would count towards the
+	 * round trip */
+	if (cursor->connection->pending_reply && cursor->connection->pending_reply != cursor) {
+		cursor->sent_at.tv_sec = 0;
+	}
+
+	/* Another cursor has prefetched batches (or an exhaust stream) coming in
+	 * on this connection, which come first and are set aside for that cursor */
+	status = collect_pending_replies(cursor->connection, cursor, (char**) &error_message TSRMLS_CC);
+	if (status != 0) {
+		mongo_cursor_throw(cursor->connection, status TSRMLS_CC, error_message);
+		free(error_message);
+		return FAILURE;
+	}
+
+	status = get_cursor_header(cursor->connection, cursor, (char**) &error_message TSRMLS_CC);
 	if (status == -1 || status > 0) {
 		mongo_cursor_throw(cursor->connection, status TSRMLS_CC, error_message);
 		free(error_message);
 		return FAILURE;
 	}
 
+	if (cursor->sent_at.tv_sec) {
+		mongo_connection_rtt_since(cursor->connection, &cursor->sent_at);
+		cursor->sent_at.tv_sec = 0;
+	}
+
 	/* Check that this is actually the response we want */
 	if (cursor->send.request_id != cursor->recv.response_to) {
 		php_mongo_log(MLOG_IO, MLOG_WARN TSRMLS_CC, "request/cursor mismatch: %d vs %d", cursor->send.request_id, cursor->recv.response_to);
@@ -204,7 +714,7 @@ int php_mongo_get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC)
 		return FAILURE;
 	}
 
-	if (FAILURE == get_cursor_body(sock, cursor, (char **) &error_message TSRMLS_CC)) {
+	if (FAILURE == get_cursor_body(cursor->connection, cursor, (char **) &error_message TSRMLS_CC)) {
 #ifdef WIN32
 		mongo_cursor_throw(cursor->connection, 12 TSRMLS_CC, "WSA error getting database response %s (%d)", error_message, WSAGetLastError());
 #else
@@ -220,11 +730,72 @@ int php_mongo_get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC)
 	return SUCCESS;
 }
 
+int php_mongo_get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC)
+{
+	int status = get_reply(cursor, errmsg TSRMLS_CC);
+
+	php_mongo_cursor_stats_end(cursor, status == FAILURE TSRMLS_CC);
+	if (status == SUCCESS) {
+		MONGO_TRACE(MonGlo(manager), MONGO_TRACE_REPLY, cursor->recv.response_to, cursor->recv.length, cursor->num, cursor->connection->socket);
+		expect_exhaust_reply(cursor TSRMLS_CC);
+	} else {
+		MONGO_TRACE(MonGlo(manager), MONGO_TRACE_REPLY_FAILED, cursor->send.request_id, cursor->connection->socket, 0, 0);
+	}
+
+	return status;
+}
+
+/* Returns the fields to return as a document: ['x', 'y', 'z'] becomes
+ * {'x' : 1, 'y' : 1, 'z' : 1}, an object is used as is. Returns NULL, with an
+ * exception thrown, if a field name is not a string. */
+static zval* convert_fields(zval *zfields TSRMLS_DC)
+{
+  zval **data;
+
+  if (Z_TYPE_P(zfields) == IS_ARRAY) {
+    HashPosition pointer;
+    zval *fields;
+
+    MAKE_STD_ZVAL(fields);
+    array_init(fields);
+
+    // fields to return
+    for(zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(zfields), &pointer);
+        zend_hash_get_current_data_ex(Z_ARRVAL_P(zfields), (void**) &data, &pointer) == SUCCESS;
+        zend_hash_move_forward_ex(Z_ARRVAL_P(zfields), &pointer)) {
+      int key_type, key_len;
+      ulong index;
+      char *key;
+
+      key_type = zend_hash_get_current_key_ex(Z_ARRVAL_P(zfields), &key, (uint*)&key_len, &index, NO_DUP, &pointer);
+
+      if (key_type == HASH_KEY_IS_LONG) {
+        if (Z_TYPE_PP(data) == IS_STRING) {
+          add_assoc_long(fields, Z_STRVAL_PP(data), 1);
+        }
+        else {
+          zval_ptr_dtor(&fields);
+          zend_throw_exception(mongo_ce_Exception, "field names must be strings", 0 TSRMLS_CC);
+          return NULL;
+        }
+      }
+      else {
+        add_assoc_zval(fields, key, *data);
+        zval_add_ref(data);
+      }
+    }
+    return fields;
+  }
+
+  // if it's already an object, we don't have to worry
+  zval_add_ref(&zfields);
+  return zfields;
+}
+
 /* {{{ MongoCursor->__construct
  */
 PHP_METHOD(MongoCursor, __construct) {
   zval *zlink = 0, *zns = 0, *zquery = 0, *zfields = 0, *empty, *timeout;
-  zval **data;
   mongo_cursor *cursor;
 
   if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Oz|zz", &zlink,
@@ -244,60 +815,24 @@ PHP_METHOD(MongoCursor, __construct) {
     zquery = empty;
   }
   if (!zfields) {
-    zfields = empty;
-  }
-
-  cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
-
-  // db connection
-  cursor->resource = zlink;
-  zval_add_ref(&zlink);
-
-	/* Initialize read_pref to empty */
-	cursor->read_pref.type = MONGO_RP_PRIMARY;
-	cursor->read_pref.tagset_count = 0;
-	cursor->read_pref.tagsets = NULL;
-
-  // change ['x', 'y', 'z'] into {'x' : 1, 'y' : 1, 'z' : 1}
-  if (Z_TYPE_P(zfields) == IS_ARRAY) {
-    HashPosition pointer;
-    zval *fields;
-
-    MAKE_STD_ZVAL(fields);
-    array_init(fields);
-
-    // fields to return
-    for(zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(zfields), &pointer);
-        zend_hash_get_current_data_ex(Z_ARRVAL_P(zfields), (void**) &data, &pointer) == SUCCESS;
-        zend_hash_move_forward_ex(Z_ARRVAL_P(zfields), &pointer)) {
-      int key_type, key_len;
-      ulong index;
-      char *key;
+    zfields = empty;
+  }
 
-      key_type = zend_hash_get_current_key_ex(Z_ARRVAL_P(zfields), &key, (uint*)&key_len, &index, NO_DUP, &pointer);
+  cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
 
-      if (key_type == HASH_KEY_IS_LONG) {
-        if (Z_TYPE_PP(data) == IS_STRING) {
-          add_assoc_long(fields, Z_STRVAL_PP(data), 1);
-        }
-        else {
-          zval_ptr_dtor(&empty);
-          zval_ptr_dtor(&fields);
-          zend_throw_exception(mongo_ce_Exception, "field names must be strings", 0 TSRMLS_CC);
-          return;
-        }
-      }
-      else {
-        add_assoc_zval(fields, key, *data);
-        zval_add_ref(data);
-      }
-    }
-    cursor->fields = fields;
-  }
-  // if it's already an object, we don't have to worry
-  else {
-    cursor->fields = zfields;
-    zval_add_ref(&zfields);
+  // db connection
+  cursor->resource = zlink;
+  zval_add_ref(&zlink);
+
+	/* Initialize read_pref to empty */
+	cursor->read_pref.type = MONGO_RP_PRIMARY;
+	cursor->read_pref.tagset_count = 0;
+	cursor->read_pref.tagsets = NULL;
+
+  cursor->fields = convert_fields(zfields TSRMLS_CC);
+  if (!cursor->fields) {
+    zval_ptr_dtor(&empty);
+    return;
   }
 
   // ns
@@ -319,6 +854,9 @@ PHP_METHOD(MongoCursor, __construct) {
   timeout = zend_read_static_property(mongo_ce_Cursor, "timeout", strlen("timeout"), NOISY TSRMLS_CC);
   cursor->timeout = Z_LVAL_P(timeout);
 
+  /* the receive buffers count towards mongo.cursor_buffer_limit */
+  cursor->budgeted = 1;
+
   // get rid of extra ref
   zval_ptr_dtor(&empty);
 }
@@ -363,6 +901,46 @@ PHP_METHOD(MongoCursor, hasNext) {
 		}
 		RETURN_FALSE;
 	}
+	/* The current batch is used up and the next one was prefetched */
+	if (cursor->buf.pos >= cursor->buf.end && (cursor->prefetch_pending || cursor->prefetch_ready)) {
+		buffer spare;
+		int spare_size;
+
+		if (cursor->prefetch_pending && php_mongo_cursor_read_pending(cursor TSRMLS_CC) == FAILURE) {
+			return;
+		}
+
+		spare = cursor->buf;
+		spare_size = cursor->buf_size;
+		cursor->buf = cursor->prefetch_buf;
+		cursor->buf_size = cursor->prefetch_buf_size;
+		cursor->prefetch_buf = spare;
+		cursor->prefetch_buf_size = spare_size;
+		cursor->prefetch_ready = 0;
+
+		/* a command started with php_mongo_cursor_start */
+		if (cursor->command_cursor && !cursor->cursor_ns) {
+			if (unpack_command_cursor(cursor TSRMLS_CC) == FAILURE) {
+				return;
+			}
+			if (cursor->cursor_id != 0 && !cursor->node) {
+				php_mongo_create_le(cursor, "cursor_list" TSRMLS_CC);
+			}
+		}
+
+		if (cursor->cursor_id == 0) {
+			mongo_cursor_free_le(cursor, MONGO_CURSOR TSRMLS_CC);
+			release_connection(cursor TSRMLS_CC);
+		}
+
+		if (cursor->flag & 1) {
+			mongo_cursor_throw(cursor->connection, 2 TSRMLS_CC, "cursor not found");
+			return;
+		}
+
+		RETURN_BOOL(cursor->at < cursor->num);
+	}
+
   if (cursor->at < cursor->num) {
     RETURN_TRUE;
   }
@@ -383,7 +961,9 @@ PHP_METHOD(MongoCursor, hasNext) {
     return;
   }
 
-	if (mongo_io_send(cursor->connection->socket, buf.start, buf.pos - buf.start, (char**) &error_message) == -1) {
+	php_mongo_cursor_stats_start(cursor, MONGO_STATS_OP_GETMORE TSRMLS_CC);
+	if (mongo_io_flush(cursor->connection, buf.start, buf.pos - buf.start, (char**) &error_message) == -1) {
+		php_mongo_cursor_stats_end(cursor, 1 TSRMLS_CC);
 		efree(buf.start);
 
 		mongo_cursor_throw(cursor->connection, 1 TSRMLS_CC, error_message);
@@ -391,8 +971,10 @@ PHP_METHOD(MongoCursor, hasNext) {
 		mongo_util_cursor_failed(cursor TSRMLS_CC);
 		return;
 	}
+	MONGO_TRACE(MonGlo(manager), MONGO_TRACE_SEND_GET_MORE, cursor->send.request_id, buf.pos - buf.start, cursor->connection->socket, 0);
 
 	efree(buf.start);
+	gettimeofday(&cursor->sent_at, NULL);
 
 	MAKE_STD_ZVAL(temp);
 	ZVAL_NULL(temp);
@@ -407,6 +989,7 @@ PHP_METHOD(MongoCursor, hasNext) {
 
   if (cursor->cursor_id == 0) {
     mongo_cursor_free_le(cursor, MONGO_CURSOR TSRMLS_CC);
+		release_connection(cursor TSRMLS_CC);
   }
   // if cursor_id != 0, server should stay the same
 
@@ -476,6 +1059,23 @@ PHP_METHOD(MongoCursor, batchSize) {
 }
 /* }}} */
 
+/* {{{ MongoCursor::batchBytes(int bytes)
+ * Sets how big the replies to OP_GET_MORE should be, which asks the server
+ * for as many documents as fit, going by the size of the documents so far.
+ * 0 goes back to batchSize. */
+PHP_METHOD(MongoCursor, batchBytes) {
+	long l;
+	preiteration_setup;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &l) == FAILURE) {
+		return;
+	}
+
+	cursor->batch_bytes = l > INT_MAX ? INT_MAX : (l < 0 ? 0 : l);
+	RETVAL_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
 /* {{{ MongoCursor::skip
  */
 PHP_METHOD(MongoCursor, skip) {
@@ -511,6 +1111,154 @@ PHP_METHOD(MongoCursor, fields) {
 /* }}} */
 
 
+/* {{{ MongoCursor::lazy([bool lazy])
+ * Makes the cursor return read-only MongoLazyDocument objects, which only
+ * decode a field once it is read, instead of arrays. */
+PHP_METHOD(MongoCursor, lazy)
+{
+	zend_bool z = 1;
+	preiteration_setup;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|b", &z) == FAILURE) {
+		return;
+	}
+
+	cursor->lazy = z;
+	RETURN_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
+/* {{{ MongoCursor::raw([bool raw])
+ * Makes the cursor return every document as a string holding its BSON, as
+ * sent by the database. Takes precedence over lazy(). */
+PHP_METHOD(MongoCursor, raw)
+{
+	zend_bool z = 1;
+	preiteration_setup;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|b", &z) == FAILURE) {
+		return;
+	}
+
+	cursor->raw = z;
+	RETURN_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
+/* {{{ MongoCursor::prefetch([float share])
+ * Requests the next batch from the database once share (0.5 by default) of the
+ * current batch has been used, instead of when it runs out. 0 turns prefetching
+ * off. Works best when nothing else uses the connection during the iteration,
+ * as other replies have to wait for the prefetched batch. */
+PHP_METHOD(MongoCursor, prefetch)
+{
+	double share = 0.5;
+	mongo_cursor *cursor;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|d", &share) == FAILURE) {
+		return;
+	}
+	PHP_MONGO_GET_CURSOR(getThis());
+
+	if (share < 0 || share > 1) {
+		zend_throw_exception_ex(mongo_ce_CursorException, 22 TSRMLS_CC, "the prefetch share must be between 0 and 1, %f given", share);
+		return;
+	}
+
+	cursor->prefetch = share;
+	RETURN_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
+/* Adds a dotted field path to the tree of fields to decode. Fields that are
+ * wanted whole map to true, fields of which only some subfields are wanted map
+ * to the tree for those subfields. */
+static void add_decode_field(HashTable *tree, char *path)
+{
+	char *copy = estrdup(path), *field = copy, *dot;
+	zval **node, *value;
+
+	while (1) {
+		int len;
+
+		dot = strchr(field, '.');
+		if (dot) {
+			*dot = '\0';
+		}
+		len = strlen(field) + 1;
+
+		if (zend_hash_find(tree, field, len, (void**)&node) == SUCCESS) {
+			// the whole field is wanted already
+			if (Z_TYPE_PP(node) != IS_ARRAY) {
+				break;
+			}
+		} else if (dot) {
+			MAKE_STD_ZVAL(value);
+			array_init(value);
+			zend_hash_update(tree, field, len, &value, sizeof(zval*), (void**)&node);
+		}
+
+		if (!dot) {
+			MAKE_STD_ZVAL(value);
+			ZVAL_TRUE(value);
+			zend_hash_update(tree, field, len, &value, sizeof(zval*), NULL);
+			break;
+		}
+
+		tree = Z_ARRVAL_PP(node);
+		field = dot + 1;
+	}
+
+	efree(copy);
+}
+
+/* {{{ MongoCursor::decodeFields(array fields)
+ * Only decodes the given fields (and _id) of each document, all other fields
+ * are skipped without creating any zvals. Fields can be dotted paths into
+ * subobjects. This is done on the client side, so unlike fields() it works for
+ * any query. An empty array decodes everything again. */
+PHP_METHOD(MongoCursor, decodeFields)
+{
+	zval *fields, **path, *tree;
+	HashPosition pointer;
+	preiteration_setup;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a", &fields) == FAILURE) {
+		return;
+	}
+
+	if (cursor->decode_fields) {
+		zval_ptr_dtor(&cursor->decode_fields);
+		cursor->decode_fields = NULL;
+	}
+
+	if (zend_hash_num_elements(Z_ARRVAL_P(fields)) == 0) {
+		RETURN_ZVAL(getThis(), 1, 0);
+	}
+
+	MAKE_STD_ZVAL(tree);
+	array_init(tree);
+
+	for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(fields), &pointer);
+	     zend_hash_get_current_data_ex(Z_ARRVAL_P(fields), (void**)&path, &pointer) == SUCCESS;
+	     zend_hash_move_forward_ex(Z_ARRVAL_P(fields), &pointer)) {
+
+		if (Z_TYPE_PP(path) != IS_STRING) {
+			zval_ptr_dtor(&tree);
+			zend_throw_exception(mongo_ce_Exception, "field names must be strings", 8 TSRMLS_CC);
+			return;
+		}
+		add_decode_field(Z_ARRVAL_P(tree), Z_STRVAL_PP(path));
+	}
+
+	// key() and the server both treat _id as always being there
+	add_decode_field(Z_ARRVAL_P(tree), "_id");
+
+	cursor->decode_fields = tree;
+	RETURN_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
 /* {{{ MongoCursor::dead
  */
 PHP_METHOD(MongoCursor, dead) {
@@ -557,17 +1305,24 @@ PHP_METHOD(MongoCursor, setFlag)
 	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|b", &bit, &set) == FAILURE) {
 		return;
 	}
-	/* Prevent bit 3 (CURSOR_FLAG_OPLOG_REPLAY) and bit 6 (CURSOR_FLAG_EXHAUST) from
-	 * being set. The first because it's an internal flag, and the second because
-	 * the driver can't handle this at the moment. */
-	if (bit == 3 || bit == 6) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "The CURSOR_FLAG_OPLOG_REPLAY(3) and CURSOR_FLAG_EXHAUST(6) flags are not supported.");
+	/* Prevent bit 3 (CURSOR_FLAG_OPLOG_REPLAY) from being set, as it's an
+	 * internal flag */
+	if (bit == 3) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "The CURSOR_FLAG_OPLOG_REPLAY(3) flag is not supported.");
 		return;
 	}
 	set_cursor_flag(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1 << bit, set);
 }
 /* }}} */
 
+/* Makes cursor a tailable cursor that waits for data, for MongoTailer. With
+ * oplog_replay, the server finds the start of a query on ts itself instead of
+ * scanning the collection from the beginning. */
+void php_mongo_cursor_tail(mongo_cursor *cursor, int oplog_replay)
+{
+	cursor->opts |= CURSOR_FLAG_TAILABLE | CURSOR_FLAG_AWAIT_DATA | (oplog_replay ? CURSOR_FLAG_OPLOG_REPLAY : 0);
+}
+
 /* {{{ MongoCursor::tailable(bool flag)
  */
 PHP_METHOD(MongoCursor, tailable)
@@ -593,6 +1348,16 @@ PHP_METHOD(MongoCursor, immortal)
 }
 /* }}} */
 
+/* {{{ MongoCursor::exhaust(bool flag)
+ * Makes the database send all batches without waiting for an OP_GET_MORE for
+ * each. Replies for other operations on the same connection are only read
+ * after the whole result has arrived. */
+PHP_METHOD(MongoCursor, exhaust)
+{
+	set_cursor_flag(INTERNAL_FUNCTION_PARAM_PASSTHRU, CURSOR_FLAG_EXHAUST, -1);
+}
+/* }}} */
+
 /* {{{ MongoCursor::awaitData(bool flag)
  */
 PHP_METHOD(MongoCursor, awaitData)
@@ -823,22 +1588,123 @@ PHP_METHOD(MongoCursor, doQuery) {
 	mongo_cursor_throw(cursor->connection, 19 TSRMLS_CC, "max number of retries exhausted, couldn't send query");
 }
 
-int mongo_cursor__do_query(zval *this_ptr, zval *return_value TSRMLS_DC) {
-  mongo_cursor *cursor;
+/* How long a query on con may take before it is hedged, in ms (0 if it is
+ * not hedged at all) */
+static long hedge_delay(mongo_con_manager *manager, mongo_connection *con)
+{
+	mongo_stats_op *op;
+	long delay = manager->hedge_delay;
+
+	if (manager->hedge_percentile && con->stats) {
+		op = &con->stats->total[MONGO_STATS_OP_QUERY];
+		if (op->count >= MONGO_HEDGE_MIN_SAMPLES) {
+			delay = mongo_stats_percentile(op, manager->hedge_percentile) / 1000 + 1;
+		}
+	}
+	return delay;
+}
+
+/* Hedged reads: when the query in buf, which was just sent on the connection
+ * of the cursor, has no reply after the hedge delay, it is sent to another
+ * member the read preference allows too. Whichever server answers first
+ * becomes the connection of the cursor, and the other reply is discarded.
+ * Only plain queries with a reply that is not stuck behind another one are
+ * hedged. */
+static void hedge_query(mongo_cursor *cursor, mongo_link *link, buffer *buf TSRMLS_DC)
+{
+	mongo_con_manager *manager = link->manager;
+	mongo_connection  *first = cursor->connection, *hedge, *loser;
+	mongo_stats_probe  probe;
+	struct timeval     sent_at;
+	struct pollfd      pfds[2];
+	char              *error_message = NULL;
+	long               delay;
+	int                status;
+
+	if (
+		!first || cursor->read_pref.type == MONGO_RP_PRIMARY ||
+		(cursor->opts & CURSOR_FLAG_EXHAUST) || query_stats_op(cursor) != MONGO_STATS_OP_QUERY ||
+		first->pending_reply || first->stale_count || mongo_io_has_buffered_data(first)
+	) {
+		return;
+	}
+	delay = hedge_delay(manager, first);
+	if (delay <= 0) {
+		return;
+	}
+
+	/* An error is left for reading the reply to find */
+	status = mongo_io_wait_with_timeout(first->socket, delay, &error_message);
+	free(error_message);
+	error_message = NULL;
+	if (status != 80) {
+		return;
+	}
+
+	hedge = mongo_get_hedge_connection(manager, link->servers, &cursor->read_pref, first);
+	if (!hedge) {
+		return;
+	}
+	/* Only a socket of the pool that nobody else uses will do, as the reply
+	 * that loses is left on it */
+	hedge = mongo_manager_connection_checkout(manager, hedge, link->servers->server[0]);
+	if (
+		hedge == mongo_manager_connection_find_by_hash(manager, hedge->hash) || hedge->busy > 1 ||
+		hedge->pending_reply || hedge->stale_count || mongo_io_has_buffered_data(hedge) ||
+		(manager->share_auth && !mongo_manager_connection_authenticate(manager, hedge, link->servers->server[0], &error_message))
+	) {
+		free(error_message);
+		mongo_manager_connection_checkin(manager, hedge);
+		return;
+	}
+
+	mongo_stats_start(manager, &probe, hedge);
+	gettimeofday(&sent_at, NULL);
+	if (mongo_io_flush(hedge, buf->start, buf->pos - buf->start, &error_message) == -1) {
+		mongo_stats_end(manager, &probe, MONGO_STATS_OP_QUERY, hedge, MONGO_STATS_FAILED);
+		mongo_manager_log(manager, MLOG_IO, MLOG_WARN, "hedge: couldn't send query to %s: %s", hedge->hash, error_message ? error_message : "");
+		free(error_message);
+		mongo_manager_connection_checkin(manager, hedge);
+		return;
+	}
+	MONGO_TRACE(manager, MONGO_TRACE_SEND_QUERY, cursor->send.request_id, buf->pos - buf->start, hedge->socket, 0);
+
+	pfds[0].fd = first->socket;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	pfds[1].fd = hedge->socket;
+	pfds[1].events = POLLIN;
+	pfds[1].revents = 0;
+	status = mongo_io_poll(pfds, 2, cursor->timeout > 0 ? cursor->timeout : -1);
+
+	/* On a tie, or if neither answered in time, the first server is kept */
+	if (status > 0 && !pfds[0].revents && (pfds[1].revents & POLLIN)) {
+		loser = first;
+		cursor->connection = hedge;
+		cursor->stats_probe = probe;
+		cursor->sent_at = sent_at;
+	} else {
+		loser = hedge;
+	}
+	MONGO_TRACE(manager, MONGO_TRACE_HEDGE, cursor->send.request_id, hedge->socket, delay, cursor->connection->socket);
+	mongo_manager_log(manager, MLOG_IO, MLOG_FINE, "hedge: query sent to %s after %ldms, %s answered first", hedge->hash, delay, cursor->connection->hash);
+
+	/* The other reply is read, and its cursor killed, before anything else
+	 * on that socket. The socket of the cursor is checked in by
+	 * release_connection. */
+	mongo_connection_expect_stale_reply(loser, cursor->send.request_id);
+	mongo_manager_connection_checkin(manager, loser);
+}
+
+/* Sends the query of the cursor. With defer, the reply is not waited for:
+ * the cursor owns the next reply on its connection, and reads it when it's
+ * needed (see php_mongo_cursor_start). */
+static int send_query(mongo_cursor *cursor, zend_bool defer TSRMLS_DC) {
   buffer buf;
-  zval *errmsg;
 	char *error_message;
 	mongo_link *link;
 	mongo_read_preference rp;
 
-  cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
-  if (!cursor) {
-    zend_throw_exception(mongo_ce_Exception,
-                         "The MongoCursor object has not been correctly initialized by its constructor",
-                         0 TSRMLS_CC);
-    return FAILURE;
-  }
-
 	/* db connection resource */
 	link = (mongo_link*)zend_object_store_get_object(cursor->resource TSRMLS_CC);
 	if (!link->servers) {
@@ -867,62 +1733,306 @@ int mongo_cursor__do_query(zval *this_ptr, zval *return_value TSRMLS_DC) {
 	 * read/write setup already, instead of having to force a new mode later
 	 * (like we do for commands right now through
 	 * php_mongo_connection_force_primary).  See also MongoDB::command and
-	 * append_getlasterror, where this has to be done too. */
+	 * append_getlasterror, where this has to be done too. The socket that an
+	 * earlier query checked out goes back first. */
+	release_connection(cursor TSRMLS_CC);
 	cursor->connection = mongo_get_read_write_connection(link->manager, link->servers, MONGO_CON_FLAG_READ, (char**) &error_message);
 
-	/* restore read preferences from backup */
-	mongo_read_preference_replace(&rp, &link->servers->read_pref);
-	mongo_read_preference_dtor(&rp);
+	/* restore read preferences from backup */
+	mongo_read_preference_replace(&rp, &link->servers->read_pref);
+	mongo_read_preference_dtor(&rp);
+
+	if (!cursor->connection && error_message) {
+		efree(buf.start);
+		zend_throw_exception(mongo_ce_ConnectionException, error_message, 71 TSRMLS_CC);
+		free(error_message);
+		return FAILURE;
+	}
+
+	/* Another cursor may be waiting for a reply on this connection, in which
+	 * case a socket of its own keeps the two apart */
+	if (cursor->connection) {
+		cursor->connection = mongo_manager_connection_checkout(link->manager, cursor->connection, link->servers->server[0]);
+		cursor->checked_out = 1;
+	}
+
+	php_mongo_cursor_stats_start(cursor, query_stats_op(cursor) TSRMLS_CC);
+	if (mongo_io_flush(cursor->connection, buf.start, buf.pos - buf.start, (char **) &error_message) == -1) {
+		php_mongo_cursor_stats_end(cursor, 1 TSRMLS_CC);
+		if (error_message) {
+			mongo_cursor_throw(cursor->connection, 14 TSRMLS_CC, "couldn't send query: %s", error_message);
+			free(error_message);
+		} else {
+			mongo_cursor_throw(cursor->connection, 14 TSRMLS_CC, "couldn't send query");
+		}
+		efree(buf.start);
+		
+		return mongo_util_cursor_failed(cursor TSRMLS_CC);
+	}
+	MONGO_TRACE(MonGlo(manager), MONGO_TRACE_SEND_QUERY, cursor->send.request_id, buf.pos - buf.start, cursor->connection->socket, 0);
+
+	if (defer) {
+		php_mongo_cursor_queue_pending(cursor);
+	} else {
+		gettimeofday(&cursor->sent_at, NULL);
+		hedge_query(cursor, link, &buf TSRMLS_CC);
+	}
+
+	efree(buf.start);
+
+	return SUCCESS;
+}
+
+int mongo_cursor__do_query(zval *this_ptr, zval *return_value TSRMLS_DC) {
+  mongo_cursor *cursor;
+  zval *errmsg;
+
+  cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  if (!cursor) {
+    zend_throw_exception(mongo_ce_Exception,
+                         "The MongoCursor object has not been correctly initialized by its constructor",
+                         0 TSRMLS_CC);
+    return FAILURE;
+  }
+
+  if (send_query(cursor, 0 TSRMLS_CC) == FAILURE) {
+    return FAILURE;
+  }
+
+	MAKE_STD_ZVAL(errmsg);
+	ZVAL_NULL(errmsg);
+  if (php_mongo_get_reply(cursor, errmsg TSRMLS_CC) == FAILURE) {
+    zval_ptr_dtor(&errmsg);
+    return mongo_util_cursor_failed(cursor TSRMLS_CC);
+  }
+
+  zval_ptr_dtor(&errmsg);
+
+	if (unpack_command_cursor(cursor TSRMLS_CC) == FAILURE) {
+		return FAILURE;
+	}
+
+  /* we've got something to kill, make a note */
+  if (cursor->cursor_id != 0) {
+    php_mongo_create_le(cursor, "cursor_list" TSRMLS_CC);
+  }
+
+  return SUCCESS;
+}
+/* }}} */
+
+int php_mongo_cursor_find_one(zval *zlink, char *ns, zval *zquery, zval *zfields, mongo_read_preference *read_pref, long cache_ttl, zval *return_value TSRMLS_DC)
+{
+	mongo_cursor cursor;
+	zval *empty, *doc = NULL, *timeout, errmsg;
+	int status, cached_len = 0;
+	buffer cache_key;
+	char *cached, *start = NULL;
+
+	if (cache_ttl > 0 && php_mongo_result_cache_key(&cache_key, 'f', zlink, ns, zquery, zfields, read_pref TSRMLS_CC) == FAILURE) {
+		if (EG(exception)) {
+			return FAILURE;
+		}
+		cache_ttl = 0;
+	}
+	if (cache_ttl > 0 && (cached = php_mongo_result_cache_find(&cache_key, &cached_len TSRMLS_CC))) {
+		efree(cache_key.start);
+		if (cached_len) {
+			array_init(return_value);
+			bson_to_zval(cached, HASH_P(return_value) TSRMLS_CC);
+		}
+		return EG(exception) ? FAILURE : SUCCESS;
+	}
+
+	memset(&cursor, 0, sizeof(mongo_cursor));
+
+	MAKE_STD_ZVAL(empty);
+	object_init(empty);
+
+	if (!zquery || (Z_TYPE_P(zquery) == IS_ARRAY && zend_hash_num_elements(HASH_P(zquery)) == 0)) {
+		zquery = empty;
+	}
+	cursor.query = zquery;
+	cursor.fields = convert_fields(zfields ? zfields : empty TSRMLS_CC);
+	if (!cursor.fields) {
+		zval_ptr_dtor(&empty);
+		return FAILURE;
+	}
+
+	cursor.resource = zlink;
+	cursor.ns = ns;
+	cursor.limit = -1;
+	mongo_read_preference_copy(read_pref, &cursor.read_pref);
+
+	timeout = zend_read_static_property(mongo_ce_Cursor, "timeout", strlen("timeout"), NOISY TSRMLS_CC);
+	cursor.timeout = Z_LVAL_P(timeout);
+
+	ZVAL_NULL(&errmsg);
+
+	do {
+		cursor.num = 0;
+		status = send_query(&cursor, 0 TSRMLS_CC);
+		if (status == SUCCESS && php_mongo_get_reply(&cursor, &errmsg TSRMLS_CC) == FAILURE) {
+			status = mongo_util_cursor_failed(&cursor TSRMLS_CC);
+		}
+	} while (status == FAILURE && !EG(exception) && mongo_cursor__should_retry(&cursor));
 
-	if (!cursor->connection && error_message) {
-		efree(buf.start);
-		zend_throw_exception(mongo_ce_ConnectionException, error_message, 71 TSRMLS_CC);
-		free(error_message);
-		return FAILURE;
+	if (status == FAILURE && !EG(exception)) {
+		mongo_cursor_throw(cursor.connection, 19 TSRMLS_CC, "max number of retries exhausted, couldn't send query");
 	}
 
-	if (mongo_io_send(cursor->connection->socket, buf.start, buf.pos - buf.start, (char **) &error_message) == -1) {
-		if (error_message) {
-			mongo_cursor_throw(cursor->connection, 14 TSRMLS_CC, "couldn't send query: %s", error_message);
-			free(error_message);
+	/* With a negative limit the database closes the cursor itself, so there
+	 * is nothing to put on the cursor_list. */
+	if (status == SUCCESS && cursor.num > 0) {
+		start = cursor.buf.pos;
+	}
+	if (start && decode_document(&cursor, &doc, 1 TSRMLS_CC) == SUCCESS) {
+		if (php_mongo_cursor_throw_error(cursor.connection, doc TSRMLS_CC)) {
+			zval_ptr_dtor(&doc);
 		} else {
-			mongo_cursor_throw(cursor->connection, 14 TSRMLS_CC, "couldn't send query");
+			RETVAL_ZVAL(doc, 0, 1);
 		}
-		efree(buf.start);
-		
-		return mongo_util_cursor_failed(cursor TSRMLS_CC);
 	}
 
-	efree(buf.start);
+	/* Nothing found is a result too, but errors aren't */
+	if (cache_ttl > 0) {
+		if (status == SUCCESS && !EG(exception)) {
+			php_mongo_result_cache_store(&cache_key, ns, start, start ? cursor.buf.pos - start : 0, cache_ttl TSRMLS_CC);
+		}
+		efree(cache_key.start);
+	}
 
-	MAKE_STD_ZVAL(errmsg);
-	ZVAL_NULL(errmsg);
-  if (php_mongo_get_reply(cursor, errmsg TSRMLS_CC) == FAILURE) {
-    zval_ptr_dtor(&errmsg);
-    return mongo_util_cursor_failed(cursor TSRMLS_CC);
-  }
+	release_connection(&cursor TSRMLS_CC);
+	if (cursor.buf.start) efree(cursor.buf.start);
+	if (cursor.key_cache) mongo_key_cache_free(cursor.key_cache);
+	mongo_read_preference_dtor(&cursor.read_pref);
+	zval_ptr_dtor(&cursor.fields);
+	zval_ptr_dtor(&empty);
 
-  zval_ptr_dtor(&errmsg);
+	return EG(exception) ? FAILURE : SUCCESS;
+}
 
-  /* we've got something to kill, make a note */
-  if (cursor->cursor_id != 0) {
-    php_mongo_create_le(cursor, "cursor_list" TSRMLS_CC);
-  }
+int php_mongo_cursor_command(zval *zlink, char *database, zval *cmd, char **reply TSRMLS_DC)
+{
+	mongo_cursor cursor;
+	zval *timeout, errmsg;
+	int status, len = 0;
+	char type;
 
-  return SUCCESS;
+	memset(&cursor, 0, sizeof(mongo_cursor));
+
+	/* the read preference is left at primary, which is where commands go */
+	cursor.query = cmd;
+	cursor.resource = zlink;
+	spprintf(&cursor.ns, 0, "%s.$cmd", database);
+	cursor.limit = -1;
+
+	timeout = zend_read_static_property(mongo_ce_Cursor, "timeout", strlen("timeout"), NOISY TSRMLS_CC);
+	cursor.timeout = Z_LVAL_P(timeout);
+
+	ZVAL_NULL(&errmsg);
+
+	/* commands are never retried, see mongo_cursor__should_retry */
+	status = send_query(&cursor, 0 TSRMLS_CC);
+	if (status == SUCCESS && php_mongo_get_reply(&cursor, &errmsg TSRMLS_CC) == FAILURE) {
+		status = mongo_util_cursor_failed(&cursor TSRMLS_CC);
+	}
+	if (status == FAILURE && !EG(exception)) {
+		mongo_cursor_throw(cursor.connection, 19 TSRMLS_CC, "couldn't send command");
+	}
+
+	if (status == SUCCESS) {
+		if (cursor.num > 0 && cursor.buf.end - cursor.buf.pos >= INT_32) {
+			len = MONGO_32(*(int*)cursor.buf.pos);
+		}
+		if (len < INT_32 + 1 || len > cursor.buf.end - cursor.buf.pos) {
+			mongo_cursor_throw(cursor.connection, 21 TSRMLS_CC, "invalid reply to the command");
+			status = FAILURE;
+		} else if (bson_find_value(cursor.buf.pos, "$err", &type)) {
+			zval *doc;
+
+			/* A query failure, the exception carries the decoded document */
+			if (decode_document(&cursor, &doc, 1 TSRMLS_CC) == SUCCESS) {
+				php_mongo_cursor_throw_error(cursor.connection, doc TSRMLS_CC);
+				zval_ptr_dtor(&doc);
+			}
+			status = FAILURE;
+		} else {
+			/* the reply is the first (and only) document in the buffer, which
+			 * the caller takes over */
+			*reply = cursor.buf.start;
+			cursor.buf.start = NULL;
+		}
+	}
+
+	release_connection(&cursor TSRMLS_CC);
+	if (cursor.buf.start) efree(cursor.buf.start);
+	if (cursor.key_cache) mongo_key_cache_free(cursor.key_cache);
+	efree(cursor.ns);
+
+	return status;
 }
-/* }}} */
 
 int mongo_util_cursor_failed(mongo_cursor *cursor TSRMLS_DC)
 {
 	mongo_connection *connection = cursor->connection;
 
+	unqueue_pending(cursor);
+	cursor->checked_out = 0;
+
 	mongo_manager_connection_deregister(MonGlo(manager), connection);
 	cursor->dead = 1;
 
 	return FAILURE;
 }
 
+int php_mongo_cursor_start(zval *zcursor TSRMLS_DC)
+{
+	mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(zcursor TSRMLS_CC);
+
+	mongo_util_cursor_reset(cursor TSRMLS_CC);
+	if (send_query(cursor, 1 TSRMLS_CC) == FAILURE) {
+		return FAILURE;
+	}
+	cursor->started_iterating = 1;
+
+	return SUCCESS;
+}
+
+int php_mongo_cursor_request_more(mongo_cursor *cursor TSRMLS_DC)
+{
+	char *error_message = NULL;
+
+	if (send_get_more(cursor, &error_message TSRMLS_CC) == FAILURE) {
+		mongo_cursor_throw(cursor->connection, 1 TSRMLS_CC, error_message);
+		free(error_message);
+		return mongo_util_cursor_failed(cursor TSRMLS_CC);
+	}
+
+	return SUCCESS;
+}
+
+int php_mongo_cursor_read_pending(mongo_cursor *cursor TSRMLS_DC)
+{
+	signed int status;
+	char *error_message = NULL;
+
+	status = read_prefetch(cursor, &error_message TSRMLS_CC);
+	if (status != 0) {
+		mongo_cursor_throw(cursor->connection, status TSRMLS_CC, error_message);
+		free(error_message);
+		return mongo_util_cursor_failed(cursor TSRMLS_CC);
+	}
+
+	/* the cursor may have been started with php_mongo_cursor_start, in which
+	 * case this is the first reply */
+	if (cursor->cursor_id != 0) {
+		php_mongo_create_le(cursor, "cursor_list" TSRMLS_CC);
+	}
+
+	return SUCCESS;
+}
+
 // ITERATOR FUNCTIONS
 
 /* {{{ MongoCursor->current
@@ -944,16 +2054,33 @@ PHP_METHOD(MongoCursor, current) {
 /* {{{ MongoCursor->key
  */
 PHP_METHOD(MongoCursor, key) {
-  zval **id;
+  zval **id = NULL, *lazy_id, *raw_id = NULL;
   mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(getThis() TSRMLS_CC);
 	MONGO_CHECK_INITIALIZED(cursor->resource, MongoCursor);
 
   if (!cursor->current) {
     RETURN_NULL();
   }
-  if (cursor->current &&
-      Z_TYPE_P(cursor->current) == IS_ARRAY &&
-      zend_hash_find(HASH_P(cursor->current), "_id", 4, (void**)&id) == SUCCESS) {
+	if (cursor->lazy && Z_TYPE_P(cursor->current) == IS_OBJECT) {
+		lazy_id = php_mongo_lazy_document_get(cursor->current, "_id" TSRMLS_CC);
+		if (lazy_id) {
+			id = &lazy_id;
+		}
+	}
+	else if (cursor->raw && Z_TYPE_P(cursor->current) == IS_STRING) {
+		char type, *data = bson_find_value(Z_STRVAL_P(cursor->current), "_id", &type);
+
+		if (data) {
+			MAKE_STD_ZVAL(raw_id);
+			ZVAL_NULL(raw_id);
+			if (bson_value_to_zval(type, "_id", data, Z_STRVAL_P(cursor->current), raw_id TSRMLS_CC)) {
+				id = &raw_id;
+			}
+		}
+	}
+  if (id ||
+      (Z_TYPE_P(cursor->current) == IS_ARRAY &&
+       zend_hash_find(HASH_P(cursor->current), "_id", 4, (void**)&id) == SUCCESS)) {
 
     if (Z_TYPE_PP(id) == IS_OBJECT) {
 #if ZEND_MODULE_API_NO >= 20060613
@@ -968,13 +2095,19 @@ PHP_METHOD(MongoCursor, key) {
     }
   }
   else {
-    RETURN_LONG(cursor->at - 1);
+    RETVAL_LONG(cursor->at - 1);
   }
+
+	if (raw_id) {
+		zval_ptr_dtor(&raw_id);
+	}
 }
 /* }}} */
 
 int mongo_cursor__should_retry(mongo_cursor *cursor) {
   int microseconds = 50000, slots = 0, wait_us = 0;
+	struct timeval now;
+	long left_us;
 
   // never retry commands
   if (cursor->retry >= 5 ||
@@ -982,8 +2115,41 @@ int mongo_cursor__should_retry(mongo_cursor *cursor) {
     return 0;
   }
 
-  slots = (int)pow(2.0, cursor->retry++);
+	gettimeofday(&now, NULL);
+	if (cursor->retry == 0) {
+		cursor->retry_deadline.tv_sec = 0;
+		if (cursor->timeout > 0) {
+			cursor->retry_deadline.tv_sec = now.tv_sec + cursor->timeout / 1000;
+			cursor->retry_deadline.tv_usec = now.tv_usec + (cursor->timeout % 1000) * 1000;
+			if (cursor->retry_deadline.tv_usec >= 1000000) {
+				cursor->retry_deadline.tv_sec++;
+				cursor->retry_deadline.tv_usec -= 1000000;
+			}
+		}
+	}
+
+	left_us = -1;
+	if (cursor->retry_deadline.tv_sec) {
+		left_us = (cursor->retry_deadline.tv_sec - now.tv_sec) * 1000000 + (cursor->retry_deadline.tv_usec - now.tv_usec);
+		if (left_us <= 0) {
+			return 0;
+		}
+	}
+
+	/* The connection that failed has been deregistered, so the next attempt
+	 * picks another member from the read preference's candidates. Any member
+	 * will do for a query that can read from secondaries, so that happens
+	 * right away, as it does for the first retry of the others. Only queries
+	 * for the primary wait for one to be elected, and never longer than the
+	 * time that is left. */
+	slots = (int)pow(2.0, cursor->retry++);
+	if (slots == 1 || cursor->read_pref.type != MONGO_RP_PRIMARY) {
+		return 1;
+	}
   wait_us = (rand() % slots) * microseconds;
+	if (left_us >= 0 && wait_us > left_us) {
+		wait_us = left_us;
+	}
 
 #ifdef WIN32
   // windows sleep takes milliseconds
@@ -1003,12 +2169,74 @@ int mongo_cursor__should_retry(mongo_cursor *cursor) {
   return 1;
 }
 
+int php_mongo_cursor_throw_error(mongo_connection *connection, zval *doc TSRMLS_DC)
+{
+  zval **err = NULL, **wnote = NULL, **code_z, *exception;
+  char *error_message;
+  // default error code
+  int code = 4;
+
+  if (Z_TYPE_P(doc) != IS_ARRAY) {
+    return 0;
+  }
+
+  // check for $err
+  if (zend_hash_find(Z_ARRVAL_P(doc), "$err", strlen("$err")+1, (void**)&err) == FAILURE &&
+      // getLastError can return an error here
+      (zend_hash_find(Z_ARRVAL_P(doc), "err", strlen("err")+1, (void**)&err) == FAILURE ||
+       Z_TYPE_PP(err) != IS_STRING)) {
+    return 0;
+  }
+
+  if (zend_hash_find(Z_ARRVAL_P(doc), "code", strlen("code")+1, (void**)&code_z) == SUCCESS) {
+    // check for not master
+    if (Z_TYPE_PP(code_z) == IS_LONG) {
+      code = Z_LVAL_PP(code_z);
+    }
+    else if (Z_TYPE_PP(code_z) == IS_DOUBLE) {
+      code = (int)Z_DVAL_PP(code_z);
+    }
+    // else code == 4
+#if 0
+    // this shouldn't be necessary after 1.7.* is standard, it forces
+    // failover in case the master steps down.
+    // not master: 10107
+    // not master and slaveok=false (more recent): 13435
+    // not master or secondary: 13436
+    if (cursor->link->rs && (code == 10107 || code == 13435 || code == 13436 || code == 10058)) {
+      mongo_util_link_master_failed(cursor->link TSRMLS_CC);
+    }
+#endif
+		/* The member stepped down, so the connections are picked again */
+		if (code == 10107 || code == 13435 || code == 13436 || code == 10058) {
+			mongo_manager_unbind_all(MonGlo(manager));
+		}
+  }
+
+	error_message = strdup(Z_STRVAL_PP(err));
+
+	/* We check for additional information as well, in the "wnote" property */
+	if (
+		(zend_hash_find(Z_ARRVAL_P(doc), "wnote", strlen("wnote") + 1, (void**) &wnote) == SUCCESS) &&
+		(Z_TYPE_PP(wnote) == IS_STRING)
+	) {
+		free(error_message);
+		error_message = malloc(Z_STRLEN_PP(err) + 2 + Z_STRLEN_PP(wnote) + 1);
+		snprintf(error_message, Z_STRLEN_PP(err) + 2 + Z_STRLEN_PP(wnote) + 1, "%s: %s", Z_STRVAL_PP(err), Z_STRVAL_PP(wnote));
+	}
+
+  exception = mongo_cursor_throw(connection, code TSRMLS_CC, error_message);
+	free(error_message);
+  zend_update_property(mongo_ce_CursorException, exception, "doc", strlen("doc"), doc TSRMLS_CC);
+
+  return 1;
+}
+
 /* {{{ MongoCursor->next
  */
 PHP_METHOD(MongoCursor, next) {
   zval has_next;
   mongo_cursor *cursor;
-	char *error_message = NULL;
 
   PHP_MONGO_GET_CURSOR(getThis());
 	MONGO_CURSOR_CHECK_DEAD;
@@ -1039,66 +2267,18 @@ PHP_METHOD(MongoCursor, next) {
 
   // we got more results
   if (cursor->at < cursor->num) {
-		zval **err = NULL, **wnote = NULL;
-
-    MAKE_STD_ZVAL(cursor->current);
-    array_init(cursor->current);
-    cursor->buf.pos = bson_to_zval((char*)cursor->buf.pos, Z_ARRVAL_P(cursor->current) TSRMLS_CC);
-
-    if (EG(exception)) {
-      zval_ptr_dtor(&cursor->current);
-      cursor->current = 0;
-      return;
-    }
-
-    // increment cursor position
-    cursor->at++;
-
-    // check for $err
-    if (zend_hash_find(Z_ARRVAL_P(cursor->current), "$err", strlen("$err")+1, (void**)&err) == SUCCESS ||
-        // getLastError can return an error here
-        (zend_hash_find(Z_ARRVAL_P(cursor->current), "err", strlen("err")+1, (void**)&err) == SUCCESS &&
-         Z_TYPE_PP(err) == IS_STRING)) {
-      zval **code_z, *exception;
-      // default error code
-      int code = 4;
-
-      if (zend_hash_find(Z_ARRVAL_P(cursor->current), "code", strlen("code")+1, (void**)&code_z) == SUCCESS) {
-        // check for not master
-        if (Z_TYPE_PP(code_z) == IS_LONG) {
-          code = Z_LVAL_PP(code_z);
-        }
-        else if (Z_TYPE_PP(code_z) == IS_DOUBLE) {
-          code = (int)Z_DVAL_PP(code_z);
-        }
-        // else code == 4
-#if 0
-        // this shouldn't be necessary after 1.7.* is standard, it forces
-        // failover in case the master steps down.
-        // not master: 10107
-        // not master and slaveok=false (more recent): 13435
-        // not master or secondary: 13436
-        if (cursor->link->rs && (code == 10107 || code == 13435 || code == 13436 || code == 10058)) {
-          mongo_util_link_master_failed(cursor->link TSRMLS_CC);
-        }
-#endif
-      }
+		if (decode_document(cursor, &cursor->current, 1 TSRMLS_CC) == FAILURE) {
+			return;
+		}
 
-			error_message = strdup(Z_STRVAL_PP(err));
+		cursor->at++;
+		start_prefetch(cursor TSRMLS_CC);
 
-			/* We check for additional information as well, in the "wnote" property */
-			if (
-				(zend_hash_find(Z_ARRVAL_P(cursor->current), "wnote", strlen("wnote") + 1, (void**) &wnote) == SUCCESS) &&
-				(Z_TYPE_PP(wnote) == IS_STRING)
-			) {
-				free(error_message);
-				error_message = malloc(Z_STRLEN_PP(err) + 2 + Z_STRLEN_PP(wnote) + 1);
-				snprintf(error_message, Z_STRLEN_PP(err) + 2 + Z_STRLEN_PP(wnote) + 1, "%s: %s", Z_STRVAL_PP(err), Z_STRVAL_PP(wnote));
-			}
+		if (Z_TYPE_P(cursor->current) != IS_ARRAY) {
+			RETURN_NULL();
+		}
 
-      exception = mongo_cursor_throw(cursor->connection, code TSRMLS_CC, error_message);
-			free(error_message);
-      zend_update_property(mongo_ce_CursorException, exception, "doc", strlen("doc"), cursor->current TSRMLS_CC);
+    if (php_mongo_cursor_throw_error(cursor->connection, cursor->current TSRMLS_CC)) {
       zval_ptr_dtor(&cursor->current);
       cursor->current = 0;
       RETURN_FALSE;
@@ -1109,6 +2289,114 @@ PHP_METHOD(MongoCursor, next) {
 }
 /* }}} */
 
+/* {{{ MongoCursor::nextBatch([int max])
+ * Returns up to max (by default all) of the documents left in the current
+ * reply as a list, fetching the next reply first if the current one has been
+ * used up. Documents are not checked for errors one by one, only the reply's
+ * QueryFailure flag is. */
+PHP_METHOD(MongoCursor, nextBatch)
+{
+	long max = 0;
+	zval has_next, *doc;
+	mongo_cursor *cursor;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &max) == FAILURE) {
+		return;
+	}
+
+	PHP_MONGO_GET_CURSOR(getThis());
+	MONGO_CURSOR_CHECK_DEAD;
+
+	if (!cursor->started_iterating) {
+		MONGO_METHOD(MongoCursor, doQuery, return_value, getThis());
+		if (EG(exception)) {
+			return;
+		}
+		cursor->started_iterating = 1;
+	}
+
+	if (cursor->current) {
+		zval_ptr_dtor(&cursor->current);
+		cursor->current = 0;
+	}
+
+	MONGO_METHOD(MongoCursor, hasNext, &has_next, getThis());
+	if (EG(exception)) {
+		return;
+	}
+
+	array_init(return_value);
+	if (!Z_BVAL(has_next)) {
+		return;
+	}
+
+	/* The reply is a single error document, next() knows how to report it */
+	if (cursor->flag & REPLY_FLAG_QUERY_FAILURE) {
+		zval ignored;
+
+		MONGO_METHOD(MongoCursor, next, &ignored, getThis());
+		return;
+	}
+
+	while (
+		cursor->at < cursor->num && cursor->buf.pos < cursor->buf.end &&
+		(max <= 0 || zend_hash_num_elements(Z_ARRVAL_P(return_value)) < max) &&
+		(cursor->limit <= 0 || cursor->at < cursor->limit)
+	) {
+		if (decode_document(cursor, &doc, 0 TSRMLS_CC) == FAILURE) {
+			return;
+		}
+		add_next_index_zval(return_value, doc);
+		cursor->at++;
+	}
+
+	start_prefetch(cursor TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ php_mongo_cursor_next_raw
+ * Like getNext, but hands out the document where it is in the reply buffer
+ * instead of decoding it */
+int php_mongo_cursor_next_raw(zval *zcursor, char **doc, int *len TSRMLS_DC)
+{
+	zval has_next, *error_doc;
+	int length = 0;
+	mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(zcursor TSRMLS_CC);
+
+	*doc = NULL;
+
+	MONGO_METHOD(MongoCursor, hasNext, &has_next, zcursor);
+	if (EG(exception) || !Z_BVAL(has_next) || cursor->at >= cursor->num) {
+		return FAILURE;
+	}
+
+	if (cursor->buf.end - cursor->buf.pos >= INT_32) {
+		length = MONGO_32(*(int*)cursor->buf.pos);
+	}
+	if (length < INT_32 + 1 || length > cursor->buf.end - cursor->buf.pos) {
+		zend_throw_exception_ex(mongo_ce_CursorException, 21 TSRMLS_CC, "invalid document length: %d", length);
+		return FAILURE;
+	}
+
+	if (is_error_document(cursor->buf.pos)) {
+		if (decode_document(cursor, &error_doc, 1 TSRMLS_CC) == SUCCESS) {
+			cursor->at++;
+			php_mongo_cursor_throw_error(cursor->connection, error_doc TSRMLS_CC);
+			zval_ptr_dtor(&error_doc);
+		}
+		return FAILURE;
+	}
+
+	*doc = cursor->buf.pos;
+	*len = length;
+	cursor->buf.pos += length;
+	cursor->at++;
+	start_prefetch(cursor TSRMLS_CC);
+
+	return SUCCESS;
+}
+/* }}} */
+
 /* {{{ MongoCursor->rewind
  */
 PHP_METHOD(MongoCursor, rewind) {
@@ -1137,17 +2425,24 @@ PHP_METHOD(MongoCursor, reset) {
 }
 
 void mongo_util_cursor_reset(mongo_cursor *cursor TSRMLS_DC) {
+  php_mongo_cursor_discard_pending(cursor TSRMLS_CC);
+	release_connection(cursor TSRMLS_CC);
   cursor->buf.pos = cursor->buf.start;
 
   if (cursor->current) {
     zval_ptr_dtor(&cursor->current);
   }
 
-  if (cursor->cursor_id != 0) {
+  if (cursor->cursor_id != 0 || cursor->node) {
     mongo_cursor_free_le(cursor, MONGO_CURSOR TSRMLS_CC);
     cursor->cursor_id = 0;
   }
 
+  if (cursor->cursor_ns) {
+    efree(cursor->cursor_ns);
+    cursor->cursor_ns = NULL;
+  }
+
   cursor->started_iterating = 0;
   cursor->current = 0;
   cursor->at = 0;
@@ -1250,6 +2545,10 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_batchsize, 0, ZEND_RETURN_VALUE, 1)
 	ZEND_ARG_INFO(0, number)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_batchbytes, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, bytes)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_skip, 0, ZEND_RETURN_VALUE, 1)
 	ZEND_ARG_INFO(0, number)
 ZEND_END_ARG_INFO()
@@ -1296,6 +2595,30 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO_EX(arginfo_partial, 0, ZEND_RETURN_VALUE, 0)
 	ZEND_ARG_INFO(0, okay)
 ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_exhaust, 0, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_INFO(0, exhaust)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_lazy, 0, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_INFO(0, lazy)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_raw, 0, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_INFO(0, raw)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_decode_fields, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_ARRAY_INFO(0, fields, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_prefetch, 0, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_INFO(0, share)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_next_batch, 0, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_INFO(0, max)
+ZEND_END_ARG_INFO()
 /* }}} */
 
 ZEND_BEGIN_ARG_INFO_EX(arginfo_timeout, 0, ZEND_RETURN_VALUE, 1)
@@ -1311,12 +2634,18 @@ static zend_function_entry MongoCursor_methods[] = {
   PHP_ME(MongoCursor, __construct, arginfo___construct, ZEND_ACC_CTOR|ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, hasNext, arginfo_no_parameters, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, getNext, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, nextBatch, arginfo_next_batch, ZEND_ACC_PUBLIC)
 
   /* options */
   PHP_ME(MongoCursor, limit, arginfo_limit, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, batchSize, arginfo_batchsize, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, batchBytes, arginfo_batchbytes, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, skip, arginfo_skip, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, fields, arginfo_fields, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, lazy, arginfo_lazy, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, raw, arginfo_raw, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, decodeFields, arginfo_decode_fields, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, prefetch, arginfo_prefetch, ZEND_ACC_PUBLIC)
 
   /* meta options */
   PHP_ME(MongoCursor, addOption, arginfo_add_option, ZEND_ACC_PUBLIC)
@@ -1332,6 +2661,7 @@ static zend_function_entry MongoCursor_methods[] = {
   PHP_ME(MongoCursor, immortal, arginfo_immortal, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, awaitData, arginfo_await_data, ZEND_ACC_PUBLIC)
   PHP_ME(MongoCursor, partial, arginfo_partial, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoCursor, exhaust, arginfo_exhaust, ZEND_ACC_PUBLIC)
 
   /* query */
   PHP_ME(MongoCursor, timeout, NULL, ZEND_ACC_PUBLIC)
@@ -1391,6 +2721,7 @@ zval* mongo_cursor_throw(mongo_connection *connection, int code TSRMLS_DC, char
 	if (EG(exception)) {
 		return EG(exception);
 	}
+	MONGO_TRACE(MonGlo(manager), MONGO_TRACE_EXCEPTION, code, connection ? connection->socket : -1, 0, 0);
 
 	/* Based on the status, we pick a different exception class. Right now, we
 	 * choose mongo_ce_CursorException for everything but status 80, which is a
@@ -1401,17 +2732,24 @@ zval* mongo_cursor_throw(mongo_connection *connection, int code TSRMLS_DC, char
 		exception_ce = mongo_ce_CursorException;
 	}
 
-	/* Retrieve connections host and port */
-	host = mongo_server_hash_to_server(connection->hash);
-
 	va_start(arg, format);
 	message = malloc(1024);
 	vsnprintf(message, 1024, format, arg);
 	va_end(arg);
+
+	/* Without a connection (it went away since), there is no host to report */
+	if (!connection) {
+		e = zend_throw_exception_ex(exception_ce, code TSRMLS_CC, "%s", message);
+		free(message);
+		return e;
+	}
+
+	/* Retrieve connections host and port */
+	host = mongo_server_hash_to_server(connection->hash);
 	e = zend_throw_exception_ex(exception_ce, code TSRMLS_CC, "%s: %s", host, message);
 	free(message);
 
-	if (connection && code != 80) {
+	if (code != 80) {
 		zend_update_property_string(exception_ce, e, "host", strlen("host"), host TSRMLS_CC);
 		zend_update_property_long(exception_ce, e, "fd", strlen("fd"), connection->socket TSRMLS_CC);
 	}
@@ -1424,56 +2762,50 @@ zval* mongo_cursor_throw(mongo_connection *connection, int code TSRMLS_DC, char
 
 void mongo_cursor_free_le(void *val, int type TSRMLS_DC) {
   zend_rsrc_list_entry *le;
+  mongo_cursor *cursor;
+  cursor_node *node;
+
+  if (type != MONGO_CURSOR) {
+    return;
+  }
 
-  LOCK(cursor);
+  cursor = (mongo_cursor*)val;
+  node = cursor->node;
+  if (!node) {
+    return;
+  }
 
   /*
-   * This should work if le->ptr is null or non-null
+   * The node is only on the list of the thread that created the cursor
    */
-  if (zend_hash_find(&EG(persistent_list), "cursor_list", strlen("cursor_list") + 1, (void**)&le) == SUCCESS) {
-    cursor_node *current;
-
-    current = le->ptr;
-
-    while (current) {
-      cursor_node *next = current->next;
-
-      if (type == MONGO_CURSOR) {
-        mongo_cursor *cursor = (mongo_cursor*)val;
-        if (current->cursor_id == cursor->cursor_id &&
-            cursor->connection != NULL &&
-            current->socket == cursor->connection->socket) {
-
-          // If the cursor_id is 0, the db is out of results anyway
-          // If the connection is not connected, just return
-          if (current->cursor_id == 0/* || !cursor->connection->connected*/) {
-            php_mongo_free_cursor_node(current, le);
-          }
-          else {
-            kill_cursor(current, le TSRMLS_CC);
-
-            /*
-             * if the connection is closed before the cursor is destroyed, the cursor
-             * might try to fetch more results with disasterous consequences.  Thus, the
-             * cursor_id is set to 0, so no more results will be fetched.
-             *
-             * this might not be the most elegant solution, since you could fetch 100
-             * results, get the first one, close the connection, get 99 more, and suddenly
-             * not be able to get any more.  Not sure if there's a better one, though. I
-             * guess the user can call dead() on the cursor.
-             */
-            cursor->cursor_id = 0;
-          }
-          // only one cursor to be freed
-          break;
-        }
-      }
+  if (zend_hash_find(&EG(persistent_list), "cursor_list", strlen("cursor_list") + 1, (void**)&le) == FAILURE) {
+    cursor->node = NULL;
+    return;
+  }
 
-      current = next;
-    }
+  cursor->node = NULL;
+
+  // If the cursor_id is 0, the db is out of results anyway.  If the
+  // connection is gone (or is a different one now), the socket can't be used.
+  if (node->cursor_id == 0 || node->cursor_id != cursor->cursor_id ||
+      cursor->connection == NULL || node->socket != cursor->connection->socket) {
+    php_mongo_free_cursor_node(node, le);
+    return;
   }
 
-  UNLOCK(cursor);
+  kill_cursor(node, le TSRMLS_CC);
+
+  /*
+   * if the connection is closed before the cursor is destroyed, the cursor
+   * might try to fetch more results with disasterous consequences.  Thus, the
+   * cursor_id is set to 0, so no more results will be fetched.
+   *
+   * this might not be the most elegant solution, since you could fetch 100
+   * results, get the first one, close the connection, get 99 more, and suddenly
+   * not be able to get any more.  Not sure if there's a better one, though. I
+   * guess the user can call dead() on the cursor.
+   */
+  cursor->cursor_id = 0;
 }
 
 
@@ -1481,59 +2813,31 @@ int php_mongo_create_le(mongo_cursor *cursor, char *name TSRMLS_DC) {
   zend_rsrc_list_entry *le;
   cursor_node *new_node;
 
-  LOCK(cursor);
+  /*
+   * A cursor is on the list at most once, its node only has to follow the
+   * cursor (a reset cursor gets a new id on the same node).
+   */
+  if (cursor->node) {
+    cursor->node->cursor_id = cursor->cursor_id;
+    cursor->node->socket = cursor->connection ? cursor->connection->socket : 0;
+    return 0;
+  }
 
   new_node = (cursor_node*)pemalloc(sizeof(cursor_node), 1);
   new_node->cursor_id = cursor->cursor_id;
-	if (cursor->connection) {
-		new_node->socket = cursor->connection->socket;
-  }
-  else {
-    new_node->socket = 0;
-  }
+  new_node->socket = cursor->connection ? cursor->connection->socket : 0;
   new_node->next = new_node->prev = 0;
 
   /*
-   * 3 options:
-   *   - le doesn't exist
-   *   - le exists and is null
-   *   - le exists and has elements
-   * In case 1 & 2, we want to create a new le ptr, otherwise we want to append
-   * to the existing ptr.
+   * If the list exists (possibly empty), the new node becomes its head,
+   * otherwise the list is created with just this node.
    */
   if (zend_hash_find(&EG(persistent_list), name, strlen(name)+1, (void**)&le) == SUCCESS) {
-    cursor_node *current = le->ptr;
-    cursor_node *prev = 0;
-
-    if (current == 0) {
-      le->ptr = new_node;
-      UNLOCK(cursor);
-      return 0;
-    }
-
-    do {
-      /*
-       * if we find the current cursor in the cursor list, we don't need another
-       * dtor for it so unlock the mutex & return.
-       */
-      if (current->cursor_id == cursor->cursor_id &&
-          current->socket == cursor->connection->socket) {
-        pefree(new_node, 1);
-        UNLOCK(cursor);
-        return 0;
-      }
-
-      prev = current;
-      current = current->next;
+    new_node->next = le->ptr;
+    if (new_node->next) {
+      new_node->next->prev = new_node;
     }
-    while (current);
-
-    /*
-     * we didn't find the cursor.  add it to the list. (prev is pointing to the
-     * tail of the list, current is pointing to null.
-     */
-    prev->next = new_node;
-    new_node->prev = prev;
+    le->ptr = new_node;
   }
   else {
     zend_rsrc_list_entry new_le;
@@ -1543,30 +2847,20 @@ int php_mongo_create_le(mongo_cursor *cursor, char *name TSRMLS_DC) {
     zend_hash_add(&EG(persistent_list), name, strlen(name)+1, &new_le, sizeof(zend_rsrc_list_entry), NULL);
   }
 
-  UNLOCK(cursor);
+  cursor->node = new_node;
   return 0;
 }
 
 static int cursor_list_pfree_helper(zend_rsrc_list_entry *rsrc TSRMLS_DC) {
-  LOCK(cursor);
-
-  {
-    cursor_node *node = (cursor_node*)rsrc->ptr;
+  cursor_node *node = (cursor_node*)rsrc->ptr;
 
-    if (!node) {
-      UNLOCK(cursor);
-      return 0;
-    }
-
-    while (node->next) {
-      cursor_node *temp = node;
-      node = node->next;
-      pefree(temp, 1);
-    }
-    pefree(node, 1);
+  while (node) {
+    cursor_node *temp = node;
+    node = node->next;
+    pefree(temp, 1);
   }
 
-  UNLOCK(cursor);
+  rsrc->ptr = 0;
   return 0;
 }
 
@@ -1649,7 +2943,10 @@ void php_mongo_cursor_free(void *object TSRMLS_DC) {
   mongo_cursor *cursor = (mongo_cursor*)object;
 
   if (cursor) {
-    if (cursor->cursor_id != 0) {
+    php_mongo_cursor_discard_pending(cursor TSRMLS_CC);
+		release_connection(cursor TSRMLS_CC);
+
+    if (cursor->cursor_id != 0 || cursor->node) {
       mongo_cursor_free_le(cursor, MONGO_CURSOR TSRMLS_CC);
     }
 
@@ -1657,9 +2954,14 @@ void php_mongo_cursor_free(void *object TSRMLS_DC) {
 
     if (cursor->query) zval_ptr_dtor(&cursor->query);
     if (cursor->fields) zval_ptr_dtor(&cursor->fields);
+    if (cursor->decode_fields) zval_ptr_dtor(&cursor->decode_fields);
 
     if (cursor->buf.start) efree(cursor->buf.start);
+    if (cursor->prefetch_buf.start) efree(cursor->prefetch_buf.start);
+    if (cursor->budgeted) MonGlo(cursor_buffer_used) -= cursor->budget_bytes;
     if (cursor->ns) efree(cursor->ns);
+    if (cursor->cursor_ns) efree(cursor->cursor_ns);
+    if (cursor->key_cache) mongo_key_cache_free(cursor->key_cache);
 
     if (cursor->resource) zval_ptr_dtor(&cursor->resource);
 
@@ -29,6 +29,26 @@ int php_mongo_get_reply(mongo_cursor *cursor, zval *errmsg TSRMLS_DC);
  */
 int mongo_cursor__do_query(zval *this_ptr, zval *return_value TSRMLS_DC);
 
+/**
+ * Queries ns for a single document and sets return_value to it, or to NULL
+ * if nothing matches. This uses a cursor on the stack, rather than a
+ * MongoCursor object, and never puts it on the cursor_list. With a cache_ttl
+ * of more than 0 seconds the result comes from the result cache if it is
+ * there, and goes into it otherwise. Returns SUCCESS, or FAILURE with an
+ * exception thrown.
+ */
+int php_mongo_cursor_find_one(zval *zlink, char *ns, zval *query, zval *fields, mongo_read_preference *read_pref, long cache_ttl, zval *return_value TSRMLS_DC);
+
+/**
+ * Runs the command cmd against database, on the primary, and sets reply to
+ * the raw BSON of the reply document, which the caller efrees. Like
+ * php_mongo_cursor_find_one, this uses a cursor on the stack; nothing is
+ * decoded, so that internal callers can read just the fields they need.
+ * Returns SUCCESS, or FAILURE with an exception thrown (also when the reply is
+ * a query failure, $err).
+ */
+int php_mongo_cursor_command(zval *zlink, char *database, zval *cmd, char **reply TSRMLS_DC);
+
 /**
  * Reset the cursor to clean up or prepare for another query.  Removes cursor
  * from cursor list (and kills it, if necessary).
@@ -41,12 +61,76 @@ void mongo_util_cursor_reset(mongo_cursor *cursor TSRMLS_DC);
  */
 int mongo_util_cursor_failed(mongo_cursor *cursor TSRMLS_DC);
 
+/**
+ * Sends the query of a cursor without waiting for the reply. The cursor owns
+ * the next reply on its connection until it has been read, by
+ * php_mongo_cursor_read_pending or by iterating. Returns SUCCESS or FAILURE.
+ */
+int php_mongo_cursor_start(zval *zcursor TSRMLS_DC);
+
+/**
+ * Sends an OP_GET_MORE for cursor without waiting for the reply. Returns
+ * SUCCESS or FAILURE.
+ */
+int php_mongo_cursor_request_more(mongo_cursor *cursor TSRMLS_DC);
+
+/**
+ * Reads the reply that cursor is waiting for into its prefetch buffer, from
+ * where the next call to hasNext picks it up. Returns SUCCESS or FAILURE.
+ */
+int php_mongo_cursor_read_pending(mongo_cursor *cursor TSRMLS_DC);
+
+/**
+ * Makes cursor the owner of the reply to the request it has just sent
+ * (cursor->send.request_id). The reply is read by php_mongo_cursor_read_pending,
+ * or set aside into cursor->prefetch_buf when a reply that comes after it on
+ * the connection is needed first.
+ */
+void php_mongo_cursor_queue_pending(mongo_cursor *cursor);
+
+/**
+ * Starts timing the request that the cursor is about to send, as an operation
+ * of type op (MONGO_STATS_OP_*). The timing ends once the reply has been read
+ * by php_mongo_get_reply, or when sending the request fails.
+ */
+void php_mongo_cursor_stats_start(mongo_cursor *cursor, int op TSRMLS_DC);
+void php_mongo_cursor_stats_end(mongo_cursor *cursor, int failed TSRMLS_DC);
+
+/**
+ * Reads and drops the replies that cursor still owns.
+ */
+void php_mongo_cursor_discard_pending(mongo_cursor *cursor TSRMLS_DC);
+
+/**
+ * Sets doc to the next document of zcursor as it is in the reply buffer, and
+ * len to its length, without decoding it. The document stays valid until the
+ * next call for the cursor, or until the cursor is reset or freed. Returns
+ * FAILURE at the end of the results, or with an exception thrown if the next
+ * document is invalid or an error document.
+ */
+int php_mongo_cursor_next_raw(zval *zcursor, char **doc, int *len TSRMLS_DC);
+
+/**
+ * If doc is an error document ($err, or err for getLastError), throws a
+ * MongoCursorException with the error's code and the document attached, and
+ * returns 1. Returns 0 otherwise.
+ */
+int php_mongo_cursor_throw_error(mongo_connection *connection, zval *doc TSRMLS_DC);
+
+/**
+ * Sets the flags for tailing a capped collection (and with oplog_replay, an
+ * oplog) on a cursor that hasn't been sent yet
+ */
+void php_mongo_cursor_tail(mongo_cursor *cursor, int oplog_replay);
+
 /**
  * If the query should be send to the db or not.  The rules are:
  * - db commands should only be sent onces (no retries)
- * - normal queries should be sent up to 5 times
- * This uses exponential backoff with a random seed to avoid flooding a
- * struggling db with retries.
+ * - normal queries should be sent up to 5 times, within the cursor's timeout
+ *   from the first retry on
+ * Queries that may read from secondaries are retried right away, on another
+ * member. Those for the primary use exponential backoff with a random seed to
+ * avoid flooding a struggling db with retries, bounded by the time left.
  */
 int mongo_cursor__should_retry(mongo_cursor *cursor);
 
@@ -55,8 +139,14 @@ PHP_METHOD(MongoCursor, getNext);
 PHP_METHOD(MongoCursor, hasNext);
 PHP_METHOD(MongoCursor, limit);
 PHP_METHOD(MongoCursor, batchSize);
+PHP_METHOD(MongoCursor, batchBytes);
 PHP_METHOD(MongoCursor, skip);
 PHP_METHOD(MongoCursor, fields);
+PHP_METHOD(MongoCursor, lazy);
+PHP_METHOD(MongoCursor, raw);
+PHP_METHOD(MongoCursor, decodeFields);
+PHP_METHOD(MongoCursor, prefetch);
+PHP_METHOD(MongoCursor, nextBatch);
 
 PHP_METHOD(MongoCursor, setFlag);
 PHP_METHOD(MongoCursor, tailable);
@@ -64,6 +154,7 @@ PHP_METHOD(MongoCursor, slaveOkay);
 PHP_METHOD(MongoCursor, immortal);
 PHP_METHOD(MongoCursor, awaitData);
 PHP_METHOD(MongoCursor, partial);
+PHP_METHOD(MongoCursor, exhaust);
 
 PHP_METHOD(MongoCursor, timeout);
 PHP_METHOD(MongoCursor, dead);
@@ -128,8 +219,9 @@ void mongo_cursor_free_le(void* val, int type TSRMLS_DC);
  * Adds a cursor to the cursor_list.
  *
  * A cursor can only be added once to the cursor list.  If cursor is already on
- * the list, this does nothing.  This creates the cursor_list if it does not
- * exist.
+ * the list (cursor->node is set), its node is updated instead.  This creates
+ * the cursor_list if it does not exist.  The list is kept per thread, so no
+ * lock is taken, and adding or removing a cursor is O(1).
  */
 int php_mongo_create_le(mongo_cursor *cursor, char *name TSRMLS_DC);
 
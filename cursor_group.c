@@ -0,0 +1,408 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <php.h>
+#include <zend_interfaces.h>
+#include <zend_exceptions.h>
+
+#ifdef WIN32
+#  ifndef int64_t
+     typedef __int64 int64_t;
+#  endif
+#endif
+
+#include "php_mongo.h"
+#include "cursor.h"
+#include "cursor_group.h"
+#include "mcon/io.h"
+
+extern zend_class_entry *mongo_ce_Exception,
+  *mongo_ce_Cursor,
+  *mongo_ce_CursorException,
+  *mongo_ce_CursorTOException;
+
+extern zend_object_handlers mongo_default_handlers;
+
+zend_class_entry *mongo_ce_CursorGroup = NULL;
+
+#define PHP_MONGO_GET_CURSOR_GROUP(obj)                                           \
+  group = (mongo_cursor_group*)zend_object_store_get_object((obj) TSRMLS_CC);     \
+  MONGO_CHECK_INITIALIZED(group->cursors, MongoCursorGroup);
+
+/* Whether documents of the cursor's current batch are left */
+static int has_documents(mongo_cursor *cursor)
+{
+	return cursor->buf.pos < cursor->buf.end && (cursor->limit <= 0 || cursor->at < cursor->limit);
+}
+
+/* Makes the next document of zcursor the current one of the group, reading the
+ * reply the cursor waits for first if needed. Returns 1 if there was a
+ * document, 0 if the cursor turned out to have none left, and -1 if an
+ * exception was thrown. */
+static int take_document(mongo_cursor_group *group, zval *zcursor TSRMLS_DC)
+{
+	mongo_cursor *cursor = (mongo_cursor*)zend_object_store_get_object(zcursor TSRMLS_CC);
+	zval ignored;
+
+	if (cursor->prefetch_pending && !cursor->prefetch_ready && !has_documents(cursor)) {
+		if (php_mongo_cursor_read_pending(cursor TSRMLS_CC) == FAILURE) {
+			return -1;
+		}
+	}
+
+	MONGO_METHOD(MongoCursor, next, &ignored, zcursor);
+	if (EG(exception)) {
+		return -1;
+	}
+	if (!cursor->current) {
+		return 0;
+	}
+
+	group->current = cursor->current;
+	zval_add_ref(&group->current);
+	group->current_cursor = zcursor;
+	zval_add_ref(&group->current_cursor);
+	group->key++;
+
+	return 1;
+}
+
+/* Finds the next document: from a cursor that has documents at hand, or else
+ * from the first cursor whose reply comes in. Cursors of which the batch has
+ * been used up get their OP_GET_MORE sent right away, so that all of them
+ * wait for the database at the same time. */
+static void load_next(mongo_cursor_group *group TSRMLS_DC)
+{
+	int count = zend_hash_num_elements(Z_ARRVAL_P(group->cursors));
+	struct pollfd *fds;
+	zval **waiting, **entry;
+	HashPosition pointer;
+	mongo_cursor *cursor;
+	int i, n, status, timeout;
+
+	if (group->current) {
+		zval_ptr_dtor(&group->current);
+		group->current = NULL;
+	}
+	if (group->current_cursor) {
+		zval_ptr_dtor(&group->current_cursor);
+		group->current_cursor = NULL;
+	}
+
+	if (count == 0) {
+		return;
+	}
+
+	fds = (struct pollfd*)safe_emalloc(count, sizeof(struct pollfd), 0);
+	waiting = (zval**)safe_emalloc(count, sizeof(zval*), 0);
+
+	while (1) {
+		zval *ready = NULL;
+
+		n = 0;
+		timeout = -1;
+
+		for (
+			zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(group->cursors), &pointer);
+			zend_hash_get_current_data_ex(Z_ARRVAL_P(group->cursors), (void**)&entry, &pointer) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_P(group->cursors), &pointer)
+		) {
+			cursor = (mongo_cursor*)zend_object_store_get_object(*entry TSRMLS_CC);
+
+			if (has_documents(cursor) || cursor->prefetch_ready) {
+				ready = *entry;
+				break;
+			}
+
+			if (!cursor->prefetch_pending) {
+				if (cursor->cursor_id == 0 || !cursor->connection || (cursor->limit > 0 && cursor->at >= cursor->limit)) {
+					/* this one is done */
+					continue;
+				}
+				if (php_mongo_cursor_request_more(cursor TSRMLS_CC) == FAILURE) {
+					goto done;
+				}
+			}
+
+			if (mongo_io_has_buffered_data(cursor->connection)) {
+				ready = *entry;
+				break;
+			}
+
+			fds[n].fd = cursor->connection->socket;
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			waiting[n++] = *entry;
+
+			if (cursor->timeout > 0 && (timeout < 0 || cursor->timeout < timeout)) {
+				timeout = cursor->timeout;
+			}
+		}
+
+		if (!ready) {
+			if (n == 0) {
+				/* all cursors are done */
+				goto done;
+			}
+
+			status = mongo_io_poll(fds, n, timeout);
+			if (status == -1) {
+				zend_throw_exception(mongo_ce_CursorException, "error waiting for the cursors of the group", 13 TSRMLS_CC);
+				goto done;
+			}
+			if (status == 0) {
+				zend_throw_exception_ex(mongo_ce_CursorTOException, 80 TSRMLS_CC, "cursor group timed out (timeout: %d)", timeout);
+				goto done;
+			}
+
+			for (i = 0; i < n; i++) {
+				if (fds[i].revents) {
+					ready = waiting[i];
+					break;
+				}
+			}
+		}
+
+		if (ready && take_document(group, ready TSRMLS_CC) != 0) {
+			goto done;
+		}
+	}
+
+done:
+	efree(fds);
+	efree(waiting);
+}
+
+/* {{{ MongoCursorGroup::__construct([array cursors])
+ */
+PHP_METHOD(MongoCursorGroup, __construct)
+{
+	mongo_cursor_group *group;
+	zval *cursors = NULL, **entry;
+	HashPosition pointer;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|a", &cursors) == FAILURE) {
+		return;
+	}
+
+	if (cursors) {
+		for (
+			zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(cursors), &pointer);
+			zend_hash_get_current_data_ex(Z_ARRVAL_P(cursors), (void**)&entry, &pointer) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_P(cursors), &pointer)
+		) {
+			if (Z_TYPE_PP(entry) != IS_OBJECT || !instanceof_function(Z_OBJCE_PP(entry), mongo_ce_Cursor TSRMLS_CC)) {
+				zend_throw_exception(mongo_ce_Exception, "MongoCursorGroup expects MongoCursor objects", 24 TSRMLS_CC);
+				return;
+			}
+		}
+	}
+
+	group = (mongo_cursor_group*)zend_object_store_get_object(getThis() TSRMLS_CC);
+	if (group->cursors) {
+		zval_ptr_dtor(&group->cursors);
+	}
+
+	MAKE_STD_ZVAL(group->cursors);
+	array_init(group->cursors);
+
+	if (cursors) {
+		for (
+			zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(cursors), &pointer);
+			zend_hash_get_current_data_ex(Z_ARRVAL_P(cursors), (void**)&entry, &pointer) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_P(cursors), &pointer)
+		) {
+			zval_add_ref(entry);
+			add_next_index_zval(group->cursors, *entry);
+		}
+	}
+}
+/* }}} */
+
+/* {{{ MongoCursorGroup::add(MongoCursor cursor)
+ */
+PHP_METHOD(MongoCursorGroup, add)
+{
+	mongo_cursor_group *group;
+	zval *cursor;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "O", &cursor, mongo_ce_Cursor) == FAILURE) {
+		return;
+	}
+	PHP_MONGO_GET_CURSOR_GROUP(getThis());
+
+	if (group->started) {
+		zend_throw_exception(mongo_ce_CursorException, "cannot modify cursor group after beginning iteration", 0 TSRMLS_CC);
+		return;
+	}
+
+	zval_add_ref(&cursor);
+	add_next_index_zval(group->cursors, cursor);
+
+	RETURN_ZVAL(getThis(), 1, 0);
+}
+/* }}} */
+
+/* {{{ MongoCursorGroup::getCursor()
+ * Returns the cursor the current document came from */
+PHP_METHOD(MongoCursorGroup, getCursor)
+{
+	mongo_cursor_group *group;
+	PHP_MONGO_GET_CURSOR_GROUP(getThis());
+
+	if (!group->current_cursor) {
+		RETURN_NULL();
+	}
+	RETURN_ZVAL(group->current_cursor, 1, 0);
+}
+/* }}} */
+
+/* {{{ MongoCursorGroup::current()
+ */
+PHP_METHOD(MongoCursorGroup, current)
+{
+	mongo_cursor_group *group;
+	PHP_MONGO_GET_CURSOR_GROUP(getThis());
+
+	if (!group->current) {
+		RETURN_NULL();
+	}
+	RETURN_ZVAL(group->current, 1, 0);
+}
+/* }}} */
+
+/* {{{ MongoCursorGroup::key()
+ * The position of the current document, counting from 0 */
+PHP_METHOD(MongoCursorGroup, key)
+{
+	mongo_cursor_group *group;
+	PHP_MONGO_GET_CURSOR_GROUP(getThis());
+
+	RETURN_LONG(group->key);
+}
+/* }}} */
+
+/* {{{ MongoCursorGroup::next()
+ */
+PHP_METHOD(MongoCursorGroup, next)
+{
+	mongo_cursor_group *group;
+	PHP_MONGO_GET_CURSOR_GROUP(getThis());
+
+	if (!group->started) {
+		MONGO_METHOD(MongoCursorGroup, rewind, return_value, getThis());
+		return;
+	}
+	load_next(group TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ MongoCursorGroup::rewind()
+ * Sends the queries of all cursors, without waiting for any of the replies */
+PHP_METHOD(MongoCursorGroup, rewind)
+{
+	mongo_cursor_group *group;
+	zval **entry;
+	HashPosition pointer;
+	PHP_MONGO_GET_CURSOR_GROUP(getThis());
+
+	group->started = 1;
+	group->key = -1;
+
+	for (
+		zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(group->cursors), &pointer);
+		zend_hash_get_current_data_ex(Z_ARRVAL_P(group->cursors), (void**)&entry, &pointer) == SUCCESS;
+		zend_hash_move_forward_ex(Z_ARRVAL_P(group->cursors), &pointer)
+	) {
+		if (php_mongo_cursor_start(*entry TSRMLS_CC) == FAILURE) {
+			if (!EG(exception)) {
+				zend_throw_exception(mongo_ce_CursorException, "couldn't send query", 14 TSRMLS_CC);
+			}
+			return;
+		}
+	}
+
+	load_next(group TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ MongoCursorGroup::valid()
+ */
+PHP_METHOD(MongoCursorGroup, valid)
+{
+	mongo_cursor_group *group;
+	PHP_MONGO_GET_CURSOR_GROUP(getThis());
+
+	RETURN_BOOL(group->current != NULL);
+}
+/* }}} */
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo___construct, 0, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_ARRAY_INFO(0, cursors, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_add, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_OBJ_INFO(0, cursor, MongoCursor, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_no_parameters, 0, ZEND_RETURN_VALUE, 0)
+ZEND_END_ARG_INFO()
+
+static zend_function_entry MongoCursorGroup_methods[] = {
+	PHP_ME(MongoCursorGroup, __construct, arginfo___construct, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoCursorGroup, add, arginfo_add, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoCursorGroup, getCursor, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoCursorGroup, current, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoCursorGroup, key, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoCursorGroup, next, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoCursorGroup, rewind, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoCursorGroup, valid, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	{ NULL, NULL, NULL }
+};
+
+static void php_mongo_cursor_group_free(void *object TSRMLS_DC)
+{
+	mongo_cursor_group *group = (mongo_cursor_group*)object;
+
+	if (group) {
+		if (group->current) {
+			zval_ptr_dtor(&group->current);
+		}
+		if (group->current_cursor) {
+			zval_ptr_dtor(&group->current_cursor);
+		}
+		if (group->cursors) {
+			zval_ptr_dtor(&group->cursors);
+		}
+
+		zend_object_std_dtor(&group->std TSRMLS_CC);
+		efree(group);
+	}
+}
+
+static zend_object_value php_mongo_cursor_group_new(zend_class_entry *class_type TSRMLS_DC)
+{
+	php_mongo_obj_new(mongo_cursor_group);
+}
+
+void mongo_init_MongoCursorGroup(TSRMLS_D)
+{
+	zend_class_entry ce;
+
+	INIT_CLASS_ENTRY(ce, "MongoCursorGroup", MongoCursorGroup_methods);
+	ce.create_object = php_mongo_cursor_group_new;
+	mongo_ce_CursorGroup = zend_register_internal_class(&ce TSRMLS_CC);
+	zend_class_implements(mongo_ce_CursorGroup TSRMLS_CC, 1, zend_ce_iterator);
+}
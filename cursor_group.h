@@ -0,0 +1,30 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MONGO_CURSOR_GROUP_H
+#define MONGO_CURSOR_GROUP_H 1
+
+void mongo_init_MongoCursorGroup(TSRMLS_D);
+
+PHP_METHOD(MongoCursorGroup, __construct);
+PHP_METHOD(MongoCursorGroup, add);
+PHP_METHOD(MongoCursorGroup, getCursor);
+PHP_METHOD(MongoCursorGroup, current);
+PHP_METHOD(MongoCursorGroup, key);
+PHP_METHOD(MongoCursorGroup, next);
+PHP_METHOD(MongoCursorGroup, rewind);
+PHP_METHOD(MongoCursorGroup, valid);
+
+#endif
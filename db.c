@@ -29,6 +29,8 @@
 #include "mongo_types.h"
 #include "mcon/manager.h"
 
+ZEND_EXTERN_MODULE_GLOBALS(mongo);
+
 #ifndef zend_parse_parameters_none
 #define zend_parse_parameters_none()    \
         zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "")
@@ -269,7 +271,8 @@ PHP_METHOD(MongoDB, setProfilingLevel) {
 
 PHP_METHOD(MongoDB, drop) {
   zval *data;
-
+	char *prefix;
+	mongo_db *db = (mongo_db*)zend_object_store_get_object(getThis() TSRMLS_CC);
 
   if (zend_parse_parameters_none() == FAILURE) {
     return;
@@ -282,6 +285,12 @@ PHP_METHOD(MongoDB, drop) {
 
   MONGO_CMD(return_value, getThis());
   zval_ptr_dtor(&data);
+
+	if (db->name) {
+		spprintf(&prefix, 0, "%s.", Z_STRVAL_P(db->name));
+		mongo_manager_forget_indexes(MonGlo(manager), prefix);
+		efree(prefix);
+	}
 }
 
 PHP_METHOD(MongoDB, repair) {
@@ -30,6 +30,11 @@
 #include "cursor.h"
 #include "mongo_types.h"
 #include "db.h"
+#include "bson.h"
+#include "mcon/manager.h"
+#include "mcon/io.h"
+#include "mcon/utils.h"
+#include "gridfs_cache.h"
 
 #include "ext/standard/php_smart_str.h"
 
@@ -82,16 +87,23 @@ typedef int (*apply_copy_func_t)(void *to, char *from, int len);
 
 static int copy_bytes(void *to, char *from, int len);
 static int copy_file(void *to, char *from, int len);
-static void add_md5(zval *zfile, zval *zid, mongo_collection *c TSRMLS_DC);
 
-static int apply_to_cursor(zval *cursor, apply_copy_func_t apply_copy_func, void *to TSRMLS_DC);
+static int apply_to_cursor(zval *cursor, apply_copy_func_t apply_copy_func, void *to, int skip, int max, zval *chunks, zval *file TSRMLS_DC);
+static int apply_to_cache(zval *chunks, zval *file, int first, int skip, int max, apply_copy_func_t apply_copy_func, void *to TSRMLS_DC);
+static int get_file_int(zval *file, char *name, int *value TSRMLS_DC);
+static int setup_range(zval *file, zval *query, long offset, long length, int *first, int *skip TSRMLS_DC);
 static int setup_file(FILE *fpp, char *filename TSRMLS_DC);
 static int get_chunk_size(zval *array TSRMLS_DC);
 static zval* setup_extra(zval *zfile, zval *extra TSRMLS_DC);
 static int setup_file_fields(zval *zfile, char *filename, int size TSRMLS_DC);
-static zval* insert_chunk(zval *chunks, zval *zid, int chunk_num, char *buf, int chunk_size, zval *options TSRMLS_DC);
 static void ensure_gridfs_index(zval *return_value, zval *this_ptr TSRMLS_DC);
 
+/* The largest group of chunks that goes into one OP_INSERT message, which is
+ * the limit that php_mongo_serialize_size puts on messages */
+#define GRIDFS_MAX_GROUP_SIZE 16000000
+
+static int add_md5(zval *zfile, zval *zid, mongo_collection *c, gridfs_chunk_writer *writer, zval *options TSRMLS_DC);
+
 PHP_METHOD(MongoGridFS, __construct) {
   zval *zdb, *files = 0, *chunks = 0, *zchunks;
 
@@ -301,46 +313,63 @@ static zval* setup_extra(zval *zfile, zval *extra TSRMLS_DC) {
  * adds the response to zfile as the "md5" field.
  *
  */
-static void add_md5(zval *zfile, zval *zid, mongo_collection *c TSRMLS_DC) {
-  if (!zend_hash_exists(HASH_P(zfile), "md5", strlen("md5")+1)) {
-    zval *data = 0, *response = 0, **md5 = 0;
-
-    // get the prefix
-    int prefix_len = strchr(Z_STRVAL_P(c->name), '.') - Z_STRVAL_P(c->name);
-    char *prefix = estrndup(Z_STRVAL_P(c->name), prefix_len);
-
-    // create command
-    MAKE_STD_ZVAL(data);
-    array_init(data);
-
-    add_assoc_zval(data, "filemd5", zid);
-    zval_add_ref(&zid);
-    add_assoc_stringl(data, "root", prefix, prefix_len, 0);
-
-    MAKE_STD_ZVAL(response);
-    ZVAL_NULL(response);
-
-    // run command
-    MONGO_CMD(response, c->parent);
-
-    // make sure there wasn't an error
-    if (!EG(exception) &&
-        zend_hash_find(HASH_P(response), "md5", strlen("md5")+1, (void**)&md5) == SUCCESS) {
-      // add it to zfile
-      add_assoc_zval(zfile, "md5", *md5);
-      /*
-       * increment the refcount so it isn't cleaned up at
-       * the end of this method
-       */
-      zval_add_ref(md5);
-    }
+/* Adds the md5 of the data that writer stored to zfile, unless the user gave
+ * one. With the verifyMD5 option the server computes the md5 of the stored
+ * chunks as well (filemd5), and the upload fails if they differ. */
+static int add_md5(zval *zfile, zval *zid, mongo_collection *c, gridfs_chunk_writer *writer, zval *options TSRMLS_DC) {
+  zval *data = 0, *response = 0, **md5 = 0, **verify = 0;
+  char md5str[33];
+  int prefix_len, status = SUCCESS;
+  char *prefix;
+
+  if (zend_hash_exists(HASH_P(zfile), "md5", strlen("md5")+1)) {
+    return SUCCESS;
+  }
 
-    // cleanup
-    if (!EG(exception)) {
-      zval_ptr_dtor(&response);
-    }
-    zval_ptr_dtor(&data);
+  mongo_util_md5_final_hex(&writer->md5, md5str);
+
+  if (!options || zend_hash_find(HASH_P(options), "verifyMD5", strlen("verifyMD5")+1, (void**)&verify) == FAILURE || !zend_is_true(*verify)) {
+    add_assoc_stringl(zfile, "md5", md5str, 32, DUP);
+    return SUCCESS;
+  }
+
+  // get the prefix
+  prefix_len = strchr(Z_STRVAL_P(c->name), '.') - Z_STRVAL_P(c->name);
+  prefix = estrndup(Z_STRVAL_P(c->name), prefix_len);
+
+  // create command
+  MAKE_STD_ZVAL(data);
+  array_init(data);
+
+  add_assoc_zval(data, "filemd5", zid);
+  zval_add_ref(&zid);
+  add_assoc_stringl(data, "root", prefix, prefix_len, 0);
+
+  MAKE_STD_ZVAL(response);
+  ZVAL_NULL(response);
+
+  // run command
+  MONGO_CMD(response, c->parent);
+
+  if (EG(exception)) {
+    status = FAILURE;
+  } else if (
+    zend_hash_find(HASH_P(response), "md5", strlen("md5")+1, (void**)&md5) == FAILURE ||
+    Z_TYPE_PP(md5) != IS_STRING || strcmp(Z_STRVAL_PP(md5), md5str) != 0
+  ) {
+    zend_throw_exception_ex(mongo_ce_GridFSException, 0 TSRMLS_CC, "the md5 of the stored chunks does not match %s", md5str);
+    status = FAILURE;
+  } else {
+    add_assoc_stringl(zfile, "md5", md5str, 32, DUP);
   }
+
+  // cleanup
+  if (!EG(exception)) {
+    zval_ptr_dtor(&response);
+  }
+  zval_ptr_dtor(&data);
+
+  return status;
 }
 
 static void gridfs_rewrite_cursor_exception(TSRMLS_D)
@@ -369,18 +398,18 @@ static void gridfs_rewrite_cursor_exception(TSRMLS_D)
 	smart_str_free(&tmp_message);
 }
 
-static void cleanup_stale_chunks(INTERNAL_FUNCTION_PARAMETERS, zval *cleanup_ids)
+void gridfs_cleanup_stale_chunks(zval *gridfs, zval *cleanup_ids TSRMLS_DC)
 {
 	zval *chunks, *temp_return, *query;
 	zval **cid;
 	HashPosition pos;
-	zval *tmp_exception;
+	zval *tmp_exception = NULL;
 	if (EG(exception)) {
 		tmp_exception = EG(exception);
 		EG(exception) = NULL;
 	}
 
-	chunks = zend_read_property(mongo_ce_GridFS, getThis(), "chunks", strlen("chunks"), NOISY TSRMLS_CC);
+	chunks = zend_read_property(mongo_ce_GridFS, gridfs, "chunks", strlen("chunks"), NOISY TSRMLS_CC);
 
 	zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(cleanup_ids), &pos);
 	while(zend_hash_get_current_data_ex(Z_ARRVAL_P(cleanup_ids), (void **) &cid, &pos) == SUCCESS) {
@@ -399,7 +428,21 @@ static void cleanup_stale_chunks(INTERNAL_FUNCTION_PARAMETERS, zval *cleanup_ids
 	if (tmp_exception) {
 		EG(exception) = tmp_exception;
 	}
-	RETVAL_FALSE;
+}
+
+int gridfs_insert_file(zval *gridfs, zval *zfile, zval *zid, gridfs_chunk_writer *w, zval *options TSRMLS_DC)
+{
+	zval temp;
+	mongo_collection *c = (mongo_collection*)zend_object_store_get_object(gridfs TSRMLS_CC);
+
+	if (add_md5(zfile, zid, c, w, options TSRMLS_CC) == FAILURE) {
+		return FAILURE;
+	}
+
+	MONGO_METHOD2(MongoCollection, insert, &temp, gridfs, zfile, options);
+	zval_dtor(&temp);
+
+	return EG(exception) ? FAILURE : SUCCESS;
 }
 
 /*
@@ -421,7 +464,7 @@ PHP_METHOD(MongoGridFS, storeBytes) {
   zval *extra = 0, *zid = 0, *zfile = 0, *chunks = 0, *options = 0;
   zval **z_safe;
 	zval *cleanup_ids;
-	zval *chunk_id = NULL;
+	gridfs_chunk_writer writer;
 
   mongo_collection *c = (mongo_collection*)zend_object_store_get_object(getThis() TSRMLS_CC);
   MONGO_CHECK_INITIALIZED(c->ns, MongoGridFS);
@@ -471,18 +514,16 @@ PHP_METHOD(MongoGridFS, storeBytes) {
 		add_assoc_long(options, "safe", 1);
 	}
 
+	if (gridfs_chunk_writer_init(&writer, chunks, zid, options, cleanup_ids TSRMLS_CC) == FAILURE) {
+		revert = 1;
+		goto cleanup_on_failure;
+	}
+
   // insert chunks
   while (pos < bytes_len) {
     chunk_size = bytes_len-pos >= global_chunk_size ? global_chunk_size : bytes_len-pos;
 
-		if (!(chunk_id = insert_chunk(chunks, zid, chunk_num, bytes+pos, chunk_size, options TSRMLS_CC))) {
-			revert = 1;
-			goto cleanup_on_failure;
-		}
-		/* Keep track of that successfully inserted chunk id */
-		add_next_index_zval(cleanup_ids, chunk_id);
-
-		if (EG(exception)) {
+		if (gridfs_chunk_writer_add(&writer, chunk_num, bytes+pos, chunk_size TSRMLS_CC) == FAILURE) {
 			revert = 1;
 			goto cleanup_on_failure;
 		}
@@ -492,8 +533,16 @@ PHP_METHOD(MongoGridFS, storeBytes) {
     chunk_num++;
   }
 
-  // now that we've inserted the chunks, use them to calculate the hash
-  add_md5(zfile, zid, c TSRMLS_CC);
+	if (gridfs_chunk_writer_finish(&writer TSRMLS_CC) == FAILURE) {
+		revert = 1;
+		goto cleanup_on_failure;
+	}
+
+  // the hash of the chunks, which were hashed while they were written
+	if (add_md5(zfile, zid, c, &writer, options TSRMLS_CC) == FAILURE) {
+		revert = 1;
+		goto cleanup_on_failure;
+	}
 
   // insert file
   MONGO_METHOD2(MongoCollection, insert, &temp, getThis(), zfile, options);
@@ -503,10 +552,11 @@ PHP_METHOD(MongoGridFS, storeBytes) {
 	}
 
 cleanup_on_failure:
+	gridfs_chunk_writer_dtor(&writer TSRMLS_CC);
 	if (revert) {
 		/* Cleanup any created chunks from the chunks collection */
 		/* If the insert into the files collection fails, it fails - and nothing to cleanup there anyway */
-		cleanup_stale_chunks(INTERNAL_FUNCTION_PARAM_PASSTHRU, cleanup_ids);
+		gridfs_cleanup_stale_chunks(getThis(), cleanup_ids TSRMLS_CC);
 		gridfs_rewrite_cursor_exception(TSRMLS_C);
 		RETVAL_FALSE;
 	} else {
@@ -551,63 +601,232 @@ static int setup_file_fields(zval *zfile, char *filename, int length TSRMLS_DC)
 	return SUCCESS;
 }
 
-/* Creates a chunk and adds it to the chunks collection as:
- * array(3) {
+/* Returns the connection that the writer sends its next group on. Unless
+ * replies are still coming on the one it used last, it is looked up again:
+ * between the fwrite() calls of a stream anything may have dropped it. If
+ * replies are still coming, that connection has to be the one that is
+ * registered under its hash still, or they are lost. Returns NULL, with an
+ * exception thrown, when there's none. */
+static mongo_connection *writer_connection(gridfs_chunk_writer *w TSRMLS_DC)
+{
+	if (w->groups == 0) {
+		if (w->hash) {
+			efree(w->hash);
+			w->hash = NULL;
+		}
+		w->connection = php_mongo_collection_get_connection(w->chunks, MONGO_CON_FLAG_WRITE TSRMLS_CC);
+		if (w->connection) {
+			w->hash = estrdup(w->connection->hash);
+		}
+	} else if (mongo_manager_connection_find_by_hash(MonGlo(manager), w->hash) != w->connection) {
+		w->connection = NULL;
+		w->groups = 0;
+		if (!EG(exception)) {
+			zend_throw_exception_ex(mongo_ce_GridFSException, 16 TSRMLS_CC, "the connection to %s went away before the chunks were acknowledged", w->hash);
+		}
+	}
+	return w->connection;
+}
+
+int gridfs_chunk_writer_init(gridfs_chunk_writer *w, zval *chunks, zval *zid, zval *options, zval *cleanup_ids TSRMLS_DC)
+{
+	memset(w, 0, sizeof(gridfs_chunk_writer));
+
+	w->chunks = chunks;
+	if (!writer_connection(w TSRMLS_CC)) {
+		return FAILURE;
+	}
+
+	w->zid = zid;
+	w->cleanup_ids = cleanup_ids;
+	w->gle_cmd = php_mongo_getlasterror_cmd(chunks, options, &w->timeout TSRMLS_CC);
+	w->max_size = MonGlo(max_send_size) > 0 && MonGlo(max_send_size) < GRIDFS_MAX_GROUP_SIZE ? MonGlo(max_send_size) : GRIDFS_MAX_GROUP_SIZE;
+	CREATE_BUF(w->buf, INITIAL_BUF_SIZE);
+	MD5_Init(&w->md5);
+
+	return SUCCESS;
+}
+
+/* Sends the message of the current group, followed by its getlasterror */
+static int gridfs_chunk_writer_flush(gridfs_chunk_writer *w TSRMLS_DC)
+{
+	int request_id;
+	char *error_message = NULL;
+
+	if (!w->in_message) {
+		return SUCCESS;
+	}
+
+	if (php_mongo_serialize_size(w->buf.start, &w->buf TSRMLS_CC) == FAILURE) {
+		return FAILURE;
+	}
+	if ((request_id = php_mongo_append_getlasterror_query(w->chunks, &w->buf, w->gle_cmd TSRMLS_CC)) == 0) {
+		return FAILURE;
+	}
+	if (!writer_connection(w TSRMLS_CC)) {
+		return FAILURE;
+	}
+
+	if (mongo_io_flush(w->connection, w->buf.start, w->buf.pos - w->buf.start, &error_message) == -1) {
+		mongo_cursor_throw(w->connection, 16 TSRMLS_CC, error_message);
+		free(error_message);
+		mongo_manager_connection_deregister(MonGlo(manager), w->connection);
+		w->connection = NULL;
+		w->groups = 0;
+		return FAILURE;
+	}
+
+	if (w->groups == w->groups_size) {
+		w->groups_size = w->groups_size ? w->groups_size * 2 : 8;
+		w->request_ids = (int*)erealloc(w->request_ids, w->groups_size * sizeof(int));
+	}
+	w->request_ids[w->groups++] = request_id;
+
+	w->buf.pos = w->buf.start;
+	w->in_message = 0;
+	return SUCCESS;
+}
+
+/* Adds a chunk as:
+ * {
+ *   _id => new MongoId
  *   files_id => zid
  *   n => chunk_num
- *   data => MongoBinData(buf, chunk_size, type 2)
+ *   data => MongoBinData(data, len, type 2)
  * }
- *
- * Clean up should leave:
- * - 1 ref to zid
- * - buf
- */
-static zval* insert_chunk(zval *chunks, zval *zid, int chunk_num, char *buf, int chunk_size, zval *options  TSRMLS_DC) {
-	zval temp;
-  zval *zchunk, *zbin, *zretval = NULL;
-  zval **_id;
+ * and sends the group first if the chunk would take it over max_size. */
+int gridfs_chunk_writer_add(gridfs_chunk_writer *w, int chunk_num, char *data, int len TSRMLS_DC)
+{
+	mongo_msg_header header;
+	buffer *buf = &w->buf;
+	mongo_collection *c;
+	mongo_id *id;
+	zval *zchunk_id;
+	int doc_start;
+
+	if (w->in_message && (buf->pos - buf->start) + len + INITIAL_BUF_SIZE > w->max_size) {
+		if (gridfs_chunk_writer_flush(w TSRMLS_CC) == FAILURE) {
+			return FAILURE;
+		}
+	}
 
-  // create chunk
-  MAKE_STD_ZVAL(zchunk);
-  array_init(zchunk);
+	if (!w->in_message) {
+		c = (mongo_collection*)zend_object_store_get_object(w->chunks TSRMLS_CC);
+		CREATE_HEADER(buf, Z_STRVAL_P(c->ns), OP_INSERT);
+	}
 
-  add_assoc_zval(zchunk, "files_id", zid);
-  zval_add_ref(&zid); // zid->refcount = 2
-  add_assoc_long(zchunk, "n", chunk_num);
+	/* Keep track of the chunk's id, to clean up after a failure */
+	MAKE_STD_ZVAL(zchunk_id);
+	object_init_ex(zchunk_id, mongo_ce_Id);
+	id = (mongo_id*)zend_object_store_get_object(zchunk_id TSRMLS_CC);
+	id->id = emalloc(OID_SIZE + 1);
+	generate_id(id->id TSRMLS_CC);
+	add_next_index_zval(w->cleanup_ids, zchunk_id);
 
-  // create MongoBinData object
-  MAKE_STD_ZVAL(zbin);
-  object_init_ex(zbin, mongo_ce_BinData);
-  zend_update_property_stringl(mongo_ce_BinData, zbin, "bin", strlen("bin"), buf, chunk_size TSRMLS_CC);
-  zend_update_property_long(mongo_ce_BinData, zbin, "type", strlen("type"), 2 TSRMLS_CC);
+	doc_start = buf->pos - buf->start;
+	php_mongo_serialize_int(buf, 0);
 
-  add_assoc_zval(zchunk, "data", zbin);
+	php_mongo_set_type(buf, BSON_OID);
+	php_mongo_serialize_key(buf, "_id", strlen("_id"), 0 TSRMLS_CC);
+	php_mongo_serialize_bytes(buf, id->id, OID_SIZE);
 
-  // insert chunk
-  if (options) {
-    MONGO_METHOD2(MongoCollection, insert, &temp, chunks, zchunk, options);
-  }
-  else {
-    MONGO_METHOD1(MongoCollection, insert, &temp, chunks, zchunk);
-  }
-	if (zend_hash_find(Z_ARRVAL_P(zchunk), "_id", strlen("_id")+1, (void**)&_id) == SUCCESS) {
-		MAKE_STD_ZVAL(zretval);
-		ZVAL_ZVAL(zretval, *_id, 1, 0);
+	php_mongo_serialize_element("files_id", &w->zid, buf, 0 TSRMLS_CC);
+	if (EG(exception)) {
+		return FAILURE;
 	}
-  zval_dtor(&temp);
 
-  // increment counters
-  zval_ptr_dtor(&zchunk); // zid->refcount = 1
+	php_mongo_set_type(buf, BSON_INT);
+	php_mongo_serialize_key(buf, "n", strlen("n"), 0 TSRMLS_CC);
+	php_mongo_serialize_int(buf, chunk_num);
+
+	/* type 2 binary data repeats the length, see php_mongo_serialize_bin_data */
+	php_mongo_set_type(buf, BSON_BINARY);
+	php_mongo_serialize_key(buf, "data", strlen("data"), 0 TSRMLS_CC);
+	php_mongo_serialize_int(buf, len + INT_32);
+	php_mongo_serialize_byte(buf, 2);
+	php_mongo_serialize_int(buf, len);
+	php_mongo_serialize_bytes(buf, data, len);
+	MD5_Update(&w->md5, data, len);
+
+	php_mongo_serialize_null(buf);
+	if (php_mongo_serialize_size(buf->start + doc_start, buf TSRMLS_CC) == FAILURE) {
+		return FAILURE;
+	}
 
-  if (!zretval) {
-	  return NULL;
-  }
-  if (EG(exception)) {
-	  zval_ptr_dtor(&zretval);
-    return NULL;
-  }
+	w->in_message++;
+	return SUCCESS;
+}
+
+/* Reads the getlasterror replies that are still coming. With check, the
+ * first error that they report is thrown. */
+static int gridfs_chunk_writer_read_replies(gridfs_chunk_writer *w, int check TSRMLS_DC)
+{
+	zval *replies, **reply, **err, **code;
+	HashPosition pos;
+	int status, groups = w->groups;
 
-  return zretval;
+	if (w->groups == 0) {
+		return SUCCESS;
+	}
+	if (!writer_connection(w TSRMLS_CC)) {
+		return check ? FAILURE : SUCCESS;
+	}
+	w->groups = 0;
+
+	MAKE_STD_ZVAL(replies);
+	array_init(replies);
+	status = php_mongo_read_getlasterror_replies(w->connection, w->request_ids, groups, w->timeout, replies TSRMLS_CC);
+
+	for (
+		zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(replies), &pos);
+		check && status == SUCCESS && zend_hash_get_current_data_ex(Z_ARRVAL_P(replies), (void**)&reply, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(Z_ARRVAL_P(replies), &pos)
+	) {
+		if (php_mongo_cursor_throw_error(w->connection, *reply TSRMLS_CC)) {
+			status = FAILURE;
+		}
+		// w timeout
+		else if (zend_hash_find(Z_ARRVAL_PP(reply), "errmsg", strlen("errmsg") + 1, (void**)&err) == SUCCESS && Z_TYPE_PP(err) == IS_STRING) {
+			int found = zend_hash_find(Z_ARRVAL_PP(reply), "n", strlen("n") + 1, (void**)&code) == SUCCESS && Z_TYPE_PP(code) == IS_LONG;
+
+			mongo_cursor_throw(w->connection, found ? Z_LVAL_PP(code) : 0 TSRMLS_CC, Z_STRVAL_PP(err));
+			status = FAILURE;
+		}
+	}
+
+	zval_ptr_dtor(&replies);
+	return status;
+}
+
+/* Sends the last group and checks the replies for all of them */
+int gridfs_chunk_writer_finish(gridfs_chunk_writer *w TSRMLS_DC)
+{
+	if (gridfs_chunk_writer_flush(w TSRMLS_CC) == FAILURE) {
+		return FAILURE;
+	}
+	return gridfs_chunk_writer_read_replies(w, 1 TSRMLS_CC);
+}
+
+/* Frees the writer. Replies that haven't been read yet (after a failure while
+ * the chunks were written) are read and dropped, so that none are left on the
+ * connection. */
+void gridfs_chunk_writer_dtor(gridfs_chunk_writer *w TSRMLS_DC)
+{
+	gridfs_chunk_writer_read_replies(w, 0 TSRMLS_CC);
+
+	if (w->buf.start) {
+		efree(w->buf.start);
+	}
+	if (w->request_ids) {
+		efree(w->request_ids);
+	}
+	if (w->gle_cmd) {
+		zval_ptr_dtor(&w->gle_cmd);
+	}
+	if (w->hash) {
+		efree(w->hash);
+	}
+	memset(w, 0, sizeof(gridfs_chunk_writer));
 }
 
 
@@ -623,6 +842,7 @@ PHP_METHOD(MongoGridFS, storeFile) {
   zval *zid = 0, *zfile = 0, *chunks = 0;
   zval **z_safe;
   zval *cleanup_ids;
+  gridfs_chunk_writer writer;
 
   mongo_collection *c = (mongo_collection*)zend_object_store_get_object(getThis() TSRMLS_CC);
   MONGO_CHECK_INITIALIZED(c->ns, MongoGridFS);
@@ -715,11 +935,15 @@ PHP_METHOD(MongoGridFS, storeFile) {
 	MAKE_STD_ZVAL(cleanup_ids);
 	array_init(cleanup_ids);
 
+	if (gridfs_chunk_writer_init(&writer, chunks, zid, options, cleanup_ids TSRMLS_CC) == FAILURE) {
+		revert = 1;
+		goto cleanup_on_failure;
+	}
+
   // insert chunks
   while (pos < size || fp == 0) {
     int result = 0;
     char *buf;
-	zval *chunk_id = NULL;
 
     int chunk_size = size-pos >= global_chunk_size || fp == 0 ? global_chunk_size : size-pos;
     buf = (char*)emalloc(chunk_size);
@@ -732,12 +956,11 @@ PHP_METHOD(MongoGridFS, storeFile) {
 				goto cleanup_on_failure;
       }
       pos += chunk_size;
-      if (!(chunk_id = insert_chunk(chunks, zid, chunk_num, buf, chunk_size, options TSRMLS_CC))) {
+      if (gridfs_chunk_writer_add(&writer, chunk_num, buf, chunk_size TSRMLS_CC) == FAILURE) {
 				revert = 1;
 				efree(buf);
 				goto cleanup_on_failure;
       }
-		add_next_index_zval(cleanup_ids, chunk_id);
     }
     else {
       result = read(fd, buf, chunk_size);
@@ -748,12 +971,11 @@ PHP_METHOD(MongoGridFS, storeFile) {
 				goto cleanup_on_failure;
       }
       pos += result;
-      if (!(chunk_id = insert_chunk(chunks, zid, chunk_num, buf, result, options TSRMLS_CC))) {
+      if (result > 0 && gridfs_chunk_writer_add(&writer, chunk_num, buf, result TSRMLS_CC) == FAILURE) {
 				revert = 1;
 				efree(buf);
 				goto cleanup_on_failure;
       }
-	  add_next_index_zval(cleanup_ids, chunk_id);
     }
 
     efree(buf);
@@ -779,11 +1001,19 @@ PHP_METHOD(MongoGridFS, storeFile) {
 		goto cleanup_on_failure;
   }
 
+	if (gridfs_chunk_writer_finish(&writer TSRMLS_CC) == FAILURE) {
+		revert = 1;
+		goto cleanup_on_failure;
+	}
+
   if (!fp) {
     add_assoc_long(zfile, "length", pos);
   }
 
-  add_md5(zfile, zid, c TSRMLS_CC);
+	if (add_md5(zfile, zid, c, &writer, options TSRMLS_CC) == FAILURE) {
+		revert = 1;
+		goto cleanup_on_failure;
+	}
 
 	// insert file
 	if (!revert) {
@@ -805,11 +1035,13 @@ PHP_METHOD(MongoGridFS, storeFile) {
 	}
 
 cleanup_on_failure:
+	gridfs_chunk_writer_dtor(&writer TSRMLS_CC);
+
 	// remove all inserted chunks and main file document
 	if (revert) {
 		/* Cleanup any created chunks from the chunks collection */
 		/* If the insert into the files collection fails, it fails - and nothing to cleanup there anyway */
-		cleanup_stale_chunks(INTERNAL_FUNCTION_PARAM_PASSTHRU, cleanup_ids);
+		gridfs_cleanup_stale_chunks(getThis(), cleanup_ids TSRMLS_CC);
 		gridfs_rewrite_cursor_exception(TSRMLS_C);
 		RETVAL_FALSE;
 	}
@@ -823,6 +1055,65 @@ cleanup_on_failure:
 	}
 }
 
+/* Returns a stream that a file can be written to, one chunk at a time. The
+ * chunks are sent as they fill and the files document (with the length and md5
+ * of what was written) is only inserted when the stream is closed. */
+PHP_METHOD(MongoGridFS, openWriteStream) {
+	zval temp;
+	zval *extra = 0, *options = 0, *zfile, *chunks;
+	zval **z_safe;
+	php_stream *stream;
+	int chunk_size;
+
+	mongo_collection *c = (mongo_collection*)zend_object_store_get_object(getThis() TSRMLS_CC);
+	MONGO_CHECK_INITIALIZED(c->ns, MongoGridFS);
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|aa/", &extra, &options) == FAILURE) {
+		return;
+	}
+
+	chunks = zend_read_property(mongo_ce_GridFS, getThis(), "chunks", strlen("chunks"), NOISY TSRMLS_CC);
+	ensure_gridfs_index(&temp, chunks TSRMLS_CC);
+
+	// the length is only known when the stream is closed
+	MAKE_STD_ZVAL(zfile);
+	setup_extra(zfile, extra TSRMLS_CC);
+	setup_file_fields(zfile, NULL, 0 TSRMLS_CC);
+	chunk_size = get_chunk_size(zfile TSRMLS_CC);
+
+	// options
+	if (!options) {
+		MAKE_STD_ZVAL(options);
+		array_init(options);
+	} else {
+		zval_add_ref(&options);
+	}
+
+	// force safe mode
+	if (zend_hash_find(Z_ARRVAL_P(options), "safe", strlen("safe")+1, (void**)&z_safe) == SUCCESS) {
+		convert_to_long_ex(z_safe);
+		if (Z_LVAL_PP(z_safe) < 1) {
+			add_assoc_long(options, "safe", 1);
+		}
+	} else {
+		add_assoc_long(options, "safe", 1);
+	}
+
+	stream = gridfs_stream_init_write(getThis(), zfile, chunk_size, options TSRMLS_CC);
+
+	zval_ptr_dtor(&zfile);
+	zval_ptr_dtor(&options);
+
+	if (!stream) {
+		if (!EG(exception)) {
+			zend_throw_exception(mongo_ce_GridFSException, "couldn't create a php_stream", 0 TSRMLS_CC);
+		}
+		return;
+	}
+
+	php_stream_to_zval(stream, return_value);
+}
+
 PHP_METHOD(MongoGridFS, findOne) {
   zval *zquery = 0, *zfields = 0, *file;
   if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|zz", &zquery, &zfields) == FAILURE) {
@@ -1123,6 +1414,7 @@ static zend_function_entry MongoGridFS_methods[] = {
   PHP_ME(MongoGridFS, find, arginfo_find, ZEND_ACC_PUBLIC)
   PHP_ME(MongoGridFS, storeFile, NULL, ZEND_ACC_PUBLIC)
   PHP_ME(MongoGridFS, storeBytes, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MongoGridFS, openWriteStream, NULL, ZEND_ACC_PUBLIC)
   PHP_ME(MongoGridFS, findOne, arginfo_find_one, ZEND_ACC_PUBLIC)
   PHP_ME(MongoGridFS, remove, arginfo_remove, ZEND_ACC_PUBLIC)
   PHP_ME(MongoGridFS, storeUpload, NULL, ZEND_ACC_PUBLIC)
@@ -1179,12 +1471,13 @@ PHP_METHOD(MongoGridFSFile, getSize) {
 
 PHP_METHOD(MongoGridFSFile, write) {
   char *filename = 0;
-  int filename_len, total = 0;
+  int filename_len, total = 0, first = 0, skip = 0, max = -1;
+  long offset = 0, length = -1;
   zval *gridfs, *file, *chunks, *query, *cursor, *sort;
   zval **id;
   FILE *fp;
 
-  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|s", &filename, &filename_len) == FAILURE) {
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|s!ll", &filename, &filename_len, &offset, &length) == FAILURE) {
     return;
   }
 
@@ -1205,19 +1498,36 @@ PHP_METHOD(MongoGridFSFile, write) {
 		}
 	}
 
+  zend_hash_find(HASH_P(file), "_id", strlen("_id")+1, (void**)&id);
+
+  MAKE_STD_ZVAL(query);
+  array_init(query);
+  zval_add_ref(id);
+  add_assoc_zval(query, "files_id", *id);
+
+	// only the chunks that hold the range
+	if (ZEND_NUM_ARGS() > 1 && (max = setup_range(file, query, offset, length, &first, &skip TSRMLS_CC)) == -1) {
+		zval_ptr_dtor(&query);
+		return;
+	}
 
   fp = fopen(filename, "wb");
   if (!fp) {
     zend_throw_exception_ex(mongo_ce_GridFSException, 0 TSRMLS_CC, "could not open destination file %s", filename);
+    zval_ptr_dtor(&query);
     return;
   }
 
-  zend_hash_find(HASH_P(file), "_id", strlen("_id")+1, (void**)&id);
+	if (max == -1) {
+		get_file_int(file, "length", &max TSRMLS_CC);
+	}
 
-  MAKE_STD_ZVAL(query);
-  array_init(query);
-  zval_add_ref(id);
-  add_assoc_zval(query, "files_id", *id);
+	// there is nothing to read, or all chunks of the range are cached
+	if (max == 0 || (max > 0 && (total = apply_to_cache(chunks, file, first, skip, max, copy_file, fp TSRMLS_CC)) != FAILURE)) {
+		fclose(fp);
+		zval_ptr_dtor(&query);
+		RETURN_LONG(max > 0 ? total : 0);
+	}
 
   MAKE_STD_ZVAL(cursor);
   MONGO_METHOD1(MongoCollection, find, cursor, chunks, query);
@@ -1228,7 +1538,7 @@ PHP_METHOD(MongoGridFSFile, write) {
 
   MONGO_METHOD1(MongoCursor, sort, cursor, cursor, sort);
 
-  if ((total = apply_to_cursor(cursor, copy_file, fp TSRMLS_CC)) == FAILURE) {
+  if ((total = apply_to_cursor(cursor, copy_file, fp, skip, max, chunks, file TSRMLS_CC)) == FAILURE) {
     zend_throw_exception(mongo_ce_GridFSException, "error reading chunk of file", 0 TSRMLS_CC);
   }
 
@@ -1255,16 +1565,21 @@ PHP_METHOD(MongoGridFSFile, getResource) {
 
 PHP_METHOD(MongoGridFSFile, getBytes) {
   zval *file, *gridfs, *chunks, *query, *cursor, *sort, *temp;
-  zval **id, **size;
+  zval **id;
   char *str, *str_ptr;
-  int len;
+  int len, first = 0, skip = 0, max = -1;
+  long offset = 0, length = -1;
   mongo_cursor *cursorobj;
   zval *flags;
 
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|ll", &offset, &length) == FAILURE) {
+    return;
+  }
+
   file = zend_read_property(mongo_ce_GridFSFile, getThis(), "file", strlen("file"), NOISY TSRMLS_CC);
   zend_hash_find(HASH_P(file), "_id", strlen("_id")+1, (void**)&id);
 
-  if (zend_hash_find(HASH_P(file), "length", strlen("length")+1, (void**)&size) == FAILURE) {
+  if (get_file_int(file, "length", &len TSRMLS_CC) == FAILURE) {
     zend_throw_exception(mongo_ce_GridFSException, "couldn't find file size", 0 TSRMLS_CC);
     return;
   }
@@ -1282,6 +1597,32 @@ PHP_METHOD(MongoGridFSFile, getBytes) {
   zval_add_ref(id);
   add_assoc_zval(query, "files_id", *id);
 
+	// only the chunks that hold the range
+	if (ZEND_NUM_ARGS() > 0) {
+		if ((max = setup_range(file, query, offset, length, &first, &skip TSRMLS_CC)) <= 0) {
+			zval_ptr_dtor(&temp);
+			zval_ptr_dtor(&query);
+			if (max == 0) {
+				RETURN_EMPTY_STRING();
+			}
+			return;
+		}
+		len = max;
+	} else {
+		max = len;
+	}
+
+	// all chunks of the range are cached
+	str = (char*)emalloc(len + 1);
+	str_ptr = str;
+	if (apply_to_cache(chunks, file, first, skip, max, copy_bytes, &str TSRMLS_CC) != FAILURE) {
+		zval_ptr_dtor(&temp);
+		zval_ptr_dtor(&query);
+
+		str_ptr[len] = '\0';
+		RETURN_STRINGL(str_ptr, len, 0);
+	}
+
   MAKE_STD_ZVAL(cursor);
   MONGO_METHOD1(MongoCollection, find, cursor, chunks, query);
 
@@ -1302,19 +1643,7 @@ PHP_METHOD(MongoGridFSFile, getBytes) {
   zval_ptr_dtor(&query);
   zval_ptr_dtor(&sort);
 
-	if (Z_TYPE_PP(size) == IS_DOUBLE) {
-		len = (int)Z_DVAL_PP(size);
-	} else if (Z_TYPE_PP(size) == IS_LONG) {
-		len = Z_LVAL_PP(size);
-	} else if (Z_TYPE_PP(size) == IS_OBJECT && (Z_OBJCE_PP(size) == mongo_ce_Int32 || Z_OBJCE_PP(size) == mongo_ce_Int64)) {
-		zval *sizet = zend_read_property(mongo_ce_Int64, *size, "value", strlen("value"), NOISY TSRMLS_CC);
-		len = atoi(Z_STRVAL_P(sizet));
-	}
-
-  str = (char*)emalloc(len + 1);
-  str_ptr = str;
-
-  if (apply_to_cursor(cursor, copy_bytes, &str TSRMLS_CC) == FAILURE) {
+  if (apply_to_cursor(cursor, copy_bytes, &str, skip, max, chunks, file TSRMLS_CC) == FAILURE) {
       if (EG(exception)) {
           return;
       }
@@ -1348,7 +1677,113 @@ static int copy_file(void *to, char *from, int len) {
   return written;
 }
 
-static int apply_to_cursor(zval *cursor, apply_copy_func_t apply_copy_func, void *to TSRMLS_DC) {
+/* Reads an int field of a files document, which can be stored as any of the
+ * numeric types */
+static int get_file_int(zval *file, char *name, int *value TSRMLS_DC)
+{
+	zval **field;
+
+	if (zend_hash_find(HASH_P(file), name, strlen(name) + 1, (void**)&field) == FAILURE) {
+		return FAILURE;
+	}
+
+	if (Z_TYPE_PP(field) == IS_DOUBLE) {
+		*value = (int)Z_DVAL_PP(field);
+	} else if (Z_TYPE_PP(field) == IS_LONG) {
+		*value = Z_LVAL_PP(field);
+	} else if (Z_TYPE_PP(field) == IS_OBJECT && (Z_OBJCE_PP(field) == mongo_ce_Int32 || Z_OBJCE_PP(field) == mongo_ce_Int64)) {
+		*value = (int)((mongo_int*)php_mongo_native_get(*field TSRMLS_CC))->value;
+	} else {
+		return FAILURE;
+	}
+	return SUCCESS;
+}
+
+/* Limits a read to length bytes from offset, or up to the end of the file if
+ * length is negative. The query for the chunks is narrowed down to the ones
+ * from first = floor(offset / chunkSize) to floor((offset + length - 1) /
+ * chunkSize), and skip is set to where the range starts in the first one.
+ * Returns the length of the range, or -1 (with an exception thrown) if it
+ * can't be read. */
+static int setup_range(zval *file, zval *query, long offset, long length, int *first, int *skip TSRMLS_DC)
+{
+	int size, chunk_size;
+	zval *n;
+
+	if (get_file_int(file, "length", &size TSRMLS_CC) == FAILURE || get_file_int(file, "chunkSize", &chunk_size TSRMLS_CC) == FAILURE || chunk_size <= 0) {
+		zend_throw_exception(mongo_ce_GridFSException, "couldn't find file size or chunk size", 0 TSRMLS_CC);
+		return -1;
+	}
+	if (offset < 0) {
+		zend_throw_exception(mongo_ce_GridFSException, "the offset can not be negative", 0 TSRMLS_CC);
+		return -1;
+	}
+
+	if (offset > size) {
+		offset = size;
+	}
+	if (length < 0 || length > size - offset) {
+		length = size - offset;
+	}
+	if (length == 0) {
+		return 0;
+	}
+
+	*first = offset / chunk_size;
+	*skip = offset - (long)*first * chunk_size;
+
+	MAKE_STD_ZVAL(n);
+	array_init(n);
+	add_assoc_long(n, "$gte", *first);
+	add_assoc_long(n, "$lte", (offset + length - 1) / chunk_size);
+	add_assoc_zval(query, "n", n);
+
+	return length;
+}
+
+/* Copies the range from the chunk cache, starting skip bytes into chunk first,
+ * if all the chunks it needs are cached. Returns the number of bytes copied,
+ * or FAILURE (without copying anything) if they have to be read from the
+ * database. */
+static int apply_to_cache(zval *chunks, zval *file, int first, int skip, int max, apply_copy_func_t apply_copy_func, void *to TSRMLS_DC)
+{
+	char *data;
+	int n, len, needed, total = 0;
+
+	if (MonGlo(gridfs_cache_size) <= 0) {
+		return FAILURE;
+	}
+
+	// check for all chunks first, as nothing can be copied if one is missing
+	for (n = first, needed = skip + max; needed > 0; n++) {
+		if ((data = php_mongo_gridfs_cache_find(chunks, file, n, &len TSRMLS_CC)) == NULL || len == 0) {
+			return FAILURE;
+		}
+		needed -= len;
+	}
+
+	for (n = first; total < max; n++) {
+		data = php_mongo_gridfs_cache_find(chunks, file, n, &len TSRMLS_CC);
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		data += skip;
+		len -= skip;
+		skip = 0;
+		if (len > max - total) {
+			len = max - total;
+		}
+		total += apply_copy_func(to, data, len);
+	}
+
+	return total;
+}
+
+/* Copies the data of all chunks that cursor returns, leaving out the first
+ * skip bytes and anything after max bytes (if max isn't -1). With file, the
+ * chunks are put into the chunk cache (for the chunks collection) as well. */
+static int apply_to_cursor(zval *cursor, apply_copy_func_t apply_copy_func, void *to, int skip, int max, zval *chunks, zval *file TSRMLS_DC) {
   int total = 0;
   zval *next;
 
@@ -1359,7 +1794,9 @@ static int apply_to_cursor(zval *cursor, apply_copy_func_t apply_copy_func, void
       return FAILURE;
   }
   while (Z_TYPE_P(next) == IS_ARRAY) {
-    zval **zdata;
+    zval **zdata, **zn;
+    char *data;
+    int len;
 
     // check if data field exists.  if it doesn't, we've probably
     // got an error message from the db, so return that
@@ -1377,19 +1814,45 @@ static int apply_to_cursor(zval *cursor, apply_copy_func_t apply_copy_func, void
      */
     // raw bytes
     if (Z_TYPE_PP(zdata) == IS_STRING) {
-      total += apply_copy_func(to, Z_STRVAL_PP(zdata), Z_STRLEN_PP(zdata));
+      data = Z_STRVAL_PP(zdata);
+      len = Z_STRLEN_PP(zdata);
     }
     // MongoBinData
     else if (Z_TYPE_PP(zdata) == IS_OBJECT &&
              Z_OBJCE_PP(zdata) == mongo_ce_BinData) {
-      zval *bin = zend_read_property(mongo_ce_BinData, *zdata, "bin", strlen("bin"), NOISY TSRMLS_CC);
-      total += apply_copy_func(to, Z_STRVAL_P(bin), Z_STRLEN_P(bin));
+      mongo_bin_data *bin = (mongo_bin_data*)php_mongo_native_get(*zdata TSRMLS_CC);
+      data = bin->bin;
+      len = bin->bin_len;
     }
     // if it's not a string or a MongoBinData, give up
     else {
       return FAILURE;
     }
 
+		if (file && zend_hash_find(HASH_P(next), "n", strlen("n") + 1, (void**)&zn) == SUCCESS) {
+			convert_to_long(*zn);
+			php_mongo_gridfs_cache_store(chunks, file, Z_LVAL_PP(zn), data, len TSRMLS_CC);
+		}
+
+		// trim the chunk to the range
+		if (skip >= len) {
+			skip -= len;
+			len = 0;
+		} else {
+			data += skip;
+			len -= skip;
+			skip = 0;
+		}
+		if (max != -1 && len > max - total) {
+			len = max - total;
+		}
+		if (len > 0) {
+			total += apply_copy_func(to, data, len);
+		}
+		if (max != -1 && total >= max) {
+			break;
+		}
+
     // get ready for the next iteration
     zval_ptr_dtor(&next);
     MAKE_STD_ZVAL(next);
@@ -17,6 +17,49 @@
 #ifndef MONGO_GRIDFS_H
 #define MONGO_GRIDFS_H
 
+#include "mcon/utils.h"
+
+/* Writes the chunks of a file as OP_INSERT messages that are encoded straight
+ * from the data, without an array and a MongoBinData for every chunk. The
+ * chunks go into one message for as long as it stays below 16MB and
+ * mongo.max_send_size, then the message is sent followed by a single
+ * getlasterror. The next group is sent without waiting for that reply, they
+ * are all read by gridfs_chunk_writer_finish. */
+typedef struct {
+	zval *chunks;        /* the chunks collection */
+	zval *zid;           /* files_id of the chunks */
+	zval *cleanup_ids;   /* list that the _id of every chunk is added to */
+	zval *gle_cmd;
+	int timeout;
+	mongo_connection *connection; /* only valid while hash is registered as it, see writer_connection */
+	char *hash;
+
+	buffer buf;          /* the message of the current group */
+	int in_message;      /* how many chunks the message holds */
+	int max_size;
+
+	int *request_ids;    /* of the getlasterror replies still to be read */
+	int groups;
+	int groups_size;
+
+	MD5_CTX md5;         /* of all the data written so far */
+} gridfs_chunk_writer;
+
+int gridfs_chunk_writer_init(gridfs_chunk_writer *w, zval *chunks, zval *zid, zval *options, zval *cleanup_ids TSRMLS_DC);
+int gridfs_chunk_writer_add(gridfs_chunk_writer *w, int chunk_num, char *data, int len TSRMLS_DC);
+
+/* Sends the last group and checks the replies for all of them. Chunks can
+ * still be added afterwards, they start a new group. */
+int gridfs_chunk_writer_finish(gridfs_chunk_writer *w TSRMLS_DC);
+void gridfs_chunk_writer_dtor(gridfs_chunk_writer *w TSRMLS_DC);
+
+/* Adds the md5 of the chunks that w wrote to zfile (see the verifyMD5 option)
+ * and inserts it into the files collection of gridfs */
+int gridfs_insert_file(zval *gridfs, zval *zfile, zval *zid, gridfs_chunk_writer *w, zval *options TSRMLS_DC);
+
+/* Removes the chunks whose _id is in cleanup_ids, after a failed upload */
+void gridfs_cleanup_stale_chunks(zval *gridfs, zval *cleanup_ids TSRMLS_DC);
+
 PHP_METHOD(MongoGridFS, __construct);
 PHP_METHOD(MongoGridFS, drop);
 PHP_METHOD(MongoGridFS, find);
@@ -28,6 +71,7 @@ PHP_METHOD(MongoGridFS, storeBytes);
 PHP_METHOD(MongoGridFS, get);
 PHP_METHOD(MongoGridFS, put);
 PHP_METHOD(MongoGridFS, delete);
+PHP_METHOD(MongoGridFS, openWriteStream);
 
 PHP_METHOD(MongoGridFSFile, __construct);
 PHP_METHOD(MongoGridFSFile, getFilename);
@@ -0,0 +1,204 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <php.h>
+
+#include "php_mongo.h"
+#include "bson.h"
+#include "gridfs_cache.h"
+
+ZEND_EXTERN_MODULE_GLOBALS(mongo);
+
+gridfs_cache *php_mongo_gridfs_cache_init(void)
+{
+	gridfs_cache *cache = pemalloc(sizeof(gridfs_cache), 1);
+
+	memset(cache, 0, sizeof(gridfs_cache));
+	zend_hash_init(&cache->entries, 64, NULL, NULL, 1);
+
+	return cache;
+}
+
+static void gridfs_cache_entry_dtor(gridfs_cache_entry *entry)
+{
+	pefree(entry->key, 1);
+	pefree(entry->version, 1);
+	pefree(entry->data, 1);
+	pefree(entry, 1);
+}
+
+void php_mongo_gridfs_cache_dtor(gridfs_cache *cache)
+{
+	gridfs_cache_entry *entry, *next;
+
+	for (entry = cache->first; entry; entry = next) {
+		next = entry->next;
+		gridfs_cache_entry_dtor(entry);
+	}
+	zend_hash_destroy(&cache->entries);
+	pefree(cache, 1);
+}
+
+static void gridfs_cache_unlink(gridfs_cache *cache, gridfs_cache_entry *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->first = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->last = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void gridfs_cache_link_first(gridfs_cache *cache, gridfs_cache_entry *entry)
+{
+	entry->next = cache->first;
+	if (cache->first) {
+		cache->first->prev = entry;
+	} else {
+		cache->last = entry;
+	}
+	cache->first = entry;
+}
+
+static void gridfs_cache_remove(gridfs_cache *cache, gridfs_cache_entry *entry)
+{
+	gridfs_cache_unlink(cache, entry);
+	zend_hash_del(&cache->entries, entry->key, entry->key_len);
+	cache->size -= sizeof(gridfs_cache_entry) + entry->key_len + entry->version_len + entry->data_len;
+	gridfs_cache_entry_dtor(entry);
+}
+
+/* The key of a chunk is the namespace of the chunks collection, followed by
+ * the BSON of the files_id, the chunkSize and n, so that buckets (and
+ * databases) with the same files_id don't share chunks. Its version is the
+ * BSON of the md5 or uploadDate of the file. Files without either can't be
+ * checked for changes, so they aren't cached. */
+static int gridfs_cache_key(zval *chunks, zval *file, int n, buffer *key, buffer *version TSRMLS_DC)
+{
+	mongo_collection *c;
+	zval **id, **field, **chunk_size;
+
+	if (
+		zend_hash_find(HASH_P(file), "md5", strlen("md5") + 1, (void**)&field) == FAILURE &&
+		zend_hash_find(HASH_P(file), "uploadDate", strlen("uploadDate") + 1, (void**)&field) == FAILURE
+	) {
+		return FAILURE;
+	}
+	if (zend_hash_find(HASH_P(file), "_id", strlen("_id") + 1, (void**)&id) == FAILURE) {
+		return FAILURE;
+	}
+	c = (mongo_collection*)zend_object_store_get_object(chunks TSRMLS_CC);
+	if (!c->ns) {
+		return FAILURE;
+	}
+
+	CREATE_BUF((*key), INITIAL_BUF_SIZE);
+	CREATE_BUF((*version), INITIAL_BUF_SIZE);
+
+	php_mongo_serialize_bytes(key, Z_STRVAL_P(c->ns), Z_STRLEN_P(c->ns) + 1);
+	php_mongo_serialize_element("", id, key, 0 TSRMLS_CC);
+	if (zend_hash_find(HASH_P(file), "chunkSize", strlen("chunkSize") + 1, (void**)&chunk_size) == SUCCESS) {
+		php_mongo_serialize_element("", chunk_size, key, 0 TSRMLS_CC);
+	}
+	php_mongo_serialize_int(key, n);
+	php_mongo_serialize_element("", field, version, 0 TSRMLS_CC);
+
+	if (EG(exception)) {
+		efree(key->start);
+		efree(version->start);
+		return FAILURE;
+	}
+	return SUCCESS;
+}
+
+char *php_mongo_gridfs_cache_find(zval *chunks, zval *file, int n, int *len TSRMLS_DC)
+{
+	gridfs_cache *cache = MonGlo(gridfs_cache);
+	gridfs_cache_entry **found, *entry = NULL;
+	buffer key, version;
+
+	if (MonGlo(gridfs_cache_size) <= 0 || !cache || gridfs_cache_key(chunks, file, n, &key, &version TSRMLS_CC) == FAILURE) {
+		return NULL;
+	}
+
+	if (zend_hash_find(&cache->entries, key.start, key.pos - key.start, (void**)&found) == SUCCESS) {
+		entry = *found;
+
+		/* the file was replaced since */
+		if (entry->version_len != version.pos - version.start || memcmp(entry->version, version.start, entry->version_len) != 0) {
+			gridfs_cache_remove(cache, entry);
+			entry = NULL;
+		} else {
+			gridfs_cache_unlink(cache, entry);
+			gridfs_cache_link_first(cache, entry);
+			*len = entry->data_len;
+		}
+	}
+
+	efree(key.start);
+	efree(version.start);
+	return entry ? entry->data : NULL;
+}
+
+void php_mongo_gridfs_cache_store(zval *chunks, zval *file, int n, char *data, int len TSRMLS_DC)
+{
+	gridfs_cache *cache = MonGlo(gridfs_cache);
+	gridfs_cache_entry **found, *entry;
+	buffer key, version;
+	size_t size;
+
+	if (MonGlo(gridfs_cache_size) <= 0 || !cache || gridfs_cache_key(chunks, file, n, &key, &version TSRMLS_CC) == FAILURE) {
+		return;
+	}
+
+	if (zend_hash_find(&cache->entries, key.start, key.pos - key.start, (void**)&found) == SUCCESS) {
+		gridfs_cache_remove(cache, *found);
+	}
+
+	size = sizeof(gridfs_cache_entry) + (key.pos - key.start) + (version.pos - version.start) + len;
+	if (size > (size_t)MonGlo(gridfs_cache_size)) {
+		efree(key.start);
+		efree(version.start);
+		return;
+	}
+
+	while (cache->last && cache->size + size > (size_t)MonGlo(gridfs_cache_size)) {
+		gridfs_cache_remove(cache, cache->last);
+	}
+
+	entry = pemalloc(sizeof(gridfs_cache_entry), 1);
+	memset(entry, 0, sizeof(gridfs_cache_entry));
+	entry->key_len = key.pos - key.start;
+	entry->key = pemalloc(entry->key_len, 1);
+	memcpy(entry->key, key.start, entry->key_len);
+	entry->version_len = version.pos - version.start;
+	entry->version = pemalloc(entry->version_len, 1);
+	memcpy(entry->version, version.start, entry->version_len);
+	entry->data_len = len;
+	entry->data = pemalloc(len ? len : 1, 1);
+	memcpy(entry->data, data, len);
+
+	zend_hash_update(&cache->entries, entry->key, entry->key_len, &entry, sizeof(gridfs_cache_entry*), NULL);
+	gridfs_cache_link_first(cache, entry);
+	cache->size += size;
+
+	efree(key.start);
+	efree(version.start);
+}
@@ -0,0 +1,60 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MONGO_GRIDFS_CACHE_H
+#define MONGO_GRIDFS_CACHE_H 1
+
+/* A chunk in the cache, the list runs from the most to the least recently used
+ * one */
+typedef struct _gridfs_cache_entry {
+	char *key;       /* files_id and n */
+	int   key_len;
+	char *version;   /* md5 or uploadDate of the file the chunk belongs to */
+	int   version_len;
+	char *data;
+	int   data_len;
+
+	struct _gridfs_cache_entry *prev;
+	struct _gridfs_cache_entry *next;
+} gridfs_cache_entry;
+
+/* Chunks of the GridFS files that were read, for mongo.gridfs_cache_size
+ * bytes. The cache lives as long as the process (or thread), so it is shared
+ * by all requests that it serves. */
+typedef struct _gridfs_cache {
+	HashTable           entries;
+	gridfs_cache_entry *first;
+	gridfs_cache_entry *last;
+	size_t              size;
+} gridfs_cache;
+
+gridfs_cache *php_mongo_gridfs_cache_init(void);
+void php_mongo_gridfs_cache_dtor(gridfs_cache *cache);
+
+/**
+ * Returns the data of chunk n of file (a files document) in the chunks
+ * collection, or NULL if it isn't cached or was cached for an older version of the file: a chunk only matches
+ * while the md5 (or the uploadDate, if there is no md5) is the same. The data
+ * belongs to the cache, it is only valid until the next chunk is stored.
+ */
+char *php_mongo_gridfs_cache_find(zval *chunks, zval *file, int n, int *len TSRMLS_DC);
+
+/**
+ * Stores a copy of the data of chunk n of file in chunks, taking the least recently used
+ * chunks out if the cache would grow over mongo.gridfs_cache_size.
+ */
+void php_mongo_gridfs_cache_store(zval *chunks, zval *file, int n, char *data, int len TSRMLS_DC);
+
+#endif
@@ -37,6 +37,8 @@
 #include "cursor.h"
 #include "mongo_types.h"
 #include "db.h"
+#include "bson.h"
+#include "gridfs_cache.h"
 
 extern zend_class_entry
 	*mongo_ce_BinData,
@@ -51,12 +53,14 @@ static int gridfs_close(php_stream *stream, int close_handle TSRMLS_DC);
 static int gridfs_stat(php_stream *stream, php_stream_statbuf *ssb TSRMLS_DC);
 static int gridfs_option(php_stream *stream, int option, int value, void *ptrparam TSRMLS_DC);
 static int gridfs_seek(php_stream *stream, off_t offset, int whence, off_t *newoffs TSRMLS_DC);
+static size_t gridfs_write(php_stream *stream, const char *buf, size_t count TSRMLS_DC);
+static int gridfs_write_close(php_stream *stream, int close_handle TSRMLS_DC);
+static int gridfs_write_stat(php_stream *stream, php_stream_statbuf *ssb TSRMLS_DC);
 
 typedef struct _gridfs_stream_data {
 	zval * fileObj; /* MongoGridFSFile Object */
 	zval * chunkObj; /* Chunk collection object */
 	zval * id; /* File ID  */
-	zval * query; /* Query array */
 
 	/* file current position */
 	size_t offset;
@@ -72,9 +76,18 @@ typedef struct _gridfs_stream_data {
 	/* which chunk is loaded? */
 	int chunkId;
 
+	/* Cursor that the loaded chunk came from: over the chunks from chunkId on,
+	 * sorted by n, while the file is read in order, or over just chunkId after
+	 * a seek. cursorChunkId is the n of the chunk it returns next. */
+	zval * cursor;
+	int cursorChunkId;
+	int cursorSingle;
 
-	/* mongo current chunk is kept in memory */
-	unsigned char * buffer;
+	/* data of the loaded chunk, in the reply buffer of the cursor or in cached */
+	char * buffer;
+
+	/* copy of a chunk that came from the chunk cache */
+	char * cached;
 
 	/* chunk size */
 	int buffer_size;
@@ -98,10 +111,51 @@ php_stream_ops gridfs_stream_ops = {
 	gridfs_option, /* set_option */
 };
 
+/* A stream that a file is written to. Only the chunk that is being filled is
+ * kept, every full chunk is sent (and acknowledged) before the next one is
+ * started. */
+typedef struct _gridfs_write_stream_data {
+	zval * gridfs; /* MongoGridFS Object */
+	zval * file; /* files document */
+	zval * id; /* File ID */
+	zval * options;
+	zval * cleanup_ids; /* _id of the chunks written so far */
+
+	gridfs_chunk_writer writer;
+
+	/* bytes written so far */
+	size_t length;
+
+	int chunkSize;
+	int chunkId;
+
+	/* the chunk that is being filled */
+	char * buffer;
+	int buffer_offset;
+
+	/* a chunk couldn't be written, nothing is stored on close */
+	int failed;
+} gridfs_write_stream_data;
+
+php_stream_ops gridfs_write_stream_ops = {
+	gridfs_write, /* write */
+	NULL, /* read */
+	gridfs_write_close, /* close */
+	NULL, /* flush */
+	"gridfs-wrapper",
+	NULL, /* seek */
+	NULL, /* cast */
+	gridfs_write_stat, /* stat */
+	NULL, /* set_option */
+};
+
 /* some handy macros {{{ */
 #ifndef MIN
 #   define MIN(a, b) a > b ? b : a
 #endif
+#ifndef MAX
+#   define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
 
 #if 0
 #   define DEBUG(x)  printf x;fflush(stdout);
@@ -115,12 +169,8 @@ php_stream_ops gridfs_stream_ops = {
 		return 0; \
 	} \
 
-// returns FAILURE on failure
-#define READ_ARRAY_PROP(dest, name, toVariable) \
-	if (zend_hash_find(HASH_P(dest), name, strlen(name)+1, (void**)&toVariable) == FAILURE) { \
-		zend_throw_exception(mongo_ce_GridFSException, "couldn't find " name, 0 TSRMLS_CC); \
-		return FAILURE; \
-	} \
+/* How much of a file the chunk cursor asks for in one batch */
+#define GRIDFS_READ_AHEAD_SIZE (4 * 1024 * 1024)
 
 #define READ_OBJ_PROP(type, obj, name)  \
 	zend_read_property(mongo_ce_##type, obj, name, strlen(name), NOISY TSRMLS_CC);
@@ -138,7 +188,7 @@ php_stream_ops gridfs_stream_ops = {
 		char * err; \
 		spprintf(&err, 0, "chunk %d has wrong size (%d) when the max is %d", chunk_id, size, self->chunkSize); \
 		zend_throw_exception(mongo_ce_GridFSException, err, 1 TSRMLS_CC); \
-		zval_ptr_dtor(&chunk); \
+		efree(err); \
 		return FAILURE; \
 	} \
 /* }}} */
@@ -166,7 +216,6 @@ php_stream * gridfs_stream_init(zval * file_object TSRMLS_DC)
 	self->fileObj  = file_object;
 
 	self->chunkObj = READ_OBJ_PROP(GridFS, gridfs, "chunks");
-	self->buffer   = emalloc(self->chunkSize +1);
 	self->id = *id;
 	self->chunkId = -1;
 	self->totalChunks = ceil(self->size/self->chunkSize);
@@ -175,13 +224,6 @@ php_stream * gridfs_stream_init(zval * file_object TSRMLS_DC)
 	zval_add_ref(&self->chunkObj);
 	zval_add_ref(&self->id);
 
-
-	/* create base query object */
-	MAKE_STD_ZVAL(self->query);
-	array_init(self->query);
-	add_assoc_zval(self->query, "files_id", self->id);
-	zval_add_ref(&self->id);
-
 	stream = php_stream_alloc(&gridfs_stream_ops, self, 0, "rb");
 	return stream;
 }
@@ -198,10 +240,152 @@ static int gridfs_stat(php_stream *stream, php_stream_statbuf *ssb TSRMLS_DC)
 }
 /* }}} */
 
-/* {{{ int gridfs_read_chunk(gridfs_stream_data *self, int chunk_id) */
+/* {{{ static void gridfs_close_cursor(gridfs_stream_data *self)
+ * Closes the cursor, which also drops the data of the loaded chunk */
+static void gridfs_close_cursor(gridfs_stream_data *self TSRMLS_DC)
+{
+	if (self->cursor) {
+		zval_ptr_dtor(&self->cursor);
+		self->cursor = NULL;
+	}
+	self->buffer = NULL;
+	self->buffer_size = 0;
+	self->chunkId = -1;
+}
+/* }}} */
+
+/* {{{ static int gridfs_open_cursor(gridfs_stream_data *self, int chunk_id, int single)
+ * Opens a cursor over the chunks from chunk_id on, which fetches batches of
+ * GRIDFS_READ_AHEAD_SIZE bytes and asks for the next one while the current
+ * one is read. With single, the cursor returns just chunk_id. */
+static int gridfs_open_cursor(gridfs_stream_data *self, int chunk_id, int single TSRMLS_DC)
+{
+	zval *query, *n, *sort, *temp, *flags;
+	mongo_cursor *cursor;
+
+	MAKE_STD_ZVAL(query);
+	array_init(query);
+	add_assoc_zval(query, "files_id", self->id);
+	zval_add_ref(&self->id);
+
+	if (single) {
+		add_assoc_long(query, "n", chunk_id);
+	} else {
+		MAKE_STD_ZVAL(n);
+		array_init(n);
+		add_assoc_long(n, "$gte", chunk_id);
+		add_assoc_zval(query, "n", n);
+	}
+
+	MAKE_STD_ZVAL(self->cursor);
+	MONGO_METHOD1(MongoCollection, find, self->cursor, self->chunkObj, query);
+	zval_ptr_dtor(&query);
+
+	if (EG(exception) || Z_TYPE_P(self->cursor) != IS_OBJECT) {
+		gridfs_close_cursor(self TSRMLS_CC);
+		return FAILURE;
+	}
+
+	/* Use the flags of the cursor that found the file, like getBytes does */
+	cursor = (mongo_cursor*)zend_object_store_get_object(self->cursor TSRMLS_CC);
+	flags = zend_read_property(mongo_ce_GridFSFile, self->fileObj, "flags", strlen("flags"), NOISY TSRMLS_CC);
+	convert_to_long(flags);
+	cursor->opts = Z_LVAL_P(flags);
+
+	if (single) {
+		cursor->limit = -1;
+	} else {
+		MAKE_STD_ZVAL(sort);
+		array_init(sort);
+		add_assoc_long(sort, "n", 1);
+
+		MAKE_STD_ZVAL(temp);
+		MONGO_METHOD1(MongoCursor, sort, temp, self->cursor, sort);
+		zval_ptr_dtor(&temp);
+		zval_ptr_dtor(&sort);
+
+		cursor->batch_size = self->chunkSize > 0 ? MAX(GRIDFS_READ_AHEAD_SIZE / self->chunkSize, 2) : 0;
+		cursor->prefetch = 0.5;
+	}
+
+	self->cursorChunkId = chunk_id;
+	self->cursorSingle = single;
+	DEBUG(("opened chunk cursor at %d, batches of %d\n", chunk_id, cursor->batch_size));
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ static int gridfs_find_chunk_data(gridfs_stream_data *self, char *chunk, int len, int chunk_id)
+ * Points the buffer at the data of the raw chunk document, which is a binary
+ * field or, for files stored by old versions of the driver, a string */
+static int gridfs_find_chunk_data(gridfs_stream_data *self, char *chunk, int len, int chunk_id TSRMLS_DC)
+{
+	char type, *data, *n;
+	int size, chunk_n = -1;
+
+	/* A chunk that is missing would shift all the ones after it */
+	n = bson_find_value(chunk, "n", &type);
+	if (n && type == BSON_INT) {
+		chunk_n = MONGO_32(*(int*)n);
+	} else if (n && type == BSON_LONG) {
+		chunk_n = (int)MONGO_64(*(int64_t*)n);
+	} else if (n && type == BSON_DOUBLE) {
+		chunk_n = (int)*(double*)n;
+	}
+	if (chunk_n != chunk_id) {
+		char * err;
+		spprintf(&err, 0, "chunk %d is missing", chunk_id);
+		zend_throw_exception(mongo_ce_GridFSException, err, 1 TSRMLS_CC);
+		efree(err);
+
+		return FAILURE;
+	}
+
+	data = bson_find_value(chunk, "data", &type);
+	if (!data) {
+		zend_throw_exception(mongo_ce_GridFSException, "couldn't find data", 0 TSRMLS_CC);
+		return FAILURE;
+	}
+
+	if (type == BSON_STRING) {
+		size = MONGO_32(*(int*)data) - 1;
+		data += INT_32;
+	} else if (type == BSON_BINARY) {
+		size = MONGO_32(*(int*)data);
+		data += INT_32;
+
+		/* the old binary subtype repeats the length, see bson_to_zval */
+		if (*data++ == 2 && size >= INT_32 && MONGO_32(*(int*)data) == size - INT_32) {
+			size -= INT_32;
+			data += INT_32;
+		}
+	} else {
+		zend_throw_exception(mongo_ce_GridFSException, "chunk has wrong format", 0 TSRMLS_CC);
+		return FAILURE;
+	}
+
+	if (size < 0 || data + size > chunk + len) {
+		zend_throw_exception(mongo_ce_GridFSException, "chunk has wrong format", 0 TSRMLS_CC);
+		return FAILURE;
+	}
+	ASSERT_SIZE(size)
+
+	self->buffer = data;
+	self->buffer_size = size;
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ int gridfs_read_chunk(gridfs_stream_data *self, int chunk_id)
+ * Loads chunk_id. Chunks that are read in order come from one cursor, a
+ * chunk after a seek is looked up on its own. The data is not copied out of
+ * the cursor's reply, and stays there until the next chunk is loaded. */
 static int gridfs_read_chunk(gridfs_stream_data *self, int chunk_id TSRMLS_DC)
 {
-	zval * chunk = 0, **data, *bin;
+	zval *file;
+	char *chunk;
+	int len, sequential;
 
 	if (chunk_id == -1) {
 		/* we need to figure out which chunk to load */
@@ -215,42 +399,57 @@ static int gridfs_read_chunk(gridfs_stream_data *self, int chunk_id TSRMLS_DC)
 
 	DEBUG(("loading chunk %d\n", chunk_id));
 
-	add_assoc_long(self->query, "n", chunk_id);
-
-	MAKE_STD_ZVAL(chunk);
-	MONGO_METHOD1(MongoCollection, findOne, chunk, self->chunkObj, self->query);
+	/* A hot chunk doesn't need the database, it is copied as the cache can
+	 * drop it while the stream is still reading it */
+	file = READ_OBJ_PROP(GridFSFile, self->fileObj, "file");
+	if ((chunk = php_mongo_gridfs_cache_find(self->chunkObj, file, chunk_id, &len TSRMLS_CC)) != NULL && len <= self->chunkSize) {
+		if (!self->cached) {
+			self->cached = emalloc(self->chunkSize);
+		}
+		memcpy(self->cached, chunk, len);
 
-	if (Z_TYPE_P(chunk) == IS_NULL) {
-		zval_ptr_dtor(&chunk);
+		self->buffer = self->cached;
+		self->buffer_size = len;
+		self->chunkId = chunk_id;
+		self->buffer_offset = self->offset % self->chunkSize;
 
-		return FAILURE;
+		return SUCCESS;
 	}
 
-	READ_ARRAY_PROP(chunk, "data", data);
+	if (!self->cursor || self->cursorSingle || chunk_id != self->cursorChunkId) {
+		/* Reading from the start or on from the last chunk, so the chunks
+		 * after this one are likely to be wanted too */
+		sequential = self->chunkId == -1 || chunk_id == self->chunkId + 1;
 
-	if (Z_TYPE_PP(data) == IS_STRING) {
-		ASSERT_SIZE(Z_STRLEN_PP(data))
-		memcpy(self->buffer, Z_STRVAL_PP(data), Z_STRLEN_PP(data));
-		self->buffer_size = Z_STRLEN_PP(data);
-	} else if (Z_TYPE_PP(data) == IS_OBJECT &&
-			 Z_OBJCE_PP(data) == mongo_ce_BinData) {
+		gridfs_close_cursor(self TSRMLS_CC);
+		if (gridfs_open_cursor(self, chunk_id, !sequential TSRMLS_CC) == FAILURE) {
+			return FAILURE;
+		}
+	}
 
-		bin = READ_OBJ_PROP(BinData, *data, "bin");
+	if (php_mongo_cursor_next_raw(self->cursor, &chunk, &len TSRMLS_CC) == FAILURE) {
+		if (!EG(exception)) {
+			char * err;
+			spprintf(&err, 0, "chunk %d is missing", chunk_id);
+			zend_throw_exception(mongo_ce_GridFSException, err, 1 TSRMLS_CC);
+			efree(err);
+		}
+		gridfs_close_cursor(self TSRMLS_CC);
 
-		ASSERT_SIZE(Z_STRLEN_P(bin))
-		memcpy(self->buffer, Z_STRVAL_P(bin), Z_STRLEN_P(bin));
-		self->buffer_size = Z_STRLEN_P(bin);
-	} else {
-		zend_throw_exception(mongo_ce_GridFSException, "chunk has wrong format", 0 TSRMLS_CC);
-		zval_ptr_dtor(&chunk);
+		return FAILURE;
+	}
+	self->cursorChunkId++;
+
+	if (gridfs_find_chunk_data(self, chunk, len, chunk_id TSRMLS_CC) == FAILURE) {
+		gridfs_close_cursor(self TSRMLS_CC);
 
 		return FAILURE;
 	}
+	php_mongo_gridfs_cache_store(self->chunkObj, file, chunk_id, self->buffer, self->buffer_size TSRMLS_CC);
 
 	self->chunkId = chunk_id;
 	self->buffer_offset = self->offset % self->chunkSize;
 
-	zval_ptr_dtor(&chunk);
 	return SUCCESS;
 }
 /* }}} */
@@ -261,6 +460,10 @@ static size_t gridfs_read(php_stream *stream, char *buf, size_t count TSRMLS_DC)
 	gridfs_stream_data * self = (gridfs_stream_data *) stream->abstract;
 	int size, chunk_id;
 
+	if (self->offset >= self->size) {
+		return 0;
+	}
+
 	/* load the needed chunk from mongo */
 	chunk_id = (int)((self->offset)/self->chunkSize);
 	if (gridfs_read_chunk(self, chunk_id TSRMLS_CC) == FAILURE) {
@@ -331,12 +534,14 @@ static int gridfs_close(php_stream *stream, int close_handle TSRMLS_DC)
 {
 	gridfs_stream_data * self = (gridfs_stream_data *) stream->abstract;
 
+	gridfs_close_cursor(self TSRMLS_CC);
+	if (self->cached) {
+		efree(self->cached);
+	}
 	zval_ptr_dtor(&self->fileObj);
 	zval_ptr_dtor(&self->chunkObj);
-	zval_ptr_dtor(&self->query);
 	zval_ptr_dtor(&self->id);
 
-	efree(self->buffer);
 	efree(self);
 
 	return 0;
@@ -360,6 +565,145 @@ static int gridfs_option(php_stream *stream, int option, int value, void *ptrpar
 }
 /* }}} */
 
+/* {{{ php_stream * gridfs_stream_init_write(zval * gridfs, zval * zfile, int chunk_size, zval * options TSRMLS_DC) */
+php_stream * gridfs_stream_init_write(zval * gridfs, zval * zfile, int chunk_size, zval * options TSRMLS_DC)
+{
+	gridfs_write_stream_data * self;
+	zval **id, *chunks;
+
+	READ_ARRAY_PROP_PTR(zfile, "_id", id);
+	chunks = READ_OBJ_PROP(GridFS, gridfs, "chunks");
+
+	self = emalloc(sizeof(*self));
+	memset(self, 0, sizeof(*self));
+
+	MAKE_STD_ZVAL(self->cleanup_ids);
+	array_init(self->cleanup_ids);
+
+	if (gridfs_chunk_writer_init(&self->writer, chunks, *id, options, self->cleanup_ids TSRMLS_CC) == FAILURE) {
+		gridfs_chunk_writer_dtor(&self->writer TSRMLS_CC);
+		zval_ptr_dtor(&self->cleanup_ids);
+		efree(self);
+		return NULL;
+	}
+
+	self->gridfs = gridfs;
+	self->file = zfile;
+	self->id = *id;
+	self->options = options;
+	self->chunkSize = chunk_size;
+	self->buffer = emalloc(chunk_size);
+
+	zval_add_ref(&self->gridfs);
+	zval_add_ref(&self->file);
+	zval_add_ref(&self->id);
+	zval_add_ref(&self->options);
+
+	return php_stream_alloc(&gridfs_write_stream_ops, self, 0, "wb");
+}
+/* }}} */
+
+/* {{{ static int gridfs_write_chunk(gridfs_write_stream_data *self)
+ * Sends the buffered chunk and waits for it to be acknowledged, so that no
+ * reply is left on the connection in between two writes. The writer looks the
+ * connection up again for every chunk, as user code runs in between. */
+static int gridfs_write_chunk(gridfs_write_stream_data *self TSRMLS_DC)
+{
+	if (
+		gridfs_chunk_writer_add(&self->writer, self->chunkId, self->buffer, self->buffer_offset TSRMLS_CC) == FAILURE ||
+		gridfs_chunk_writer_finish(&self->writer TSRMLS_CC) == FAILURE
+	) {
+		self->failed = 1;
+		return FAILURE;
+	}
+
+	self->chunkId++;
+	self->buffer_offset = 0;
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ fwrite($fp) */
+static size_t gridfs_write(php_stream *stream, const char *buf, size_t count TSRMLS_DC)
+{
+	gridfs_write_stream_data * self = (gridfs_write_stream_data *) stream->abstract;
+	size_t written = 0, size;
+
+	if (self->failed) {
+		return 0;
+	}
+
+	while (written < count) {
+		size = self->chunkSize - self->buffer_offset;
+		if (size > count - written) {
+			size = count - written;
+		}
+
+		memcpy(self->buffer + self->buffer_offset, buf + written, size);
+		self->buffer_offset += size;
+		written += size;
+
+		if (self->buffer_offset == self->chunkSize && gridfs_write_chunk(self TSRMLS_CC) == FAILURE) {
+			return 0;
+		}
+	}
+
+	self->length += count;
+	return count;
+}
+/* }}} */
+
+/* {{{ array fstat($fp) */
+static int gridfs_write_stat(php_stream *stream, php_stream_statbuf *ssb TSRMLS_DC)
+{
+	gridfs_write_stream_data * self = (gridfs_write_stream_data *) stream->abstract;
+
+	ssb->sb.st_size = self->length;
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ fclose($fp)
+ * Sends the last chunk and stores the files document. If anything failed
+ * (or an exception is on its way), the chunks that were written are removed
+ * again. */
+static int gridfs_write_close(php_stream *stream, int close_handle TSRMLS_DC)
+{
+	gridfs_write_stream_data * self = (gridfs_write_stream_data *) stream->abstract;
+	int failed;
+
+	if (!self->failed && !EG(exception) && self->buffer_offset > 0) {
+		gridfs_write_chunk(self TSRMLS_CC);
+	}
+
+	if (!self->failed && !EG(exception)) {
+		add_assoc_long(self->file, "length", self->length);
+		if (gridfs_insert_file(self->gridfs, self->file, self->id, &self->writer, self->options TSRMLS_CC) == FAILURE) {
+			self->failed = 1;
+		}
+	} else {
+		self->failed = 1;
+	}
+
+	gridfs_chunk_writer_dtor(&self->writer TSRMLS_CC);
+	if (self->failed) {
+		gridfs_cleanup_stale_chunks(self->gridfs, self->cleanup_ids TSRMLS_CC);
+	}
+
+	zval_ptr_dtor(&self->gridfs);
+	zval_ptr_dtor(&self->file);
+	zval_ptr_dtor(&self->id);
+	zval_ptr_dtor(&self->options);
+	zval_ptr_dtor(&self->cleanup_ids);
+	failed = self->failed;
+	efree(self->buffer);
+	efree(self);
+
+	return failed ? EOF : 0;
+}
+/* }}} */
+
 /*
  * Local variables:
  * tab-width: 4
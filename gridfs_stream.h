@@ -19,4 +19,8 @@
 
 PHPAPI php_stream * gridfs_stream_init(zval * file_object TSRMLS_DC);
 
+/* Opens a stream that uploads a file to gridfs, zfile is its files document
+ * without the length and md5, which are added when the stream is closed */
+PHPAPI php_stream * gridfs_stream_init_write(zval * gridfs, zval * zfile, int chunk_size, zval * options TSRMLS_DC);
+
 #endif /* MONGO_GRIDFS_STREAM_H */
@@ -0,0 +1,276 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <php.h>
+#include <zend_interfaces.h>
+#include <zend_exceptions.h>
+
+#ifdef WIN32
+#  ifndef int64_t
+     typedef __int64 int64_t;
+#  endif
+#endif
+
+#include "php_mongo.h"
+#include "bson.h"
+#include "lazy_document.h"
+
+extern zend_class_entry *mongo_ce_Exception,
+  *mongo_ce_CursorException;
+
+extern zend_object_handlers mongo_default_handlers;
+
+zend_class_entry *mongo_ce_LazyDocument = NULL;
+
+/* Makes zdoc a lazy document over doc, which lives inside buffer. Nested
+ * documents share the buffer of the document they were read from, so only
+ * the outermost document ever copies data. */
+static void attach_buffer(zval *zdoc, mongo_lazy_buffer *buffer, char *doc TSRMLS_DC)
+{
+	mongo_lazy_document *lazy;
+
+	object_init_ex(zdoc, mongo_ce_LazyDocument);
+
+	lazy = (mongo_lazy_document*)zend_object_store_get_object(zdoc TSRMLS_CC);
+	lazy->buffer = buffer;
+	lazy->doc = doc;
+	buffer->refcount++;
+}
+
+char* php_mongo_lazy_document_init(zval *zdoc, char *buf, char *end TSRMLS_DC)
+{
+	mongo_lazy_buffer *buffer;
+	int len = 0;
+
+	if (end - buf >= INT_32) {
+		len = MONGO_32(*(int*)buf);
+	}
+
+	/* the smallest document is the length and the trailing \0 */
+	if (len < INT_32 + 1 || len > end - buf) {
+		zend_throw_exception_ex(mongo_ce_CursorException, 21 TSRMLS_CC, "invalid document length: %d", len);
+		return 0;
+	}
+
+	/* The reply buffer is reused as soon as the cursor fetches its next batch,
+	 * so the document has to be copied out. That is a single memcpy, compared
+	 * to a zval for every field. */
+	buffer = (mongo_lazy_buffer*)emalloc(sizeof(mongo_lazy_buffer));
+	buffer->data = (char*)emalloc(len);
+	buffer->refcount = 0;
+	memcpy(buffer->data, buf, len);
+
+	attach_buffer(zdoc, buffer, buffer->data TSRMLS_CC);
+
+	return buf + len;
+}
+
+zval* php_mongo_lazy_document_get(zval *zdoc, char *name TSRMLS_DC)
+{
+	mongo_lazy_document *lazy;
+	zval **cached, *value;
+	char *data, type;
+
+	lazy = (mongo_lazy_document*)zend_object_store_get_object(zdoc TSRMLS_CC);
+	if (!lazy->buffer) {
+		return NULL;
+	}
+
+	if (lazy->fields && zend_hash_find(lazy->fields, name, strlen(name) + 1, (void**)&cached) == SUCCESS) {
+		return *cached;
+	}
+
+	data = bson_find_value(lazy->doc, name, &type);
+	if (!data) {
+		return NULL;
+	}
+
+	MAKE_STD_ZVAL(value);
+	ZVAL_NULL(value);
+
+	if (type == BSON_OBJECT || type == BSON_ARRAY) {
+		attach_buffer(value, lazy->buffer, data TSRMLS_CC);
+	} else if (!bson_value_to_zval(type, name, data, lazy->doc, value TSRMLS_CC)) {
+		zval_ptr_dtor(&value);
+		return NULL;
+	}
+
+	if (!lazy->fields) {
+		ALLOC_HASHTABLE(lazy->fields);
+		zend_hash_init(lazy->fields, 8, NULL, ZVAL_PTR_DTOR, 0);
+	}
+	zend_hash_update(lazy->fields, name, strlen(name) + 1, &value, sizeof(zval*), NULL);
+
+	return value;
+}
+
+#define PHP_MONGO_GET_LAZY_DOCUMENT(obj)                                          \
+  lazy = (mongo_lazy_document*)zend_object_store_get_object((obj) TSRMLS_CC);     \
+  MONGO_CHECK_INITIALIZED(lazy->buffer, MongoLazyDocument);
+
+/* {{{ MongoLazyDocument::offsetExists(string key)
+ */
+PHP_METHOD(MongoLazyDocument, offsetExists)
+{
+	mongo_lazy_document *lazy;
+	char *key, type;
+	int key_len;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &key, &key_len) == FAILURE) {
+		return;
+	}
+	PHP_MONGO_GET_LAZY_DOCUMENT(getThis());
+
+	if (lazy->fields && zend_hash_exists(lazy->fields, key, key_len + 1)) {
+		RETURN_TRUE;
+	}
+
+	RETURN_BOOL(bson_find_value(lazy->doc, key, &type) != 0);
+}
+/* }}} */
+
+/* {{{ MongoLazyDocument::offsetGet(string key)
+ */
+PHP_METHOD(MongoLazyDocument, offsetGet)
+{
+	mongo_lazy_document *lazy;
+	char *key;
+	int key_len;
+	zval *value;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &key, &key_len) == FAILURE) {
+		return;
+	}
+	PHP_MONGO_GET_LAZY_DOCUMENT(getThis());
+
+	value = php_mongo_lazy_document_get(getThis(), key TSRMLS_CC);
+	if (!value) {
+		RETURN_NULL();
+	}
+
+	RETURN_ZVAL(value, 1, 0);
+}
+/* }}} */
+
+/* {{{ MongoLazyDocument::offsetSet(string key, mixed value)
+ */
+PHP_METHOD(MongoLazyDocument, offsetSet)
+{
+	zend_throw_exception(mongo_ce_Exception, "MongoLazyDocument is read-only, use toArray() to get a modifiable copy", 18 TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ MongoLazyDocument::offsetUnset(string key)
+ */
+PHP_METHOD(MongoLazyDocument, offsetUnset)
+{
+	zend_throw_exception(mongo_ce_Exception, "MongoLazyDocument is read-only, use toArray() to get a modifiable copy", 18 TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ MongoLazyDocument::count()
+ * Counts the fields of the document, without decoding any of them. */
+PHP_METHOD(MongoLazyDocument, count)
+{
+	mongo_lazy_document *lazy;
+	char *buf, type;
+	long count = 0;
+
+	PHP_MONGO_GET_LAZY_DOCUMENT(getThis());
+
+	buf = lazy->doc + INT_32;
+	while ((type = *buf++) != 0) {
+		buf += strlen(buf) + 1;
+		buf = bson_skip_value(type, buf);
+		if (!buf) {
+			break;
+		}
+		count++;
+	}
+
+	RETURN_LONG(count);
+}
+/* }}} */
+
+/* {{{ MongoLazyDocument::toArray()
+ * Decodes the whole document, including all nested documents. */
+PHP_METHOD(MongoLazyDocument, toArray)
+{
+	mongo_lazy_document *lazy;
+
+	PHP_MONGO_GET_LAZY_DOCUMENT(getThis());
+
+	array_init(return_value);
+	bson_to_zval(lazy->doc, Z_ARRVAL_P(return_value) TSRMLS_CC);
+}
+/* }}} */
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_offset, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, key)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_offset_set, 0, ZEND_RETURN_VALUE, 2)
+	ZEND_ARG_INFO(0, key)
+	ZEND_ARG_INFO(0, value)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_no_parameters, 0, ZEND_RETURN_VALUE, 0)
+ZEND_END_ARG_INFO()
+
+static zend_function_entry MongoLazyDocument_methods[] = {
+	PHP_ME(MongoLazyDocument, offsetExists, arginfo_offset, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoLazyDocument, offsetGet, arginfo_offset, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoLazyDocument, offsetSet, arginfo_offset_set, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoLazyDocument, offsetUnset, arginfo_offset, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoLazyDocument, count, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoLazyDocument, toArray, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	{ NULL, NULL, NULL }
+};
+
+static void php_mongo_lazy_document_free(void *object TSRMLS_DC)
+{
+	mongo_lazy_document *lazy = (mongo_lazy_document*)object;
+
+	if (lazy) {
+		if (lazy->fields) {
+			zend_hash_destroy(lazy->fields);
+			FREE_HASHTABLE(lazy->fields);
+		}
+
+		if (lazy->buffer && --lazy->buffer->refcount == 0) {
+			efree(lazy->buffer->data);
+			efree(lazy->buffer);
+		}
+
+		zend_object_std_dtor(&lazy->std TSRMLS_CC);
+		efree(lazy);
+	}
+}
+
+static zend_object_value php_mongo_lazy_document_new(zend_class_entry *class_type TSRMLS_DC)
+{
+	php_mongo_obj_new(mongo_lazy_document);
+}
+
+void mongo_init_MongoLazyDocument(TSRMLS_D)
+{
+	zend_class_entry ce;
+
+	INIT_CLASS_ENTRY(ce, "MongoLazyDocument", MongoLazyDocument_methods);
+	ce.create_object = php_mongo_lazy_document_new;
+	mongo_ce_LazyDocument = zend_register_internal_class(&ce TSRMLS_CC);
+	mongo_ce_LazyDocument->ce_flags |= ZEND_ACC_FINAL_CLASS;
+	zend_class_implements(mongo_ce_LazyDocument TSRMLS_CC, 1, zend_ce_arrayaccess);
+}
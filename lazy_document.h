@@ -0,0 +1,42 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MONGO_LAZY_DOCUMENT_H
+#define MONGO_LAZY_DOCUMENT_H 1
+
+/**
+ * Turns doc into a MongoLazyDocument for the BSON document starting at buf.
+ * The raw document is copied once, fields are only decoded when they are
+ * read. Returns the position after the document, or 0 (with an exception
+ * thrown) if the document does not fit between buf and end.
+ */
+char* php_mongo_lazy_document_init(zval *doc, char *buf, char *end TSRMLS_DC);
+
+/**
+ * Returns the (decoded) field called name, or NULL if there is no such field.
+ * The returned zval is owned by the document.
+ */
+zval* php_mongo_lazy_document_get(zval *doc, char *name TSRMLS_DC);
+
+void mongo_init_MongoLazyDocument(TSRMLS_D);
+
+PHP_METHOD(MongoLazyDocument, offsetExists);
+PHP_METHOD(MongoLazyDocument, offsetGet);
+PHP_METHOD(MongoLazyDocument, offsetSet);
+PHP_METHOD(MongoLazyDocument, offsetUnset);
+PHP_METHOD(MongoLazyDocument, count);
+PHP_METHOD(MongoLazyDocument, toArray);
+
+#endif
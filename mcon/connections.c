@@ -8,6 +8,10 @@
 #include "str.h"
 #include "bson_helpers.h"
 #include "mini_bson.h"
+#include "topology_cache.h"
+#include "resolver.h"
+#include "stats.h"
+#include "trace.h"
 
 #ifdef WIN32
 #include <winsock2.h>
@@ -42,68 +46,130 @@ int mongo_connection_get_reqid(mongo_connection *con)
 	return con->last_reqid;
 }
 
-static int mongo_util_connect__sockaddr(struct sockaddr *sa, int family, char *host, int port, char **errmsg)
+/* A single slow round trip moves the average by a fifth of the difference
+ * only, so that one hiccup does not take a server out of the latency window,
+ * and one fast reply does not bring a slow one back in. */
+void mongo_connection_rtt_sample(mongo_connection *con, int rtt_us)
 {
-#ifndef WIN32
-	if (family == AF_UNIX) {
-		struct sockaddr_un* su = (struct sockaddr_un*)(sa);
-		su->sun_family = AF_UNIX;
-		strncpy(su->sun_path, host, sizeof(su->sun_path));
+	if (rtt_us < 0) { /* some clocks do weird stuff */
+		rtt_us = 0;
+	}
+
+	if (con->rtt_us == 0) {
+		con->rtt_us = rtt_us > 0 ? rtt_us : 1;
 	} else {
+		con->rtt_us += (rtt_us - con->rtt_us) / MONGO_CONNECTION_RTT_WEIGHT;
+		if (con->rtt_us <= 0) {
+			con->rtt_us = 1;
+		}
+	}
+}
+
+void mongo_connection_rtt_since(mongo_connection *con, struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	mongo_connection_rtt_sample(con, (end.tv_sec - start->tv_sec) * 1000000 + (end.tv_usec - start->tv_usec));
+	con->last_reply = end.tv_sec;
+}
+
+static void close_socket(int socket)
+{
+#ifdef WIN32
+	shutdown((socket), 2);
+	closesocket(socket);
+	WSACleanup();
+#else
+	shutdown((socket), 2);
+	close(socket);
 #endif
-		struct hostent *hostinfo;
-		struct sockaddr_in* si = (struct sockaddr_in*)(sa);
+}
 
-		si->sin_family = AF_INET;
-		si->sin_port = htons(port);
-		hostinfo = (struct hostent*)gethostbyname(host);
+void mongo_socket_options_init(mongo_socket_options *options)
+{
+	options->nodelay = -1;
+	options->keepalive = -1;
+	options->keepalive_idle = -1;
+	options->keepalive_interval = -1;
+	options->keepalive_count = -1;
+	options->send_buffer = -1;
+	options->receive_buffer = -1;
+	options->socket_timeout = -1;
+	options->compressors = -1;
+	options->zlib_level = -1;
+}
 
-		if (hostinfo == NULL) {
-			*errmsg = malloc(256);
-			snprintf(*errmsg, 256, "Couldn't get host info for %s", host);
-			return 0;
+#define MONGO_SOCKET_OPTION(o) (options->o != -1 ? options->o : manager->socket_options.o)
+
+/* Sets the options for a socket that was just created. The TCP ones are
+ * skipped for domain sockets. Errors are only logged, as the socket works
+ * without them as well. */
+static void mongo_connection_set_socket_options(mongo_con_manager *manager, int sock, int family, mongo_socket_options *options)
+{
+	int value;
+#ifdef WIN32
+	DWORD timeout;
+#else
+	struct timeval timeout;
+#endif
+
+	if (family != AF_UNIX) {
+		value = MONGO_SOCKET_OPTION(nodelay) > 0;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*) &value, sizeof(value));
+
+		value = MONGO_SOCKET_OPTION(keepalive) > 0;
+		setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (char*) &value, sizeof(value));
+#ifdef TCP_KEEPIDLE
+		if (value) {
+			if ((value = MONGO_SOCKET_OPTION(keepalive_idle)) > 0) {
+				setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &value, sizeof(value));
+			}
+			if ((value = MONGO_SOCKET_OPTION(keepalive_interval)) > 0) {
+				setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &value, sizeof(value));
+			}
+			if ((value = MONGO_SOCKET_OPTION(keepalive_count)) > 0) {
+				setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &value, sizeof(value));
+			}
 		}
+#endif
+	}
 
-#ifndef WIN32
-		si->sin_addr = *((struct in_addr*)hostinfo->h_addr);
+	if ((value = MONGO_SOCKET_OPTION(send_buffer)) > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char*) &value, sizeof(value)) == -1) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "connect: couldn't set the send buffer to %d: %s", value, strerror(errno));
 	}
+	if ((value = MONGO_SOCKET_OPTION(receive_buffer)) > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*) &value, sizeof(value)) == -1) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "connect: couldn't set the receive buffer to %d: %s", value, strerror(errno));
+	}
+
+	if ((value = MONGO_SOCKET_OPTION(socket_timeout)) > 0) {
+#ifdef WIN32
+		timeout = value;
 #else
-	si->sin_addr.s_addr = ((struct in_addr*)(hostinfo->h_addr))->s_addr;
+		timeout.tv_sec = value / 1000;
+		timeout.tv_usec = (value % 1000) * 1000;
 #endif
-
-	return 1;
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*) &timeout, sizeof(timeout));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*) &timeout, sizeof(timeout));
+	}
 }
 
-/* This function does the actual connecting */
-int mongo_connection_connect(char *host, int port, int timeout, char **error_message)
+/* Creates a non-blocking socket with the given options and starts connecting
+ * it to address. Returns the socket, with *in_progress set if the connect has
+ * not completed yet, or -1 with *error_message set. */
+static int mongo_connection_connect_start(mongo_con_manager *manager, mongo_address *address, mongo_socket_options *options, int *in_progress, char **error_message)
 {
-	struct sockaddr*   sa;
-	struct sockaddr_in si;
-	socklen_t          sn;
-	int                family;
-	struct timeval     tval;
-	int                connected;
 	int                status;
 	int                tmp_socket;
 
 	*error_message = NULL;
+	*in_progress = 0;
 
 #ifdef WIN32
 	WORD       version;
 	WSADATA    wsaData;
-	int        size, error;
-	u_long     no = 0;
+	int        error;
 	const char yes = 1;
-#else
-	struct sockaddr_un su;
-	uint               size;
-	int                yes = 1;
-#endif
-
-#ifdef WIN32
-	family = AF_INET;
-	sa = (struct sockaddr*)(&si);
-	sn = sizeof(si);
 
 	version = MAKEWORD(2,2);
 	error = WSAStartup(version, &wsaData);
@@ -113,43 +179,21 @@ int mongo_connection_connect(char *host, int port, int timeout, char **error_mes
 	}
 
 	/* create socket */
-	tmp_socket = socket(family, SOCK_STREAM, 0);
+	tmp_socket = socket(address->family, SOCK_STREAM, 0);
 	if (tmp_socket == INVALID_SOCKET) {
 		*error_message = strdup(strerror(errno));
 		return -1;
 	}
 
 #else
-	/* domain socket */
-	if (port == 0) {
-		family = AF_UNIX;
-		sa = (struct sockaddr*)(&su);
-		sn = sizeof(su);
-	} else {
-		family = AF_INET;
-		sa = (struct sockaddr*)(&si);
-		sn = sizeof(si);
-	}
-
 	/* create socket */
-	if ((tmp_socket = socket(family, SOCK_STREAM, 0)) == -1) {
+	if ((tmp_socket = socket(address->family, SOCK_STREAM, 0)) == -1) {
 		*error_message = strdup(strerror(errno));
 		return -1;
 	}
 #endif
 
-	/* TODO: Move this to within the loop & use real timeout setting */
-	/* connection timeout: set in ms (current default 1000 secs) */
-	tval.tv_sec = timeout <= 0 ? 1000 : timeout / 1000;
-	tval.tv_usec = timeout <= 0 ? 0 : (timeout % 1000) * 1000;
-
-	/* get addresses */
-	if (mongo_util_connect__sockaddr(sa, family, host, port, error_message) == 0) {
-		goto error;
-	}
-
-	setsockopt(tmp_socket, SOL_SOCKET, SO_KEEPALIVE, &yes, INT_32);
-	setsockopt(tmp_socket, IPPROTO_TCP, TCP_NODELAY, &yes, INT_32);
+	mongo_connection_set_socket_options(manager, tmp_socket, address->family, options);
 
 #ifdef WIN32
 	ioctlsocket(tmp_socket, FIONBIO, (u_long*)&yes);
@@ -158,7 +202,7 @@ int mongo_connection_connect(char *host, int port, int timeout, char **error_mes
 #endif
 
 	/* connect */
-	status = connect(tmp_socket, sa, sn);
+	status = connect(tmp_socket, (struct sockaddr*) &address->addr, address->len);
 	if (status < 0) {
 #ifdef WIN32
 		errno = WSAGetLastError();
@@ -167,67 +211,185 @@ int mongo_connection_connect(char *host, int port, int timeout, char **error_mes
 		if (errno != EINPROGRESS) {
 #endif
 			*error_message = strdup(strerror(errno));
-			goto error;
+			close_socket(tmp_socket);
+			return -1;
 		}
+		*in_progress = 1;
+	}
 
-		while (1) {
-			fd_set rset, wset, eset;
+	return tmp_socket;
+}
 
-			FD_ZERO(&rset);
-			FD_SET(tmp_socket, &rset);
-			FD_ZERO(&wset);
-			FD_SET(tmp_socket, &wset);
-			FD_ZERO(&eset);
-			FD_SET(tmp_socket, &eset);
+/* Checks whether a connect that was in progress worked, and switches the
+ * socket back to blocking mode. Returns 1 if it worked, or 0 with
+ * *error_message set, in which case the socket has been closed. */
+static int mongo_connection_connect_finish(int tmp_socket, int in_progress, char **error_message)
+{
+	int       error = 0;
+	socklen_t size = sizeof(error);
+#ifdef WIN32
+	u_long    no = 0;
+#endif
 
-			if (select(tmp_socket+1, &rset, &wset, &eset, &tval) == 0) {
-				*error_message = malloc(256);
-				snprintf(*error_message, 256, "Timed out after %d ms", timeout);
-				goto error;
+	if (in_progress) {
+		if (getsockopt(tmp_socket, SOL_SOCKET, SO_ERROR, (char*) &error, &size) == -1) {
+			error = errno;
+		}
+		if (error != 0) {
+			*error_message = strdup(strerror(error));
+			close_socket(tmp_socket);
+			return 0;
+		}
+	}
+
+	/* reset flags */
+#ifdef WIN32
+	ioctlsocket(tmp_socket, FIONBIO, &no);
+#else
+	fcntl(tmp_socket, F_SETFL, FLAGS);
+#endif
+	return 1;
+}
+
+/* One connect to one of the addresses of a server */
+typedef struct _mongo_connect_attempt
+{
+	int server;      /* Index of the server it is for */
+	int in_progress;
+} mongo_connect_attempt;
+
+/* Connects to all count servers at once, and to all the addresses of each
+ * server at once too. The first connect to a server that works is the one
+ * that is used, the others are closed. Waits at most timeout ms. Sets
+ * sockets[i] to the socket for servers[i], or to -1 with errors[i] set (to be
+ * freed) if none of its addresses could be connected to. */
+static void mongo_connection_connect_race(mongo_con_manager *manager, mongo_server_def **servers, int count, int timeout, int *sockets, char **errors)
+{
+	mongo_connect_attempt *attempts = NULL;
+	struct pollfd         *pfds = NULL;
+	mongo_address         *addresses;
+	struct timeval         start, now;
+	char                  *error_message;
+	int                    nr_attempts = 0, i, j, nr_addresses, pending, left = timeout;
+
+	for (i = 0; i < count; i++) {
+		sockets[i] = -1;
+		errors[i] = NULL;
+
+		nr_addresses = mongo_resolve(manager, servers[i]->host, servers[i]->port, &addresses, &errors[i]);
+		if (nr_addresses == 0) {
+			continue;
+		}
+
+		attempts = realloc(attempts, (nr_attempts + nr_addresses) * sizeof(mongo_connect_attempt));
+		pfds = realloc(pfds, (nr_attempts + nr_addresses) * sizeof(struct pollfd));
+		for (j = 0; j < nr_addresses; j++) {
+			attempts[nr_attempts].server = i;
+			pfds[nr_attempts].fd = mongo_connection_connect_start(manager, &addresses[j], &servers[i]->options, &attempts[nr_attempts].in_progress, &error_message);
+			pfds[nr_attempts].events = POLLOUT;
+			pfds[nr_attempts].revents = 0;
+			if (pfds[nr_attempts].fd == -1) {
+				free(errors[i]);
+				errors[i] = error_message;
+			} else if (!attempts[nr_attempts].in_progress && sockets[i] == -1) {
+				/* connected straight away (a domain socket, usually) */
+				if (mongo_connection_connect_finish(pfds[nr_attempts].fd, 0, &error_message)) {
+					sockets[i] = pfds[nr_attempts].fd;
+				}
+				pfds[nr_attempts].fd = -1;
 			}
+			nr_attempts++;
+		}
+		free(addresses);
+	}
 
-			/* if our descriptor has an error */
-			if (FD_ISSET(tmp_socket, &eset)) {
-				*error_message = strdup(strerror(errno));
-				goto error;
+	gettimeofday(&start, NULL);
+	while (1) {
+		/* attempts for servers that are connected already are dropped */
+		pending = 0;
+		for (i = 0; i < nr_attempts; i++) {
+			if (pfds[i].fd != -1 && sockets[attempts[i].server] != -1) {
+				close_socket(pfds[i].fd);
+				pfds[i].fd = -1;
 			}
+			if (pfds[i].fd != -1) {
+				pending++;
+			}
+		}
+		if (!pending || left <= 0) {
+			break;
+		}
 
-			/* if our descriptor is ready break out */
-			if (FD_ISSET(tmp_socket, &wset) || FD_ISSET(tmp_socket, &rset)) {
-				break;
+		if (mongo_io_poll(pfds, nr_attempts, left) == -1) {
+			break;
+		}
+		for (i = 0; i < nr_attempts; i++) {
+			if (pfds[i].fd == -1 || pfds[i].revents == 0) {
+				continue;
 			}
+			j = attempts[i].server;
+			if (mongo_connection_connect_finish(pfds[i].fd, attempts[i].in_progress, &error_message)) {
+				if (sockets[j] == -1) {
+					sockets[j] = pfds[i].fd;
+				} else {
+					close_socket(pfds[i].fd);
+				}
+			} else {
+				free(errors[j]);
+				errors[j] = error_message;
+			}
+			pfds[i].fd = -1;
 		}
 
-		size = sn;
+		gettimeofday(&now, NULL);
+		left = timeout - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+	}
 
-		connected = getpeername(tmp_socket, sa, &size);
-		if (connected == -1) {
-			*error_message = strdup(strerror(errno));
-			goto error;
+	/* whatever is left has timed out */
+	for (i = 0; i < nr_attempts; i++) {
+		if (pfds[i].fd != -1) {
+			j = attempts[i].server;
+			close_socket(pfds[i].fd);
+			if (sockets[j] == -1) {
+				free(errors[j]);
+				errors[j] = malloc(256);
+				snprintf(errors[j], 256, "Timed out after %d ms", timeout);
+			}
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (sockets[i] != -1) {
+			free(errors[i]);
+			errors[i] = NULL;
+		} else if (!errors[i]) {
+			errors[i] = strdup("No addresses to connect to");
 		}
 	}
 
-	/* reset flags */
-#ifdef WIN32
-	ioctlsocket(tmp_socket, FIONBIO, &no);
-#else
-	fcntl(tmp_socket, F_SETFL, FLAGS);
-#endif
-	return tmp_socket;
+	free(attempts);
+	free(pfds);
+}
 
-error:
-#ifdef WIN32
-	shutdown((tmp_socket), 2);
-	closesocket(tmp_socket);
-	WSACleanup();
-#else
-	shutdown((tmp_socket), 2);
-	close(tmp_socket);
-#endif
-	return -1;
+/* This function does the actual connecting */
+int mongo_connection_connect(mongo_con_manager *manager, char *host, int port, int timeout, char **error_message)
+{
+	mongo_server_def server;
+	mongo_server_def *servers[1];
+	int socket;
+
+	memset(&server, 0, sizeof(server));
+	server.host = host;
+	server.port = port;
+	mongo_socket_options_init(&server.options);
+	servers[0] = &server;
+
+	/* connection timeout: set in ms (current default 1000 secs) */
+	mongo_connection_connect_race(manager, servers, 1, timeout <= 0 ? 1000000 : timeout, &socket, error_message);
+
+	return socket;
 }
 
-mongo_connection *mongo_connection_create(mongo_con_manager *manager, mongo_server_def *server_def, char **error_message)
+static mongo_connection *mongo_connection_init(mongo_con_manager *manager, int socket, mongo_socket_options *options)
 {
 	mongo_connection *tmp;
 
@@ -236,15 +398,36 @@ mongo_connection *mongo_connection_create(mongo_con_manager *manager, mongo_serv
 	memset(tmp, 0, sizeof(mongo_connection));
 	tmp->last_reqid = rand();
 	tmp->connection_type = MONGO_NODE_STANDALONE;
+	tmp->socket = socket;
+
+	/* What get_server_flags offers the server, compressor is only set once it
+	 * has agreed to one */
+	tmp->compressors = MONGO_SOCKET_OPTION(compressors);
+	tmp->zlib_level = MONGO_SOCKET_OPTION(zlib_level);
+#ifndef MONGO_HAVE_ZLIB
+	tmp->compressors &= ~(1 << MONGO_COMPRESSOR_ZLIB);
+#endif
+
+	return tmp;
+}
+
+mongo_connection *mongo_connection_create(mongo_con_manager *manager, mongo_server_def *server_def, char **error_message)
+{
+	mongo_connection *tmp;
+	mongo_stats_probe probe;
+	int socket;
 
 	/* Connect */
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "connection_create: creating new connection for %s:%d", server_def->host, server_def->port);
-	tmp->socket = mongo_connection_connect(server_def->host, server_def->port, 1000, error_message);
-	if (tmp->socket == -1) {
+	mongo_stats_start_host(manager, &probe, server_def->host, server_def->port);
+	mongo_connection_connect_race(manager, &server_def, 1, MONGO_CONNECTION_DEFAULT_CONNECT_TIMEOUT, &socket, error_message);
+	mongo_stats_end(manager, &probe, MONGO_STATS_OP_CONNECT, NULL, socket == -1 ? MONGO_STATS_FAILED : 0);
+	MONGO_TRACE(manager, MONGO_TRACE_CONNECT, server_def->port, socket, 0, 0);
+	if (socket == -1) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "connection_create: error while creating connection for %s:%d: %s", server_def->host, server_def->port, *error_message);
-		free(tmp);
 		return NULL;
 	}
+	tmp = mongo_connection_init(manager, socket, &server_def->options);
 
 	/* We call get_server_flags to the maxBsonObjectSize data */
 	mongo_connection_get_server_flags(manager, tmp, (char**) &error_message);
@@ -252,6 +435,113 @@ mongo_connection *mongo_connection_create(mongo_con_manager *manager, mongo_serv
 	return tmp;
 }
 
+/* Connects to all count servers at the same time, waiting at most timeout ms
+ * for all of them together. cons[i] is set to the new connection to
+ * servers[i], or to NULL with error_messages[i] set (to be freed). Returns
+ * the number of connections that were made. */
+int mongo_connection_create_many(mongo_con_manager *manager, mongo_server_def **servers, int count, int timeout, mongo_connection **cons, char **error_messages)
+{
+	int  *sockets;
+	int   i, connected = 0;
+	char *error_message;
+	mongo_stats_probe *probes;
+
+	if (timeout <= 0) {
+		timeout = MONGO_CONNECTION_DEFAULT_CONNECT_TIMEOUT;
+	}
+
+	sockets = calloc(count, sizeof(int));
+	probes = calloc(count, sizeof(mongo_stats_probe));
+	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "connection_create_many: connecting to %d servers", count);
+	for (i = 0; i < count; i++) {
+		mongo_stats_start_host(manager, &probes[i], servers[i]->host, servers[i]->port);
+	}
+	mongo_connection_connect_race(manager, servers, count, timeout, sockets, error_messages);
+
+	for (i = 0; i < count; i++) {
+		cons[i] = NULL;
+		/* They all raced together, so each counts the whole race */
+		mongo_stats_end(manager, &probes[i], MONGO_STATS_OP_CONNECT, NULL, sockets[i] == -1 ? MONGO_STATS_FAILED : 0);
+		MONGO_TRACE(manager, MONGO_TRACE_CONNECT, servers[i]->port, sockets[i], 0, 0);
+		if (sockets[i] == -1) {
+			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "connection_create_many: error while connecting to %s:%d: %s", servers[i]->host, servers[i]->port, error_messages[i]);
+			continue;
+		}
+		cons[i] = mongo_connection_init(manager, sockets[i], &servers[i]->options);
+		error_message = NULL;
+		mongo_connection_get_server_flags(manager, cons[i], &error_message);
+		free(error_message);
+		connected++;
+	}
+
+	free(probes);
+	free(sockets);
+
+	return connected;
+}
+
+/* Returns 1 if spec has been ensured on con for ns, and has not expired yet.
+ * Expired entries are dropped along the way. */
+int mongo_connection_index_ensured(mongo_connection *con, char *ns, char *spec, int spec_len)
+{
+	mongo_ensured_index **ptr = &con->ensured_indexes, *tmp;
+	time_t now = time(NULL);
+
+	while (*ptr) {
+		if ((*ptr)->expires <= now) {
+			tmp = *ptr;
+			*ptr = tmp->next;
+			free(tmp->ns);
+			free(tmp->spec);
+			free(tmp);
+			continue;
+		}
+		if ((*ptr)->spec_len == spec_len && strcmp((*ptr)->ns, ns) == 0 && memcmp((*ptr)->spec, spec, spec_len) == 0) {
+			return 1;
+		}
+		ptr = &(*ptr)->next;
+	}
+	return 0;
+}
+
+void mongo_connection_index_remember(mongo_connection *con, char *ns, char *spec, int spec_len, int ttl)
+{
+	mongo_ensured_index *tmp;
+
+	if (mongo_connection_index_ensured(con, ns, spec, spec_len)) {
+		return;
+	}
+
+	tmp = malloc(sizeof(mongo_ensured_index));
+	tmp->ns = strdup(ns);
+	tmp->spec = malloc(spec_len);
+	memcpy(tmp->spec, spec, spec_len);
+	tmp->spec_len = spec_len;
+	tmp->expires = time(NULL) + ttl;
+	tmp->next = con->ensured_indexes;
+	con->ensured_indexes = tmp;
+}
+
+/* Forgets the indexes of all namespaces starting with ns_prefix, for when
+ * they have been dropped */
+void mongo_connection_index_forget(mongo_connection *con, char *ns_prefix)
+{
+	mongo_ensured_index **ptr = &con->ensured_indexes, *tmp;
+	size_t len = strlen(ns_prefix);
+
+	while (*ptr) {
+		if (strncmp((*ptr)->ns, ns_prefix, len) == 0) {
+			tmp = *ptr;
+			*ptr = tmp->next;
+			free(tmp->ns);
+			free(tmp->spec);
+			free(tmp);
+		} else {
+			ptr = &(*ptr)->next;
+		}
+	}
+}
+
 void mongo_connection_destroy(mongo_con_manager *manager, mongo_connection *con)
 {
 	int current_pid, connection_pid;
@@ -279,6 +569,19 @@ void mongo_connection_destroy(mongo_con_manager *manager, mongo_connection *con)
 		}
 		free(con->tags);
 		free(con->hash);
+		free(con->read_buf);
+		free(con->write_buf);
+		free(con->stale_replies);
+		mongo_connection_index_forget(con, "");
+		while (con->auths) {
+			mongo_connection_auth *next = con->auths->next;
+
+			free(con->auths->db);
+			free(con->auths->username);
+			free(con->auths->auth_hash);
+			free(con->auths);
+			con->auths = next;
+		}
 		free(con);
 	}
 }
@@ -287,7 +590,81 @@ void mongo_connection_destroy(mongo_con_manager *manager, mongo_connection *con)
 
 /* Returns 1 if it worked, and 0 if it didn't. If 0 is returned, *error_message
  * is set and must be freed */
+static int mongo_connect_read_reply(mongo_con_manager *manager, mongo_connection *con, char **data_buffer, char **error_message);
+
+/* Remembers that the reply to request_id is still coming on con, but that it
+ * is to be dropped (the loser of a hedged query, for example). It is read
+ * before any other reply on con, see mongo_connection_drain_stale_replies. */
+void mongo_connection_expect_stale_reply(mongo_connection *con, int request_id)
+{
+	con->stale_replies = realloc(con->stale_replies, (con->stale_count + 1) * sizeof(int));
+	con->stale_replies[con->stale_count++] = request_id;
+}
+
+/* Reads and drops the replies that mongo_connection_expect_stale_reply was
+ * told about, and kills the cursors that they opened. Returns 1 if it
+ * worked, and 0 with error_message set if con can't be used anymore. */
+int mongo_connection_drain_stale_replies(mongo_con_manager *manager, mongo_connection *con, char **error_message)
+{
+	char     header[MONGO_REPLY_HEADER_SIZE], rest[4096];
+	int      length, chunk;
+	int64_t  cursor_id;
+	mcon_str *packet;
+
+	while (con->stale_count > 0) {
+		if (mongo_io_recv_buffered(con, header, MONGO_REPLY_HEADER_SIZE, error_message) != MONGO_REPLY_HEADER_SIZE) {
+			return 0;
+		}
+		length = MONGO_32(*(int*)header) - MONGO_REPLY_HEADER_SIZE;
+		if (length < 0 || MONGO_32(*(int*)(header + INT_32 * 2)) != con->stale_replies[0]) {
+			*error_message = strdup("drain_stale_replies: the reply is not the one that was expected");
+			return 0;
+		}
+		for (; length > 0; length -= chunk) {
+			chunk = length > (int) sizeof(rest) ? (int) sizeof(rest) : length;
+			if (mongo_io_recv_buffered(con, rest, chunk, error_message) != chunk) {
+				return 0;
+			}
+		}
+
+		con->stale_count--;
+		memmove(con->stale_replies, con->stale_replies + 1, con->stale_count * sizeof(int));
+		mongo_manager_log(manager, MLOG_IO, MLOG_FINE, "drain_stale_replies: dropped a reply on %s", con->hash);
+
+		/* Nobody else knows about the cursor that the reply opened */
+		cursor_id = MONGO_64(*(int64_t*)(header + INT_32 * 5));
+		if (cursor_id != 0) {
+			packet = bson_create_kill_cursors_packet(con, cursor_id);
+			chunk = mongo_io_flush_uncompressed(con, packet->d, packet->l, error_message);
+			mcon_str_ptr_dtor(packet);
+			if (chunk == -1) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
 static int mongo_connect_send_packet(mongo_con_manager *manager, mongo_connection *con, mcon_str *packet, char **data_buffer, char **error_message)
+{
+	/* The reply would otherwise be mistaken for one that is dropped */
+	if (!mongo_connection_drain_stale_replies(manager, con, error_message)) {
+		mcon_str_ptr_dtor(packet);
+		return 0;
+	}
+
+	/* Send and wait for reply. The handshake and authentication commands are
+	 * never compressed. */
+	mongo_io_flush_uncompressed(con, packet->d, packet->l, error_message);
+	mcon_str_ptr_dtor(packet);
+
+	return mongo_connect_read_reply(manager, con, data_buffer, error_message);
+}
+
+/* Reads the reply to a command that was sent with mongo_connect_send_packet
+ * or on its own. Returns 1 if it worked, and 0 if it didn't. If 0 is returned,
+ * *error_message is set and must be freed */
+static int mongo_connect_read_reply(mongo_con_manager *manager, mongo_connection *con, char **data_buffer, char **error_message)
 {
 	int            read;
 	uint32_t       data_size;
@@ -295,16 +672,16 @@ static int mongo_connect_send_packet(mongo_con_manager *manager, mongo_connectio
 	uint32_t       flags; /* To check for query reply status */
 	char          *recv_error_message;
 
-	/* Send and wait for reply */
-	mongo_io_send(con->socket, packet->d, packet->l, error_message);
-	mcon_str_ptr_dtor(packet);
-	read = mongo_io_recv_header(con->socket, reply_buffer, MONGO_REPLY_HEADER_SIZE, &recv_error_message);
-	if (read == -1) {
+	read = mongo_io_recv_buffered(con, reply_buffer, MONGO_REPLY_HEADER_SIZE, &recv_error_message);
+	if (read == -1 || read == 0) {
 		*error_message = malloc(256);
 		snprintf(*error_message, 256, "send_package: error reading from socket: %s", recv_error_message);
 		free(recv_error_message);
 		return 0;
 	}
+	if (read < MONGO_REPLY_HEADER_SIZE) {
+		free(recv_error_message);
+	}
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "send_packet: read from header: %d", read);
 	if (read < MONGO_REPLY_HEADER_SIZE) {
@@ -329,7 +706,8 @@ static int mongo_connect_send_packet(mongo_con_manager *manager, mongo_connectio
 
 	/* Read data */
 	*data_buffer = malloc(data_size + 1);
-	if (!mongo_io_recv_data(con->socket, *data_buffer, data_size, error_message)) {
+	if (mongo_io_recv_buffered(con, *data_buffer, data_size, error_message) != data_size) {
+		free(*data_buffer);
 		return 0;
 	}
 
@@ -365,9 +743,10 @@ static int mongo_connect_send_packet(mongo_con_manager *manager, mongo_connectio
  */
 int mongo_connection_ping(mongo_con_manager *manager, mongo_connection *con, char **error_message)
 {
-	mcon_str      *packet;
-	struct timeval start, end;
-	char          *data_buffer;
+	mcon_str         *packet;
+	struct timeval    start, end;
+	char             *data_buffer;
+	mongo_stats_probe probe;
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "is_ping: pinging %s", con->hash);
 
@@ -376,10 +755,29 @@ int mongo_connection_ping(mongo_con_manager *manager, mongo_connection *con, cha
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "is_ping: skipping: last ran at %ld, now: %ld, time left: %ld", con->last_ping, start.tv_sec, con->last_ping + manager->ping_interval - start.tv_sec);
 		return 2;
 	}
+	/* A reply came in recently, so the socket works and its round trip is
+	 * known */
+	if ((con->last_reply + manager->ping_interval) > start.tv_sec) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "is_ping: skipping: last reply at %ld, now: %ld", con->last_reply, start.tv_sec);
+		return 2;
+	}
+	/* The next reply on the socket belongs to somebody else */
+	if (con->pending_reply) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "is_ping: skipping: a reply is still pending on %s", con->hash);
+		return 2;
+	}
+	/* Another process may have pinged the server just now */
+	if (!mongo_topology_cache_check(manager, con, MONGO_TOPOLOGY_PING, manager->ping_interval)) {
+		return 2;
+	}
 	packet = bson_create_ping_packet(con);
+	mongo_stats_start(manager, &probe, con);
 	if (!mongo_connect_send_packet(manager, con, packet, &data_buffer, error_message)) {
+		mongo_stats_end(manager, &probe, MONGO_STATS_OP_PING, con, MONGO_STATS_FAILED);
+		mongo_topology_cache_store(manager, con, MONGO_TOPOLOGY_PING, 0);
 		return 0;
 	}
+	mongo_stats_end(manager, &probe, MONGO_STATS_OP_PING, con, 0);
 	gettimeofday(&end, NULL);
 	free(data_buffer);
 
@@ -388,8 +786,11 @@ int mongo_connection_ping(mongo_con_manager *manager, mongo_connection *con, cha
 	if (con->ping_ms < 0) { /* some clocks do weird stuff */
 		con->ping_ms = 0;
 	}
+	mongo_connection_rtt_since(con, &start);
+	mongo_topology_cache_store(manager, con, MONGO_TOPOLOGY_PING, 1);
+	MONGO_TRACE(manager, MONGO_TRACE_PING, con->socket, con->ping_ms, 0, 0);
 
-	mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "is_ping: last pinged at %ld; time: %dms", con->last_ping, con->ping_ms);
+	mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "is_ping: last pinged at %ld; time: %dms, average: %dus", con->last_ping, con->ping_ms, con->rtt_us);
 
 	return 1;
 }
@@ -401,34 +802,125 @@ int mongo_connection_ping(mongo_con_manager *manager, mongo_connection *con, cha
  * Returns:
  * 0: when an error occurred
  * 1: when is master was run and worked
- * 2: when is master wasn't run due to the time-out limit
+ * 2: when is master wasn't run due to the time-out limit, or because the
+ *    reply to another request is still pending on the connection
  * 3: when it all worked, but we need to remove the seed host (due to its name
  *    not being what the server thought it is) - in that case, the server in
  *    the last argument is changed
  */
 int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server)
+{
+	int retval;
+
+	retval = mongo_connection_ismaster_send(manager, con, error_message);
+	if (retval != 1) {
+		return retval;
+	}
+	return mongo_connection_ismaster_reply(manager, con, repl_set_name, nr_hosts, found_hosts, error_message, server);
+}
+
+/**
+ * The first half of mongo_connection_ismaster: sends the ismaster command,
+ * without waiting for its reply. That way, it can be sent to several servers
+ * before any of the replies have come in.
+ *
+ * Returns 1 when it was sent, 0 when an error occurred, and 2 when ismaster
+ * doesn't need to run (see mongo_connection_ismaster).
+ */
+int mongo_connection_ismaster_send(mongo_con_manager *manager, mongo_connection *con, char **error_message)
 {
 	mcon_str      *packet;
-	char          *data_buffer;
-	char          *set = NULL;      /* For replicaset in return */
-	char          *hosts, *ptr, *string;
-	unsigned char  ismaster = 0, arbiter = 0;
-	char          *connected_name, *we_think_we_are;
 	struct timeval now;
-	int            retval = 1;
+	int            sent;
 
 	gettimeofday(&now, NULL);
 	if ((con->last_ismaster + manager->ismaster_interval) > now.tv_sec) {
 		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: skipping: last ran at %ld, now: %ld, time left: %ld", con->last_ismaster, now.tv_sec, con->last_ismaster + manager->ismaster_interval - now.tv_sec);
 		return 2;
 	}
+	if (con->pending_reply) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "ismaster: skipping: a reply is still pending on %s", con->hash);
+		return 2;
+	}
+
+	if (!mongo_topology_cache_check(manager, con, MONGO_TOPOLOGY_ISMASTER, manager->ismaster_interval)) {
+		return 2;
+	}
+
+	if (!mongo_connection_drain_stale_replies(manager, con, error_message)) {
+		mongo_topology_cache_store(manager, con, MONGO_TOPOLOGY_ISMASTER, 0);
+		return 0;
+	}
 
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "ismaster: start");
 	packet = bson_create_ismaster_packet(con);
+	mongo_stats_start(manager, &con->ismaster_probe, con);
+	sent = mongo_io_flush_uncompressed(con, packet->d, packet->l, error_message);
+	mcon_str_ptr_dtor(packet);
 
-	if (!mongo_connect_send_packet(manager, con, packet, &data_buffer, error_message)) {
+	if (sent == -1) {
+		mongo_stats_end(manager, &con->ismaster_probe, MONGO_STATS_OP_ISMASTER, con, MONGO_STATS_FAILED);
+		mongo_topology_cache_store(manager, con, MONGO_TOPOLOGY_ISMASTER, 0);
+		return 0;
+	}
+	return 1;
+}
+
+/* Picks the compressor that is used for everything but the handshake from
+ * the "compression" array of an ismaster reply, which lists the ones out of
+ * what we offered that the server supports. Servers that don't know about
+ * compression leave the array out, and the messages stay as they are. */
+static void mongo_connection_pick_compressor(mongo_con_manager *manager, mongo_connection *con, char *ismaster)
+{
+	char *compression, *name = NULL;
+
+	con->compressor = MONGO_COMPRESSOR_NOOP;
+	if (!con->compressors || !bson_find_field_as_array(ismaster, "compression", &compression)) {
+		return;
+	}
+
+	while (bson_array_find_next_string(&compression, NULL, &name)) {
+		if (name && strcmp(name, "zlib") == 0 && (con->compressors & (1 << MONGO_COMPRESSOR_ZLIB))) {
+			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "compression: using zlib (level %d) with %s", con->zlib_level, con->hash ? con->hash : "a new connection");
+			con->compressor = MONGO_COMPRESSOR_ZLIB;
+			return;
+		}
+	}
+}
+
+static int mongo_connection_ismaster_handle_reply(mongo_con_manager *manager, mongo_connection *con, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server);
+
+/**
+ * The second half of mongo_connection_ismaster: reads and handles the reply
+ * to mongo_connection_ismaster_send. Returns what mongo_connection_ismaster
+ * returns.
+ */
+int mongo_connection_ismaster_reply(mongo_con_manager *manager, mongo_connection *con, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server)
+{
+	int retval;
+
+	retval = mongo_connection_ismaster_handle_reply(manager, con, repl_set_name, nr_hosts, found_hosts, error_message, server);
+	mongo_stats_end(manager, &con->ismaster_probe, MONGO_STATS_OP_ISMASTER, con, retval == 0 ? MONGO_STATS_FAILED : 0);
+	MONGO_TRACE(manager, MONGO_TRACE_ISMASTER, con->socket, retval, 0, 0);
+	mongo_topology_cache_store(manager, con, MONGO_TOPOLOGY_ISMASTER, retval != 0);
+
+	return retval;
+}
+
+static int mongo_connection_ismaster_handle_reply(mongo_con_manager *manager, mongo_connection *con, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server)
+{
+	char          *data_buffer;
+	char          *set = NULL;      /* For replicaset in return */
+	char          *hosts, *ptr, *string;
+	unsigned char  ismaster = 0, arbiter = 0;
+	char          *connected_name, *we_think_we_are;
+	struct timeval now;
+	int            retval = 1;
+
+	if (!mongo_connect_read_reply(manager, con, &data_buffer, error_message)) {
 		return 0;
 	}
+	gettimeofday(&now, NULL);
 
 	/* Find data fields */
 	ptr = data_buffer + sizeof(int32_t); /* Skip the length */
@@ -502,6 +994,8 @@ int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con,
 		*repl_set_name = strdup(set);
 	}
 
+	mongo_connection_pick_compressor(manager, con, ptr);
+
 	/* Check for flags */
 	bson_find_field_as_bool(ptr, "ismaster", &ismaster);
 	bson_find_field_as_bool(ptr, "arbiterOnly", &arbiter);
@@ -578,6 +1072,8 @@ int mongo_connection_get_server_flags(mongo_con_manager *manager, mongo_connecti
 		}
 	}
 
+	mongo_connection_pick_compressor(manager, con, ptr);
+
 	/* Find read preferences tags */
 	con->tag_count = 0;
 	con->tags = NULL;
@@ -4,14 +4,44 @@
 #include "types.h"
 #include "str.h"
 
+#include <sys/time.h>
+
+/* In ms */
+#define MONGO_CONNECTION_DEFAULT_CONNECT_TIMEOUT 1000
+
+/* Weight of a new round trip in the moving average, 1/MONGO_CONNECTION_RTT_WEIGHT */
+#define MONGO_CONNECTION_RTT_WEIGHT 5
+
+/* Sets all options to -1, so that the defaults of the manager are used */
+void mongo_socket_options_init(mongo_socket_options *options);
+
+int mongo_connection_connect(mongo_con_manager *manager, char *host, int port, int timeout, char **error_message);
 mongo_connection *mongo_connection_create(mongo_con_manager *manager, mongo_server_def *server_def, char **error_message);
+int mongo_connection_create_many(mongo_con_manager *manager, mongo_server_def **servers, int count, int timeout, mongo_connection **cons, char **error_messages);
 
 int mongo_connection_get_reqid(mongo_connection *con);
+void mongo_connection_expect_stale_reply(mongo_connection *con, int request_id);
+int mongo_connection_drain_stale_replies(mongo_con_manager *manager, mongo_connection *con, char **error_message);
+
+/* Adds a round trip of rtt_us microseconds to the moving average in
+ * con->rtt_us. mongo_connection_rtt_since does the same for a request that
+ * was sent at start, and also records the reply in con->last_reply so that
+ * mongo_connection_ping can skip the connection. */
+void mongo_connection_rtt_sample(mongo_connection *con, int rtt_us);
+void mongo_connection_rtt_since(mongo_connection *con, struct timeval *start);
 int mongo_connection_ping(mongo_con_manager *manager, mongo_connection *con, char **error_message);
 int mongo_connection_ismaster(mongo_con_manager *manager, mongo_connection *con, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server);
+int mongo_connection_ismaster_send(mongo_con_manager *manager, mongo_connection *con, char **error_message);
+int mongo_connection_ismaster_reply(mongo_con_manager *manager, mongo_connection *con, char **repl_set_name, int *nr_hosts, char ***found_hosts, char **error_message, mongo_server_def *server);
 int mongo_connection_get_server_flags(mongo_con_manager *manager, mongo_connection *con, char **error_message);
 char *mongo_connection_getnonce(mongo_con_manager *manager, mongo_connection *con, char **error_message);
 int mongo_connection_authenticate(mongo_con_manager *manager, mongo_connection *con, char *database, char *username, char *password, char *nonce, char **error_message);
+/* Remembers which index specs have been ensured on a connection, so that
+ * ensuring them again can be skipped until ttl seconds have passed. The cache
+ * goes with the connection, so a reconnect sends them again. */
+int mongo_connection_index_ensured(mongo_connection *con, char *ns, char *spec, int spec_len);
+void mongo_connection_index_remember(mongo_connection *con, char *ns, char *spec, int spec_len, int ttl);
+void mongo_connection_index_forget(mongo_connection *con, char *ns_prefix);
 void mongo_connection_destroy(mongo_con_manager *manager, mongo_connection *con);
 
 #endif
@@ -3,14 +3,25 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#ifdef MONGO_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "types.h"
+#include "bson_helpers.h"
+#include "io.h"
 
 /*
  * Low-level send function.
  *
- * Goes through the buffer sending 4K byte batches.
+ * Hands the whole remainder of the packet to the kernel with every send(),
+ * so a large packet takes as few calls as the socket buffer allows.
  * On failure, sets errmsg to errno string and returns -1.
  * On success, returns number of bytes sent.
  * Does not attempt to reconnect nor throw any exceptions.
@@ -19,23 +30,278 @@
  */
 int mongo_io_send(int sock, char *packet, int total, char **error_message)
 {
-	int sent = 0, status = 1;
+	mongo_io_vec piece;
+
+	piece.data = packet;
+	piece.len = total;
+
+	return mongo_io_sendv(sock, &piece, 1, error_message);
+}
+
+/*
+ * Scatter-gather version of mongo_io_send: sends count pieces, in order, as
+ * if they were one packet, with writev() (WSASend() on Windows) so they don't
+ * have to be copied together first. Returns the number of bytes sent, or -1
+ * with *error_message set.
+ */
+int mongo_io_sendv(int sock, mongo_io_vec *pieces, int count, char **error_message)
+{
+#ifdef WIN32
+	WSABUF iov[MONGO_IO_MAX_VECS];
+#else
+	struct iovec iov[MONGO_IO_MAX_VECS];
+#endif
+	int i, n, sent = 0, skip = 0;
+
+	/* skip is how much of pieces[0] has been sent already */
+	while (count > 0) {
+		int status;
 
-	while (sent < total && status > 0) {
-		int len = 4096 < (total - sent) ? 4096 : total - sent;
+		for (n = 0; n < count && n < MONGO_IO_MAX_VECS; n++) {
+#ifdef WIN32
+			iov[n].buf = pieces[n].data + (n == 0 ? skip : 0);
+			iov[n].len = pieces[n].len - (n == 0 ? skip : 0);
+#else
+			iov[n].iov_base = pieces[n].data + (n == 0 ? skip : 0);
+			iov[n].iov_len = pieces[n].len - (n == 0 ? skip : 0);
+#endif
+		}
 
-		status = send(sock, (const char*)packet + sent, len, 0);
+#ifdef WIN32
+		{
+			DWORD written;
+
+			status = WSASend(sock, iov, n, &written, 0, NULL, NULL) == 0 ? (int) written : -1;
+		}
+#else
+		status = writev(sock, iov, n);
+#endif
 
 		if (status == -1) {
+#ifndef WIN32
+			if (errno == EINTR) {
+				continue;
+			}
+#endif
 			*error_message = strdup(strerror(errno));
 			return -1;
 		}
 		sent += status;
+
+		/* move past the pieces that have been sent completely */
+		status += skip;
+		skip = 0;
+		for (i = 0; i < count && status >= pieces[i].len; i++) {
+			status -= pieces[i].len;
+		}
+		pieces += i;
+		count -= i;
+		skip = status;
 	}
 
 	return sent;
 }
 
+/* Appends packet to the writes queued on con, growing the queue if needed */
+static void append_to_queue(mongo_connection *con, char *packet, int total)
+{
+	if (con->write_buf_len + total > con->write_buf_size) {
+		con->write_buf_size = con->write_buf_size * 2 > con->write_buf_len + total ? con->write_buf_size * 2 : con->write_buf_len + total;
+		con->write_buf = realloc(con->write_buf, con->write_buf_size);
+	}
+
+	memcpy(con->write_buf + con->write_buf_len, packet, total);
+	con->write_buf_len += total;
+}
+
+/*
+ * Queues packet (a message that gets no reply) to be sent on con later,
+ * together with other queued messages and the next request that is sent with
+ * mongo_io_flush. Once threshold bytes are queued, they are sent right away.
+ *
+ * Returns total, or -1 with *error_message set if sending failed.
+ */
+int mongo_io_queue(mongo_connection *con, char *packet, int total, int threshold, char **error_message)
+{
+	if (con->write_buf_len + total >= threshold) {
+		return mongo_io_flush(con, packet, total, error_message);
+	}
+
+	append_to_queue(con, packet, total);
+	return total;
+}
+
+/* Writes the OP_COMPRESSED version of the message, a complete request, to
+ * out, which has room for MONGO_IO_COMPRESSED_HEADER_SIZE + compressBound()
+ * of the message's body. Returns the length, or -1 with *error_message set. */
+static int compress_message(mongo_connection *con, char *message, int length, char *out, char **error_message)
+{
+#ifdef MONGO_HAVE_ZLIB
+	uLongf compressed_length = compressBound(length - MONGO_IO_HEADER_SIZE);
+	int    value;
+
+	if (compress2((Bytef*) out + MONGO_IO_COMPRESSED_HEADER_SIZE, &compressed_length, (Bytef*) message + MONGO_IO_HEADER_SIZE, length - MONGO_IO_HEADER_SIZE, con->zlib_level) != Z_OK) {
+		*error_message = strdup("Couldn't compress the message with zlib");
+		return -1;
+	}
+
+	/* the request ID and response to stay the same */
+	value = MONGO_32(MONGO_IO_COMPRESSED_HEADER_SIZE + (int) compressed_length);
+	memcpy(out, &value, 4);
+	memcpy(out + 4, message + 4, 8);
+	value = MONGO_32(MONGO_OP_COMPRESSED);
+	memcpy(out + 12, &value, 4);
+	memcpy(out + 16, message + 12, 4); /* the original opcode */
+	value = MONGO_32(length - MONGO_IO_HEADER_SIZE);
+	memcpy(out + 20, &value, 4);
+	out[24] = MONGO_COMPRESSOR_ZLIB;
+
+	return MONGO_IO_COMPRESSED_HEADER_SIZE + compressed_length;
+#else
+	*error_message = strdup("zlib compression is not available");
+	return -1;
+#endif
+}
+
+/* Sends the queue and the pieces of con as one OP_COMPRESSED message for
+ * every message they hold. Returns the number of bytes that went out, or -1
+ * with *error_message set. */
+static int send_compressed(mongo_connection *con, mongo_io_vec *pieces, int count, char **error_message)
+{
+	char *plain, *compressed;
+	int   i, length, plain_length = con->write_buf_len, pos, out_length = 0, bound = 0, status;
+
+	for (i = 0; i < count; i++) {
+		plain_length += pieces[i].len;
+	}
+	if (plain_length == 0) {
+		return 0;
+	}
+
+	/* the messages can be split over the pieces, so they're put together first */
+	plain = malloc(plain_length);
+	memcpy(plain, con->write_buf, con->write_buf_len);
+	pos = con->write_buf_len;
+	for (i = 0; i < count; i++) {
+		memcpy(plain + pos, pieces[i].data, pieces[i].len);
+		pos += pieces[i].len;
+	}
+
+	for (pos = 0; pos < plain_length; pos += length) {
+		length = plain_length - pos >= 4 ? MONGO_32(*(int*)(plain + pos)) : 0;
+		if (length < MONGO_IO_HEADER_SIZE || length > plain_length - pos) {
+			*error_message = strdup("Can't compress a message with an invalid length");
+			free(plain);
+			return -1;
+		}
+#ifdef MONGO_HAVE_ZLIB
+		bound += MONGO_IO_COMPRESSED_HEADER_SIZE + compressBound(length - MONGO_IO_HEADER_SIZE);
+#endif
+	}
+
+	compressed = malloc(bound + 1);
+	for (pos = 0; pos < plain_length; pos += length) {
+		length = MONGO_32(*(int*)(plain + pos));
+		status = compress_message(con, plain + pos, length, compressed + out_length, error_message);
+		if (status == -1) {
+			free(compressed);
+			free(plain);
+			return -1;
+		}
+		out_length += status;
+	}
+	free(plain);
+
+	status = mongo_io_send(con->socket, compressed, out_length, error_message);
+	free(compressed);
+
+	return status;
+}
+
+/* Does the work of the flush functions, compress says whether the messages
+ * go out as OP_COMPRESSED ones */
+static int flushv(mongo_connection *con, mongo_io_vec *pieces, int count, int compress, char **error_message)
+{
+	mongo_io_vec vecs[MONGO_IO_MAX_VECS];
+	int i, total = 0, status;
+
+	for (i = 0; i < count; i++) {
+		total += pieces[i].len;
+	}
+	con->bytes_sent += total + con->write_buf_len;
+
+	if (compress) {
+		status = send_compressed(con, pieces, count, error_message);
+		con->write_buf_len = 0;
+
+		return status == -1 ? -1 : total;
+	}
+
+	if (con->write_buf_len == 0) {
+		return count ? mongo_io_sendv(con->socket, pieces, count, error_message) : 0;
+	}
+
+	/* the queue goes first, in front of the pieces */
+	if (count < MONGO_IO_MAX_VECS) {
+		vecs[0].data = con->write_buf;
+		vecs[0].len = con->write_buf_len;
+		memcpy(vecs + 1, pieces, count * sizeof(mongo_io_vec));
+
+		status = mongo_io_sendv(con->socket, vecs, count + 1, error_message);
+	} else {
+		status = mongo_io_send(con->socket, con->write_buf, con->write_buf_len, error_message);
+		if (status != -1) {
+			status = mongo_io_sendv(con->socket, pieces, count, error_message);
+		}
+	}
+	con->write_buf_len = 0;
+
+	return status == -1 ? -1 : total;
+}
+
+/*
+ * Sends the messages queued on con, followed by packet (which may be NULL),
+ * with as few send() calls as possible. Every request on a connection has to
+ * go through here (or mongo_io_flushv), so that the database gets the messages
+ * in the order in which they were made. When the server agreed to a
+ * compressor, each message is sent as an OP_COMPRESSED one.
+ *
+ * Returns total, or -1 with *error_message set on failure. The queue is empty
+ * afterwards either way.
+ */
+int mongo_io_flush(mongo_connection *con, char *packet, int total, char **error_message)
+{
+	mongo_io_vec piece;
+
+	piece.data = packet;
+	piece.len = total;
+
+	return mongo_io_flushv(con, &piece, total ? 1 : 0, error_message);
+}
+
+/*
+ * Like mongo_io_flush, but never compresses, which the handshake and the
+ * authentication commands have to be.
+ */
+int mongo_io_flush_uncompressed(mongo_connection *con, char *packet, int total, char **error_message)
+{
+	mongo_io_vec piece;
+
+	piece.data = packet;
+	piece.len = total;
+
+	return flushv(con, &piece, total ? 1 : 0, 0, error_message);
+}
+
+/*
+ * Like mongo_io_flush, but sends count pieces after the queued messages.
+ * Returns the number of bytes of the pieces, or -1 with *error_message set.
+ */
+int mongo_io_flushv(mongo_connection *con, mongo_io_vec *pieces, int count, char **error_message)
+{
+	return flushv(con, pieces, count, con->compressor != MONGO_COMPRESSOR_NOOP, error_message);
+}
+
 /*
  * Low-level receive functions.
  *
@@ -82,61 +348,344 @@ int mongo_io_recv_data(int sock, void *dest, int size, char **error_message)
 	return received;
 }
 
-/* Wait on socket availability with a timeout
- * TODO: Port to use poll() instead of select().
- *
- * Returns:
- * 0 on success
- * -1 on failure, but not critical enough to throw an exception
- * 1.. on failure, and throw an exception. The return value is the error code
- */
-int mongo_io_wait_with_timeout(int sock, int to, char **error_message)
+/* recv() with the error handling of the buffered receive functions. Returns
+ * the number of bytes received, or 0 when the socket was closed and -1 on
+ * failure, with *error_message set in both cases. */
+static int recv_some(mongo_connection *con, char *dest, int size, char **error_message)
 {
-	while (1) {
-		int status;
-		struct timeval timeout;
-		fd_set readfds, exceptfds;
+	int num;
 
-		FD_ZERO(&readfds);
-		FD_SET(sock, &readfds);
-		FD_ZERO(&exceptfds);
-		FD_SET(sock, &exceptfds);
+	do {
+		num = recv(con->socket, dest, size, 0);
+	} while (num == -1 && errno == EINTR);
 
-		timeout.tv_sec = to / 1000 ;
-		timeout.tv_usec = (to % 1000) * 1000;
+	if (num == -1) {
+		/* the socketTimeoutMS option ran out */
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			*error_message = strdup("Timed out reading from the socket");
+		} else {
+			*error_message = strdup(strerror(errno));
+		}
+	} else if (num == 0) {
+		*error_message = strdup("The socket is closed");
+	}
+	return num;
+}
 
-		status = select(sock+1, &readfds, NULL, &exceptfds, &timeout);
+/* Reads size bytes from the socket, through the read buffer of con, without
+ * any regard for message boundaries. Returns what mongo_io_recv_buffered
+ * returns. */
+static int recv_plain(mongo_connection *con, char *dest, int size, char **error_message)
+{
+	int received = 0, num, buffered;
 
-		if (status == -1) {
-			/* on EINTR, retry - this resets the timeout however to its full length */
-			if (errno == EINTR) {
-				continue;
+	while (received < size) {
+		buffered = con->read_buf_len - con->read_buf_pos;
+
+		if (buffered > 0) {
+			int len = buffered < size - received ? buffered : size - received;
+
+			memcpy(dest + received, con->read_buf + con->read_buf_pos, len);
+			con->read_buf_pos += len;
+			received += len;
+			continue;
+		}
+
+		if (size - received >= MONGO_IO_READ_BUFFER_SIZE) {
+			num = recv_some(con, dest + received, size - received, error_message);
+			if (num > 0) {
+				received += num;
+			}
+		} else {
+			/* a buffer that was grown for an inflated reply isn't kept */
+			if (con->read_buf_size > MONGO_IO_READ_BUFFER_SIZE) {
+				free(con->read_buf);
+				con->read_buf = NULL;
+			}
+			if (!con->read_buf) {
+				con->read_buf = malloc(MONGO_IO_READ_BUFFER_SIZE);
+				con->read_buf_size = MONGO_IO_READ_BUFFER_SIZE;
 			}
+			num = recv_some(con, con->read_buf, MONGO_IO_READ_BUFFER_SIZE, error_message);
+			con->read_buf_pos = 0;
+			con->read_buf_len = num > 0 ? num : 0;
+		}
 
-			*error_message = strdup(strerror(errno));
-			return 13;
+		if (num == -1) {
+			return -1;
+		} else if (num == 0) {
+			return received;
+		}
+	}
+
+	return received;
+}
+
+/* Makes sure that the first want bytes of the buffered data are in the read
+ * buffer of con. Returns 1, or 0 with *error_message set. */
+static int fill_read_buf(mongo_connection *con, int want, char **error_message)
+{
+	int num, buffered = con->read_buf_len - con->read_buf_pos;
+
+	if (buffered >= want) {
+		return 1;
+	}
+
+	if (!con->read_buf) {
+		con->read_buf = malloc(MONGO_IO_READ_BUFFER_SIZE);
+		con->read_buf_size = MONGO_IO_READ_BUFFER_SIZE;
+	}
+	memmove(con->read_buf, con->read_buf + con->read_buf_pos, buffered);
+	con->read_buf_pos = 0;
+	con->read_buf_len = buffered;
+
+	while (con->read_buf_len < want) {
+		num = recv_some(con, con->read_buf + con->read_buf_len, con->read_buf_size - con->read_buf_len, error_message);
+		if (num <= 0) {
+			return 0;
 		}
+		con->read_buf_len += num;
+	}
+	return 1;
+}
+
+/* Turns the OP_COMPRESSED message in compressed into the message that it
+ * holds, and puts that in front of the rest of the buffered data. Returns 1,
+ * or 0 with *error_message set. */
+static int inflate_message(mongo_connection *con, char *compressed, int length, char **error_message)
+{
+	char *buf;
+	int   value, size, body_length, buffered = con->read_buf_len - con->read_buf_pos;
+	char  compressor = compressed[24];
+
+	body_length = MONGO_32(*(int*)(compressed + 20));
+	if (body_length < 0 || body_length > MONGO_IO_MAX_INFLATED_SIZE) {
+		*error_message = malloc(256);
+		snprintf(*error_message, 256, "The uncompressed size of a reply is invalid: %d", body_length);
+		return 0;
+	}
+
+	size = MONGO_IO_HEADER_SIZE + body_length + buffered;
+	if (size < MONGO_IO_READ_BUFFER_SIZE) {
+		size = MONGO_IO_READ_BUFFER_SIZE;
+	}
+	buf = malloc(size);
+
+	switch (compressor) {
+		case MONGO_COMPRESSOR_NOOP:
+			if (body_length != length - MONGO_IO_COMPRESSED_HEADER_SIZE) {
+				free(buf);
+				*error_message = strdup("The size of an uncompressed reply does not match its length");
+				return 0;
+			}
+			memcpy(buf + MONGO_IO_HEADER_SIZE, compressed + MONGO_IO_COMPRESSED_HEADER_SIZE, body_length);
+			break;
+
+#ifdef MONGO_HAVE_ZLIB
+		case MONGO_COMPRESSOR_ZLIB: {
+			uLongf inflated_length = body_length;
 
-		if (FD_ISSET(sock, &exceptfds)) {
-			*error_message = strdup("Exceptional condition on socket");
-			return 17;
+			if (
+				uncompress((Bytef*) buf + MONGO_IO_HEADER_SIZE, &inflated_length, (Bytef*) compressed + MONGO_IO_COMPRESSED_HEADER_SIZE, length - MONGO_IO_COMPRESSED_HEADER_SIZE) != Z_OK ||
+				inflated_length != (uLongf) body_length
+			) {
+				free(buf);
+				*error_message = strdup("Couldn't decompress a reply with zlib");
+				return 0;
+			}
+			break;
 		}
+#endif
 
-		if (status == 0 && !FD_ISSET(sock, &readfds)) {
+		default:
+			free(buf);
 			*error_message = malloc(256);
-			snprintf(
-				*error_message, 256,
-				"cursor timed out (timeout: %d, time left: %ld:%ld, status: %d)", 
-				to, timeout.tv_sec, timeout.tv_usec, status
-			);
-			return 80;
+			snprintf(*error_message, 256, "A reply was compressed with an unsupported compressor: %d", compressor);
+			return 0;
+	}
+
+	/* the header of the original message, with the request ID and response to
+	 * of the compressed one */
+	value = MONGO_32(MONGO_IO_HEADER_SIZE + body_length);
+	memcpy(buf, &value, 4);
+	memcpy(buf + 4, compressed + 4, 8);
+	memcpy(buf + 12, compressed + 16, 4);
+
+	memcpy(buf + MONGO_IO_HEADER_SIZE + body_length, con->read_buf + con->read_buf_pos, buffered);
+	free(con->read_buf);
+	con->read_buf = buf;
+	con->read_buf_size = size;
+	con->read_buf_pos = 0;
+	con->read_buf_len = MONGO_IO_HEADER_SIZE + body_length + buffered;
+	con->read_msg_left = MONGO_IO_HEADER_SIZE + body_length;
+
+	return 1;
+}
+
+/* Called at the start of every message on a connection that uses compression:
+ * finds out how long the message is, and replaces an OP_COMPRESSED one with
+ * the message it holds. Returns 1, or 0 with *error_message set. */
+static int read_next_message(mongo_connection *con, char **error_message)
+{
+	char *header, *compressed;
+	int   length, retval;
+
+	if (!fill_read_buf(con, MONGO_IO_HEADER_SIZE, error_message)) {
+		return 0;
+	}
+	header = con->read_buf + con->read_buf_pos;
+	length = MONGO_32(*(int*)header);
+
+	if (MONGO_32(*(int*)(header + 12)) != MONGO_OP_COMPRESSED) {
+		con->read_msg_left = length < MONGO_IO_HEADER_SIZE ? MONGO_IO_HEADER_SIZE : length;
+		return 1;
+	}
+
+	if (length < MONGO_IO_COMPRESSED_HEADER_SIZE) {
+		*error_message = malloc(256);
+		snprintf(*error_message, 256, "The length of a compressed reply is invalid: %d", length);
+		return 0;
+	}
+
+	compressed = malloc(length);
+	if (recv_plain(con, compressed, length, error_message) != length) {
+		free(compressed);
+		return 0;
+	}
+	retval = inflate_message(con, compressed, length, error_message);
+	free(compressed);
+
+	return retval;
+}
+
+/*
+ * Buffered receive function.
+ *
+ * Reads from the socket in chunks of up to MONGO_IO_READ_BUFFER_SIZE bytes and
+ * keeps what is left over in the connection for the next call, so that the
+ * header and a small body of a reply cost a single recv() together. Reads
+ * that are larger than the buffer go straight into dest, once the buffered
+ * data has been used.
+ *
+ * When the connection uses compression, compressed replies are decompressed
+ * as they come in, so that callers only ever see the original messages.
+ *
+ * Returns the number of bytes read, which is less than size if the socket was
+ * closed (*error_message is set then), or -1 with *error_message set on
+ * failure.
+ */
+int mongo_io_recv_buffered(mongo_connection *con, void *dest, int size, char **error_message)
+{
+	int received = 0, len, num;
+
+	if (con->compressor == MONGO_COMPRESSOR_NOOP) {
+		received = recv_plain(con, (char*) dest, size, error_message);
+		if (received > 0) {
+			con->bytes_received += received;
+		}
+		return received;
+	}
+
+	while (received < size) {
+		if (con->read_msg_left == 0 && !read_next_message(con, error_message)) {
+			return -1;
+		}
+
+		len = size - received < con->read_msg_left ? size - received : con->read_msg_left;
+		num = recv_plain(con, (char*) dest + received, len, error_message);
+		if (num == -1) {
+			return -1;
 		}
+		received += num;
+		con->read_msg_left -= num;
 
-		/* if our descriptor is ready break out */
-		if (FD_ISSET(sock, &readfds)) {
+		if (num < len) {
 			break;
 		}
 	}
+	con->bytes_received += received;
+
+	return received;
+}
+
+/* Returns whether data was read from the socket that hasn't been consumed yet,
+ * in which case there is no need to wait for the socket to become readable */
+int mongo_io_has_buffered_data(mongo_connection *con)
+{
+	return con->read_buf_pos < con->read_buf_len;
+}
+
+/* poll(), but with a deadline: when it gets interrupted by a signal, it waits
+ * for what is left of the timeout only, instead of starting over. A timeout
+ * of less than 0 waits forever. Returns what poll() returns.
+ *
+ * There is no epoll/kqueue variant, as every wait here is on a set that is
+ * built for just that wait, and registering the sockets with those would
+ * cost as much as the poll() itself. */
+int mongo_io_poll(struct pollfd *fds, int count, int timeout)
+{
+	struct timeval start, now;
+	int status, left = timeout;
+
+	gettimeofday(&start, NULL);
+
+	while (1) {
+#ifdef WIN32
+		status = WSAPoll(fds, count, left);
+		if (status == SOCKET_ERROR && WSAGetLastError() == WSAEINTR) {
+			errno = EINTR;
+		}
+#else
+		status = poll(fds, count, left);
+#endif
+		if (status != -1 || errno != EINTR) {
+			return status;
+		}
+
+		if (timeout >= 0) {
+			gettimeofday(&now, NULL);
+			left = timeout - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+			if (left <= 0) {
+				return 0;
+			}
+		}
+	}
+}
+
+/* Wait on socket availability with a timeout
+ *
+ * Returns:
+ * 0 on success
+ * -1 on failure, but not critical enough to throw an exception
+ * 1.. on failure, and throw an exception. The return value is the error code
+ */
+int mongo_io_wait_with_timeout(int sock, int to, char **error_message)
+{
+	struct pollfd pfd;
+	int status;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	status = mongo_io_poll(&pfd, 1, to);
+
+	if (status == -1) {
+		*error_message = strdup(strerror(errno));
+		return 13;
+	}
+
+	if (status == 0) {
+		*error_message = malloc(256);
+		snprintf(*error_message, 256, "cursor timed out (timeout: %d, status: %d)", to, status);
+		return 80;
+	}
+
+	/* a hang up still has to be read, to find out that the socket is closed */
+	if ((pfd.revents & (POLLERR | POLLNVAL)) && !(pfd.revents & POLLIN)) {
+		*error_message = strdup("Exceptional condition on socket");
+		return 17;
+	}
 
 	return 0;
 }
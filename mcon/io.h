@@ -1,9 +1,47 @@
 #ifndef __MCON_IO_H__
 #define __MCON_IO_H__
 
+#include "types.h"
+
+#ifdef WIN32
+# include <winsock2.h>
+#else
+# include <poll.h>
+#endif
+
+#define MONGO_IO_READ_BUFFER_SIZE 65536
+
+/* The standard message header, and the one of OP_COMPRESSED, which adds the
+ * original opcode, the uncompressed size and the compressor ID */
+#define MONGO_IO_HEADER_SIZE            16
+#define MONGO_IO_COMPRESSED_HEADER_SIZE 25
+#define MONGO_OP_COMPRESSED             2012
+
+/* Largest reply that is decompressed, which is well over the 48MB a reply can
+ * hold */
+#define MONGO_IO_MAX_INFLATED_SIZE (64 * 1024 * 1024)
+
+/* Most pieces that are handed to the kernel in one writev() call */
+#define MONGO_IO_MAX_VECS 64
+
+/* A piece of a packet, for mongo_io_sendv and mongo_io_flushv */
+typedef struct _mongo_io_vec
+{
+	char *data;
+	int   len;
+} mongo_io_vec;
+
+int mongo_io_poll(struct pollfd *fds, int count, int timeout);
 int mongo_io_wait_with_timeout(int sock, int to, char **error_message);
 int mongo_io_send(int sock, char *packet, int total, char **error_message);
+int mongo_io_sendv(int sock, mongo_io_vec *pieces, int count, char **error_message);
+int mongo_io_queue(mongo_connection *con, char *packet, int total, int threshold, char **error_message);
+int mongo_io_flush(mongo_connection *con, char *packet, int total, char **error_message);
+int mongo_io_flush_uncompressed(mongo_connection *con, char *packet, int total, char **error_message);
+int mongo_io_flushv(mongo_connection *con, mongo_io_vec *pieces, int count, char **error_message);
 int mongo_io_recv_header(int sock, char *reply_buffer, int size, char **error_message);
 int mongo_io_recv_data(int sock, void *dest, int size, char **error_message);
+int mongo_io_recv_buffered(mongo_connection *con, void *dest, int size, char **error_message);
+int mongo_io_has_buffered_data(mongo_connection *con);
 
 #endif
@@ -11,6 +11,11 @@
 #include "collection.h"
 #include "parse.h"
 #include "read_preference.h"
+#include "io.h"
+#include "topology_cache.h"
+#include "resolver.h"
+#include "stats.h"
+#include "trace.h"
 
 /* Helpers */
 static int authenticate_connection(mongo_con_manager *manager, mongo_connection *con, char *database, char *username, char *password, char **error_message)
@@ -29,35 +34,129 @@ static int authenticate_connection(mongo_con_manager *manager, mongo_connection
 	return retval;
 }
 
+/* Makes sure that con is authenticated with the credentials of server, which
+ * takes no round trips if it is already, or if there are none (or if the
+ * socket still has a reply coming for someone else). A socket can
+ * only carry one user per database, so a different user for the same database
+ * replaces the one it has. Returns 1 if it worked, or 0 with *error_message
+ * set. */
+int mongo_manager_connection_authenticate(mongo_con_manager *manager, mongo_connection *con, mongo_server_def *server, char **error_message)
+{
+	mongo_connection_auth **ptr, *auth;
+	char *auth_hash;
+
+	if (!server || !server->db || !server->username || !server->password) {
+		return 1;
+	}
+
+	auth_hash = mongo_server_create_hashed_password(server->username, server->password);
+	for (ptr = &con->auths; *ptr; ptr = &(*ptr)->next) {
+		if (strcmp((*ptr)->db, server->db) == 0) {
+			break;
+		}
+	}
+	if (*ptr && strcmp((*ptr)->username, server->username) == 0 && strcmp((*ptr)->auth_hash, auth_hash) == 0) {
+		free(auth_hash);
+		return 1;
+	}
+
+	/* The reply to getnonce would be mistaken for the one that a prefetching
+	 * or exhaust cursor waits for, so the socket is left as it is, just like
+	 * mongo_connection_ping does. It is authenticated on a later use, once
+	 * nothing is pending anymore. */
+	if (con->pending_reply || mongo_io_has_buffered_data(con)) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "not authenticating %s as %s on %s yet: a reply is still pending", con->hash, server->username, server->db);
+		free(auth_hash);
+		return 1;
+	}
+
+	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "authenticating %s as %s on %s", con->hash, server->username, server->db);
+	if (!authenticate_connection(manager, con, server->db, server->username, server->password, error_message)) {
+		/* it's not known which user the database has now */
+		if (*ptr) {
+			auth = *ptr;
+			*ptr = auth->next;
+			free(auth->db);
+			free(auth->username);
+			free(auth->auth_hash);
+			free(auth);
+		}
+		free(auth_hash);
+		return 0;
+	}
+
+	if (*ptr) {
+		auth = *ptr;
+		free(auth->username);
+		free(auth->auth_hash);
+	} else {
+		auth = calloc(1, sizeof(mongo_connection_auth));
+		auth->db = strdup(server->db);
+		auth->next = con->auths;
+		con->auths = auth;
+	}
+	auth->username = strdup(server->username);
+	auth->auth_hash = auth_hash;
+
+	return 1;
+}
+
+/* Returns the hash that the connection to server is registered under. When
+ * the sockets are shared between credentials, that hash has none. */
+static char *create_hash(mongo_con_manager *manager, mongo_server_def *server)
+{
+	mongo_server_def tmp;
+
+	if (!manager->share_auth) {
+		return mongo_server_create_hash(server);
+	}
+
+	tmp = *server;
+	tmp.db = NULL;
+	tmp.username = NULL;
+	tmp.password = NULL;
+	return mongo_server_create_hash(&tmp);
+}
+
+/* Authenticates and pings a connection that has just been made, and
+ * registers it. Returns NULL, with the connection destroyed and
+ * *error_message set, if either of those fails. */
+static mongo_connection *mongo_setup_new_connection(mongo_con_manager *manager, mongo_server_def *server, mongo_connection *con, char *hash, char **error_message)
+{
+	/* Store hash */
+	con->hash = strdup(hash);
+	/* Do authentication if requested. Shared sockets are only authenticated
+	 * once they get used with the credentials. */
+	if (!manager->share_auth && !mongo_manager_connection_authenticate(manager, con, server, error_message)) {
+		mongo_connection_destroy(manager, con);
+		return NULL;
+	}
+	/* Do the ping */
+	if (!mongo_connection_ping(manager, con, error_message)) {
+		mongo_connection_destroy(manager, con);
+		return NULL;
+	}
+	/* Register the connection */
+	mongo_manager_connection_register(manager, con);
+
+	/* Kept for opening more sockets to the server, see
+	 * mongo_manager_connection_checkout */
+	manager->connections_last->server = malloc(sizeof(mongo_server_def));
+	mongo_server_def_copy(manager->connections_last->server, server, MONGO_SERVER_COPY_CREDENTIALS);
+	return con;
+}
+
 static mongo_connection *mongo_get_connection_single(mongo_con_manager *manager, mongo_server_def *server, int connection_flags, char **error_message)
 {
 	char *hash;
 	mongo_connection *con = NULL;
 
-	hash = mongo_server_create_hash(server);
+	hash = create_hash(manager, server);
 	con = mongo_manager_connection_find_by_hash(manager, hash);
 	if (!con && !(connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
 		con = mongo_connection_create(manager, server, error_message);
 		if (con) {
-			/* Store hash */
-			con->hash = strdup(hash);
-			/* Do authentication if requested */
-			if (server->db && server->username && server->password) {
-				mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "get_connection_single: authenticating %s", hash);
-				if (!authenticate_connection(manager, con, server->db, server->username, server->password, error_message)) {
-					mongo_connection_destroy(manager, con);
-					con = NULL;
-					goto bailout;
-				}
-			}
-			/* Do the ping */
-			if (!mongo_connection_ping(manager, con, error_message)) {
-				mongo_connection_destroy(manager, con);
-				con = NULL;
-				goto bailout;
-			}
-			/* Register the connection */
-			mongo_manager_connection_register(manager, con);
+			con = mongo_setup_new_connection(manager, server, con, hash, error_message);
 		}
 	} else if (!(connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
 		/* Do the ping */
@@ -72,97 +171,269 @@ bailout:
 	return con;
 }
 
+/* Connects to all the servers in the seed list that there is no connection
+ * for yet at the same time, so that a server that is down only costs one
+ * connect timeout instead of one on top of every other server. Returns an
+ * array with the error message for each server that could not be connected
+ * to (NULL for the others), or NULL if all of them are connected. */
+static char **mongo_connect_seeds(mongo_con_manager *manager, mongo_servers *servers)
+{
+	mongo_server_def **todo;
+	mongo_connection **cons;
+	char             **todo_errors, **errors = NULL;
+	int               *todo_index;
+	char              *hash;
+	int                i, count = 0;
+
+	todo = calloc(servers->count, sizeof(mongo_server_def*));
+	todo_index = calloc(servers->count, sizeof(int));
+	for (i = 0; i < servers->count; i++) {
+		hash = create_hash(manager, servers->server[i]);
+		if (!mongo_manager_connection_find_by_hash(manager, hash)) {
+			todo[count] = servers->server[i];
+			todo_index[count] = i;
+			count++;
+		}
+		free(hash);
+	}
+
+	if (count > 0) {
+		cons = calloc(count, sizeof(mongo_connection*));
+		todo_errors = calloc(count, sizeof(char*));
+		errors = calloc(servers->count, sizeof(char*));
+
+		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "connect_seeds: connecting to %d servers at once", count);
+		mongo_connection_create_many(manager, todo, count, MONGO_CONNECTION_DEFAULT_CONNECT_TIMEOUT, cons, todo_errors);
+
+		for (i = 0; i < count; i++) {
+			if (cons[i]) {
+				hash = create_hash(manager, todo[i]);
+				/* the same server can be in the seed list twice */
+				if (mongo_manager_connection_find_by_hash(manager, hash)) {
+					cons[i]->hash = strdup(hash);
+					mongo_connection_destroy(manager, cons[i]);
+				} else {
+					mongo_setup_new_connection(manager, todo[i], cons[i], hash, &todo_errors[i]);
+				}
+				free(hash);
+			}
+			errors[todo_index[i]] = todo_errors[i];
+		}
+
+		free(cons);
+		free(todo_errors);
+	}
+
+	free(todo);
+	free(todo_index);
+	return errors;
+}
+
 /* Topology discovery */
 
 /* - Helpers */
+
+/* Returns the index of a connection in cons (skipping the NULL ones) that
+ * has its reply waiting, blocking until one has. Returns -1 when cons has no
+ * connections left. */
+static int mongo_wait_for_reply(mongo_connection **cons, int count)
+{
+	struct pollfd *pfds;
+	int i, nr = 0, found = -1;
+
+	for (i = 0; i < count; i++) {
+		if (cons[i]) {
+			if (mongo_io_has_buffered_data(cons[i])) {
+				return i;
+			}
+			nr++;
+			found = i;
+		}
+	}
+	if (nr <= 1) {
+		return found;
+	}
+
+	pfds = calloc(count, sizeof(struct pollfd));
+	for (i = 0; i < count; i++) {
+		pfds[i].fd = cons[i] ? cons[i]->socket : -1;
+		pfds[i].events = POLLIN;
+	}
+	/* if polling goes wrong, reading the first one simply blocks */
+	if (mongo_io_poll(pfds, count, -1) > 0) {
+		for (i = 0; i < count; i++) {
+			if (pfds[i].revents) {
+				found = i;
+				break;
+			}
+		}
+	}
+	free(pfds);
+
+	return found;
+}
+
+/* Adds the host "host:port" to new_defs, unless there is a connection for it
+ * already or it is in the list already */
+static void mongo_add_found_host(mongo_con_manager *manager, mongo_server_def *seed, char *found_host, mongo_server_def ***new_defs, int *new_count)
+{
+	mongo_server_def *tmp_def;
+	char *tmp_hash, *hash;
+	int i;
+
+	/* Create a temp server definition to create a new connection */
+	tmp_def = calloc(1, sizeof(mongo_server_def));
+	tmp_def->username = seed->username ? strdup(seed->username) : NULL;
+	tmp_def->password = seed->password ? strdup(seed->password) : NULL;
+	tmp_def->db = seed->db ? strdup(seed->db) : NULL;
+	tmp_def->host = strndup(found_host, strchr(found_host, ':') - found_host);
+	tmp_def->port = atoi(strchr(found_host, ':') + 1);
+	tmp_def->options = seed->options;
+
+	/* Create a hash so that we can check whether we already have a
+	 * connection for this server definition, or are about to make one. */
+	tmp_hash = create_hash(manager, tmp_def);
+	if (mongo_manager_connection_find_by_hash(manager, tmp_hash)) {
+		mongo_server_def_dtor(tmp_def);
+		free(tmp_hash);
+		return;
+	}
+	for (i = 0; i < *new_count; i++) {
+		hash = create_hash(manager, (*new_defs)[i]);
+		if (strcmp(hash, tmp_hash) == 0) {
+			free(hash);
+			mongo_server_def_dtor(tmp_def);
+			free(tmp_hash);
+			return;
+		}
+		free(hash);
+	}
+	free(tmp_hash);
+
+	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "discover_topology: found new host: %s:%d", tmp_def->host, tmp_def->port);
+	*new_defs = realloc(*new_defs, (*new_count + 1) * sizeof(mongo_server_def*));
+	(*new_defs)[*new_count] = tmp_def;
+	(*new_count)++;
+}
+
+/* Connects to all the new hosts at once. The ones that could be connected to
+ * are added to the list of servers that we're processing, so we might use
+ * them to find more servers. */
+static void mongo_connect_found_hosts(mongo_con_manager *manager, mongo_servers *servers, mongo_server_def **new_defs, int new_count)
+{
+	mongo_connection **cons;
+	char             **errors;
+	char              *hash;
+	int                i;
+
+	cons = calloc(new_count, sizeof(mongo_connection*));
+	errors = calloc(new_count, sizeof(char*));
+	mongo_connection_create_many(manager, new_defs, new_count, servers->connectTimeoutMS, cons, errors);
+
+	for (i = 0; i < new_count; i++) {
+		if (cons[i]) {
+			hash = create_hash(manager, new_defs[i]);
+			cons[i] = mongo_setup_new_connection(manager, new_defs[i], cons[i], hash, &errors[i]);
+			free(hash);
+		}
+		if (cons[i]) {
+			mongo_servers_add(servers, new_defs[i]);
+		} else {
+			mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "discover_topology: could not connect to new host: %s:%d: %s", new_defs[i]->host, new_defs[i]->port, errors[i]);
+			mongo_server_def_dtor(new_defs[i]);
+		}
+		free(errors[i]);
+	}
+
+	free(cons);
+	free(errors);
+}
+
+/* Runs ismaster on all servers at once and collects the replies as they
+ * come in. The new hosts that are found are connected to at once as well, and
+ * are then asked in the next round, until no new hosts turn up. */
 static void mongo_discover_topology(mongo_con_manager *manager, mongo_servers *servers)
 {
-	int i, j;
+	int i, j, k, start = 0, end;
 	char *hash;
-	mongo_connection *con;
+	mongo_connection *con, **cons;
 	char *error_message;
 	char *repl_set_name = servers->repl_set_name ? strdup(servers->repl_set_name) : NULL;
 	int nr_hosts;
 	char **found_hosts = NULL;
-	char *tmp_hash;
+	mongo_server_def **new_defs;
+	int   new_count;
 	int   res;
 
-	for (i = 0; i < servers->count; i++) {
-		hash = mongo_server_create_hash(servers->server[i]);
-		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "discover_topology: checking ismaster for %s", hash);
-		con = mongo_manager_connection_find_by_hash(manager, hash);
-
-		if (!con) {
-			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: couldn't create a connection for %s", hash);
+	while (start < servers->count) {
+		end = servers->count;
+		cons = calloc(end - start, sizeof(mongo_connection*));
+		new_defs = NULL;
+		new_count = 0;
+
+		for (i = start; i < end; i++) {
+			hash = create_hash(manager, servers->server[i]);
+			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "discover_topology: checking ismaster for %s", hash);
+			con = mongo_manager_connection_find_by_hash(manager, hash);
+
+			if (!con) {
+				mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: couldn't create a connection for %s", hash);
+				free(hash);
+				continue;
+			}
 			free(hash);
-			continue;
-		}
-		
-		res = mongo_connection_ismaster(manager, con, (char**) &repl_set_name, (int*) &nr_hosts, (char***) &found_hosts, (char**) &error_message, servers->server[i]);
-		switch (res) {
-			case 0:
-				/* Something is wrong with the connection, we need to remove
-				 * this from our list */
+
+			res = mongo_connection_ismaster_send(manager, con, (char**) &error_message);
+			if (res == 0) {
 				mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: ismaster return with an error for %s:%d: [%s]", servers->server[i]->host, servers->server[i]->port, error_message);
 				free(error_message);
 				mongo_manager_connection_deregister(manager, con);
-				break;
+			} else if (res == 2) {
+				mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "discover_topology: ismaster got skipped");
+			} else {
+				cons[i - start] = con;
+			}
+		}
 
-			case 3:
-				mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: ismaster worked, but we need to remove the seed host's connection");
-				mongo_manager_connection_deregister(manager, con);
-				/* Break intentionally missing */
-
-			case 1:
-				mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "discover_topology: ismaster worked");
-				for (j = 0; j < nr_hosts; j++) {
-					mongo_server_def *tmp_def;
-					mongo_connection *new_con;
-					char *con_error_message = NULL;
-
-					/* Create a temp server definition to create a new connection */
-					tmp_def = calloc(1, sizeof(mongo_server_def));
-					tmp_def->username = servers->server[i]->username ? strdup(servers->server[i]->username) : NULL;
-					tmp_def->password = servers->server[i]->password ? strdup(servers->server[i]->password) : NULL;
-					tmp_def->db = servers->server[i]->db ? strdup(servers->server[i]->db) : NULL;
-					tmp_def->host = strndup(found_hosts[j], strchr(found_hosts[j], ':') - found_hosts[j]);
-					tmp_def->port = atoi(strchr(found_hosts[j], ':') + 1);
-					
-					/* Create a hash so that we can check whether we already have a
-					 * connection for this server definition. If we don't create
-					 * the connection, register it (done in
-					 * mongo_get_connection_single) and add it to the list of
-					 * servers that we're processing so we might use this host to
-					 * find more servers. */
-					tmp_hash = mongo_server_create_hash(tmp_def);
-					if (!mongo_manager_connection_find_by_hash(manager, tmp_hash)) {
-						mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "discover_topology: found new host: %s:%d", tmp_def->host, tmp_def->port);
-						new_con = mongo_get_connection_single(manager, tmp_def, MONGO_CON_FLAG_WRITE, (char **) &con_error_message);
-						if (new_con) {
-							servers->server[servers->count] = tmp_def;
-							servers->count++;
-						} else {
-							mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "discover_topology: could not connect to new host: %s:%d: %s", tmp_def->host, tmp_def->port, con_error_message);
-							free(con_error_message);
-						}
-					} else {
-						mongo_server_def_dtor(tmp_def);
+		while ((j = mongo_wait_for_reply(cons, end - start)) != -1) {
+			con = cons[j];
+			cons[j] = NULL;
+			i = start + j;
+
+			res = mongo_connection_ismaster_reply(manager, con, (char**) &repl_set_name, (int*) &nr_hosts, (char***) &found_hosts, (char**) &error_message, servers->server[i]);
+			switch (res) {
+				case 0:
+					/* Something is wrong with the connection, we need to remove
+					 * this from our list */
+					mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: ismaster return with an error for %s:%d: [%s]", servers->server[i]->host, servers->server[i]->port, error_message);
+					free(error_message);
+					mongo_manager_connection_deregister(manager, con);
+					break;
+
+				case 3:
+					mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "discover_topology: ismaster worked, but we need to remove the seed host's connection");
+					mongo_manager_connection_deregister(manager, con);
+					/* Break intentionally missing */
+
+				case 1:
+					mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "discover_topology: ismaster worked");
+					for (k = 0; k < nr_hosts; k++) {
+						mongo_add_found_host(manager, servers->server[i], found_hosts[k], &new_defs, &new_count);
+						free(found_hosts[k]);
 					}
-					free(tmp_hash);
-
-					/* Cleanup */
-					free(found_hosts[j]);
-				}
-				free(found_hosts);
-				found_hosts = NULL;
-				break;
+					free(found_hosts);
+					found_hosts = NULL;
+					break;
+			}
+		}
+		free(cons);
 
-			case 2:
-				mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "discover_topology: ismaster got skipped");
-				break;
+		if (new_count) {
+			mongo_connect_found_hosts(manager, servers, new_defs, new_count);
 		}
+		free(new_defs);
 
-		free(hash);
+		start = end;
 	}
 	if (repl_set_name) {
 		free(repl_set_name);
@@ -178,9 +449,23 @@ static mongo_connection *mongo_get_read_write_connection_replicaset(mongo_con_ma
 	char             *auth_hash = NULL;
 	int i;
 	int found_connected_server = 0;
+	char            **seed_errors = NULL;
+
+	/* Connect to all the servers in the seed list that we have no connection
+	 * for yet at once */
+	if (!(connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
+		seed_errors = mongo_connect_seeds(manager, servers);
+	}
 
 	/* Create a connection to every of the servers in the seed list */
 	for (i = 0; i < servers->count; i++) {
+		/* Don't try again, the error is the same */
+		if (seed_errors && seed_errors[i]) {
+			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "Couldn't connect to '%s:%d': %s", servers->server[i]->host, servers->server[i]->port, seed_errors[i]);
+			free(seed_errors[i]);
+			continue;
+		}
+
 		tmp = mongo_get_connection_single(manager, servers->server[i], connection_flags, (char **) &con_error_message);
 
 		if (tmp) {
@@ -190,6 +475,7 @@ static mongo_connection *mongo_get_read_write_connection_replicaset(mongo_con_ma
 			free(con_error_message);
 		}
 	}
+	free(seed_errors);
 	if (!found_connected_server && (connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
 		return NULL;
 	}
@@ -197,8 +483,9 @@ static mongo_connection *mongo_get_read_write_connection_replicaset(mongo_con_ma
 	/* Discover more nodes. This also adds a connection to "servers" for each
 	 * new node */
 	mongo_discover_topology(manager, servers);
-	/* Create the authentication hash to filter connections */
-	if (servers->server[0]->username && servers->server[0]->password) {
+	/* Create the authentication hash to filter connections, shared sockets
+	 * have no credentials in theirs */
+	if (!manager->share_auth && servers->server[0]->username && servers->server[0]->password) {
 		auth_hash = mongo_server_create_hashed_password(servers->server[0]->username, servers->server[0]->password);
 	}
 	/* Depending on whether we want a read or a write connection, run the correct algorithms */
@@ -217,7 +504,7 @@ static mongo_connection *mongo_get_read_write_connection_replicaset(mongo_con_ma
 		goto bailout;
 	}
 	collection = mongo_sort_servers(manager, collection, &servers->read_pref);
-	collection = mongo_select_nearest_servers(manager, collection, &servers->read_pref);
+	collection = mongo_select_nearest_servers(manager, collection, &servers->read_pref, servers->secondaryAcceptableLatencyMS);
 	con = mongo_pick_server_from_set(manager, collection, &servers->read_pref);
 
 bailout:
@@ -227,7 +514,130 @@ bailout:
 }
 
 
-static mongo_connection *mongo_get_connection_multiple(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, char **error_message)
+/* Finds another member than first that the read preference rp allows, from
+ * the nearest ones, for sending a query to a second time (see hedged reads in
+ * cursor.c). Nothing is connected or discovered, as that would take longer
+ * than the reply that is already late. Returns NULL if there is no such
+ * member. */
+mongo_connection *mongo_get_hedge_connection(mongo_con_manager *manager, mongo_servers *servers, mongo_read_preference *rp, mongo_connection *first)
+{
+	mongo_connection *con = NULL;
+	mcon_collection  *collection;
+	char             *auth_hash = NULL;
+	int i;
+
+	if (servers->con_type != MONGO_CON_TYPE_REPLSET || rp->type == MONGO_RP_PRIMARY) {
+		return NULL;
+	}
+
+	if (!manager->share_auth && servers->server[0]->username && servers->server[0]->password) {
+		auth_hash = mongo_server_create_hashed_password(servers->server[0]->username, servers->server[0]->password);
+	}
+	collection = mongo_find_candidate_servers(manager, rp, auth_hash);
+	if (!collection || collection->count < 2) {
+		goto bailout;
+	}
+	collection = mongo_sort_servers(manager, collection, rp);
+	collection = mongo_select_nearest_servers(manager, collection, rp, servers->secondaryAcceptableLatencyMS);
+
+	/* They're sorted by how near they are, so the first other one will do */
+	for (i = 0; i < collection->count; i++) {
+		if (strcmp(((mongo_connection*)collection->data[i])->hash, first->hash) != 0) {
+			con = (mongo_connection*)collection->data[i];
+			break;
+		}
+	}
+
+bailout:
+	if (collection) {
+		mcon_collection_free(collection);
+	}
+	free(auth_hash);
+	return con;
+}
+
+/* Server ejection */
+static char *ejection_key(mongo_server_def *server)
+{
+	char *key = malloc(strlen(server->host) + 1 + 10 + 1);
+
+	sprintf(key, "%s:%d", server->host, server->port);
+	return key;
+}
+
+static mongo_ejected_server **find_ejected_server(mongo_con_manager *manager, mongo_server_def *server)
+{
+	mongo_ejected_server **ptr;
+	char *key = ejection_key(server);
+
+	for (ptr = &manager->ejected_servers; *ptr; ptr = &(*ptr)->next) {
+		if (strcmp((*ptr)->host, key) == 0) {
+			break;
+		}
+	}
+	free(key);
+	return ptr;
+}
+
+/* Returns whether server failed recently enough to be left alone still */
+int mongo_manager_server_is_ejected(mongo_con_manager *manager, mongo_server_def *server)
+{
+	mongo_ejected_server *ejected = *find_ejected_server(manager, server);
+
+	return ejected && ejected->until > time(NULL);
+}
+
+/* Records a failure of server, which ejects it for eject_time seconds, twice
+ * as long for every failure in a row before it. Once that time is up, the
+ * next request tries the server again. */
+void mongo_manager_server_eject(mongo_con_manager *manager, mongo_server_def *server)
+{
+	mongo_ejected_server **ptr = find_ejected_server(manager, server);
+	int shift;
+
+	if (!*ptr) {
+		*ptr = calloc(1, sizeof(mongo_ejected_server));
+		(*ptr)->host = ejection_key(server);
+	}
+	shift = (*ptr)->failures < MONGO_MANAGER_MAX_EJECT_SHIFT ? (*ptr)->failures : MONGO_MANAGER_MAX_EJECT_SHIFT;
+	(*ptr)->failures++;
+	(*ptr)->until = time(NULL) + (manager->eject_time << shift);
+
+	mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "ejecting %s for %ld seconds after %d failures", (*ptr)->host, manager->eject_time << shift, (*ptr)->failures);
+}
+
+/* Forgets the failures of server, as it worked again */
+void mongo_manager_server_restore(mongo_con_manager *manager, mongo_server_def *server)
+{
+	mongo_ejected_server **ptr, *ejected;
+
+	if (!manager->ejected_servers) {
+		return;
+	}
+
+	ptr = find_ejected_server(manager, server);
+	if (*ptr) {
+		ejected = *ptr;
+		*ptr = ejected->next;
+		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "%s works again after %d failures", ejected->host, ejected->failures);
+		free(ejected->host);
+		free(ejected);
+	}
+}
+
+static void free_ejected_servers(mongo_con_manager *manager)
+{
+	mongo_ejected_server *next;
+
+	while (manager->ejected_servers) {
+		next = manager->ejected_servers->next;
+		free(manager->ejected_servers->host);
+		free(manager->ejected_servers);
+		manager->ejected_servers = next;
+	}
+}
+
+static mongo_connection *mongo_get_connection_multiple(mongo_con_manager *manager, mongo_servers *all_servers, int connection_flags, char **error_message)
 {
 	mongo_connection *con = NULL;
 	mongo_connection *tmp;
@@ -238,17 +648,54 @@ static mongo_connection *mongo_get_connection_multiple(mongo_con_manager *manage
 	int i;
 	int found_connected_server = 0;
 	mcon_str         *messages;
+	char            **seed_errors = NULL;
+	mongo_servers     available, *servers = all_servers;
+	int               eject = all_servers->con_type == MONGO_CON_TYPE_MULTIPLE && !(connection_flags & MONGO_CON_FLAG_DONT_CONNECT);
 
 	mcon_str_ptr_init(messages);
 
+	/* The mongos routers that failed a moment ago are skipped, unless all of
+	 * them did */
+	if (eject && manager->ejected_servers) {
+		available = *all_servers;
+		available.count = 0;
+		available.server = malloc(all_servers->count * sizeof(mongo_server_def*));
+		for (i = 0; i < all_servers->count; i++) {
+			if (!mongo_manager_server_is_ejected(manager, all_servers->server[i])) {
+				available.server[available.count++] = all_servers->server[i];
+			}
+		}
+		if (available.count > 0) {
+			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "get_connection_multiple: skipping %d ejected servers", all_servers->count - available.count);
+			servers = &available;
+		} else {
+			free(available.server);
+		}
+	}
+
+	if (!(connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
+		seed_errors = mongo_connect_seeds(manager, servers);
+	}
+
 	/* Create a connection to every of the servers in the seed list */
 	for (i = 0; i < servers->count; i++) {
-		tmp = mongo_get_connection_single(manager, servers->server[i], connection_flags, (char **) &con_error_message);
+		if (seed_errors && seed_errors[i]) {
+			tmp = NULL;
+			con_error_message = seed_errors[i];
+		} else {
+			tmp = mongo_get_connection_single(manager, servers->server[i], connection_flags, (char **) &con_error_message);
+		}
 
 		if (tmp) {
 			found_connected_server = 1;
+			if (eject) {
+				mongo_manager_server_restore(manager, servers->server[i]);
+			}
 		} else if (!(connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
 			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "Couldn't connect to '%s:%d': %s", servers->server[i]->host, servers->server[i]->port, con_error_message);
+			if (eject) {
+				mongo_manager_server_eject(manager, servers->server[i]);
+			}
 			if (messages->l) {
 				mcon_str_addl(messages, "; ", 2, 0);
 			}
@@ -260,14 +707,20 @@ static mongo_connection *mongo_get_connection_multiple(mongo_con_manager *manage
 			mcon_str_add(messages, con_error_message, 1); /* Also frees con_error_message */
 		}
 	}
+	free(seed_errors);
+	if (servers == &available) {
+		free(available.server);
+	}
+	servers = all_servers;
 
 	/* If we don't have a connected server then there is no point in continueing */
 	if (!found_connected_server && (connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
 		return NULL;
 	}
 
-	/* Create the authentication hash to filter connections */
-	if (servers->server[0]->username && servers->server[0]->password) {
+	/* Create the authentication hash to filter connections, shared sockets
+	 * have no credentials in theirs */
+	if (!manager->share_auth && servers->server[0]->username && servers->server[0]->password) {
 		auth_hash = mongo_server_create_hashed_password(servers->server[0]->username, servers->server[0]->password);
 	}
 	/* Force the RP of NEAREST, which is the only one that makes sense right
@@ -286,7 +739,7 @@ static mongo_connection *mongo_get_connection_multiple(mongo_con_manager *manage
 		goto bailout;
 	}
 	collection = mongo_sort_servers(manager, collection, &servers->read_pref);
-	collection = mongo_select_nearest_servers(manager, collection, &servers->read_pref);
+	collection = mongo_select_nearest_servers(manager, collection, &servers->read_pref, servers->secondaryAcceptableLatencyMS);
 	con = mongo_pick_server_from_set(manager, collection, &servers->read_pref);
 
 bailout:
@@ -299,13 +752,105 @@ bailout:
 }
 
 /* API interface to fetch a connection */
+/* Binding */
+static int read_preference_equals(mongo_read_preference *a, mongo_read_preference *b)
+{
+	int i, j;
+
+	if (a->type != b->type || a->tagset_count != b->tagset_count) {
+		return 0;
+	}
+	for (i = 0; i < a->tagset_count; i++) {
+		if (a->tagsets[i]->tag_count != b->tagsets[i]->tag_count) {
+			return 0;
+		}
+		for (j = 0; j < a->tagsets[i]->tag_count; j++) {
+			if (strcmp(a->tagsets[i]->tags[j], b->tagsets[i]->tags[j]) != 0) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Returns the connection that was picked for servers before, when that is
+ * still valid, and pings it if that is due */
+static mongo_connection *find_bound_connection(mongo_con_manager *manager, mongo_servers *servers, int slot, char **error_message)
+{
+	mongo_server_binding *binding = &servers->bound[slot];
+	mongo_connection     *con;
+
+	if (!binding->hash || binding->epoch != manager->binding_epoch) {
+		return NULL;
+	}
+	if (slot == MONGO_SERVER_BOUND_READ && !read_preference_equals(&binding->rp, &servers->read_pref)) {
+		return NULL;
+	}
+
+	con = mongo_manager_connection_find_by_hash(manager, binding->hash);
+	if (!con) {
+		return NULL;
+	}
+	/* The member could have become a secondary since the last ismaster */
+	if (slot == MONGO_SERVER_BOUND_WRITE && servers->con_type == MONGO_CON_TYPE_REPLSET && con->connection_type != MONGO_NODE_PRIMARY) {
+		return NULL;
+	}
+	if (!mongo_connection_ping(manager, con, error_message)) {
+		mongo_manager_connection_deregister(manager, con);
+		free(*error_message);
+		*error_message = NULL;
+		return NULL;
+	}
+
+	mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "mongo_get_read_write_connection: reusing the bound connection %s", con->hash);
+	return con;
+}
+
+static void bind_connection(mongo_con_manager *manager, mongo_servers *servers, int slot, mongo_connection *con)
+{
+	mongo_server_binding *binding = &servers->bound[slot];
+
+	if (binding->hash) {
+		free(binding->hash);
+	}
+	binding->hash = strdup(con->hash);
+	binding->epoch = manager->binding_epoch;
+
+	if (slot == MONGO_SERVER_BOUND_READ) {
+		mongo_read_preference_dtor(&binding->rp);
+		mongo_read_preference_copy(&servers->read_pref, &binding->rp);
+	}
+}
+
+/* Makes every mongo_servers pick its connections again, on their next use */
+void mongo_manager_unbind_all(mongo_con_manager *manager)
+{
+	manager->binding_epoch++;
+}
+
+/* Once a connection has been picked for reads or writes with servers, it is
+ * used for the rest of the request, until it fails, the member steps down or
+ * the read preference changes. That saves the lookups, the topology
+ * discovery and the candidate selection for all but the first operation. */
 mongo_connection *mongo_get_read_write_connection(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, char **error_message)
 {
+	mongo_connection *con = NULL;
+	int slot = connection_flags & MONGO_CON_FLAG_WRITE ? MONGO_SERVER_BOUND_WRITE : MONGO_SERVER_BOUND_READ;
+	int bindable = !(connection_flags & MONGO_CON_FLAG_DONT_CONNECT);
+
+	if (bindable) {
+		con = find_bound_connection(manager, servers, slot, error_message);
+		if (con) {
+			goto authenticate;
+		}
+	}
+
 	/* Which connection we return depends on the type of connection we want */
 	switch (servers->con_type) {
 		case MONGO_CON_TYPE_STANDALONE:
 			mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "mongo_get_read_write_connection: finding a STANDALONE connection");
-			return mongo_get_connection_multiple(manager, servers, connection_flags, error_message);
+			con = mongo_get_connection_multiple(manager, servers, connection_flags, error_message);
+			break;
 
 		case MONGO_CON_TYPE_REPLSET:
 			mongo_manager_log(
@@ -313,36 +858,289 @@ mongo_connection *mongo_get_read_write_connection(mongo_con_manager *manager, mo
 				"mongo_get_read_write_connection: finding a REPLSET connection (%s)",
 				connection_flags & MONGO_CON_FLAG_WRITE ? "write" : "read"
 			);
-			return mongo_get_read_write_connection_replicaset(manager, servers, connection_flags, error_message);
+			con = mongo_get_read_write_connection_replicaset(manager, servers, connection_flags, error_message);
+			break;
 
 		case MONGO_CON_TYPE_MULTIPLE:
 			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "mongo_get_read_write_connection: finding a MULTIPLE connection");
-			return mongo_get_connection_multiple(manager, servers, connection_flags, error_message);
+			con = mongo_get_connection_multiple(manager, servers, connection_flags, error_message);
+			break;
 
 		default:
 			mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "mongo_get_read_write_connection: connection type %d is not supported", servers->con_type);
 			*error_message = strdup("mongo_get_read_write_connection: Unknown connection type requested");
 	}
-	return NULL;
+
+	if (con && bindable) {
+		bind_connection(manager, servers, slot, con);
+	}
+
+authenticate:
+	/* A shared socket is authenticated on its first use with these credentials */
+	if (con && manager->share_auth && !(connection_flags & MONGO_CON_FLAG_DONT_CONNECT)) {
+		if (!mongo_manager_connection_authenticate(manager, con, servers->server[0], error_message)) {
+			return NULL;
+		}
+	}
+	return con;
 }
 
 /* Connection management */
 
 /* - Helpers */
+#define MONGO_MANAGER_INITIAL_BUCKETS 16
+
+/* FNV-1a */
+static unsigned int hash_string(char *str)
+{
+	unsigned int value = 2166136261U;
+
+	while (*str) {
+		value ^= (unsigned char) *str++;
+		value *= 16777619U;
+	}
+	return value;
+}
+
+static mongo_con_manager_item *find_item(mongo_con_manager *manager, char *hash)
+{
+	mongo_con_manager_item *ptr;
+	unsigned int value;
+
+	if (!manager->buckets) {
+		return NULL;
+	}
+
+	value = hash_string(hash);
+	for (ptr = manager->buckets[value % manager->bucket_count]; ptr; ptr = ptr->bucket_next) {
+		if (ptr->hash_value == value && strcmp(ptr->hash, hash) == 0) {
+			return ptr;
+		}
+	}
+	return NULL;
+}
+
+static void add_to_bucket(mongo_con_manager *manager, mongo_con_manager_item *item)
+{
+	mongo_con_manager_item **bucket = &manager->buckets[item->hash_value % manager->bucket_count];
+
+	item->bucket_next = *bucket;
+	*bucket = item;
+}
+
+/* Doubles the number of buckets once there are more connections than
+ * buckets, so that chains stay short */
+static void grow_buckets(mongo_con_manager *manager)
+{
+	mongo_con_manager_item *ptr;
+
+	if (manager->buckets && manager->connection_count <= manager->bucket_count) {
+		return;
+	}
+
+	free(manager->buckets);
+	manager->bucket_count = manager->buckets ? manager->bucket_count * 2 : MONGO_MANAGER_INITIAL_BUCKETS;
+	manager->buckets = calloc(manager->bucket_count, sizeof(mongo_con_manager_item*));
+
+	for (ptr = manager->connections; ptr; ptr = ptr->next) {
+		add_to_bucket(manager, ptr);
+	}
+}
+
 mongo_connection *mongo_manager_connection_find_by_hash(mongo_con_manager *manager, char *hash)
+{
+	mongo_con_manager_item *ptr = find_item(manager, hash);
+
+	if (ptr) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "found connection %s (looking for %s)", ptr->hash, hash);
+		return ptr->connection;
+	}
+	return NULL;
+}
+
+/* Returns whether con is still one of the sockets to the server of hash: the
+ * registered connection or one of its pool. A pointer that was kept while
+ * connections may have been destroyed is checked with this before it is
+ * used. */
+int mongo_manager_connection_has_socket(mongo_con_manager *manager, char *hash, mongo_connection *con)
+{
+	mongo_con_manager_item *item = find_item(manager, hash);
+	mongo_connection *ptr;
+
+	if (!item || !con) {
+		return 0;
+	}
+	if (item->connection == con) {
+		return 1;
+	}
+	for (ptr = item->pool; ptr; ptr = ptr->pool_next) {
+		if (ptr == con) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Drops the ensured index cache of all connections for the namespaces
+ * starting with ns_prefix */
+void mongo_manager_forget_indexes(mongo_con_manager *manager, char *ns_prefix)
 {
 	mongo_con_manager_item *ptr = manager->connections;
 
 	while (ptr) {
-		if (strcmp(ptr->hash, hash) == 0) {
-			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "found connection %s (looking for %s)", ptr->hash, hash);
-			return ptr->connection;
-		}
+		mongo_connection_index_forget(ptr->connection, ns_prefix);
 		ptr = ptr->next;
 	}
+}
+
+/* The pings that mongo_get_connection_single would otherwise run when a
+ * request needs the connection. Sockets of the pool are not checked, a
+ * failure shows up on them once they're used. */
+void mongo_manager_check_idle_connections(mongo_con_manager *manager)
+{
+	mongo_con_manager_item *item, *next;
+	char *error_message = NULL;
+
+	for (item = manager->connections; item; item = next) {
+		next = item->next;
+
+		if (item->connection->busy || item->connection->pending_reply || item->connection->stale_count || mongo_io_has_buffered_data(item->connection)) {
+			continue;
+		}
+		if (!mongo_connection_ping(manager, item->connection, &error_message)) {
+			mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "idle check: dropping %s: %s", item->hash, error_message);
+			free(error_message);
+			error_message = NULL;
+			mongo_manager_connection_deregister(manager, item->connection);
+		}
+	}
+}
+
+/* Connection pool */
+static int connection_is_free(mongo_connection *con)
+{
+	return con->busy == 0 && con->pending_reply == NULL;
+}
+
+/* Opens another socket to the server of item, and adds it to its pool */
+static mongo_connection *add_pool_connection(mongo_con_manager *manager, mongo_con_manager_item *item)
+{
+	mongo_server_def *server = item->server;
+	mongo_connection *con;
+	char *error_message = NULL;
+
+	con = mongo_connection_create(manager, server, &error_message);
+	if (!con) {
+		goto failed;
+	}
+	con->hash = strdup(item->hash);
+
+	if (!manager->share_auth && !mongo_manager_connection_authenticate(manager, con, server, &error_message)) {
+		mongo_connection_destroy(manager, con);
+		goto failed;
+	}
+
+	/* What the server is was found out on the registered connection already */
+	con->connection_type = item->connection->connection_type;
+	con->ping_ms = item->connection->ping_ms;
+
+	con->pool_next = item->pool;
+	item->pool = con;
+	item->pool_count++;
+
+	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "pool: opened socket %d of %d to %s", item->pool_count + 1, manager->pool_size, item->hash);
+	return con;
+
+failed:
+	mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "pool: couldn't open another socket to %s: %s", item->hash, error_message);
+	free(error_message);
 	return NULL;
 }
 
+/* Returns a socket to the same server as con that has no request in flight:
+ * con itself, one of the other sockets in its pool, or a new one if the pool
+ * is smaller than manager->pool_size. When all of them are busy, con is
+ * shared, just like it would be without a pool; its replies are then read in
+ * the order the requests were sent. The socket that is returned is marked
+ * busy until mongo_manager_connection_checkin is called for it.
+ *
+ * When the sockets are shared between credentials, another socket than con
+ * is authenticated with those of server first (which may be NULL). If that
+ * fails, con is shared instead. */
+mongo_connection *mongo_manager_connection_checkout(mongo_con_manager *manager, mongo_connection *con, mongo_server_def *server)
+{
+	mongo_con_manager_item *item;
+	mongo_connection *found = NULL, *ptr;
+
+	item = find_item(manager, con->hash);
+	if (!item || connection_is_free(con)) {
+		found = con;
+	} else {
+		for (ptr = item->pool; ptr; ptr = ptr->pool_next) {
+			if (connection_is_free(ptr)) {
+				found = ptr;
+				break;
+			}
+		}
+
+		if (!found && item->server && item->pool_count + 1 < manager->pool_size) {
+			found = add_pool_connection(manager, item);
+		}
+		if (found && manager->share_auth) {
+			char *error_message = NULL;
+
+			if (!mongo_manager_connection_authenticate(manager, found, server, &error_message)) {
+				mongo_manager_log(manager, MLOG_CON, MLOG_WARN, "pool: couldn't authenticate another socket to %s: %s", item->hash, error_message);
+				free(error_message);
+				found = NULL;
+			}
+		}
+		if (!found) {
+			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "pool: all sockets to %s are busy, sharing %s", item->hash, con->hash);
+			found = con;
+		}
+	}
+
+	found->busy++;
+	return found;
+}
+
+void mongo_manager_connection_checkin(mongo_con_manager *manager, mongo_connection *con)
+{
+	if (con->busy > 0) {
+		con->busy--;
+	}
+}
+
+static void destroy_pool(mongo_con_manager *manager, mongo_con_manager_item *item)
+{
+	mongo_connection *next;
+
+	while (item->pool) {
+		next = item->pool->pool_next;
+		mongo_connection_destroy(manager, item->pool);
+		item->pool = next;
+	}
+	item->pool_count = 0;
+}
+
+/* Takes con out of the pool of item, and destroys it. Returns 0 if con is
+ * not in the pool. */
+static int remove_pool_connection(mongo_con_manager *manager, mongo_con_manager_item *item, mongo_connection *con)
+{
+	mongo_connection **ptr;
+
+	for (ptr = &item->pool; *ptr; ptr = &(*ptr)->pool_next) {
+		if (*ptr == con) {
+			*ptr = con->pool_next;
+			item->pool_count--;
+			mongo_connection_destroy(manager, con);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static mongo_con_manager_item *create_new_manager_item(void)
 {
 	mongo_con_manager_item *tmp = malloc(sizeof(mongo_con_manager_item));
@@ -354,6 +1152,10 @@ static mongo_con_manager_item *create_new_manager_item(void)
 static inline void free_manager_item(mongo_con_manager *manager, mongo_con_manager_item *item)
 {
 	mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "freeing connection %s", item->hash);
+	destroy_pool(manager, item);
+	if (item->server) {
+		mongo_server_def_dtor(item->server);
+	}
 	free(item->hash);
 	free(item);
 }
@@ -369,62 +1171,73 @@ static void destroy_manager_item(mongo_con_manager *manager, mongo_con_manager_i
 
 void mongo_manager_connection_register(mongo_con_manager *manager, mongo_connection *con)
 {
-	mongo_con_manager_item *ptr = manager->connections;
 	mongo_con_manager_item *new;
 
 	/* Setup new entry */
 	new = create_new_manager_item();
 	new->hash = strdup(con->hash);
+	new->hash_value = hash_string(con->hash);
 	new->connection = con;
-	new->next = NULL;
 
-	if (!ptr) { /* No connections at all yet */
+	/* Append it, so that the registration order is kept */
+	new->prev = manager->connections_last;
+	if (manager->connections_last) {
+		manager->connections_last->next = new;
+	} else {
 		manager->connections = new;
+	}
+	manager->connections_last = new;
+	manager->connection_count++;
+
+	/* A freshly grown table already includes the new item */
+	if (manager->buckets && manager->connection_count <= manager->bucket_count) {
+		add_to_bucket(manager, new);
 	} else {
-		/* Existing connections, so find the last one */
-		do {
-			if (!ptr->next) {
-				ptr->next = new;
-				break;
-			}
-			ptr = ptr->next;
-		} while (1);
+		grow_buckets(manager);
 	}
 }
 
 int mongo_manager_connection_deregister(mongo_con_manager *manager, mongo_connection *con)
 {
-	mongo_con_manager_item *ptr = manager->connections;
-	mongo_con_manager_item *prev = NULL;
+	mongo_con_manager_item *ptr, **bucket;
+
+	/* Whatever was bound to it, or picked while it was around, is picked
+	 * again */
+	mongo_manager_unbind_all(manager);
 
 	/* Remove from manager */
-	/* - if there are no connections, simply return false */
+	/* - if it's not known, simply return false */
+	ptr = find_item(manager, con->hash);
 	if (!ptr) {
 		return 0;
 	}
-	/* Loop over existing connections and compare hashes */
-	do {
-		/* The connection is the one we're looking for */
-		if (strcmp(ptr->hash, con->hash) == 0) {
-			if (prev == NULL) { /* It's the first one in the list... */
-				manager->connections = ptr->next;
-			} else {
-				prev->next = ptr->next;
-			}
-			/* Free structures */
-			mongo_connection_destroy(manager, con);
-			free_manager_item(manager, ptr);
 
-			/* Woo! */
-			return 1;
-		}
+	/* A socket from the pool only takes itself down */
+	if (ptr->connection != con) {
+		return remove_pool_connection(manager, ptr, con);
+	}
 
-		/* Next iteration */
-		prev = ptr;
-		ptr = ptr->next;
-	} while (ptr);
+	for (bucket = &manager->buckets[ptr->hash_value % manager->bucket_count]; *bucket != ptr; bucket = &(*bucket)->bucket_next) {
+	}
+	*bucket = ptr->bucket_next;
 
-	return 0;
+	if (ptr->prev) {
+		ptr->prev->next = ptr->next;
+	} else {
+		manager->connections = ptr->next;
+	}
+	if (ptr->next) {
+		ptr->next->prev = ptr->prev;
+	} else {
+		manager->connections_last = ptr->prev;
+	}
+	manager->connection_count--;
+
+	/* Free structures */
+	mongo_connection_destroy(manager, con);
+	free_manager_item(manager, ptr);
+
+	return 1;
 }
 
 /* Logging */
@@ -432,6 +1245,10 @@ void mongo_manager_log(mongo_con_manager *manager, int module, int level, char *
 {
 	va_list arg;
 
+	if (!mongo_manager_log_enabled(manager, module, level)) {
+		return;
+	}
+
 	va_start(arg, format);
 	if (manager->log_function) {
 		manager->log_function(module, level, manager->log_context, format, arg);
@@ -470,9 +1287,18 @@ mongo_con_manager *mongo_init(void)
 
 	tmp->log_context = NULL;
 	tmp->log_function = mongo_log_null;
+	tmp->log_modules = MLOG_ALL;
+	tmp->log_levels = MLOG_WARN | MLOG_INFO | MLOG_FINE;
 
 	tmp->ping_interval = MONGO_MANAGER_DEFAULT_PING_INTERVAL;
 	tmp->ismaster_interval = MONGO_MANAGER_DEFAULT_MASTER_INTERVAL;
+	tmp->pool_size = MONGO_MANAGER_DEFAULT_POOL_SIZE;
+	tmp->eject_time = MONGO_MANAGER_DEFAULT_EJECT_TIME;
+
+	memset(&tmp->socket_options, 0, sizeof(mongo_socket_options));
+	tmp->socket_options.nodelay = 1;
+	tmp->socket_options.keepalive = 1;
+	tmp->socket_options.zlib_level = -1;
 
 	return tmp;
 }
@@ -484,5 +1310,14 @@ void mongo_deinit(mongo_con_manager *manager)
 		destroy_manager_item(manager, manager->connections);
 	}
 
+	if (manager->topology_cache) {
+		mongo_topology_cache_close(manager->topology_cache);
+	}
+	mongo_resolver_cache_free(manager);
+	mongo_parse_cache_free(manager);
+	mongo_stats_free(manager);
+	mongo_trace_free(manager->trace);
+	free_ejected_servers(manager);
+	free(manager->buckets);
 	free(manager);
 }
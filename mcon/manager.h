@@ -11,14 +11,37 @@ void mongo_deinit(mongo_con_manager *manager);
 /* Fetching connections */
 /* connection_flags: Bitfield consisting of MONGO_CON_FLAG_READ/MONGO_CON_FLAG_WRITE/MONGO_CON_FLAG_DONT_CONNECT */
 mongo_connection *mongo_get_read_write_connection(mongo_con_manager *manager, mongo_servers *servers, int connection_flags, char **error_message);
+/* Drops the connections that mongo_get_read_write_connection bound */
+void mongo_manager_unbind_all(mongo_con_manager *manager);
+mongo_connection *mongo_get_hedge_connection(mongo_con_manager *manager, mongo_servers *servers, mongo_read_preference *rp, mongo_connection *first);
 
 /* Connection management */
 mongo_connection *mongo_manager_connection_find_by_hash(mongo_con_manager *manager, char *hash);
+int mongo_manager_connection_has_socket(mongo_con_manager *manager, char *hash, mongo_connection *con);
 void mongo_manager_connection_register(mongo_con_manager *manager, mongo_connection *con);
 int mongo_manager_connection_deregister(mongo_con_manager *manager, mongo_connection *con);
+void mongo_manager_forget_indexes(mongo_con_manager *manager, char *ns_prefix);
+int mongo_manager_connection_authenticate(mongo_con_manager *manager, mongo_connection *con, mongo_server_def *server, char **error_message);
+
+/* Server ejection */
+int mongo_manager_server_is_ejected(mongo_con_manager *manager, mongo_server_def *server);
+void mongo_manager_server_eject(mongo_con_manager *manager, mongo_server_def *server);
+void mongo_manager_server_restore(mongo_con_manager *manager, mongo_server_def *server);
+
+/* Pings the registered connections that are due and idle, and drops the
+ * ones that fail, so that requests don't have to wait for that */
+void mongo_manager_check_idle_connections(mongo_con_manager *manager);
+
+/* Connection pool */
+mongo_connection *mongo_manager_connection_checkout(mongo_con_manager *manager, mongo_connection *con, mongo_server_def *server);
+void mongo_manager_connection_checkin(mongo_con_manager *manager, mongo_connection *con);
 
 /* Logging */
 void mongo_log_null(int module, int level, void *context, char *format, va_list arg);
 void mongo_log_printf(int module, int level, void *context, char *format, va_list arg);
 void mongo_manager_log(mongo_con_manager *manager, int module, int level, char *format, ...);
+
+/* Whether a message for module and level would be passed to the log function,
+ * for skipping the work for messages that aren't */
+#define mongo_manager_log_enabled(m, module, level) (((m)->log_modules & (module)) && ((m)->log_levels & (level)))
 #endif
@@ -69,6 +69,26 @@ mcon_str *bson_create_ping_packet(mongo_connection *con)
 	return str;
 }
 
+/* Not a query, but there is nothing else that mcon sends */
+mcon_str *bson_create_kill_cursors_packet(mongo_connection *con, int64_t cursor_id)
+{
+	struct mcon_str *str;
+
+	mcon_str_ptr_init(str);
+
+	mcon_serialize_int(str, 0); /* We need to fill this with the length */
+	mcon_serialize_int(str, mongo_connection_get_reqid(con));
+	mcon_serialize_int(str, 0); /* Reponse to */
+	mcon_serialize_int(str, 2007); /* OP_KILL_CURSORS */
+
+	mcon_serialize_int(str, 0); /* Reserved */
+	mcon_serialize_int(str, 1); /* Number of cursor IDs */
+	mcon_serialize_int64(str, cursor_id);
+
+	((int*) str->d)[0] = str->l;
+	return str;
+}
+
 mcon_str *bson_create_ismaster_packet(mongo_connection *con)
 {
 	struct mcon_str *str = create_simple_header(con, NULL);
@@ -77,6 +97,18 @@ mcon_str *bson_create_ismaster_packet(mongo_connection *con)
 	hdr = str->l;
 	mcon_serialize_int(str, 0); /* We need to fill this with the length */
 	bson_add_long(str, "isMaster", 1);
+	if (con->compressors & (1 << MONGO_COMPRESSOR_ZLIB)) {
+		int array;
+
+		/* compression: [ "zlib" ] */
+		mcon_str_addl(str, "\x04", 1, 0);
+		mcon_str_addl(str, "compression", 12, 0);
+		array = str->l;
+		mcon_serialize_int(str, 0);
+		bson_add_string(str, "0", "zlib");
+		mcon_str_addl(str, "", 1, 0);
+		((int*) (&(str->d[array])))[0] = str->l - array;
+	}
 	mcon_str_addl(str, "", 1, 0); /* Trailing 0x00 */
 
 	/* Set length */
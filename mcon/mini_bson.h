@@ -3,13 +3,18 @@
 
 #include "types.h"
 
+void bson_add_long(mcon_str *str, char *fieldname, int64_t v);
+void bson_add_string(mcon_str *str, char *fieldname, char *string);
+
 mcon_str *bson_create_ping_packet(mongo_connection *con);
+mcon_str *bson_create_kill_cursors_packet(mongo_connection *con, int64_t cursor_id);
 mcon_str *bson_create_ismaster_packet(mongo_connection *con);
 mcon_str *bson_create_rs_status_packet(mongo_connection *con);
 mcon_str *bson_create_getnonce_packet(mongo_connection *con);
 mcon_str *bson_create_authenticate_packet(mongo_connection *con, char *database, char *username, char *nonce, char *key);
 
 char *bson_skip_field_name(char *data);
+char *bson_next(char *data);
 int bson_find_field_as_array(char *buffer, char *field, char **data);
 int bson_find_field_as_document(char *buffer, char *field, char **data);
 int bson_find_field_as_double(char *buffer, char *field, double *data);
@@ -6,6 +6,7 @@
 #include "parse.h"
 #include "manager.h"
 #include "read_preference.h"
+#include "connections.h"
 
 /* Forward declarations */
 void static mongo_add_parsed_server_addr(mongo_con_manager *manager, mongo_servers *servers, char *host_start, char *host_end, char *port_start);
@@ -22,6 +23,7 @@ mongo_servers* mongo_parse_init(void)
 	servers->count = 0;
 	servers->repl_set_name = NULL;
 	servers->con_type = MONGO_CON_TYPE_STANDALONE;
+	servers->secondaryAcceptableLatencyMS = MONGO_RP_CUTOFF;
 
 	return servers;
 }
@@ -88,6 +90,10 @@ int mongo_parse_server_spec(mongo_con_manager *manager, mongo_servers *servers,
 			host_end = port_start = NULL;
 		}
 		if (*pos == '/') {
+			if (host_end && is_hostname) {
+				/* host:port, the / starts the database name */
+				break;
+			}
 			if (!host_end && is_hostname) {
 				/* If we really found a hostname, break out, otherwise we are probably working with a Unix Domain socket */
 				if (host_start - pos) {
@@ -212,13 +218,13 @@ void static mongo_add_parsed_server_addr(mongo_con_manager *manager, mongo_serve
 	memset(tmp, 0, sizeof(mongo_server_def));
 	tmp->username = tmp->password = tmp->db = NULL;
 	tmp->port = 27017;
+	mongo_socket_options_init(&tmp->options);
 
 	tmp->host = strndup(host_start, host_end - host_start);
 	if (port_start) {
 		tmp->port = atoi(port_start);
 	}
-	servers->server[servers->count] = tmp;
-	servers->count++;
+	mongo_servers_add(servers, tmp);
 	mongo_manager_log(manager, MLOG_PARSE, MLOG_INFO, "- Found node: %s:%d", tmp->host, tmp->port);
 }
 
@@ -287,6 +293,79 @@ static int parse_read_preference_tags(mongo_con_manager *manager, mongo_servers
 	return 0;
 }
 
+/* Sets one of the socket options for all the servers */
+static int parse_socket_option(mongo_con_manager *manager, mongo_servers *servers, char *option_name, char *option_value, char **error_message)
+{
+	int i, value;
+
+	if (strcasecmp(option_name, "noDelay") == 0 || strcasecmp(option_name, "keepAlive") == 0) {
+		value = strcasecmp(option_value, "true") == 0 || *option_value == '1';
+	} else {
+		value = atoi(option_value);
+		if (value < 0) {
+			*error_message = malloc(256);
+			snprintf(*error_message, 256, "The value of '%s' must not be negative, %d given.", option_name, value);
+			return 3;
+		}
+	}
+	mongo_manager_log(manager, MLOG_PARSE, MLOG_INFO, "- Found option '%s': %d", option_name, value);
+
+	for (i = 0; i < servers->count; i++) {
+		mongo_socket_options *options = &servers->server[i]->options;
+
+		if (strcasecmp(option_name, "noDelay") == 0) {
+			options->nodelay = value;
+		} else if (strcasecmp(option_name, "keepAlive") == 0) {
+			options->keepalive = value;
+		} else if (strcasecmp(option_name, "keepAliveIdle") == 0) {
+			options->keepalive_idle = value;
+		} else if (strcasecmp(option_name, "keepAliveInterval") == 0) {
+			options->keepalive_interval = value;
+		} else if (strcasecmp(option_name, "keepAliveCount") == 0) {
+			options->keepalive_count = value;
+		} else if (strcasecmp(option_name, "sendBufferSize") == 0) {
+			options->send_buffer = value;
+		} else if (strcasecmp(option_name, "receiveBufferSize") == 0) {
+			options->receive_buffer = value;
+		} else {
+			options->socket_timeout = value;
+		}
+	}
+	return 0;
+}
+
+/* Sets the compressors that are offered to the servers, from a comma
+ * separated list. Ones that aren't available are skipped, so that the
+ * connection works uncompressed with them. */
+static int parse_compressors(mongo_con_manager *manager, mongo_servers *servers, char *option_value, char **error_message)
+{
+	char *name, *end;
+	int   i, compressors = 0;
+
+	for (name = option_value; *name; name = end + (*end == ',')) {
+		end = strchr(name, ',');
+		if (!end) {
+			end = name + strlen(name);
+		}
+
+		if (end - name == 4 && strncasecmp(name, "zlib", 4) == 0) {
+#ifdef MONGO_HAVE_ZLIB
+			compressors |= 1 << MONGO_COMPRESSOR_ZLIB;
+			mongo_manager_log(manager, MLOG_PARSE, MLOG_INFO, "- Found compressor 'zlib'");
+#else
+			mongo_manager_log(manager, MLOG_PARSE, MLOG_WARN, "- Skipping compressor 'zlib', as the driver was built without zlib");
+#endif
+		} else if (end > name) {
+			mongo_manager_log(manager, MLOG_PARSE, MLOG_WARN, "- Skipping unsupported compressor '%.*s'", (int) (end - name), name);
+		}
+	}
+
+	for (i = 0; i < servers->count; i++) {
+		servers->server[i]->options.compressors = compressors;
+	}
+	return 0;
+}
+
 /* Sets server options.
  * Returns 0 if it worked, 2 if the option didn't exist, 3 on logical errors.
  * On logical errors, the error_message will be populated with the reason.
@@ -392,6 +471,41 @@ int mongo_store_option(mongo_con_manager *manager, mongo_servers *servers, char
 		return parse_read_preference_tags(manager, servers, option_value, error_message);
 	}
 
+	if (strcasecmp(option_name, "secondaryAcceptableLatencyMS") == 0) {
+		mongo_manager_log(manager, MLOG_PARSE, MLOG_INFO, "- Found option 'secondaryAcceptableLatencyMS': %d", atoi(option_value));
+		if (atoi(option_value) < 0) {
+			*error_message = strdup("The secondaryAcceptableLatencyMS value must not be negative.");
+			return 3;
+		}
+		servers->secondaryAcceptableLatencyMS = atoi(option_value);
+		return 0;
+	}
+
+	if (strcasecmp(option_name, "compressors") == 0) {
+		return parse_compressors(manager, servers, option_value, error_message);
+	}
+
+	if (strcasecmp(option_name, "zlibCompressionLevel") == 0) {
+		mongo_manager_log(manager, MLOG_PARSE, MLOG_INFO, "- Found option 'zlibCompressionLevel': %d", atoi(option_value));
+		if (atoi(option_value) < -1 || atoi(option_value) > 9) {
+			*error_message = strdup("The zlibCompressionLevel value must be between -1 and 9.");
+			return 3;
+		}
+		for (i = 0; i < servers->count; i++) {
+			servers->server[i]->options.zlib_level = atoi(option_value);
+		}
+		return 0;
+	}
+
+	if (
+		strcasecmp(option_name, "noDelay") == 0 || strcasecmp(option_name, "keepAlive") == 0 ||
+		strcasecmp(option_name, "keepAliveIdle") == 0 || strcasecmp(option_name, "keepAliveInterval") == 0 ||
+		strcasecmp(option_name, "keepAliveCount") == 0 || strcasecmp(option_name, "sendBufferSize") == 0 ||
+		strcasecmp(option_name, "receiveBufferSize") == 0 || strcasecmp(option_name, "socketTimeoutMS") == 0
+	) {
+		return parse_socket_option(manager, servers, option_name, option_value, error_message);
+	}
+
 	if (strcasecmp(option_name, "timeout") == 0) {
 		mongo_manager_log(manager, MLOG_PARSE, MLOG_INFO, "- Found option 'timeout': %d", atoi(option_value));
 		servers->connectTimeoutMS = atoi(option_value);
@@ -435,6 +549,66 @@ int static mongo_parse_options(mongo_con_manager *manager, mongo_servers *server
 	return retval > 1 ? 1 : 0;
 }
 
+int mongo_parse_server_spec_cached(mongo_con_manager *manager, mongo_servers *servers, char *spec, char **error_message)
+{
+	mongo_parsed_spec **ptr, *entry;
+	int                 count = 0; /* Of the connection strings in the cache */
+
+	if (mongo_manager_log_enabled(manager, MLOG_PARSE, MLOG_INFO)) {
+		return mongo_parse_server_spec(manager, servers, spec, error_message);
+	}
+
+	for (ptr = &manager->parsed_specs; *ptr; ptr = &(*ptr)->next, count++) {
+		if (strcmp((*ptr)->spec, spec) == 0) {
+			entry = *ptr;
+
+			/* Move it to the front */
+			*ptr = entry->next;
+			entry->next = manager->parsed_specs;
+			manager->parsed_specs = entry;
+
+			mongo_servers_copy(servers, entry->servers, MONGO_SERVER_COPY_CREDENTIALS);
+			return 0;
+		}
+	}
+
+	if (mongo_parse_server_spec(manager, servers, spec, error_message)) {
+		return 1;
+	}
+
+	entry = malloc(sizeof(mongo_parsed_spec));
+	entry->spec = strdup(spec);
+	entry->servers = mongo_parse_init();
+	mongo_servers_copy(entry->servers, servers, MONGO_SERVER_COPY_CREDENTIALS);
+	entry->next = manager->parsed_specs;
+	manager->parsed_specs = entry;
+
+	/* Drop the least recently used one if there is no room for it */
+	if (count == MONGO_PARSE_CACHE_SIZE) {
+		for (ptr = &manager->parsed_specs; (*ptr)->next; ptr = &(*ptr)->next);
+		entry = *ptr;
+		*ptr = NULL;
+		free(entry->spec);
+		mongo_servers_dtor(entry->servers);
+		free(entry);
+	}
+
+	return 0;
+}
+
+void mongo_parse_cache_free(mongo_con_manager *manager)
+{
+	mongo_parsed_spec *entry;
+
+	while (manager->parsed_specs) {
+		entry = manager->parsed_specs;
+		manager->parsed_specs = entry->next;
+		free(entry->spec);
+		mongo_servers_dtor(entry->servers);
+		free(entry);
+	}
+}
+
 void static mongo_server_def_dump(mongo_con_manager *manager, mongo_server_def *server_def)
 {
 	mongo_manager_log(manager, MLOG_PARSE, MLOG_INFO,
@@ -464,13 +638,14 @@ void mongo_servers_dump(mongo_con_manager *manager, mongo_servers *servers)
 }
 
 /* Cloning */
-static void mongo_server_def_copy(mongo_server_def *to, mongo_server_def *from, int flags)
+void mongo_server_def_copy(mongo_server_def *to, mongo_server_def *from, int flags)
 {
 	to->host = to->db = to->username = to->password = NULL;
 	if (from->host) {
 		to->host = strdup(from->host);
 	}
 	to->port = from->port;
+	to->options = from->options;
 
 	if (flags & MONGO_SERVER_COPY_CREDENTIALS) {
 		if (from->db) {
@@ -485,11 +660,24 @@ static void mongo_server_def_copy(mongo_server_def *to, mongo_server_def *from,
 	}
 }
 
+/* Appends server to the list, which then owns it */
+void mongo_servers_add(mongo_servers *servers, mongo_server_def *server)
+{
+	if (servers->count == servers->size) {
+		servers->size = servers->size ? servers->size * 2 : 4;
+		servers->server = realloc(servers->server, servers->size * sizeof(mongo_server_def*));
+	}
+	servers->server[servers->count] = server;
+	servers->count++;
+}
+
 void mongo_servers_copy(mongo_servers *to, mongo_servers *from, int flags)
 {
 	int i;
 
 	to->count = from->count;
+	to->size = from->count;
+	to->server = malloc((from->count ? from->count : 1) * sizeof(mongo_server_def*));
 	for (i = 0; i < from->count; i++) {
 		to->server[i] = malloc(sizeof(mongo_server_def));
 		mongo_server_def_copy(to->server[i], from->server[i], flags);
@@ -498,11 +686,15 @@ void mongo_servers_copy(mongo_servers *to, mongo_servers *from, int flags)
 	to->con_type = from->con_type;
 	to->repl_set_name = NULL;
 	to->connectTimeoutMS = from->connectTimeoutMS;
+	to->secondaryAcceptableLatencyMS = from->secondaryAcceptableLatencyMS;
 
 	if (from->repl_set_name) {
 		to->repl_set_name = strdup(from->repl_set_name);
 	}
 	mongo_read_preference_copy(&from->read_pref, &to->read_pref);
+
+	/* The copy picks its own connections */
+	memset(to->bound, 0, sizeof(to->bound));
 }
 
 /* Cleanup */
@@ -530,6 +722,7 @@ void mongo_servers_dtor(mongo_servers *servers)
 	for (i = 0; i < servers->count; i++) {
 		mongo_server_def_dtor(servers->server[i]);
 	}
+	free(servers->server);
 	if (servers->repl_set_name) {
 		free(servers->repl_set_name);
 	}
@@ -539,5 +732,11 @@ void mongo_servers_dtor(mongo_servers *servers)
 	if (servers->read_pref.tagsets) {
 		free(servers->read_pref.tagsets);
 	}
+	for (i = 0; i < 2; i++) {
+		if (servers->bound[i].hash) {
+			free(servers->bound[i].hash);
+		}
+		mongo_read_preference_dtor(&servers->bound[i].rp);
+	}
 	free(servers);
 }
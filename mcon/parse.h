@@ -9,8 +9,26 @@
 /* Parsing server connection strings and its cleanup routines */
 mongo_servers* mongo_parse_init(void);
 int mongo_parse_server_spec(mongo_con_manager *manager, mongo_servers *servers, char *spec, char **error_message);
+
+/* Like mongo_parse_server_spec, but copies what an earlier call for the same
+ * spec parsed, if it is one of the last MONGO_PARSE_CACHE_SIZE connection
+ * strings. The cache is not used while the PARSE module is logged, so that
+ * every parse shows up. */
+#define MONGO_PARSE_CACHE_SIZE 16
+struct _mongo_parsed_spec
+{
+	char              *spec;
+	mongo_servers     *servers;
+	mongo_parsed_spec *next;
+};
+
+int mongo_parse_server_spec_cached(mongo_con_manager *manager, mongo_servers *servers, char *spec, char **error_message);
+void mongo_parse_cache_free(mongo_con_manager *manager);
+
 int mongo_store_option(mongo_con_manager *manager, mongo_servers *servers, char *option_name, char *option_value, char **error_message);
 void mongo_servers_dump(mongo_con_manager *manager, mongo_servers *servers);
+void mongo_server_def_copy(mongo_server_def *to, mongo_server_def *from, int flags);
+void mongo_servers_add(mongo_servers *servers, mongo_server_def *server);
 void mongo_servers_copy(mongo_servers *to, mongo_servers *from, int flags);
 void mongo_server_def_dtor(mongo_server_def *server_def);
 void mongo_servers_dtor(mongo_servers *servers);
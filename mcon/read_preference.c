@@ -4,6 +4,7 @@
 #include "manager.h"
 #include "str.h"
 #include "utils.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,10 +28,11 @@ static void mongo_print_connection_info(mongo_con_manager *manager, mongo_connec
 	int i;
 
 	mongo_manager_log(manager, MLOG_RS, level,
-		"- connection: type: %s, socket: %d, ping: %d, hash: %s",
+		"- connection: type: %s, socket: %d, ping: %d, rtt: %dus, hash: %s",
 		mongo_connection_type(con->connection_type),
 		con->socket,
 		con->ping_ms,
+		con->rtt_us,
 		con->hash
 	);
 	for (i = 0; i < con->tag_count; i++) {
@@ -230,16 +232,16 @@ static int mongo_rp_sort_primary_preferred(const void* a, const void *b)
 	mongo_connection *con_b = *(mongo_connection**) b;
 
 	/* First we prefer primary over secondary, and if the field type is the
-	 * same, we sort on ping_ms again. *_SECONDARY is a higher constant value
+	 * same, we sort on the round trip time again. *_SECONDARY is a higher constant value
 	 * than *_PRIMARY, so we sort descendingly by connection_type */
 	if (con_a->connection_type > con_b->connection_type) {
 		return 1;
 	} else if (con_a->connection_type < con_b->connection_type) {
 		return -1;
 	} else {
-		if (con_a->ping_ms > con_b->ping_ms) {
+		if (con_a->rtt_us > con_b->rtt_us) {
 			return 1;
-		} else if (con_a->ping_ms < con_b->ping_ms) {
+		} else if (con_a->rtt_us < con_b->rtt_us) {
 			return -1;
 		}
 	}
@@ -252,16 +254,16 @@ static int mongo_rp_sort_secondary_preferred(const void* a, const void *b)
 	mongo_connection *con_b = *(mongo_connection**) b;
 
 	/* First we prefer secondary over primary, and if the field type is the
-	 * same, we sort on ping_ms again. *_SECONDARY is a higher constant value
+	 * same, we sort on the round trip time again. *_SECONDARY is a higher constant value
 	 * than *_PRIMARY. */
 	if (con_a->connection_type < con_b->connection_type) {
 		return 1;
 	} else if (con_a->connection_type > con_b->connection_type) {
 		return -1;
 	} else {
-		if (con_a->ping_ms > con_b->ping_ms) {
+		if (con_a->rtt_us > con_b->rtt_us) {
 			return 1;
-		} else if (con_a->ping_ms < con_b->ping_ms) {
+		} else if (con_a->rtt_us < con_b->rtt_us) {
 			return -1;
 		}
 	}
@@ -273,9 +275,9 @@ static int mongo_rp_sort_any(const void* a, const void *b)
 	mongo_connection *con_a = *(mongo_connection**) a;
 	mongo_connection *con_b = *(mongo_connection**) b;
 
-	if (con_a->ping_ms > con_b->ping_ms) {
+	if (con_a->rtt_us > con_b->rtt_us) {
 		return 1;
-	} else if (con_a->ping_ms < con_b->ping_ms) {
+	} else if (con_a->rtt_us < con_b->rtt_us) {
 		return -1;
 	}
 	return 0;
@@ -313,17 +315,21 @@ mcon_collection *mongo_sort_servers(mongo_con_manager *manager, mcon_collection
 		default:
 			return NULL;
 	}
-	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "sorting servers by priority and ping time");
+	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "sorting servers by priority and round trip time");
 	qsort(col->data, col->count, sizeof(mongo_connection*), sort_function);
-	mcon_collection_iterate(manager, col, mongo_print_connection_iterate_wrapper);
+	if (mongo_manager_log_enabled(manager, MLOG_RS, MLOG_FINE)) {
+		mcon_collection_iterate(manager, col, mongo_print_connection_iterate_wrapper);
+	}
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "sorting servers: done");
 	return col;
 }
 
-mcon_collection *mongo_select_nearest_servers(mongo_con_manager *manager, mcon_collection *col, mongo_read_preference *rp)
+/* Keeps the servers whose average round trip is at most latency_window ms
+ * slower than that of the nearest one */
+mcon_collection *mongo_select_nearest_servers(mongo_con_manager *manager, mcon_collection *col, mongo_read_preference *rp, int latency_window)
 {
 	mcon_collection *filtered;
-	int              i, nearest_ping;
+	int              i, nearest_rtt, col_count = col->count;
 
 	filtered = mcon_init_collection(sizeof(mongo_connection*));
 
@@ -335,13 +341,13 @@ mcon_collection *mongo_select_nearest_servers(mongo_con_manager *manager, mcon_c
 		case MONGO_RP_SECONDARY:
 		case MONGO_RP_SECONDARY_PREFERRED:
 		case MONGO_RP_NEAREST:
-			/* The nearest ping time is in the first element */
-			nearest_ping = ((mongo_connection*)col->data[0])->ping_ms;
-			mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "selecting near servers: nearest is %dms", nearest_ping);
+			/* The nearest round trip time is in the first element */
+			nearest_rtt = ((mongo_connection*)col->data[0])->rtt_us;
+			mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "selecting near servers: nearest is %dus, window is %dms", nearest_rtt, latency_window);
 
 			/* FIXME: Change to iterator later */
 			for (i = 0; i < col->count; i++) {
-				if (((mongo_connection*)col->data[i])->ping_ms <= nearest_ping + MONGO_RP_CUTOFF) {
+				if (((mongo_connection*)col->data[i])->rtt_us <= nearest_rtt + latency_window * 1000) {
 					mcon_collection_add(filtered, col->data[i]);
 				}
 			}
@@ -354,16 +360,24 @@ mcon_collection *mongo_select_nearest_servers(mongo_con_manager *manager, mcon_c
 	/* Clean up the old collection that we no longer need */
 	mcon_collection_free(col);
 
-	mcon_collection_iterate(manager, filtered, mongo_print_connection_iterate_wrapper);
+	if (mongo_manager_log_enabled(manager, MLOG_RS, MLOG_FINE)) {
+		mcon_collection_iterate(manager, filtered, mongo_print_connection_iterate_wrapper);
+	}
 	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "selecting near server: done");
+	MONGO_TRACE(manager, MONGO_TRACE_SELECT_NEAREST, col_count, filtered->count, nearest_rtt, latency_window);
 
 	return filtered;
 }
 
+/* Servers with an average round trip below this count as this close, so that
+ * a server on the same box does not get all of the reads */
+#define MONGO_RP_MIN_RTT_US 500
+
 mongo_connection *mongo_pick_server_from_set(mongo_con_manager *manager, mcon_collection *col, mongo_read_preference *rp)
 {
 	mongo_connection *con = NULL;
-	int entry = rand() % col->count;
+	double total = 0, pick;
+	int entry, rtt;
 
 	if (rp->type == MONGO_RP_PRIMARY_PREFERRED) {
 		if (((mongo_connection*)col->data[0])->connection_type == MONGO_NODE_PRIMARY) {
@@ -373,8 +387,24 @@ mongo_connection *mongo_pick_server_from_set(mongo_con_manager *manager, mcon_co
 			return con;
 		}
 	}
-	/* For now, we just pick a random server from the set */
-	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "pick server: random element %d", entry);
+	/* Pick a random server from the set, with the chance of each in
+	 * proportion to how fast it has been */
+	for (entry = 0; entry < col->count; entry++) {
+		rtt = ((mongo_connection*)col->data[entry])->rtt_us;
+		total += 1.0 / (rtt > MONGO_RP_MIN_RTT_US ? rtt : MONGO_RP_MIN_RTT_US);
+	}
+
+	pick = total * rand() / ((double) RAND_MAX + 1);
+	for (entry = 0; entry < col->count - 1; entry++) {
+		rtt = ((mongo_connection*)col->data[entry])->rtt_us;
+		pick -= 1.0 / (rtt > MONGO_RP_MIN_RTT_US ? rtt : MONGO_RP_MIN_RTT_US);
+		if (pick < 0) {
+			break;
+		}
+	}
+
+	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "pick server: weighted random element %d", entry);
+	MONGO_TRACE(manager, MONGO_TRACE_PICK_SERVER, entry, col->count, ((mongo_connection*)col->data[entry])->socket, ((mongo_connection*)col->data[entry])->rtt_us);
 	con = (mongo_connection*)col->data[entry];
 	mongo_print_connection_info(manager, con, MLOG_INFO);
 	return con;
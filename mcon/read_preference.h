@@ -15,14 +15,14 @@
 #define MONGO_RP_LAST                0x04
 
 
-/* TODO: Needs to be a setting through the connection string/options */
+/* The default for the secondaryAcceptableLatencyMS option, in ms */
 #define MONGO_RP_CUTOFF  15
 
 typedef int (mongo_connection_sort_t)(const void *a, const void *b);
 
 mcon_collection* mongo_find_candidate_servers(mongo_con_manager *manager, mongo_read_preference *rp, char *auth_hash);
 mcon_collection *mongo_sort_servers(mongo_con_manager *manager, mcon_collection *col, mongo_read_preference *rp);
-mcon_collection *mongo_select_nearest_servers(mongo_con_manager *manager, mcon_collection *col, mongo_read_preference *rp);
+mcon_collection *mongo_select_nearest_servers(mongo_con_manager *manager, mcon_collection *col, mongo_read_preference *rp, int latency_window);
 mongo_connection *mongo_pick_server_from_set(mongo_con_manager *manager, mcon_collection *col, mongo_read_preference *rp);
 
 /* Info helpers */
@@ -0,0 +1,143 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef WIN32
+# include <winsock2.h>
+# include <ws2tcpip.h>
+#else
+# include <netdb.h>
+# include <sys/un.h>
+#endif
+
+#include "types.h"
+#include "manager.h"
+#include "resolver.h"
+
+struct _mongo_resolver_entry
+{
+	char          *host;
+	int            port;
+	int            count;       /* 0 if the lookup failed */
+	mongo_address *addresses;
+	char          *error;       /* Why the lookup failed */
+	time_t         expires;
+	struct _mongo_resolver_entry *next;
+};
+
+static void free_entry(mongo_resolver_entry *entry)
+{
+	free(entry->host);
+	free(entry->addresses);
+	free(entry->error);
+	free(entry);
+}
+
+/* Finds the cached lookup of host:port, dropping the ones that have expired
+ * along the way */
+static mongo_resolver_entry *find_entry(mongo_con_manager *manager, char *host, int port)
+{
+	mongo_resolver_entry **ptr = &manager->resolver_cache, *tmp;
+	time_t now = time(NULL);
+
+	while (*ptr) {
+		if ((*ptr)->expires <= now) {
+			tmp = *ptr;
+			*ptr = tmp->next;
+			free_entry(tmp);
+			continue;
+		}
+		if ((*ptr)->port == port && strcmp((*ptr)->host, host) == 0) {
+			return *ptr;
+		}
+		ptr = &(*ptr)->next;
+	}
+	return NULL;
+}
+
+static void lookup(mongo_resolver_entry *entry)
+{
+	struct addrinfo hints, *result, *ai;
+	char port[16];
+	int  status, i = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	snprintf(port, sizeof(port), "%d", entry->port);
+
+	status = getaddrinfo(entry->host, port, &hints, &result);
+	if (status != 0) {
+		entry->error = malloc(256 + strlen(entry->host));
+		snprintf(entry->error, 256 + strlen(entry->host), "Couldn't get host info for %s: %s", entry->host, gai_strerror(status));
+		return;
+	}
+
+	for (ai = result; ai; ai = ai->ai_next) {
+		entry->count++;
+	}
+	entry->addresses = calloc(entry->count, sizeof(mongo_address));
+	for (ai = result; ai; ai = ai->ai_next) {
+		entry->addresses[i].family = ai->ai_family;
+		entry->addresses[i].len = ai->ai_addrlen;
+		memcpy(&entry->addresses[i].addr, ai->ai_addr, ai->ai_addrlen);
+		i++;
+	}
+	freeaddrinfo(result);
+}
+
+int mongo_resolve(mongo_con_manager *manager, char *host, int port, mongo_address **addresses, char **error_message)
+{
+	mongo_resolver_entry *entry;
+
+#ifndef WIN32
+	/* domain socket */
+	if (port == 0) {
+		struct sockaddr_un *su;
+
+		*addresses = calloc(1, sizeof(mongo_address));
+		(*addresses)->family = AF_UNIX;
+		(*addresses)->len = sizeof(struct sockaddr_un);
+		su = (struct sockaddr_un*) &(*addresses)->addr;
+		su->sun_family = AF_UNIX;
+		strncpy(su->sun_path, host, sizeof(su->sun_path) - 1);
+		return 1;
+	}
+#endif
+
+	entry = find_entry(manager, host, port);
+	if (entry) {
+		mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "resolve: using the cached addresses of %s:%d", host, port);
+	} else {
+		entry = calloc(1, sizeof(mongo_resolver_entry));
+		entry->host = strdup(host);
+		entry->port = port;
+		lookup(entry);
+		entry->expires = time(NULL) + (entry->count ? MONGO_RESOLVER_TTL : MONGO_RESOLVER_NEGATIVE_TTL);
+		entry->next = manager->resolver_cache;
+		manager->resolver_cache = entry;
+		mongo_manager_log(manager, MLOG_CON, MLOG_INFO, "resolve: %s:%d has %d addresses", host, port, entry->count);
+	}
+
+	if (!entry->count) {
+		*error_message = strdup(entry->error);
+		return 0;
+	}
+
+	*addresses = malloc(entry->count * sizeof(mongo_address));
+	memcpy(*addresses, entry->addresses, entry->count * sizeof(mongo_address));
+	return entry->count;
+}
+
+void mongo_resolver_cache_free(mongo_con_manager *manager)
+{
+	mongo_resolver_entry *tmp;
+
+	while (manager->resolver_cache) {
+		tmp = manager->resolver_cache;
+		manager->resolver_cache = tmp->next;
+		free_entry(tmp);
+	}
+}
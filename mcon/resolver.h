@@ -0,0 +1,34 @@
+#ifndef __MCON_RESOLVER_H__
+#define __MCON_RESOLVER_H__
+
+#include "types.h"
+
+#ifdef WIN32
+# include <winsock2.h>
+# include <ws2tcpip.h>
+#else
+# include <sys/types.h>
+# include <sys/socket.h>
+#endif
+
+/* How long resolved addresses, and failures to resolve, are remembered (in
+ * seconds). getaddrinfo() doesn't tell the TTL of the DNS records. */
+#define MONGO_RESOLVER_TTL          60
+#define MONGO_RESOLVER_NEGATIVE_TTL  5
+
+typedef struct _mongo_address
+{
+	int                     family;
+	socklen_t               len;
+	struct sockaddr_storage addr;
+} mongo_address;
+
+/* Looks up all the addresses (IPv4 and IPv6) of host, or the path of a
+ * domain socket if port is 0. Returns the number of addresses, with
+ * *addresses set to a list that must be freed, or 0 with *error_message set
+ * (to be freed) if there are none. Results are cached in the manager. */
+int mongo_resolve(mongo_con_manager *manager, char *host, int port, mongo_address **addresses, char **error_message);
+
+void mongo_resolver_cache_free(mongo_con_manager *manager);
+
+#endif
@@ -0,0 +1,194 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "types.h"
+#include "stats.h"
+
+char *mongo_stats_op_names[MONGO_STATS_OP_COUNT] = {
+	"query", "getmore", "insert", "update", "remove", "command", "connect", "ping", "ismaster"
+};
+
+/* Finds the counters for host, which is host_len long, creating them on first
+ * use. There are few enough servers that a list will do. */
+static mongo_stats_server *find_server(mongo_con_manager *manager, char *host, int host_len)
+{
+	mongo_stats_server *server;
+
+	for (server = manager->stats; server; server = server->next) {
+		if (strncmp(server->host, host, host_len) == 0 && server->host[host_len] == '\0') {
+			return server;
+		}
+	}
+
+	server = calloc(1, sizeof(mongo_stats_server));
+	server->host = malloc(host_len + 1);
+	memcpy(server->host, host, host_len);
+	server->host[host_len] = '\0';
+
+	server->next = manager->stats;
+	manager->stats = server;
+	return server;
+}
+
+static void start_probe(mongo_stats_probe *probe, mongo_stats_server *server, mongo_connection *con)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	probe->server = server;
+	probe->start_sec = now.tv_sec;
+	probe->start_usec = now.tv_usec;
+	probe->bytes_sent = con ? con->bytes_sent : 0;
+	probe->bytes_received = con ? con->bytes_received : 0;
+}
+
+void mongo_stats_start(mongo_con_manager *manager, mongo_stats_probe *probe, mongo_connection *con)
+{
+	char *end;
+
+	probe->server = NULL;
+	if (!manager->stats_enabled || !con) {
+		return;
+	}
+
+	/* The hash starts with "host:port;" */
+	if (!con->stats && con->hash) {
+		end = strchr(con->hash, ';');
+		con->stats = find_server(manager, con->hash, end ? end - con->hash : (int) strlen(con->hash));
+	}
+	if (con->stats) {
+		start_probe(probe, con->stats, con);
+	}
+}
+
+void mongo_stats_start_host(mongo_con_manager *manager, mongo_stats_probe *probe, char *host, int port)
+{
+	char name[300];
+
+	probe->server = NULL;
+	if (!manager->stats_enabled) {
+		return;
+	}
+
+	snprintf(name, sizeof(name), "%s:%d", host, port);
+	start_probe(probe, find_server(manager, name, strlen(name)), NULL);
+}
+
+int mongo_stats_bucket(unsigned long us)
+{
+	int exponent = 0;
+
+	if (us < MONGO_STATS_SUB_BUCKETS) {
+		return us;
+	}
+	while ((us >> exponent) >= 2 * MONGO_STATS_SUB_BUCKETS) {
+		exponent++;
+	}
+	if (exponent >= 32 - 1) {
+		return MONGO_STATS_BUCKETS - 1;
+	}
+	/* us >> exponent is between MONGO_STATS_SUB_BUCKETS and twice that */
+	return (exponent + 1) * MONGO_STATS_SUB_BUCKETS + (int) ((us >> exponent) - MONGO_STATS_SUB_BUCKETS);
+}
+
+unsigned long mongo_stats_bucket_start(int bucket)
+{
+	if (bucket < MONGO_STATS_SUB_BUCKETS) {
+		return bucket;
+	}
+	return (unsigned long) (MONGO_STATS_SUB_BUCKETS + bucket % MONGO_STATS_SUB_BUCKETS) << (bucket / MONGO_STATS_SUB_BUCKETS - 1);
+}
+
+unsigned long mongo_stats_percentile(mongo_stats_op *op, double percentile)
+{
+	unsigned long seen = 0;
+	double wanted = op->count * percentile / 100;
+	int i;
+
+	if (!op->count) {
+		return 0;
+	}
+	for (i = 0; i < MONGO_STATS_BUCKETS - 1; i++) {
+		seen += op->histogram[i];
+		if (seen >= wanted && seen > 0) {
+			return mongo_stats_bucket_start(i + 1) - 1;
+		}
+	}
+	return op->max_us;
+}
+
+static void count(mongo_stats_op *op, unsigned long us, unsigned long sent, unsigned long received, int flags)
+{
+	op->count++;
+	if (flags & MONGO_STATS_FAILED) {
+		op->failures++;
+	}
+	if (flags & MONGO_STATS_RETRY) {
+		op->retries++;
+	}
+	op->bytes_sent += sent;
+	op->bytes_received += received;
+	op->total_us += us;
+	if (us > op->max_us) {
+		op->max_us = us;
+	}
+	op->histogram[mongo_stats_bucket(us)]++;
+}
+
+void mongo_stats_end(mongo_con_manager *manager, mongo_stats_probe *probe, int op, mongo_connection *con, int flags)
+{
+	struct timeval now;
+	long us;
+	unsigned long sent = 0, received = 0;
+
+	if (!probe->server || op < 0 || op >= MONGO_STATS_OP_COUNT) {
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	us = (now.tv_sec - probe->start_sec) * 1000000 + (now.tv_usec - probe->start_usec);
+	if (us < 0) { /* some clocks do weird stuff */
+		us = 0;
+	}
+	if (con) {
+		sent = con->bytes_sent - probe->bytes_sent;
+		received = con->bytes_received - probe->bytes_received;
+	}
+
+	count(&probe->server->total[op], us, sent, received, flags);
+	count(&probe->server->request[op], us, sent, received, flags);
+	probe->server = NULL;
+}
+
+void mongo_stats_request_reset(mongo_con_manager *manager)
+{
+	mongo_stats_server *server;
+
+	for (server = manager->stats; server; server = server->next) {
+		memset(server->request, 0, sizeof(server->request));
+	}
+}
+
+void mongo_stats_reset(mongo_con_manager *manager)
+{
+	mongo_stats_server *server;
+
+	for (server = manager->stats; server; server = server->next) {
+		memset(server->total, 0, sizeof(server->total));
+		memset(server->request, 0, sizeof(server->request));
+	}
+}
+
+void mongo_stats_free(mongo_con_manager *manager)
+{
+	mongo_stats_server *server, *next;
+
+	for (server = manager->stats; server; server = next) {
+		next = server->next;
+		free(server->host);
+		free(server);
+	}
+	manager->stats = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef __MCON_STATS_H__
+#define __MCON_STATS_H__
+
+#include "types.h"
+
+/* Flags for mongo_stats_end */
+#define MONGO_STATS_FAILED  0x01
+#define MONGO_STATS_RETRY   0x02
+
+extern char *mongo_stats_op_names[MONGO_STATS_OP_COUNT];
+
+/* Starts timing an operation on con. Nothing is counted if stats are off or
+ * the server of con isn't known yet. */
+void mongo_stats_start(mongo_con_manager *manager, mongo_stats_probe *probe, mongo_connection *con);
+
+/* Like mongo_stats_start, for the connect to host:port, when there is no
+ * connection yet */
+void mongo_stats_start_host(mongo_con_manager *manager, mongo_stats_probe *probe, char *host, int port);
+
+/* Counts the operation that probe was started for as op, with the time since
+ * it started and the bytes that con (NULL if it was closed in the meantime)
+ * sent and received since. */
+void mongo_stats_end(mongo_con_manager *manager, mongo_stats_probe *probe, int op, mongo_connection *con, int flags);
+
+/* The bucket of the histogram that a latency goes into, and the smallest
+ * latency that goes into a bucket */
+int mongo_stats_bucket(unsigned long us);
+unsigned long mongo_stats_bucket_start(int bucket);
+
+/* The latency (the end of its bucket) that percentile % of the operations
+ * were faster than, or 0 if there are none */
+unsigned long mongo_stats_percentile(mongo_stats_op *op, double percentile);
+
+/* Clears the counters of the current request, or all of them */
+void mongo_stats_request_reset(mongo_con_manager *manager);
+void mongo_stats_reset(mongo_con_manager *manager);
+
+void mongo_stats_free(mongo_con_manager *manager);
+
+#endif
@@ -0,0 +1,113 @@
+#include "types.h"
+#include "manager.h"
+#include "parse.h"
+#include "read_preference.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* Once a read connection is picked for a set of routers, it is returned again
+ * without any selection, until the read preference changes, the bindings are
+ * dropped or the connection goes away. The routers are connections that were
+ * pinged a moment ago, so nothing goes over their sockets. */
+
+static int errors = 0;
+
+static void check(char *what, int ok)
+{
+	printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+	errors += !ok;
+}
+
+/* Routers of another type are no candidates for selection */
+static void set_type(mongo_con_manager *manager, int type)
+{
+	mongo_con_manager_item *item;
+
+	for (item = manager->connections; item; item = item->next) {
+		item->connection->connection_type = type;
+	}
+}
+
+static mongo_connection *fake_connection(mongo_con_manager *manager, mongo_server_def *def)
+{
+	mongo_connection *con;
+	int               fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		perror("socketpair");
+		exit(1);
+	}
+	con = calloc(1, sizeof(mongo_connection));
+	con->socket = fds[0];
+	con->hash = mongo_server_create_hash(def);
+	con->connection_type = MONGO_NODE_MONGOS;
+	con->last_ping = con->last_reply = con->last_ismaster = time(NULL);
+	mongo_manager_connection_register(manager, con);
+	return con;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_servers     *servers = mongo_parse_init();
+	mongo_connection  *con, *other;
+	char              *error_message = NULL;
+	int                i, ok;
+
+	if (mongo_parse_server_spec(manager, servers, "mongodb://mongos1:27017,mongos2:27018", &error_message)) {
+		printf("error_message: %s\n", error_message);
+		return 1;
+	}
+	fake_connection(manager, servers->server[0]);
+	fake_connection(manager, servers->server[1]);
+
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	check("a router is picked", con != NULL);
+	check("... and bound", servers->bound[MONGO_SERVER_BOUND_READ].hash && strcmp(servers->bound[MONGO_SERVER_BOUND_READ].hash, con->hash) == 0);
+
+	/* Without any candidates to select from, only the binding finds one */
+	set_type(manager, MONGO_NODE_ARBITER);
+	ok = 1;
+	for (i = 0; i < 20; i++) {
+		ok &= mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message) == con;
+	}
+	check("the bound router is reused without selection", ok);
+	check("... but not for writes", mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_WRITE, &error_message) == NULL);
+	free(error_message);
+	error_message = NULL;
+	check("... nor with DONT_CONNECT", mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ | MONGO_CON_FLAG_DONT_CONNECT, &error_message) == NULL);
+	free(error_message);
+	error_message = NULL;
+
+	servers->read_pref.type = MONGO_RP_NEAREST;
+	check("another read preference selects again", mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message) == NULL);
+	free(error_message);
+	error_message = NULL;
+	set_type(manager, MONGO_NODE_MONGOS);
+
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	check("... and binds its pick", con && servers->bound[MONGO_SERVER_BOUND_READ].rp.type == MONGO_RP_NEAREST);
+
+	mongo_manager_unbind_all(manager);
+	set_type(manager, MONGO_NODE_ARBITER);
+	check("dropping the bindings selects again", mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message) == NULL);
+	free(error_message);
+	error_message = NULL;
+	set_type(manager, MONGO_NODE_MONGOS);
+
+	con = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	mongo_manager_connection_deregister(manager, con);
+	other = mongo_get_read_write_connection(manager, servers, MONGO_CON_FLAG_READ, &error_message);
+	check("a router that went away is replaced", other && manager->connection_count == 1 && strcmp(servers->bound[MONGO_SERVER_BOUND_READ].hash, other->hash) == 0);
+
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
@@ -1,14 +1,34 @@
 #!/bin/bash
 
-FLAGS="-Wall -ggdb3 -O0 -I.."
-FILES="../bson_helpers.c ../collection.c ../connections.c ../manager.c ../mini_bson.c ../parse.c ../read_preference.c ../str.c ../utils.c ../io.c"
+FLAGS="-Wall -ggdb3 -O0 -I.. -DMONGO_HAVE_ZLIB"
+FILES="../bson_helpers.c ../collection.c ../connections.c ../manager.c ../mini_bson.c ../parse.c ../read_preference.c ../resolver.c ../str.c ../topology_cache.c ../utils.c ../io.c ../stats.c ../trace.c"
+LIBS="-lz"
 
-gcc $FLAGS -o sc-test1 simplecon-test.c $FILES
-gcc $FLAGS -o rc-test1 replicacon-test.c $FILES
-gcc $FLAGS -o rp-test1 rp-test-simple1.c $FILES
-gcc $FLAGS -o rp-test2 rp-test-complex1.c $FILES
-gcc $FLAGS -o hash-test1 test-hash-split.c $FILES
-gcc $FLAGS -o parse-test1 parse-test.c $FILES
-gcc $FLAGS -o parse-test2 parse-test2.c $FILES
-gcc $FLAGS -o shc-test1 shardcon-test.c $FILES
-gcc $FLAGS -o auth-test1 authcon-test.c $FILES
+gcc $FLAGS -o sc-test1 simplecon-test.c $FILES $LIBS
+gcc $FLAGS -o rc-test1 replicacon-test.c $FILES $LIBS
+gcc $FLAGS -o rp-test1 rp-test-simple1.c $FILES $LIBS
+gcc $FLAGS -o rp-test2 rp-test-complex1.c $FILES $LIBS
+gcc $FLAGS -o hash-test1 test-hash-split.c $FILES $LIBS
+gcc $FLAGS -o parse-test1 parse-test.c $FILES $LIBS
+gcc $FLAGS -o parse-test2 parse-test2.c $FILES $LIBS
+gcc $FLAGS -o shc-test1 shardcon-test.c $FILES $LIBS
+gcc $FLAGS -o auth-test1 authcon-test.c $FILES $LIBS
+gcc $FLAGS -o io-sendv-test1 io-sendv-test.c $FILES $LIBS
+gcc $FLAGS -o registry-test1 manager-registry-test.c $FILES $LIBS
+gcc $FLAGS -o connect-many-test1 connect-many-test.c $FILES $LIBS
+gcc $FLAGS -o topology-cache-test1 topology-cache-test.c $FILES $LIBS
+gcc $FLAGS -o resolver-test1 resolver-test.c $FILES $LIBS
+gcc $FLAGS -o io-wait-test1 io-wait-test.c $FILES $LIBS
+gcc $FLAGS -o pool-test1 pool-test.c $FILES $LIBS
+gcc $FLAGS -o rp-latency-test1 rp-latency-test.c $FILES $LIBS
+gcc $FLAGS -o socket-options-test1 socket-options-test.c $FILES $LIBS
+gcc $FLAGS -o compression-test1 compression-test.c $FILES $LIBS
+gcc $FLAGS -o shared-auth-test1 shared-auth-test.c $FILES $LIBS
+gcc $FLAGS -o eject-test1 eject-test.c $FILES $LIBS
+gcc $FLAGS -o stats-test1 stats-test.c $FILES $LIBS
+gcc $FLAGS -o trace-test1 trace-test.c $FILES $LIBS
+gcc $FLAGS -o parse-cache-test1 parse-cache-test.c $FILES $LIBS
+gcc $FLAGS -o liveness-test1 liveness-test.c $FILES $LIBS
+gcc $FLAGS -o binding-test1 binding-test.c $FILES $LIBS
+gcc $FLAGS -o stale-reply-test1 stale-reply-test.c $FILES $LIBS
+gcc $FLAGS -o parse-dbname-test1 parse-dbname-test.c $FILES $LIBS
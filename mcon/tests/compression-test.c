@@ -0,0 +1,163 @@
+#include "types.h"
+#include "io.h"
+#include "manager.h"
+#include "parse.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+/* Checks that the compressors option skips the compressors that aren't
+ * supported, and then sends requests over a socketpair on a connection that uses zlib, and checks
+ * that they arrive as OP_COMPRESSED messages. Then has a child process send
+ * back a compressed reply, a plain one and a compressed one that is larger
+ * than the read buffer, all in one go, and checks that they are read back as
+ * the original messages. */
+
+#define BIG_BODY (200 * 1024)
+
+static char *make_message(int reqid, int opcode, int body_length, char fill)
+{
+	char *message = malloc(16 + body_length);
+
+	((int*) message)[0] = 16 + body_length;
+	((int*) message)[1] = reqid;
+	((int*) message)[2] = 0;
+	((int*) message)[3] = opcode;
+	memset(message + 16, fill, body_length);
+	return message;
+}
+
+static int write_compressed(int fd, char *message)
+{
+	int    length = ((int*) message)[0];
+	uLongf compressed_length = compressBound(length - 16);
+	char  *out = malloc(25 + compressed_length);
+
+	compress((Bytef*) out + 25, &compressed_length, (Bytef*) message + 16, length - 16);
+	((int*) out)[0] = 25 + compressed_length;
+	memcpy(out + 4, message + 4, 8);
+	((int*) out)[3] = MONGO_OP_COMPRESSED;
+	memcpy(out + 16, message + 12, 4);
+	((int*) out)[5] = length - 16;
+	out[24] = MONGO_COMPRESSOR_ZLIB;
+
+	length = write(fd, out, 25 + compressed_length);
+	free(out);
+	return length;
+}
+
+/* Reads one message from con as a header and a body, like the cursors do */
+static int check_reply(mongo_connection *con, char *expected)
+{
+	char  header[36], *body, *error_message = NULL;
+	int   length = ((int*) expected)[0];
+
+	if (mongo_io_recv_buffered(con, header, 36, &error_message) != 36) {
+		printf("header: %s\n", error_message);
+		return 1;
+	}
+	body = malloc(length - 36);
+	if (mongo_io_recv_buffered(con, body, length - 36, &error_message) != length - 36) {
+		printf("body: %s\n", error_message);
+		return 1;
+	}
+
+	if (memcmp(header, expected, 36) != 0 || memcmp(body, expected + 36, length - 36) != 0) {
+		printf("reply %d does not match\n", ((int*) expected)[1]);
+		return 1;
+	}
+	free(body);
+	printf("reply %d: %d bytes OK\n", ((int*) expected)[1], length);
+	return 0;
+}
+
+int main(void)
+{
+	mongo_connection con;
+	char  *query, *insert, *replies[3], buf[65536], *error_message = NULL;
+	int    fds[2], status, num, received = 0, errors = 0;
+	uLongf inflated_length;
+	mongo_con_manager *manager = mongo_init();
+	mongo_servers     *servers = mongo_parse_init();
+
+	if (mongo_parse_server_spec(manager, servers, "mongodb://localhost/?compressors=snappy,zlib&zlibCompressionLevel=6", &error_message)) {
+		printf("error_message: %s\n", error_message);
+		return 1;
+	}
+	if (servers->server[0]->options.compressors != 1 << MONGO_COMPRESSOR_ZLIB || servers->server[0]->options.zlib_level != 6) {
+		printf("compressors: %d, level: %d\n", servers->server[0]->options.compressors, servers->server[0]->options.zlib_level);
+		errors++;
+	}
+	mongo_servers_dtor(servers);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+
+	memset(&con, 0, sizeof(con));
+	con.socket = fds[0];
+	con.compressor = MONGO_COMPRESSOR_ZLIB;
+	con.zlib_level = -1;
+
+	/* A queued write and a query, which go out as two compressed messages */
+	insert = make_message(1, 2002, 5000, 'i');
+	query = make_message(2, 2004, 3000, 'q');
+	mongo_io_queue(&con, insert, 16 + 5000, 1000000, &error_message);
+	if (mongo_io_flush(&con, query, 16 + 3000, &error_message) != 16 + 3000) {
+		printf("flush: %s\n", error_message);
+		return 1;
+	}
+	shutdown(fds[0], SHUT_WR);
+
+	while ((num = read(fds[1], buf + received, sizeof(buf) - received)) > 0) {
+		received += num;
+	}
+	for (num = 0; num < received; num += ((int*) (buf + num))[0]) {
+		char  *original = ((int*) (buf + num))[1] == 1 ? insert : query;
+		char   inflated[8192];
+
+		inflated_length = sizeof(inflated);
+		if (
+			((int*) (buf + num))[3] != MONGO_OP_COMPRESSED ||
+			((int*) (buf + num))[4] != ((int*) original)[3] ||
+			uncompress((Bytef*) inflated, &inflated_length, (Bytef*) buf + num + 25, ((int*) (buf + num))[0] - 25) != Z_OK ||
+			(int) inflated_length != ((int*) original)[0] - 16 ||
+			memcmp(inflated, original + 16, inflated_length) != 0
+		) {
+			printf("request %d was not compressed correctly\n", ((int*) original)[1]);
+			errors++;
+		} else {
+			printf("request %d: %d bytes compressed to %d\n", ((int*) original)[1], ((int*) original)[0], ((int*) (buf + num))[0]);
+		}
+	}
+
+	/* Replies, with a header that is as long as the one of OP_REPLY */
+	replies[0] = make_message(3, 1, 10000, 'a');
+	replies[1] = make_message(4, 1, 100, 'b');
+	replies[2] = make_message(5, 1, BIG_BODY, 'c');
+
+	fflush(stdout);
+	if (fork() == 0) {
+		close(fds[0]);
+		write_compressed(fds[1], replies[0]);
+		num = write(fds[1], replies[1], ((int*) replies[1])[0]);
+		write_compressed(fds[1], replies[2]);
+		close(fds[1]);
+		exit(num > 0 ? 0 : 1);
+	}
+	close(fds[1]);
+
+	errors += check_reply(&con, replies[0]);
+	errors += check_reply(&con, replies[1]);
+	errors += check_reply(&con, replies[2]);
+
+	wait(&status);
+	close(fds[0]);
+
+	return errors == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
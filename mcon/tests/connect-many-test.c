@@ -0,0 +1,102 @@
+#include "types.h"
+#include "manager.h"
+#include "connections.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Connects to two listening ports, a port that refuses connections and an
+ * address that does not answer at all, in one go. The two good ones have to
+ * come up, and the whole thing must not take longer than one timeout. */
+
+#define TIMEOUT 500
+
+static int listen_on(int *port)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+	bind(s, (struct sockaddr*) &sa, sizeof(sa));
+	listen(s, 4);
+	getsockname(s, (struct sockaddr*) &sa, &len);
+	*port = ntohs(sa.sin_port);
+	return s;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_server_def   defs[4], *servers[4];
+	mongo_connection  *cons[4];
+	char              *errors[4];
+	int                listeners[2], closed, ports[3], i, connected, errors_found = 0;
+	pid_t              child;
+	double             start, elapsed;
+
+	listeners[0] = listen_on(&ports[0]);
+	listeners[1] = listen_on(&ports[1]);
+	closed = listen_on(&ports[2]);
+	close(closed);
+
+	/* accepts and hangs up, so that the ismaster after connecting fails fast */
+	if ((child = fork()) == 0) {
+		while (1) {
+			close(accept(listeners[0], NULL, NULL));
+			close(accept(listeners[1], NULL, NULL));
+		}
+	}
+
+	memset(defs, 0, sizeof(defs));
+	for (i = 0; i < 3; i++) {
+		defs[i].host = "127.0.0.1";
+		defs[i].port = ports[i];
+	}
+	defs[3].host = "10.255.255.1";
+	defs[3].port = 27017;
+	for (i = 0; i < 4; i++) {
+		servers[i] = &defs[i];
+	}
+
+	start = now();
+	connected = mongo_connection_create_many(manager, servers, 4, TIMEOUT, cons, errors);
+	elapsed = now() - start;
+
+	for (i = 0; i < 4; i++) {
+		printf("%s:%d: %s\n", defs[i].host, defs[i].port, cons[i] ? "connected" : errors[i]);
+		if ((i < 2) != (cons[i] != NULL)) {
+			errors_found++;
+		}
+		if (cons[i]) {
+			close(cons[i]->socket);
+			free(cons[i]);
+		}
+		free(errors[i]);
+	}
+	if (elapsed > TIMEOUT * 1.5) {
+		printf("took %.0f ms, more than one timeout\n", elapsed);
+		errors_found++;
+	}
+	printf("%d connected, %d errors\n", connected, errors_found);
+
+	kill(child, SIGKILL);
+	mongo_deinit(manager);
+	return errors_found != 0;
+}
@@ -0,0 +1,95 @@
+#include "types.h"
+#include "manager.h"
+#include "parse.h"
+#include "str.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Parses a seed list with more routers than the old fixed server list could
+ * hold, and then ejects one of them a few times in a row to check that the
+ * ejection time doubles, that it runs out and that a success forgets it. */
+
+#define ROUTERS 40
+
+static int errors = 0;
+
+static void check(char *what, int ok)
+{
+	printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+	errors += !ok;
+}
+
+static mongo_ejected_server *find(mongo_con_manager *manager, char *host)
+{
+	mongo_ejected_server *ejected;
+
+	for (ejected = manager->ejected_servers; ejected; ejected = ejected->next) {
+		if (strcmp(ejected->host, host) == 0) {
+			return ejected;
+		}
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_servers     *servers = mongo_parse_init();
+	mcon_str          *spec;
+	char              *error_message = NULL, host[32];
+	mongo_ejected_server *ejected;
+	int                i, ok;
+
+	mcon_str_ptr_init(spec);
+	mcon_str_add(spec, "mongodb://", 0);
+	for (i = 0; i < ROUTERS; i++) {
+		snprintf(host, sizeof(host), "%smongos%d:%d", i ? "," : "", i, 27017 + i);
+		mcon_str_add(spec, host, 0);
+	}
+	if (mongo_parse_server_spec(manager, servers, spec->d, &error_message)) {
+		printf("error_message: %s\n", error_message);
+		return 1;
+	}
+	mcon_str_ptr_dtor(spec);
+
+	check("all routers are parsed", servers->count == ROUTERS && servers->size >= ROUTERS);
+	check("... which makes it a multiple connection", servers->con_type == MONGO_CON_TYPE_MULTIPLE);
+	ok = 1;
+	for (i = 0; i < servers->count; i++) {
+		snprintf(host, sizeof(host), "mongos%d", i);
+		ok &= strcmp(servers->server[i]->host, host) == 0 && servers->server[i]->port == 27017 + i;
+	}
+	check("... in order", ok);
+
+	check("nothing is ejected at first", !mongo_manager_server_is_ejected(manager, servers->server[33]));
+
+	mongo_manager_server_eject(manager, servers->server[33]);
+	ejected = find(manager, "mongos33:27050");
+	check("a failure ejects a router", mongo_manager_server_is_ejected(manager, servers->server[33]));
+	check("... only that one", !mongo_manager_server_is_ejected(manager, servers->server[32]));
+	check("... for eject_time", ejected && ejected->until - time(NULL) <= manager->eject_time && ejected->until - time(NULL) >= manager->eject_time - 1);
+
+	mongo_manager_server_eject(manager, servers->server[33]);
+	check("another failure doubles it", ejected->failures == 2 && ejected->until - time(NULL) >= manager->eject_time * 2 - 1);
+
+	for (i = 0; i < 20; i++) {
+		mongo_manager_server_eject(manager, servers->server[33]);
+	}
+	check("... up to a limit", ejected->until - time(NULL) <= manager->eject_time << MONGO_MANAGER_MAX_EJECT_SHIFT);
+
+	ejected->until = time(NULL) - 1;
+	check("once the time runs out it is tried again", !mongo_manager_server_is_ejected(manager, servers->server[33]));
+	check("... but its failures are remembered", find(manager, "mongos33:27050") != NULL);
+
+	mongo_manager_server_restore(manager, servers->server[33]);
+	check("a success forgets them", find(manager, "mongos33:27050") == NULL && manager->ejected_servers == NULL);
+
+	mongo_manager_server_eject(manager, servers->server[1]);
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
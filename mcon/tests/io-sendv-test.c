@@ -0,0 +1,64 @@
+#include "types.h"
+#include "io.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/* Sends a set of pieces through mongo_io_sendv over a socketpair, with a
+ * child process reading from the other end, and checks that the bytes arrive
+ * whole and in order. The socket buffer is much smaller than the payload, so
+ * writev() returns partial writes in the middle of pieces. */
+
+#define PIECE_COUNT 100
+
+int main(void)
+{
+	mongo_io_vec pieces[PIECE_COUNT];
+	int fds[2], i, total = 0, sent, status;
+	char *error_message = NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+
+	for (i = 0; i < PIECE_COUNT; i++) {
+		pieces[i].len = (i % 7) * 40000 + i;
+		pieces[i].data = malloc(pieces[i].len + 1);
+		memset(pieces[i].data, 'a' + (i % 26), pieces[i].len);
+		total += pieces[i].len;
+	}
+
+	if (fork() == 0) {
+		int received = 0, num, piece = 0, offset = 0, errors = 0;
+		char buf[8192];
+
+		close(fds[0]);
+		while ((num = read(fds[1], buf, sizeof(buf))) > 0) {
+			for (i = 0; i < num; i++) {
+				while (offset == pieces[piece].len) {
+					piece++;
+					offset = 0;
+				}
+				if (buf[i] != 'a' + (piece % 26)) {
+					errors++;
+				}
+				offset++;
+			}
+			received += num;
+		}
+		printf("received %d of %d bytes, %d errors\n", received, total, errors);
+		exit(received == total && errors == 0 ? 0 : 1);
+	}
+	close(fds[1]);
+
+	sent = mongo_io_sendv(fds[0], pieces, PIECE_COUNT, &error_message);
+	printf("sent %d of %d bytes\n", sent, total);
+	close(fds[0]);
+
+	wait(&status);
+	return sent == total && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#include "types.h"
+#include "io.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* Checks mongo_io_wait_with_timeout on a socket with a number above
+ * FD_SETSIZE, which select() can not wait on, and that a timeout is kept while
+ * a timer keeps interrupting the wait with signals. */
+
+#define HIGH_FD (FD_SETSIZE + 100)
+
+static void on_alarm(int sig)
+{
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(void)
+{
+	struct rlimit limit;
+	struct itimerval timer;
+	struct sigaction sa;
+	int fds[2], status, errors = 0;
+	char *error_message = NULL;
+	double start, elapsed;
+
+	getrlimit(RLIMIT_NOFILE, &limit);
+	if (limit.rlim_cur <= HIGH_FD) {
+		limit.rlim_cur = limit.rlim_max > HIGH_FD ? HIGH_FD + 1 : limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+	if (dup2(fds[0], HIGH_FD) == -1) {
+		perror("dup2");
+		return 1;
+	}
+
+	/* data is ready */
+	write(fds[1], "x", 1);
+	status = mongo_io_wait_with_timeout(HIGH_FD, 1000, &error_message);
+	printf("readable: %d\n", status);
+	errors += status != 0;
+
+	/* nothing to read, with SIGALRM every 10ms */
+	recv(HIGH_FD, &status, 1, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_alarm;
+	sigaction(SIGALRM, &sa, NULL);
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 10000;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	start = now();
+	status = mongo_io_wait_with_timeout(HIGH_FD, 300, &error_message);
+	elapsed = now() - start;
+	printf("timeout: %d (%s) after %.3fs\n", status, error_message, elapsed);
+	errors += status != 80 || elapsed < 0.28 || elapsed > 0.5;
+	free(error_message);
+
+	timer.it_value.tv_usec = 0;
+	timer.it_interval.tv_usec = 0;
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	/* the other end is gone, which has to be read to be noticed */
+	close(fds[1]);
+	status = mongo_io_wait_with_timeout(HIGH_FD, 1000, &error_message);
+	printf("hang up: %d\n", status);
+	errors += status != 0;
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
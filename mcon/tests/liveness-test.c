@@ -0,0 +1,123 @@
+#include "types.h"
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "utils.h"
+#include "str.h"
+#include "bson_helpers.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/* A connection that had a reply recently is not pinged, one that is idle is
+ * pinged by mongo_manager_check_idle_connections, and one of which the
+ * server went away is dropped by it. A child process plays the server and
+ * answers every ping, until the socket is closed. */
+
+static int errors = 0;
+
+static void check(char *what, int ok)
+{
+	printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+	errors += !ok;
+}
+
+static void play_server(int fd)
+{
+	char header[16], body[4096];
+	int  length, doc;
+	mcon_str *reply;
+
+	while (read(fd, header, 16) == 16) {
+		length = ((int*) header)[0];
+		if (length - 16 > (int) sizeof(body) || read(fd, body, length - 16) != length - 16) {
+			break;
+		}
+		/* the second ping is the last one */
+		if (((int*) header)[1] > 2) {
+			break;
+		}
+
+		mcon_str_ptr_init(reply);
+		mcon_serialize_int(reply, 0);
+		mcon_serialize_int(reply, 0);
+		mcon_serialize_int(reply, ((int*) header)[1]); /* response to */
+		mcon_serialize_int(reply, 1); /* OP_REPLY */
+		mcon_serialize_int(reply, 0); /* flags */
+		mcon_serialize_int64(reply, 0); /* cursor ID */
+		mcon_serialize_int(reply, 0); /* starting from */
+		mcon_serialize_int(reply, 1); /* number returned */
+
+		doc = reply->l;
+		mcon_serialize_int(reply, 0);
+		mcon_str_addl(reply, "", 1, 0);
+		((int*) (&(reply->d[doc])))[0] = reply->l - doc;
+		((int*) reply->d)[0] = reply->l;
+
+		if (write(fd, reply->d, reply->l) != reply->l) {
+			break;
+		}
+		mcon_str_ptr_dtor(reply);
+	}
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_connection  *con;
+	mongo_server_def   def;
+	char              *error_message = NULL;
+	int                fds[2], status;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+	if (fork() == 0) {
+		close(fds[0]);
+		play_server(fds[1]);
+		exit(0);
+	}
+	close(fds[1]);
+
+	memset(&def, 0, sizeof(def));
+	def.host = "127.0.0.1";
+	def.port = 27017;
+
+	con = calloc(1, sizeof(mongo_connection));
+	con->socket = fds[0];
+	con->hash = mongo_server_create_hash(&def);
+	mongo_manager_connection_register(manager, con);
+
+	/* every ping takes a request ID, so they count the round trips */
+	con->last_reply = time(NULL);
+	check("a recent reply makes the ping unnecessary", mongo_connection_ping(manager, con, &error_message) == 2 && con->last_reqid == 0);
+
+	con->last_reply = time(NULL) - manager->ping_interval - 1;
+	mongo_manager_check_idle_connections(manager);
+	check("an idle connection is pinged", con->last_reqid == 1 && con->last_ping != 0);
+	check("... which counts as a reply", con->last_reply >= con->last_ping);
+
+	con->last_ping = con->last_reply = time(NULL) - manager->ping_interval - 1;
+	con->busy = 1;
+	mongo_manager_check_idle_connections(manager);
+	check("a connection in use is left alone", con->last_reqid == 1);
+	con->busy = 0;
+
+	mongo_manager_check_idle_connections(manager);
+	check("the second ping works", manager->connection_count == 1 && con->last_reqid == 2);
+
+	con->last_ping = con->last_reply = time(NULL) - manager->ping_interval - 1;
+	mongo_manager_check_idle_connections(manager);
+	check("a connection that fails its ping is dropped", manager->connection_count == 0);
+
+	wait(&status);
+	mongo_deinit(manager);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
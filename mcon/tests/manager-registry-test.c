@@ -0,0 +1,102 @@
+#include "types.h"
+#include "manager.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Registers a few hundred connections with the manager, looks them up by
+ * hash, deregisters some of them and checks that the others are still found
+ * and still iterated over in registration order. */
+
+#define CONNECTION_COUNT 300
+
+static mongo_connection *fake_connection(int i)
+{
+	mongo_connection *con = malloc(sizeof(mongo_connection));
+	char hash[64];
+
+	memset(con, 0, sizeof(mongo_connection));
+	snprintf(hash, sizeof(hash), "host%d:27017;-;.;%d", i, getpid());
+	con->hash = strdup(hash);
+	con->socket = -1;
+	con->last_reqid = i;
+	return con;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_con_manager_item *ptr;
+	mongo_connection *cons[CONNECTION_COUNT];
+	char hash[64];
+	int i, last, errors = 0, count = 0;
+
+	for (i = 0; i < CONNECTION_COUNT; i++) {
+		cons[i] = fake_connection(i);
+		mongo_manager_connection_register(manager, cons[i]);
+	}
+
+	for (i = 0; i < CONNECTION_COUNT; i++) {
+		if (mongo_manager_connection_find_by_hash(manager, cons[i]->hash) != cons[i]) {
+			printf("connection %d not found\n", i);
+			errors++;
+		}
+	}
+
+	/* every third one goes, including the first and the last */
+	for (i = 0; i < CONNECTION_COUNT; i += 3) {
+		snprintf(hash, sizeof(hash), "%s", cons[i]->hash);
+		if (!mongo_manager_connection_deregister(manager, cons[i])) {
+			printf("connection %d could not be deregistered\n", i);
+			errors++;
+		}
+		if (mongo_manager_connection_find_by_hash(manager, hash)) {
+			printf("connection %d still found\n", i);
+			errors++;
+		}
+		cons[i] = NULL;
+	}
+	if (cons[CONNECTION_COUNT - 1]) {
+		mongo_manager_connection_deregister(manager, cons[CONNECTION_COUNT - 1]);
+		cons[CONNECTION_COUNT - 1] = NULL;
+	}
+
+	last = -1;
+	for (ptr = manager->connections; ptr; ptr = ptr->next) {
+		if (ptr->connection->last_reqid <= last || !cons[ptr->connection->last_reqid]) {
+			printf("connection %d out of order\n", ptr->connection->last_reqid);
+			errors++;
+		}
+		if (mongo_manager_connection_find_by_hash(manager, ptr->hash) != ptr->connection) {
+			printf("connection %d not found after deregistering\n", ptr->connection->last_reqid);
+			errors++;
+		}
+		last = ptr->connection->last_reqid;
+		count++;
+	}
+
+	/* a kept pointer is only a socket while it is still registered */
+	if (!mongo_manager_connection_has_socket(manager, cons[1]->hash, cons[1]) || mongo_manager_connection_has_socket(manager, cons[1]->hash, cons[2])) {
+		printf("connection 1 not told apart as a socket\n");
+		errors++;
+	}
+	if (mongo_manager_connection_has_socket(manager, hash, cons[1])) {
+		printf("deregistered connection still has a socket\n");
+		errors++;
+	}
+
+	/* appending still works after the last one was removed */
+	cons[0] = fake_connection(0);
+	mongo_manager_connection_register(manager, cons[0]);
+	if (manager->connections_last->connection != cons[0] || !mongo_manager_connection_find_by_hash(manager, cons[0]->hash)) {
+		printf("re-registered connection not found at the end\n");
+		errors++;
+	}
+
+	printf("%d connections, %d buckets, %d left after deregistering, %d errors\n",
+		CONNECTION_COUNT, manager->bucket_count, count, errors);
+
+	mongo_deinit(manager);
+	return errors != 0;
+}
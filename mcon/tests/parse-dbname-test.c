@@ -0,0 +1,57 @@
+#include "types.h"
+#include "manager.h"
+#include "parse.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A / after host:port starts the database name. The parser used to take
+ * the port (and what came after it) into the host name then, and lose the
+ * database, when the last host of the list had a port. */
+
+static int errors = 0;
+
+static void check(char *what, int ok)
+{
+	printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+	errors += !ok;
+}
+
+static int parses_to(mongo_con_manager *manager, char *spec, int count, char *host, int port, char *db)
+{
+	mongo_servers *servers = mongo_parse_init();
+	mongo_server_def *last;
+	char *error_message = NULL;
+	int ok;
+
+	if (mongo_parse_server_spec(manager, servers, spec, &error_message)) {
+		free(error_message);
+		mongo_servers_dtor(servers);
+		return 0;
+	}
+	last = servers->server[servers->count - 1];
+	ok =
+		servers->count == count && strcmp(last->host, host) == 0 && last->port == port &&
+		(db ? last->db && strcmp(last->db, db) == 0 : last->db == NULL);
+
+	mongo_servers_dtor(servers);
+	return ok;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+
+	manager->log_modules = 0;
+
+	check("host:port/db", parses_to(manager, "mongodb://host1:123/database", 1, "host1", 123, "database"));
+	check("host,host:port/db", parses_to(manager, "mongodb://host1,host2:123/database", 2, "host2", 123, "database"));
+	check("host:port,host/db", parses_to(manager, "mongodb://host1:123,host2/database", 2, "host2", 27017, "database"));
+	check("user:pass@host:port/db?options", parses_to(manager, "mongodb://u:p@host1:123/database?replicaSet=rs0", 1, "host1", 123, "database"));
+	check("host:port/?options", parses_to(manager, "mongodb://host1:123/?replicaSet=rs0", 1, "host1", 123, NULL));
+
+	mongo_deinit(manager);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+#include "types.h"
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Checks sockets out of the pool of one server: a busy socket is not handed
+ * out again until it is checked back in, new sockets are only opened up to
+ * the pool size, and taking down a socket from the pool leaves the others
+ * alone. */
+
+static int listen_on(int *port)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+	bind(s, (struct sockaddr*) &sa, sizeof(sa));
+	listen(s, 8);
+	getsockname(s, (struct sockaddr*) &sa, &len);
+	*port = ntohs(sa.sin_port);
+	return s;
+}
+
+static int errors = 0;
+
+static void check(char *what, int ok)
+{
+	printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+	errors += !ok;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_server_def   def;
+	mongo_connection  *con, *a, *b, *c, *d;
+	char              *error_message = NULL;
+	int                listener, port;
+	pid_t              child;
+
+	listener = listen_on(&port);
+
+	/* accepts and hangs up, so that the ismaster after connecting fails fast */
+	if ((child = fork()) == 0) {
+		while (1) {
+			close(accept(listener, NULL, NULL));
+		}
+	}
+
+	memset(&def, 0, sizeof(def));
+	def.host = "127.0.0.1";
+	def.port = port;
+
+	con = mongo_connection_create(manager, &def, &error_message);
+	if (!con) {
+		printf("couldn't connect: %s\n", error_message);
+		kill(child, SIGTERM);
+		return 1;
+	}
+	con->hash = mongo_server_create_hash(&def);
+	mongo_manager_connection_register(manager, con);
+	manager->connections_last->server = malloc(sizeof(mongo_server_def));
+	mongo_server_def_copy(manager->connections_last->server, &def, MONGO_SERVER_COPY_NONE);
+	manager->pool_size = 3;
+
+	a = mongo_manager_connection_checkout(manager, con, NULL);
+	check("first checkout gets the connection", a == con);
+	b = mongo_manager_connection_checkout(manager, con, NULL);
+	check("second checkout opens a socket", b && b != con);
+	c = mongo_manager_connection_checkout(manager, con, NULL);
+	check("third checkout opens another", c && c != con && c != b);
+	d = mongo_manager_connection_checkout(manager, con, NULL);
+	check("a full pool shares the connection", d == con && con->busy == 2);
+
+	mongo_manager_connection_checkin(manager, b);
+	check("a checked in socket is used again", mongo_manager_connection_checkout(manager, con, NULL) == b);
+
+	mongo_manager_connection_checkin(manager, a);
+	mongo_manager_connection_checkin(manager, d);
+	mongo_manager_connection_checkin(manager, c);
+	con->pending_reply = (void*) 1;
+	check("a reply that is still coming is busy", mongo_manager_connection_checkout(manager, con, NULL) == c);
+	con->pending_reply = NULL;
+
+	check("a pool socket can be deregistered", mongo_manager_connection_deregister(manager, b) == 1);
+	check("... which leaves the connection", mongo_manager_connection_find_by_hash(manager, con->hash) == con);
+	check("... and the rest of the pool", manager->connections->pool == c && manager->connections->pool_count == 1);
+
+	mongo_deinit(manager);
+	kill(child, SIGTERM);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
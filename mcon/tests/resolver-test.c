@@ -0,0 +1,95 @@
+#include "types.h"
+#include "manager.h"
+#include "connections.h"
+#include "resolver.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Looks up a few names through the resolver cache, and connects to a server
+ * that only listens on the IPv6 loopback address. */
+
+static int listen_on_ipv6(int *port)
+{
+	struct sockaddr_in6 sa;
+	socklen_t len = sizeof(sa);
+	int s = socket(AF_INET6, SOCK_STREAM, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin6_family = AF_INET6;
+	sa.sin6_addr = in6addr_loopback;
+	if (s == -1 || bind(s, (struct sockaddr*) &sa, sizeof(sa)) == -1 || listen(s, 4) == -1) {
+		return -1;
+	}
+	getsockname(s, (struct sockaddr*) &sa, &len);
+	*port = ntohs(sa.sin6_port);
+	return s;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_address     *addresses;
+	char              *error_message = NULL;
+	int                count, again, listener, port, socket, errors = 0;
+
+	count = mongo_resolve(manager, "127.0.0.1", 27017, &addresses, &error_message);
+	if (count != 1 || addresses[0].family != AF_INET) {
+		printf("127.0.0.1: %d addresses\n", count);
+		errors++;
+	}
+	free(addresses);
+
+	count = mongo_resolve(manager, "::1", 27017, &addresses, &error_message);
+	if (count != 1 || addresses[0].family != AF_INET6) {
+		printf("::1: %d addresses\n", count);
+		errors++;
+	}
+	free(addresses);
+
+	/* the second lookup comes from the cache */
+	count = mongo_resolve(manager, "localhost", 27017, &addresses, &error_message);
+	free(addresses);
+	again = mongo_resolve(manager, "localhost", 27017, &addresses, &error_message);
+	free(addresses);
+	if (count < 1 || again != count) {
+		printf("localhost: %d and then %d addresses\n", count, again);
+		errors++;
+	}
+
+	/* failures are remembered as well */
+	if (mongo_resolve(manager, "does-not-exist.invalid", 27017, &addresses, &error_message) != 0) {
+		printf("does-not-exist.invalid resolved\n");
+		errors++;
+	} else {
+		printf("%s\n", error_message);
+		free(error_message);
+	}
+	error_message = NULL;
+	if (mongo_resolve(manager, "does-not-exist.invalid", 27017, &addresses, &error_message) != 0 || !error_message) {
+		printf("negative lookup not cached\n");
+		errors++;
+	}
+	free(error_message);
+
+	listener = listen_on_ipv6(&port);
+	if (listener == -1) {
+		printf("no IPv6 loopback, skipping the connect\n");
+	} else {
+		socket = mongo_connection_connect(manager, "::1", port, 1000, &error_message);
+		if (socket == -1) {
+			printf("connecting to [::1]:%d failed: %s\n", port, error_message);
+			errors++;
+		} else {
+			close(socket);
+		}
+		close(listener);
+	}
+
+	printf("%d errors\n", errors);
+	mongo_deinit(manager);
+	return errors != 0;
+}
@@ -0,0 +1,73 @@
+#include "types.h"
+#include "read_preference.h"
+#include "collection.h"
+#include "manager.h"
+#include "connections.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Feeds round trips to three connections and picks a server from them many
+ * times. The slowest one is outside of the latency window and must never be
+ * picked, the other two must be picked in proportion to their speed. One slow
+ * round trip must not take the fastest one out of the window. */
+
+#define ROUNDS 30000
+
+static int pick(mongo_con_manager *manager, mongo_connection *cons, int count, int window)
+{
+	mongo_read_preference rp;
+	mcon_collection *col;
+	mongo_connection *con;
+	int i;
+
+	memset(&rp, 0, sizeof(rp));
+	rp.type = MONGO_RP_NEAREST;
+
+	col = mcon_init_collection(sizeof(mongo_connection*));
+	for (i = 0; i < count; i++) {
+		mcon_collection_add(col, &cons[i]);
+	}
+	col = mongo_sort_servers(manager, col, &rp);
+	col = mongo_select_nearest_servers(manager, col, &rp, window);
+	con = mongo_pick_server_from_set(manager, col, &rp);
+	mcon_collection_free(col);
+
+	return con - cons;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_connection   cons[3];
+	int                hits[3] = { 0, 0, 0 }, i, errors = 0;
+
+	memset(cons, 0, sizeof(cons));
+	for (i = 0; i < 3; i++) {
+		cons[i].hash = "test";
+	}
+	for (i = 0; i < 10; i++) {
+		mongo_connection_rtt_sample(&cons[0], 2000);
+		mongo_connection_rtt_sample(&cons[1], 6000);
+		mongo_connection_rtt_sample(&cons[2], 40000);
+	}
+	mongo_connection_rtt_sample(&cons[0], 50000);
+	printf("round trips: %dus %dus %dus\n", cons[0].rtt_us, cons[1].rtt_us, cons[2].rtt_us);
+	errors += cons[0].rtt_us > 15000 || cons[0].rtt_us < 2000;
+
+	for (i = 0; i < ROUNDS; i++) {
+		hits[pick(manager, cons, 3, 15)]++;
+	}
+	printf("picked: %d %d %d\n", hits[0], hits[1], hits[2]);
+	errors += hits[2] != 0;
+	/* 11.6ms against 6ms, so the second one gets about two thirds */
+	errors += hits[1] < ROUNDS * 0.6 || hits[1] > ROUNDS * 0.72;
+
+	/* a window of 0 leaves the nearest only */
+	for (i = 0; i < 100; i++) {
+		errors += pick(manager, cons, 3, 0) != 1;
+	}
+
+	mongo_deinit(manager);
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
@@ -14,6 +14,7 @@ mongo_connection *create_con(mongo_con_manager *manager, int type, int ping_ms,
 	con->connection_type = type;
 	con->socket = ++last_socket;
 	con->ping_ms = ping_ms;
+	con->rtt_us = ping_ms * 1000;
 	con->hash = strdup(hash);
 	mongo_manager_connection_register(manager, con);
 
@@ -41,7 +42,7 @@ int main(void)
 	if (collection->count) {
 		collection = mongo_sort_servers(manager, collection, &rp);
 		printf("collection size: %d\n", collection->count);
-		collection = mongo_select_nearest_servers(manager, collection, &rp);
+		collection = mongo_select_nearest_servers(manager, collection, &rp, MONGO_RP_CUTOFF);
 		printf("collection size: %d\n", collection->count);
 		con = mongo_pick_server_from_set(manager, collection, &rp);
 		mongo_print_connection_iterate_wrapper(manager, con);
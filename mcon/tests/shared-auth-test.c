@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include "types.h"
+#include "manager.h"
+#include "connections.h"
+#include "parse.h"
+#include "utils.h"
+#include "str.h"
+#include "bson_helpers.h"
+#include "mini_bson.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/* Authenticates one socket with several credentials, against a child process
+ * that plays the server and answers every getnonce and authenticate. Only
+ * credentials that the socket doesn't carry yet should cost round trips, and
+ * a second user for a database replaces the first. */
+
+static int errors = 0;
+
+static void check(char *what, int ok)
+{
+	printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+	errors += !ok;
+}
+
+/* Answers each command with an OP_REPLY, until the socket is closed */
+static void play_server(int fd)
+{
+	char header[16], body[4096];
+	int  length, doc;
+	mcon_str *reply;
+
+	while (read(fd, header, 16) == 16) {
+		length = ((int*) header)[0];
+		if (length - 16 > (int) sizeof(body) || read(fd, body, length - 16) != length - 16) {
+			break;
+		}
+
+		mcon_str_ptr_init(reply);
+		mcon_serialize_int(reply, 0);
+		mcon_serialize_int(reply, 0);
+		mcon_serialize_int(reply, ((int*) header)[1]); /* response to */
+		mcon_serialize_int(reply, 1); /* OP_REPLY */
+		mcon_serialize_int(reply, 0); /* flags */
+		mcon_serialize_int64(reply, 0); /* cursor ID */
+		mcon_serialize_int(reply, 0); /* starting from */
+		mcon_serialize_int(reply, 1); /* number returned */
+
+		doc = reply->l;
+		mcon_serialize_int(reply, 0);
+		if (memmem(body, length - 16, "getnonce", 8)) {
+			bson_add_string(reply, "nonce", "2375531c32080ae8");
+		}
+		mcon_str_addl(reply, "", 1, 0);
+		((int*) (&(reply->d[doc])))[0] = reply->l - doc;
+		((int*) reply->d)[0] = reply->l;
+
+		if (write(fd, reply->d, reply->l) != reply->l) {
+			break;
+		}
+		mcon_str_ptr_dtor(reply);
+	}
+}
+
+static mongo_server_def *make_def(char *db, char *username, char *password)
+{
+	mongo_server_def *def = calloc(1, sizeof(mongo_server_def));
+
+	def->host = strdup("127.0.0.1");
+	def->port = 27017;
+	def->db = db ? strdup(db) : NULL;
+	def->username = username ? strdup(username) : NULL;
+	def->password = password ? strdup(password) : NULL;
+	return def;
+}
+
+static int count_auths(mongo_connection *con)
+{
+	mongo_connection_auth *auth;
+	int count = 0;
+
+	for (auth = con->auths; auth; auth = auth->next) {
+		count++;
+	}
+	return count;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_connection  *con;
+	mongo_server_def  *tenant1, *tenant2, *other_user, *anonymous;
+	char              *error_message = NULL;
+	int                fds[2], status, reqid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+	if (fork() == 0) {
+		close(fds[0]);
+		play_server(fds[1]);
+		exit(0);
+	}
+	close(fds[1]);
+
+	manager->share_auth = 1;
+	con = calloc(1, sizeof(mongo_connection));
+	con->socket = fds[0];
+	anonymous = make_def(NULL, NULL, NULL);
+	con->hash = mongo_server_create_hash(anonymous);
+
+	tenant1 = make_def("tenant1", "app", "secret1");
+	tenant2 = make_def("tenant2", "app", "secret2");
+	other_user = make_def("tenant1", "admin", "secret3");
+
+	/* every command takes a request ID, so they count the round trips */
+	check("no credentials need no round trip", mongo_manager_connection_authenticate(manager, con, anonymous, &error_message) && con->last_reqid == 0);
+
+	check("the first tenant authenticates", mongo_manager_connection_authenticate(manager, con, tenant1, &error_message) && con->last_reqid == 2);
+	check("... once", mongo_manager_connection_authenticate(manager, con, tenant1, &error_message) && con->last_reqid == 2);
+
+	check("the second tenant gets the same socket", mongo_manager_connection_authenticate(manager, con, tenant2, &error_message) && con->last_reqid == 4);
+	check("... which carries both", count_auths(con) == 2);
+	reqid = con->last_reqid;
+	check("... and the first needs nothing more", mongo_manager_connection_authenticate(manager, con, tenant1, &error_message) && con->last_reqid == reqid);
+
+	/* the reply of a prefetching cursor must not be read as a nonce */
+	con->pending_reply = con;
+	check("a socket with a reply pending is left alone", mongo_manager_connection_authenticate(manager, con, other_user, &error_message) && con->last_reqid == reqid);
+	con->pending_reply = NULL;
+
+	check("another user for a database authenticates", mongo_manager_connection_authenticate(manager, con, other_user, &error_message) && con->last_reqid == 6);
+	check("... and replaces the first one", count_auths(con) == 2);
+	check("... which needs authenticating again", mongo_manager_connection_authenticate(manager, con, tenant1, &error_message) && con->last_reqid == 8);
+
+	mongo_connection_destroy(manager, con);
+	wait(&status);
+
+	mongo_server_def_dtor(tenant1);
+	mongo_server_def_dtor(tenant2);
+	mongo_server_def_dtor(other_user);
+	mongo_server_def_dtor(anonymous);
+	mongo_deinit(manager);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
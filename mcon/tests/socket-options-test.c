@@ -0,0 +1,112 @@
+#include "types.h"
+#include "manager.h"
+#include "parse.h"
+#include "connections.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* Parses the socket options from a connection string, connects to a server
+ * that never answers, and checks that the options ended up on the socket. The
+ * ismaster on connecting must give up after socketTimeoutMS. */
+
+static int listen_on(int *port)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+	bind(s, (struct sockaddr*) &sa, sizeof(sa));
+	listen(s, 4);
+	getsockname(s, (struct sockaddr*) &sa, &len);
+	*port = ntohs(sa.sin_port);
+	return s;
+}
+
+static int get_option(int sock, int level, int name)
+{
+	int value = 0;
+	socklen_t len = sizeof(value);
+
+	getsockopt(sock, level, name, &value, &len);
+	return value;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_servers     *servers;
+	mongo_connection  *con;
+	char               spec[256], *error_message = NULL;
+	int                listener, port, errors = 0;
+	pid_t              child;
+	double             start, elapsed;
+
+	listener = listen_on(&port);
+	if ((child = fork()) == 0) {
+		int peer = accept(listener, NULL, NULL);
+
+		sleep(10);
+		close(peer);
+		exit(0);
+	}
+
+	snprintf(spec, sizeof(spec), "mongodb://127.0.0.1:%d/?noDelay=false&keepAliveIdle=30&keepAliveCount=3&receiveBufferSize=32768&socketTimeoutMS=300", port);
+	servers = mongo_parse_init();
+	if (mongo_parse_server_spec(manager, servers, spec, &error_message)) {
+		printf("error_message: %s\n", error_message);
+		return 1;
+	}
+
+	start = now();
+	con = mongo_connection_create(manager, servers->server[0], &error_message);
+	elapsed = now() - start;
+	if (!con) {
+		printf("couldn't connect: %s\n", error_message);
+		kill(child, SIGTERM);
+		return 1;
+	}
+
+	printf("nodelay: %d\n", get_option(con->socket, IPPROTO_TCP, TCP_NODELAY));
+	errors += get_option(con->socket, IPPROTO_TCP, TCP_NODELAY) != 0;
+	printf("keepalive: %d, idle: %d, count: %d\n",
+		get_option(con->socket, SOL_SOCKET, SO_KEEPALIVE),
+		get_option(con->socket, IPPROTO_TCP, TCP_KEEPIDLE),
+		get_option(con->socket, IPPROTO_TCP, TCP_KEEPCNT));
+	errors += get_option(con->socket, SOL_SOCKET, SO_KEEPALIVE) == 0;
+	errors += get_option(con->socket, IPPROTO_TCP, TCP_KEEPIDLE) != 30;
+	errors += get_option(con->socket, IPPROTO_TCP, TCP_KEEPCNT) != 3;
+	/* Linux doubles the value that is set */
+	printf("receive buffer: %d\n", get_option(con->socket, SOL_SOCKET, SO_RCVBUF));
+	errors += get_option(con->socket, SOL_SOCKET, SO_RCVBUF) < 32768;
+	printf("ismaster gave up after %.0fms\n", elapsed);
+	errors += elapsed < 250 || elapsed > 2000;
+
+	con->hash = mongo_server_create_hash(servers->server[0]);
+	mongo_connection_destroy(manager, con);
+	mongo_servers_dtor(servers);
+	mongo_deinit(manager);
+	kill(child, SIGTERM);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
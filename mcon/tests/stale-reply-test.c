@@ -0,0 +1,109 @@
+#include "types.h"
+#include "manager.h"
+#include "connections.h"
+#include "io.h"
+#include "str.h"
+#include "utils.h"
+#include "bson_helpers.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/* A reply that nobody waits for anymore (the loser of a hedged query) is
+ * read before the next one on the socket, and the cursor that it opened is
+ * killed. A child process plays the server: it sends the stale reply with a
+ * cursor ID, and then a second one, and reports whether the kill arrived. */
+
+static int errors = 0;
+
+static void check(char *what, int ok)
+{
+	printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+	errors += !ok;
+}
+
+static void send_reply(int fd, int response_to, int64_t cursor_id)
+{
+	mcon_str *reply;
+
+	mcon_str_ptr_init(reply);
+	mcon_serialize_int(reply, 0);
+	mcon_serialize_int(reply, 0);
+	mcon_serialize_int(reply, response_to);
+	mcon_serialize_int(reply, 1); /* OP_REPLY */
+	mcon_serialize_int(reply, 0); /* flags */
+	mcon_serialize_int64(reply, cursor_id);
+	mcon_serialize_int(reply, 0); /* starting from */
+	mcon_serialize_int(reply, 0); /* number returned */
+	mcon_str_addl(reply, "padding that is dropped too", 27, 0);
+	((int*) reply->d)[0] = reply->l;
+
+	if (write(fd, reply->d, reply->l) != reply->l) {
+		exit(2);
+	}
+	mcon_str_ptr_dtor(reply);
+}
+
+static void play_server(int fd)
+{
+	char    packet[64];
+	int64_t cursor_id = 0;
+
+	send_reply(fd, 7, 12345);
+	send_reply(fd, 8, 0);
+
+	/* OP_KILL_CURSORS for one cursor is 32 bytes */
+	if (read(fd, packet, 32) != 32 || ((int*) packet)[3] != 2007) {
+		exit(1);
+	}
+	memcpy(&cursor_id, packet + 24, 8);
+	exit(cursor_id == 12345 ? 0 : 1);
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_connection  *con;
+	mongo_server_def   def;
+	char              *error_message = NULL, header[36];
+	int                fds[2], status;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+	if (fork() == 0) {
+		close(fds[0]);
+		play_server(fds[1]);
+	}
+	close(fds[1]);
+
+	memset(&def, 0, sizeof(def));
+	def.host = "127.0.0.1";
+	def.port = 27017;
+
+	con = calloc(1, sizeof(mongo_connection));
+	con->socket = fds[0];
+	con->hash = mongo_server_create_hash(&def);
+
+	mongo_connection_expect_stale_reply(con, 7);
+	check("the stale reply is remembered", con->stale_count == 1);
+	check("it is drained", mongo_connection_drain_stale_replies(manager, con, &error_message) == 1 && con->stale_count == 0);
+	check("... up to the next reply", mongo_io_recv_buffered(con, header, 36, &error_message) == 36 && ((int*) header)[2] == 8);
+
+	wait(&status);
+	check("the cursor of the stale reply is killed", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	mongo_connection_expect_stale_reply(con, 9);
+	check("a socket that went away fails the drain", mongo_connection_drain_stale_replies(manager, con, &error_message) == 0);
+	free(error_message);
+
+	mongo_connection_destroy(manager, con);
+	mongo_deinit(manager);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,91 @@
+#include "types.h"
+#include "manager.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Checks the histogram buckets, and that probes are counted per server and
+ * operation, both in the totals and in the counters of the current request,
+ * and that nothing is counted while the statistics are disabled. */
+
+static int errors = 0;
+
+static void check(char *what, int ok)
+{
+	printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+	errors += !ok;
+}
+
+static int buckets_ok(void)
+{
+	unsigned long us;
+	int bucket;
+
+	for (us = 0; us < 10000000; us += 1 + us / 7) {
+		bucket = mongo_stats_bucket(us);
+		if (mongo_stats_bucket_start(bucket) > us || mongo_stats_bucket_start(bucket + 1) <= us) {
+			printf("%lu ended up in bucket %d\n", us, bucket);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_connection   con;
+	mongo_stats_probe  probe;
+	mongo_stats_op    *op;
+	int                i;
+
+	check("buckets hold the values they start with", buckets_ok());
+	check("... the first ones are exact", mongo_stats_bucket(3) == 3 && mongo_stats_bucket(4) == 4);
+	check("... and the last one takes the rest", mongo_stats_bucket((unsigned long) -1) == MONGO_STATS_BUCKETS - 1);
+
+	memset(&con, 0, sizeof(con));
+	con.hash = strdup("db1.example.com:27017;-;.;1234");
+
+	mongo_stats_start(manager, &probe, &con);
+	mongo_stats_end(manager, &probe, MONGO_STATS_OP_QUERY, &con, 0);
+	check("disabled statistics count nothing", manager->stats == NULL);
+
+	manager->stats_enabled = 1;
+	for (i = 0; i < 10; i++) {
+		mongo_stats_start(manager, &probe, &con);
+		con.bytes_sent += 100;
+		con.bytes_received += 1000;
+		if (i == 9) {
+			usleep(20000);
+		}
+		mongo_stats_end(manager, &probe, MONGO_STATS_OP_QUERY, &con, i == 9 ? MONGO_STATS_FAILED | MONGO_STATS_RETRY : 0);
+	}
+	check("the server is named after the hash", manager->stats && strcmp(manager->stats->host, "db1.example.com:27017") == 0);
+
+	op = &manager->stats->total[MONGO_STATS_OP_QUERY];
+	check("queries are counted", op->count == 10 && op->failures == 1 && op->retries == 1);
+	check("... with their bytes", op->bytes_sent == 1000 && op->bytes_received == 10000);
+	check("... and the slowest one", op->max_us >= 20000);
+	check("p50 is a fast one", mongo_stats_percentile(op, 50) < 20000);
+	check("p99 is the slow one", mongo_stats_percentile(op, 99) >= 20000);
+	check("other operations are left alone", manager->stats->total[MONGO_STATS_OP_INSERT].count == 0);
+
+	mongo_stats_start_host(manager, &probe, "db2.example.com", 27018);
+	mongo_stats_end(manager, &probe, MONGO_STATS_OP_CONNECT, NULL, MONGO_STATS_FAILED);
+	check("connects are counted per host", manager->stats->next && strcmp(manager->stats->host, "db2.example.com:27018") == 0 && manager->stats->total[MONGO_STATS_OP_CONNECT].failures == 1);
+
+	mongo_stats_request_reset(manager);
+	check("a new request starts from scratch", manager->stats->next->request[MONGO_STATS_OP_QUERY].count == 0);
+	check("... but keeps the totals", manager->stats->next->total[MONGO_STATS_OP_QUERY].count == 10);
+
+	mongo_stats_reset(manager);
+	check("a reset drops the totals too", manager->stats->next->total[MONGO_STATS_OP_QUERY].count == 0);
+
+	free(con.hash);
+	mongo_deinit(manager);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "connections.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,6 +13,9 @@ int main(void)
 	mongo_server_def def1 = { "whisky", 13000, NULL, NULL, NULL };
 	mongo_server_def def2 = { "whisky", 13000, "phpunit", "derick", "not!" };
 
+	mongo_socket_options_init(&def1.options);
+	mongo_socket_options_init(&def2.options);
+
 	hash1 = mongo_server_create_hash(&def1);
 	mongo_server_split_hash(hash1, &host, &port, &db, &username, &auth_hash, &pid);
 	printf("HASH: %s; host: %s, port: %d, db: %s, username: %s, auth_hash: %s, pid: %d\n",
@@ -52,5 +56,15 @@ int main(void)
 
 	free(hash2);
 
+	/* servers with other socket options don't share sockets */
+	hash1 = mongo_server_create_hash(&def1);
+	def1.options.socket_timeout = 500;
+	hash2 = mongo_server_create_hash(&def1);
+	mongo_server_split_hash(hash2, &host, &port, &db, &username, &auth_hash, &pid);
+	printf("HASH: %s; host: %s, port: %d, db: %s, username: %s, auth_hash: %s, pid: %d\n",
+		hash2, host, port, db, username, auth_hash, pid);
+	printf("socket options in the hash: %s\n", strcmp(hash1, hash2) != 0 && strstr(hash2, ";S=") ? "ok" : "FAILED");
+	free(host); free(hash1); free(hash2);
+
 	return 0;
 }
@@ -0,0 +1,85 @@
+#include "types.h"
+#include "manager.h"
+#include "topology_cache.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/* Several processes ask whether they should ping the same server. Only one
+ * of them may get the lease, and once it has stored its result the others
+ * pick that up instead of pinging. */
+
+#define WORKERS 8
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	mongo_connection   con;
+	char              *error_message = NULL;
+	char               path[] = "/tmp/mcon-topology-XXXXXX";
+	int                fd, i, status, pingers = 0, errors = 0;
+
+	fd = mkstemp(path);
+	close(fd);
+
+	manager->topology_cache = mongo_topology_cache_open(path, &error_message);
+	if (!manager->topology_cache) {
+		printf("%s\n", error_message);
+		return 1;
+	}
+
+	memset(&con, 0, sizeof(con));
+	con.hash = "whisky:13000;-;.;1234";
+
+	for (i = 0; i < WORKERS; i++) {
+		if (fork() == 0) {
+			/* same server, different pid in the hash */
+			char hash[64];
+
+			snprintf(hash, sizeof(hash), "whisky:13000;-;.;%d", getpid());
+			con.hash = hash;
+			exit(mongo_topology_cache_check(manager, &con, MONGO_TOPOLOGY_PING, 5));
+		}
+	}
+	for (i = 0; i < WORKERS; i++) {
+		wait(&status);
+		pingers += WEXITSTATUS(status);
+	}
+	if (pingers != 1) {
+		printf("%d processes got the lease\n", pingers);
+		errors++;
+	}
+
+	/* the lease holder is gone without reporting back, so the lease is still
+	 * held until it expires, and the others are told to skip */
+	if (mongo_topology_cache_check(manager, &con, MONGO_TOPOLOGY_PING, 5) != 0) {
+		printf("got the lease while somebody else holds it\n");
+		errors++;
+	}
+
+	/* a result that is stored is handed to everybody else */
+	con.last_ping = time(NULL);
+	con.ping_ms = 42;
+	mongo_topology_cache_store(manager, &con, MONGO_TOPOLOGY_PING, 1);
+	con.last_ping = 0;
+	con.ping_ms = 0;
+	if (mongo_topology_cache_check(manager, &con, MONGO_TOPOLOGY_PING, 5) != 0 || con.ping_ms != 42) {
+		printf("stored ping time not picked up: %d\n", con.ping_ms);
+		errors++;
+	}
+
+	/* ismaster is leased separately */
+	if (mongo_topology_cache_check(manager, &con, MONGO_TOPOLOGY_ISMASTER, 15) != 1) {
+		printf("no ismaster lease\n");
+		errors++;
+	}
+
+	printf("%d workers, %d pinged, %d errors\n", WORKERS, pingers, errors);
+
+	mongo_deinit(manager);
+	unlink(path);
+	return errors != 0;
+}
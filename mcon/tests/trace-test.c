@@ -0,0 +1,69 @@
+#include "types.h"
+#include "manager.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Fills a small trace past its size and checks that only the newest events
+ * are dumped, oldest first and formatted, and that the log function is not
+ * called for the modules and levels that are switched off. */
+
+static int errors = 0;
+static int lines = 0, logged = 0;
+static char last[256];
+
+static void check(char *what, int ok)
+{
+	printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+	errors += !ok;
+}
+
+static void collect(void *context, char *text)
+{
+	if (lines == 0) {
+		strcpy((char*) context, text);
+	}
+	strcpy(last, text);
+	lines++;
+}
+
+static void count_log(int module, int level, void *context, char *format, va_list arg)
+{
+	logged++;
+}
+
+int main(void)
+{
+	mongo_con_manager *manager = mongo_init();
+	char               first[256];
+	int                i;
+
+	MONGO_TRACE(manager, MONGO_TRACE_PING, 3, 12, 0, 0);
+	check("nothing is traced by default", manager->trace == NULL);
+
+	manager->trace = mongo_trace_init(4);
+	for (i = 1; i <= 6; i++) {
+		MONGO_TRACE(manager, MONGO_TRACE_SEND_QUERY, i, 100 * i, 7, 0);
+	}
+	check("all events are dumped that fit", mongo_trace_dump(manager->trace, collect, first) == 4 && lines == 4);
+	check("... from the oldest", strstr(first, " send query: request 3, 300 bytes, socket 7") != NULL);
+	check("... to the newest", strstr(last, " send query: request 6, 600 bytes, socket 7") != NULL);
+
+	mongo_trace_clear(manager->trace);
+	lines = 0;
+	check("a cleared trace is empty", mongo_trace_dump(manager->trace, collect, first) == 0 && lines == 0);
+
+	manager->log_function = count_log;
+	manager->log_levels = MLOG_WARN;
+	mongo_manager_log(manager, MLOG_RS, MLOG_FINE, "not wanted: %d", 1);
+	mongo_manager_log(manager, MLOG_RS, MLOG_WARN, "wanted: %d", 2);
+	manager->log_modules = MLOG_CON;
+	mongo_manager_log(manager, MLOG_RS, MLOG_WARN, "other module: %d", 3);
+	check("only wanted messages are logged", logged == 1);
+
+	mongo_deinit(manager);
+
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
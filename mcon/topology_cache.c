@@ -0,0 +1,249 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "types.h"
+#include "manager.h"
+#include "connections.h"
+#include "topology_cache.h"
+
+/* The cache is a file that every process maps, shared. It holds a fixed
+ * table of servers, found by open addressing on the connection hash without
+ * its PID. All access is done with an fcntl() lock on the whole file held,
+ * which the kernel drops when a process dies. A process that runs a check
+ * holds a lease on it, so that the others use the state it found instead of
+ * running the same check. */
+
+#define MONGO_TOPOLOGY_MAGIC   0x6d746331 /* "mtc1" */
+#define MONGO_TOPOLOGY_SLOTS   256
+#define MONGO_TOPOLOGY_KEY_LEN 256
+
+typedef struct _mongo_topology_slot
+{
+	char   key[MONGO_TOPOLOGY_KEY_LEN];
+	int    connection_type;
+	int    ping_ms;
+	time_t last_ping;
+	time_t last_ismaster;
+	int    lease_pid[2];     /* Per MONGO_TOPOLOGY_PING/ISMASTER */
+	time_t lease_expires[2];
+} mongo_topology_slot;
+
+typedef struct _mongo_topology_table
+{
+	int                 magic;
+	mongo_topology_slot slots[MONGO_TOPOLOGY_SLOTS];
+} mongo_topology_table;
+
+struct _mongo_topology_cache
+{
+	int                   fd;
+	mongo_topology_table *table;
+};
+
+#ifndef WIN32
+static int lock_table(mongo_topology_cache *cache, int type)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+
+	while (fcntl(cache->fd, F_SETLKW, &lock) == -1) {
+		if (errno != EINTR) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+mongo_topology_cache *mongo_topology_cache_open(char *path, char **error_message)
+{
+	mongo_topology_cache *cache;
+	struct stat st;
+
+	cache = calloc(1, sizeof(mongo_topology_cache));
+	cache->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (cache->fd == -1) {
+		goto error;
+	}
+
+	if (!lock_table(cache, F_WRLCK) || fstat(cache->fd, &st) == -1) {
+		goto error;
+	}
+	/* a new file, or one of a different layout, starts out empty */
+	if (st.st_size != sizeof(mongo_topology_table) && ftruncate(cache->fd, sizeof(mongo_topology_table)) == -1) {
+		goto error;
+	}
+
+	cache->table = mmap(NULL, sizeof(mongo_topology_table), PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+	if (cache->table == MAP_FAILED) {
+		cache->table = NULL;
+		goto error;
+	}
+	if (cache->table->magic != MONGO_TOPOLOGY_MAGIC) {
+		memset(cache->table, 0, sizeof(mongo_topology_table));
+		cache->table->magic = MONGO_TOPOLOGY_MAGIC;
+	}
+
+	lock_table(cache, F_UNLCK);
+	return cache;
+
+error:
+	*error_message = malloc(256 + strlen(path));
+	snprintf(*error_message, 256 + strlen(path), "Couldn't open the topology cache %s: %s", path, strerror(errno));
+	if (cache->fd != -1) {
+		close(cache->fd);
+	}
+	free(cache);
+	return NULL;
+}
+
+void mongo_topology_cache_close(mongo_topology_cache *cache)
+{
+	munmap(cache->table, sizeof(mongo_topology_table));
+	close(cache->fd);
+	free(cache);
+}
+
+/* FNV-1a */
+static unsigned int hash_key(char *key)
+{
+	unsigned int value = 2166136261U;
+
+	while (*key) {
+		value ^= (unsigned char) *key++;
+		value *= 16777619U;
+	}
+	return value;
+}
+
+/* Finds the slot for con, claiming a free one if there is none yet. Returns
+ * NULL if the table is full. Must be called with the table locked. */
+static mongo_topology_slot *find_slot(mongo_topology_cache *cache, mongo_connection *con)
+{
+	char key[MONGO_TOPOLOGY_KEY_LEN], *pid;
+	mongo_topology_slot *slot;
+	unsigned int start, i;
+
+	/* The same server is the same server in every process */
+	snprintf(key, sizeof(key), "%s", con->hash);
+	pid = strrchr(key, ';');
+	if (pid) {
+		*pid = '\0';
+	}
+
+	start = hash_key(key) % MONGO_TOPOLOGY_SLOTS;
+	for (i = 0; i < MONGO_TOPOLOGY_SLOTS; i++) {
+		slot = &cache->table->slots[(start + i) % MONGO_TOPOLOGY_SLOTS];
+		if (slot->key[0] == '\0') {
+			memset(slot, 0, sizeof(mongo_topology_slot));
+			snprintf(slot->key, sizeof(slot->key), "%s", key);
+			return slot;
+		}
+		if (strcmp(slot->key, key) == 0) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+int mongo_topology_cache_check(mongo_con_manager *manager, mongo_connection *con, int what, int interval)
+{
+	mongo_topology_slot *slot;
+	time_t now = time(NULL), last;
+	int    retval = 1;
+
+	if (!manager->topology_cache || !lock_table(manager->topology_cache, F_WRLCK)) {
+		return 1;
+	}
+
+	slot = find_slot(manager->topology_cache, con);
+	if (slot) {
+		last = what == MONGO_TOPOLOGY_PING ? slot->last_ping : slot->last_ismaster;
+
+		if (last + interval > now || (slot->lease_expires[what] > now && slot->lease_pid[what] != getpid())) {
+			/* Checked recently, or being checked right now, by somebody */
+			if (last) {
+				if (what == MONGO_TOPOLOGY_PING) {
+					if (con->last_ping != slot->last_ping) {
+						mongo_connection_rtt_sample(con, slot->ping_ms * 1000);
+					}
+					con->last_ping = slot->last_ping;
+					con->ping_ms = slot->ping_ms;
+				} else {
+					con->last_ismaster = slot->last_ismaster;
+					con->connection_type = slot->connection_type;
+				}
+			}
+			mongo_manager_log(manager, MLOG_CON, MLOG_FINE, "topology_cache: using the shared state for %s", slot->key);
+			retval = 0;
+		} else {
+			/* Our turn. The lease runs out in case we never report back */
+			slot->lease_pid[what] = getpid();
+			slot->lease_expires[what] = now + (interval > 0 ? interval : 1);
+		}
+	}
+
+	lock_table(manager->topology_cache, F_UNLCK);
+	return retval;
+}
+
+void mongo_topology_cache_store(mongo_con_manager *manager, mongo_connection *con, int what, int worked)
+{
+	mongo_topology_slot *slot;
+
+	if (!manager->topology_cache || !lock_table(manager->topology_cache, F_WRLCK)) {
+		return;
+	}
+
+	slot = find_slot(manager->topology_cache, con);
+	if (slot) {
+		if (worked) {
+			if (what == MONGO_TOPOLOGY_PING) {
+				slot->last_ping = con->last_ping;
+				slot->ping_ms = con->ping_ms;
+			} else {
+				slot->last_ismaster = con->last_ismaster;
+				slot->connection_type = con->connection_type;
+			}
+		}
+		if (slot->lease_pid[what] == getpid()) {
+			slot->lease_pid[what] = 0;
+			slot->lease_expires[what] = 0;
+		}
+	}
+
+	lock_table(manager->topology_cache, F_UNLCK);
+}
+#else
+/* Not available on Windows, where every process does its own checks */
+mongo_topology_cache *mongo_topology_cache_open(char *path, char **error_message)
+{
+	*error_message = strdup("The topology cache is not supported on this platform");
+	return NULL;
+}
+
+void mongo_topology_cache_close(mongo_topology_cache *cache)
+{
+}
+
+int mongo_topology_cache_check(mongo_con_manager *manager, mongo_connection *con, int what, int interval)
+{
+	return 1;
+}
+
+void mongo_topology_cache_store(mongo_con_manager *manager, mongo_connection *con, int what, int worked)
+{
+}
+#endif
@@ -0,0 +1,26 @@
+#ifndef __MCON_TOPOLOGY_CACHE_H__
+#define __MCON_TOPOLOGY_CACHE_H__
+
+#include "types.h"
+
+/* Which of the health checks a lease or cached state is for */
+#define MONGO_TOPOLOGY_PING     0
+#define MONGO_TOPOLOGY_ISMASTER 1
+
+/* Opens (and creates if needed) the shared topology cache in the file at
+ * path. Returns NULL with *error_message set (to be freed) if that fails. */
+mongo_topology_cache *mongo_topology_cache_open(char *path, char **error_message);
+void mongo_topology_cache_close(mongo_topology_cache *cache);
+
+/* Asks whether this process has to run the check of the given kind on con
+ * itself. Returns 1 if it has, in which case it holds the lease for the check
+ * and must call mongo_topology_cache_store() afterwards. Returns 0 if another
+ * process has run the check recently or is running it now, in which case the
+ * state it found has been copied into con. */
+int mongo_topology_cache_check(mongo_con_manager *manager, mongo_connection *con, int what, int interval);
+
+/* Stores the result of a check into the cache (if it worked) and gives up
+ * the lease on it */
+void mongo_topology_cache_store(mongo_con_manager *manager, mongo_connection *con, int what, int worked);
+
+#endif
@@ -0,0 +1,95 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "types.h"
+#include "trace.h"
+
+/* The formats of the events, all arguments are longs */
+static char *event_formats[MONGO_TRACE_EVENT_COUNT] = {
+	"?",
+	"send query: request %ld, %ld bytes, socket %ld",
+	"send get more: request %ld, %ld bytes, socket %ld",
+	"send write: opcode %ld, %ld bytes, socket %ld",
+	"reply: response to %ld, %ld bytes, %ld documents, socket %ld",
+	"reply failed: request %ld, socket %ld",
+	"select nearest: %ld candidates, %ld near, nearest %ldus, window %ldms",
+	"pick server: element %ld of %ld, socket %ld, rtt %ldus",
+	"connect: port %ld, socket %ld",
+	"ping: socket %ld, %ldms",
+	"ismaster: socket %ld, result %ld",
+	"exception: code %ld, socket %ld",
+	"hedge: request %ld, socket %ld after %ldms, socket %ld answered first"
+};
+
+mongo_trace *mongo_trace_init(unsigned int size)
+{
+	mongo_trace *trace;
+
+	if (size == 0) {
+		return NULL;
+	}
+
+	trace = calloc(1, sizeof(mongo_trace));
+	trace->events = calloc(size, sizeof(mongo_trace_event));
+	trace->size = size;
+
+	return trace;
+}
+
+void mongo_trace_record(mongo_trace *trace, int event, long a, long b, long c, long d)
+{
+	mongo_trace_event *entry = &trace->events[trace->count % trace->size];
+	struct timeval     now;
+
+	gettimeofday(&now, NULL);
+	entry->sec = now.tv_sec;
+	entry->usec = now.tv_usec;
+	entry->event = event;
+	entry->args[0] = a;
+	entry->args[1] = b;
+	entry->args[2] = c;
+	entry->args[3] = d;
+
+	trace->count++;
+}
+
+int mongo_trace_dump(mongo_trace *trace, void (*line)(void *context, char *text), void *context)
+{
+	mongo_trace_event *entry;
+	unsigned long      i, first;
+	char               text[256];
+	int                length, event;
+
+	if (!trace) {
+		return 0;
+	}
+
+	first = trace->count > trace->size ? trace->count - trace->size : 0;
+	for (i = first; i < trace->count; i++) {
+		entry = &trace->events[i % trace->size];
+		event = entry->event > 0 && entry->event < MONGO_TRACE_EVENT_COUNT ? entry->event : 0;
+
+		length = snprintf(text, sizeof(text), "%ld.%06ld ", entry->sec, entry->usec);
+		snprintf(text + length, sizeof(text) - length, event_formats[event], entry->args[0], entry->args[1], entry->args[2], entry->args[3]);
+		line(context, text);
+	}
+
+	return trace->count - first;
+}
+
+void mongo_trace_clear(mongo_trace *trace)
+{
+	if (trace) {
+		trace->count = 0;
+	}
+}
+
+void mongo_trace_free(mongo_trace *trace)
+{
+	if (trace) {
+		free(trace->events);
+		free(trace);
+	}
+}
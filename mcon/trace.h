@@ -0,0 +1,57 @@
+#ifndef __MCON_TRACE_H__
+#define __MCON_TRACE_H__
+
+#include "types.h"
+
+/* The events that are traced. Each takes up to four integer arguments, which
+ * are only formatted (with the format in trace.c) when the trace is dumped. */
+#define MONGO_TRACE_SEND_QUERY        1
+#define MONGO_TRACE_SEND_GET_MORE     2
+#define MONGO_TRACE_SEND_WRITE        3
+#define MONGO_TRACE_REPLY             4
+#define MONGO_TRACE_REPLY_FAILED      5
+#define MONGO_TRACE_SELECT_NEAREST    6
+#define MONGO_TRACE_PICK_SERVER       7
+#define MONGO_TRACE_CONNECT           8
+#define MONGO_TRACE_PING              9
+#define MONGO_TRACE_ISMASTER         10
+#define MONGO_TRACE_EXCEPTION        11
+#define MONGO_TRACE_HEDGE            12
+#define MONGO_TRACE_EVENT_COUNT      13
+
+typedef struct _mongo_trace_event
+{
+	long sec;
+	long usec;
+	int  event;
+	long args[4];
+} mongo_trace_event;
+
+struct _mongo_trace
+{
+	mongo_trace_event *events;
+	unsigned int       size;
+	unsigned long      count; /* Of all events ever recorded, the oldest ones have been overwritten */
+};
+
+/* Records event in the trace of manager m, if there is one. This is cheap
+ * enough to be left in the paths that every request goes through. */
+#define MONGO_TRACE(m, event, a, b, c, d) do { \
+		if ((m)->trace) { \
+			mongo_trace_record((m)->trace, (event), (long) (a), (long) (b), (long) (c), (long) (d)); \
+		} \
+	} while (0)
+
+/* Creates a trace that remembers the last size events */
+mongo_trace *mongo_trace_init(unsigned int size);
+void mongo_trace_record(mongo_trace *trace, int event, long a, long b, long c, long d);
+
+/* Formats the events that are still in the trace, from the oldest to the
+ * newest one, and calls line for each with the text (which is only valid
+ * during the call). Returns the number of events. */
+int mongo_trace_dump(mongo_trace *trace, void (*line)(void *context, char *text), void *context);
+
+void mongo_trace_clear(mongo_trace *trace);
+void mongo_trace_free(mongo_trace *trace);
+
+#endif
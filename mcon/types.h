@@ -57,14 +57,108 @@
 #define MLOG_NONE    0
 #define MLOG_ALL    31 /* Must be the bit sum of all above */
 
+/* The compressor IDs of OP_COMPRESSED. They are offered to the server as a
+ * bit field of (1 << id), see mongo_socket_options.compressors */
+#define MONGO_COMPRESSOR_NOOP     0
+#define MONGO_COMPRESSOR_SNAPPY   1
+#define MONGO_COMPRESSOR_ZLIB     2
+
+
+/* Options for the sockets to a server, see mongo_connection_connect. A value
+ * of -1 means that the default of the manager is used. */
+typedef struct _mongo_socket_options
+{
+	int nodelay;            /* TCP_NODELAY, 0 or 1 */
+	int keepalive;          /* SO_KEEPALIVE, 0 or 1 */
+	int keepalive_idle;     /* Idle seconds before the first keepalive probe, 0 for the system's */
+	int keepalive_interval; /* Seconds between keepalive probes, 0 for the system's */
+	int keepalive_count;    /* Unanswered probes after which the connection is dropped, 0 for the system's */
+	int send_buffer;        /* SO_SNDBUF in bytes, 0 for the system's */
+	int receive_buffer;     /* SO_RCVBUF in bytes, 0 for the system's */
+	int socket_timeout;     /* For a single send or receive in ms, 0 for none */
+	int compressors;        /* Bit field of the MONGO_COMPRESSOR_* to offer the server, 0 for none */
+	int zlib_level;         /* 0-9, or the default of zlib when -1 is used at the manager too */
+} mongo_socket_options;
+
+/* An index spec that has been ensured on a connection, see
+ * mongo_connection_index_ensured() */
+typedef struct _mongo_ensured_index
+{
+	char   *ns;
+	char   *spec; /* The BSON of the system.indexes document */
+	int     spec_len;
+	time_t  expires;
+	struct _mongo_ensured_index *next;
+} mongo_ensured_index;
+
+/* A database that a socket has been authenticated against, see
+ * mongo_manager_connection_authenticate */
+typedef struct _mongo_connection_auth
+{
+	char *db;
+	char *username;
+	char *auth_hash; /* See mongo_server_create_hashed_password */
+	struct _mongo_connection_auth *next;
+} mongo_connection_auth;
+
+/* Operations that are counted for each server, see mongo_stats_end */
+#define MONGO_STATS_OP_QUERY     0
+#define MONGO_STATS_OP_GETMORE   1
+#define MONGO_STATS_OP_INSERT    2
+#define MONGO_STATS_OP_UPDATE    3
+#define MONGO_STATS_OP_REMOVE    4
+#define MONGO_STATS_OP_COMMAND   5
+#define MONGO_STATS_OP_CONNECT   6
+#define MONGO_STATS_OP_PING      7
+#define MONGO_STATS_OP_ISMASTER  8
+#define MONGO_STATS_OP_COUNT     9
+
+/* Latencies are counted in MONGO_STATS_SUB_BUCKETS buckets for every power of
+ * two of microseconds, which keeps each bucket within 25% of the latencies in
+ * it, like an HdrHistogram with one significant figure */
+#define MONGO_STATS_SUB_BITS     2
+#define MONGO_STATS_SUB_BUCKETS  (1 << MONGO_STATS_SUB_BITS)
+#define MONGO_STATS_BUCKETS      (32 * MONGO_STATS_SUB_BUCKETS)
+
+typedef struct _mongo_stats_op
+{
+	unsigned long count;
+	unsigned long failures;
+	unsigned long retries;
+	unsigned long bytes_sent;
+	unsigned long bytes_received;
+	double        total_us;
+	unsigned long max_us;
+	unsigned int  histogram[MONGO_STATS_BUCKETS];
+} mongo_stats_op;
+
+typedef struct _mongo_stats_server
+{
+	char                       *host; /* "host:port" */
+	mongo_stats_op              total[MONGO_STATS_OP_COUNT]; /* Since the start of the process, or the last reset */
+	mongo_stats_op              request[MONGO_STATS_OP_COUNT]; /* Since the start of the request */
+	struct _mongo_stats_server *next;
+} mongo_stats_server;
+
+/* An operation that is being timed, see mongo_stats_start */
+typedef struct _mongo_stats_probe
+{
+	mongo_stats_server *server; /* NULL when it isn't counted */
+	long                start_sec;
+	long                start_usec;
+	unsigned long       bytes_sent; /* Of the connection, when the operation started */
+	unsigned long       bytes_received;
+} mongo_stats_probe;
 
 /* Stores all the information about the connection. The hash is a group of
  * parameters to identify a unique connection. */
 typedef struct _mongo_connection
 {
 	time_t last_ping; /* The timestamp when ping was called last */
-	int    ping_ms;
+	int    ping_ms; /* Of the last ping */
+	int    rtt_us; /* Moving average of the round trips, see mongo_connection_rtt_sample (0 if none yet) */
 	int    last_ismaster; /* The timestamp when ismaster/get_server_flags was called last */
+	time_t last_reply; /* The timestamp of the last reply that was timed, which proves the socket works as well as a ping */
 	int    last_reqid;
 	int    socket;
 	int    connection_type; /* MONGO_NODE_: PRIMARY, SECONDARY, ARBITER, MONGOS */
@@ -72,34 +166,156 @@ typedef struct _mongo_connection
 	int    tag_count;
 	char **tags;
 	char  *hash; /* Duplicate of the hash that the manager knows this connection as */
+	void  *pending_reply; /* Owner of a request whose reply has not been read yet (a prefetching cursor), or NULL */
+	int   *stale_replies; /* Request IDs of replies that come before those of pending_reply, but that nobody waits for anymore (see mongo_connection_expect_stale_reply) */
+	int    stale_count;
+	char  *read_buf; /* Data that was read from the socket, but not consumed yet (see mongo_io_recv_buffered) */
+	int    read_buf_pos;
+	int    read_buf_len;
+	int    read_buf_size; /* Larger than MONGO_IO_READ_BUFFER_SIZE while it holds an inflated reply */
+	int    read_msg_left; /* What is left of the message that is being read, when compressor is set */
+	int    compressors; /* The MONGO_COMPRESSOR_* bits that were offered to the server */
+	int    compressor; /* The one that the server agreed to, MONGO_COMPRESSOR_NOOP for none */
+	int    zlib_level;
+	char  *write_buf; /* Unacknowledged writes that have not been sent yet (see mongo_io_queue) */
+	int    write_buf_len;
+	int    write_buf_size;
+	mongo_ensured_index *ensured_indexes; /* Index specs that do not need to be sent again for a while */
+	mongo_connection_auth *auths; /* The users that the socket is authenticated as, one per database */
+	int    busy; /* The number of users that have checked the socket out, see mongo_manager_connection_checkout */
+	struct _mongo_connection *pool_next; /* The next of the extra sockets to the same server */
+	unsigned long bytes_sent; /* All that went through mongo_io_flushv and mongo_io_recv_buffered */
+	unsigned long bytes_received;
+	mongo_stats_server *stats; /* Of the server that the socket is connected to, once known */
+	mongo_stats_probe ismaster_probe; /* Between mongo_connection_ismaster_send and _reply */
 } mongo_connection;
 
+/* A server that could not be connected to or pinged, which is left alone for
+ * a while instead of costing every request a timeout, see
+ * mongo_manager_server_eject */
+typedef struct _mongo_ejected_server
+{
+	char                         *host; /* "host:port" */
+	int                           failures; /* In a row */
+	time_t                        until;
+	struct _mongo_ejected_server *next;
+} mongo_ejected_server;
+
+/* Items are kept in two lists: "next"/"prev" link all of them in the order
+ * in which they were registered, which is the order everything that iterates
+ * over manager->connections sees. "bucket_next" links the items that share a
+ * bucket of the manager's hash table. */
 typedef struct _mongo_con_manager_item
 {
 	char                           *hash;
+	unsigned int                    hash_value; /* Of the hash string, see mongo_manager_connection_find_by_hash */
 	mongo_connection               *connection;
+	struct _mongo_server_def       *server; /* With credentials, to open more sockets with (NULL if not known) */
+	mongo_connection               *pool; /* The sockets to the server besides connection, linked through pool_next */
+	int                             pool_count;
 	struct _mongo_con_manager_item *next;
+	struct _mongo_con_manager_item *prev;
+	struct _mongo_con_manager_item *bucket_next;
 } mongo_con_manager_item;
 
 typedef void (mongo_log_callback_t)(int module, int level, void *context, char *format, va_list arg);
 
 #define MONGO_MANAGER_DEFAULT_PING_INTERVAL    5
 #define MONGO_MANAGER_DEFAULT_MASTER_INTERVAL 15
+#define MONGO_MANAGER_DEFAULT_POOL_SIZE        1
+#define MONGO_MANAGER_DEFAULT_EJECT_TIME       5
+#define MONGO_MANAGER_MAX_EJECT_SHIFT          6
+#define MONGO_HEDGE_MIN_SAMPLES               20
+
+/* Shared between processes, see topology_cache.c */
+typedef struct _mongo_topology_cache mongo_topology_cache;
+
+/* A cached address lookup, see resolver.c */
+typedef struct _mongo_resolver_entry mongo_resolver_entry;
+
+/* Ring buffer of binary trace records, see trace.c */
+typedef struct _mongo_trace mongo_trace;
+
+/* A connection string and what it was parsed into, see parse.c */
+typedef struct _mongo_parsed_spec mongo_parsed_spec;
 
 typedef struct _mongo_con_manager
 {
 	mongo_con_manager_item *connections;
+	mongo_con_manager_item *connections_last;
+
+	/* Hash table over the connections, for looking them up by hash */
+	mongo_con_manager_item **buckets;
+	int                     bucket_count;
+	int                     connection_count;
 
 	/* context and callback function that is used to send logging information
 	 * through */
 	void                   *log_context;
 	mongo_log_callback_t   *log_function;
 
+	/* The modules and levels (bit sums of MLOG_*) that log_function is called
+	 * for, so that messages nobody wants are not even passed on */
+	int                     log_modules;        /* default: MLOG_ALL */
+	int                     log_levels;         /* default: all levels */
+
 	/* ping/ismaster will not be called more often than the amount of seconds that
 	 * is configured with ping_interval/ismaster_interval. The ismaster interval
 	 * is also used for the get_server_flags function. */
 	long                    ping_interval;      /* default:  5 seconds */
 	long                    ismaster_interval;  /* default: 15 seconds */
+
+	/* The maximum number of sockets that are opened to each server, see
+	 * mongo_manager_connection_checkout. 1 turns pooling off. */
+	int                     pool_size;          /* default:  1 socket */
+
+	/* Whether connection strings with different credentials share the sockets
+	 * to a server, which are then authenticated for each of them on first use
+	 * (see mongo_manager_connection_authenticate). That also means that each
+	 * of those credentials can reach what the others may access. */
+	int                     share_auth;         /* default:  0 */
+
+	/* Failing servers of a MONGO_CON_TYPE_MULTIPLE set are ejected for
+	 * eject_time seconds, which doubles with every failure in a row up to
+	 * MONGO_MANAGER_MAX_EJECT_SHIFT times */
+	mongo_ejected_server   *ejected_servers;
+	long                    eject_time;         /* default:  5 seconds */
+
+	/* Optionally shares the results of the ping/ismaster checks with the other
+	 * processes on the box (NULL if not) */
+	mongo_topology_cache   *topology_cache;
+
+	/* Recently looked up host names */
+	mongo_resolver_entry   *resolver_cache;
+
+	/* Recently parsed connection strings, the most recently used first (see
+	 * mongo_parse_server_spec_cached) */
+	mongo_parsed_spec      *parsed_specs;
+
+	/* What is used for the options that the servers do not set themselves */
+	mongo_socket_options    socket_options;
+
+	/* Counters and latencies per server and operation, when stats is set (see
+	 * stats.c) */
+	int                     stats_enabled;      /* default:  0 */
+	mongo_stats_server     *stats;
+
+	/* When a query that may go to several members of a replica set has no
+	 * reply after hedge_delay ms, it is sent to another one too and the first
+	 * reply wins. With hedge_percentile, the delay is that percentile of the
+	 * query latencies of the server instead, once there are enough of them
+	 * (see MONGO_HEDGE_MIN_SAMPLES). 0 turns either off. The second query
+	 * needs a free socket of the pool, see pool_size. */
+	long                    hedge_delay;        /* default:  0 ms */
+	long                    hedge_percentile;   /* default:  0 */
+
+	/* The most recent events of the connections, or NULL when not tracing
+	 * (see mongo_trace_init) */
+	mongo_trace            *trace;
+
+	/* Bumping this drops the connections that the mongo_servers have bound
+	 * (see mongo_manager_unbind_all) */
+	int                     binding_epoch;
 } mongo_con_manager;
 
 typedef struct _mongo_read_preference_tagset
@@ -122,21 +338,40 @@ typedef struct _mongo_server_def
 	char *db;
 	char *username;
 	char *password;
+
+	mongo_socket_options options;
 } mongo_server_def;
 
+/* The connection that was picked for reads or writes, which is reused for as
+ * long as epoch is the manager's binding_epoch (see
+ * mongo_get_read_write_connection) */
+typedef struct _mongo_server_binding
+{
+	char                 *hash;  /* NULL when nothing is bound */
+	int                   epoch;
+	mongo_read_preference rp;    /* That the read connection was picked for */
+} mongo_server_binding;
+
 typedef struct _mongo_servers
 {
-	int               count;
-	mongo_server_def *server[16]; /* TODO: Make this dynamic */
+	int                count;
+	int                size; /* Of the server array, see mongo_servers_add */
+	mongo_server_def **server;
 
 	/* flags and options */
 	int                   con_type;
 	char                 *repl_set_name;
 	int                   connectTimeoutMS;
+	int                   secondaryAcceptableLatencyMS; /* See mongo_select_nearest_servers */
 
 	mongo_read_preference read_pref;
+
+	mongo_server_binding  bound[2]; /* MONGO_SERVER_BOUND_READ/WRITE */
 } mongo_servers;
 
+#define MONGO_SERVER_BOUND_READ  0
+#define MONGO_SERVER_BOUND_WRITE 1
+
 typedef struct _mcon_collection
 {
 	int count;
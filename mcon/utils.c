@@ -23,13 +23,25 @@ char *mongo_server_create_hashed_password(char *username, char *password)
 	return hash;
 }
 
-/* Hash format is: HOST:PORT;X;PID or HOST:PORT;DB/USERNAME/md5(PID,PASSWORD,USERNAME);PID */
+/* Hash format is: HOST:PORT;X;PID or HOST:PORT;DB/USERNAME/md5(PID,PASSWORD,USERNAME);PID,
+ * with ;S=OPTIONS before the ;PID when the socket options of the server
+ * aren't all the manager's defaults. */
+
+/* Whether any of the socket options is set, see mongo_socket_options_init */
+static int socket_options_set(mongo_socket_options *options)
+{
+	return
+		options->nodelay != -1 || options->keepalive != -1 ||
+		options->keepalive_idle != -1 || options->keepalive_interval != -1 || options->keepalive_count != -1 ||
+		options->send_buffer != -1 || options->receive_buffer != -1 || options->socket_timeout != -1 ||
+		options->compressors != -1 || options->zlib_level != -1;
+}
 
 /* Creates a unique hash for a server def with some info from the server config,
  * but also with the PID to make sure forking works */
 char *mongo_server_create_hash(mongo_server_def *server_def)
 {
-	char *tmp, *hash;
+	char *tmp, *hash = NULL;
 	int   size = 0;
 
 	/* Host (string) and port (max 5 digits) + 2 separators */
@@ -41,6 +53,11 @@ char *mongo_server_create_hash(mongo_server_def *server_def)
 		size += strlen(server_def->db) + 1 + strlen(server_def->username) + 1 + strlen(hash) + 1;
 	}
 
+	/* Socket options (10 signed 32bit ints, with separators) */
+	if (socket_options_set(&server_def->options)) {
+		size += 3 + 10 * 12;
+	}
+
 	/* PID (assume max size, a signed 32bit int) */
 	size += 10;
 
@@ -53,6 +70,16 @@ char *mongo_server_create_hash(mongo_server_def *server_def)
 	} else {
 		sprintf(tmp + strlen(tmp), "X;");
 	}
+	/* Links that set up their sockets differently don't share them */
+	if (socket_options_set(&server_def->options)) {
+		mongo_socket_options *o = &server_def->options;
+
+		sprintf(
+			tmp + strlen(tmp), "S=%d,%d,%d,%d,%d,%d,%d,%d,%d,%d;",
+			o->nodelay, o->keepalive, o->keepalive_idle, o->keepalive_interval, o->keepalive_count,
+			o->send_buffer, o->receive_buffer, o->socket_timeout, o->compressors, o->zlib_level
+		);
+	}
 	sprintf(tmp + strlen(tmp), "%d", getpid());
 
 	return tmp;
@@ -103,9 +130,9 @@ int mongo_server_split_hash(char *hash, char **host, int *port, char **database,
 		pid_semi = strchr(ptr, ';');
 	}
 
-	/* Find the PID */
+	/* Find the PID, which comes after the socket options if there are any */
 	if (pid) {
-		*pid = atoi(pid_semi + 1);
+		*pid = atoi(strrchr(hash, ';') + 1);
 	}
 
 	return 0;
@@ -130,29 +157,31 @@ int mongo_server_hash_to_pid(char *hash)
 	return atoi(ptr+1);
 }
 
-/* Forward declaration for the MD5 algorithm */
-void MD5_Init(MD5_CTX *ctx);
-void MD5_Update(MD5_CTX *ctx, void *data, unsigned long size);
-void MD5_Final(unsigned char *result, MD5_CTX *ctx);
-
-/* Convience function around the MD5 implementation */
-char *mongo_util_md5_hex(char *hash, int hash_length)
+/* Finishes the digest of ctx, as 32 hex digits and a \0 in md5str */
+void mongo_util_md5_final_hex(MD5_CTX *ctx, char *md5str)
 {
-	MD5_CTX           md5ctx;
 	unsigned char     digest[16];
 	static const char hexits[17] = "0123456789abcdef";
-	char              md5str[33];
 	int               i;
 
-	MD5_Init(&md5ctx);
-	MD5_Update(&md5ctx, hash, hash_length);
-	MD5_Final(digest, &md5ctx);
+	MD5_Final(digest, ctx);
 
 	for (i = 0; i < 16; i++) {
 		md5str[i * 2]       = hexits[digest[i] >> 4];
 		md5str[(i * 2) + 1] = hexits[digest[i] &  0x0F];
 	}
 	md5str[16 * 2] = '\0';
+}
+
+/* Convience function around the MD5 implementation */
+char *mongo_util_md5_hex(char *hash, int hash_length)
+{
+	MD5_CTX           md5ctx;
+	char              md5str[33];
+
+	MD5_Init(&md5ctx);
+	MD5_Update(&md5ctx, hash, hash_length);
+	mongo_util_md5_final_hex(&md5ctx, md5str);
 
 	return strdup(md5str);
 }
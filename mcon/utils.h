@@ -43,7 +43,12 @@ typedef struct {
 	unsigned char buffer[64];
 	MD5_u32plus block[16];
 } MD5_CTX;
- 
+
+void MD5_Init(MD5_CTX *ctx);
+void MD5_Update(MD5_CTX *ctx, void *data, unsigned long size);
+void MD5_Final(unsigned char *result, MD5_CTX *ctx);
+
+void mongo_util_md5_final_hex(MD5_CTX *ctx, char *md5str);
 char *mongo_util_md5_hex(char *hash, int hash_length);
 
 #endif
@@ -322,7 +322,7 @@ PHP_METHOD(Mongo, __construct)
 	 * Default to the mongo.default_host & mongo.default_port INI options */
 	link->servers = mongo_parse_init();
 	if (server) {
-		if (mongo_parse_server_spec(link->manager, link->servers, server, (char **)&error_message)) {
+		if (mongo_parse_server_spec_cached(link->manager, link->servers, server, (char **)&error_message)) {
 			zend_throw_exception(mongo_ce_ConnectionException, error_message, 0 TSRMLS_CC);
 			free(error_message);
 			return;
@@ -332,7 +332,7 @@ PHP_METHOD(Mongo, __construct)
 		int error;
 
 		spprintf(&tmp, 0, "%s:%d", MonGlo(default_host), MonGlo(default_port));
-		error = mongo_parse_server_spec(link->manager, link->servers, tmp, (char **)&error_message);
+		error = mongo_parse_server_spec_cached(link->manager, link->servers, tmp, (char **)&error_message);
 		efree(tmp);
 
 		if (error) {
@@ -853,6 +853,7 @@ PHP_METHOD(Mongo, getConnections)
 		/* Grab connection info */
 		add_assoc_long(connection, "last_ping", ptr->connection->last_ping);
 		add_assoc_long(connection, "last_ismaster", ptr->connection->last_ismaster);
+		add_assoc_long(connection, "last_reply", ptr->connection->last_reply);
 		add_assoc_long(connection, "ping_ms", ptr->connection->ping_ms);
 		add_assoc_long(connection, "connection_type", ptr->connection->connection_type);
 		add_assoc_string(connection, "connection_type_desc", mongo_connection_type(ptr->connection->connection_type), 1);
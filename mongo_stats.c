@@ -0,0 +1,127 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <php.h>
+
+#include "php_mongo.h"
+#include "mongo_stats.h"
+#include "mcon/stats.h"
+
+zend_class_entry *mongo_ce_Stats = NULL;
+
+ZEND_EXTERN_MODULE_GLOBALS(mongo);
+
+static zend_function_entry mongo_stats_methods[] = {
+	PHP_ME(MongoStats, get, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
+	PHP_ME(MongoStats, getRequest, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
+	PHP_ME(MongoStats, reset, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
+	{NULL, NULL, NULL}
+};
+
+void mongo_init_MongoStats(TSRMLS_D)
+{
+	zend_class_entry ce;
+
+	INIT_CLASS_ENTRY(ce, "MongoStats", mongo_stats_methods);
+	mongo_ce_Stats = zend_register_internal_class(&ce TSRMLS_CC);
+}
+
+/* Adds the counters of op to stats, with the histogram as a list of the
+ * lowest number of microseconds of each bucket that isn't empty, to the number
+ * of operations that took that long */
+static void add_op(zval *stats, mongo_stats_op *op)
+{
+	zval *histogram;
+	int i;
+
+	add_assoc_long(stats, "count", op->count);
+	add_assoc_long(stats, "failures", op->failures);
+	add_assoc_long(stats, "retries", op->retries);
+	add_assoc_long(stats, "bytes_sent", op->bytes_sent);
+	add_assoc_long(stats, "bytes_received", op->bytes_received);
+	add_assoc_double(stats, "total_us", op->total_us);
+	add_assoc_long(stats, "max_us", op->max_us);
+	add_assoc_long(stats, "p50", mongo_stats_percentile(op, 50));
+	add_assoc_long(stats, "p90", mongo_stats_percentile(op, 90));
+	add_assoc_long(stats, "p99", mongo_stats_percentile(op, 99));
+
+	MAKE_STD_ZVAL(histogram);
+	array_init(histogram);
+	for (i = 0; i < MONGO_STATS_BUCKETS; i++) {
+		if (op->histogram[i]) {
+			add_index_long(histogram, mongo_stats_bucket_start(i), op->histogram[i]);
+		}
+	}
+	add_assoc_zval(stats, "histogram", histogram);
+}
+
+/* Returns the counters of all servers as host:port => operation => counters,
+ * only listing the operations that have been done */
+static void get_stats(zval *return_value, int request TSRMLS_DC)
+{
+	mongo_stats_server *server;
+	mongo_stats_op *ops;
+	zval *zserver, *zop;
+	int i;
+
+	array_init(return_value);
+
+	for (server = MonGlo(manager)->stats; server; server = server->next) {
+		ops = request ? server->request : server->total;
+
+		MAKE_STD_ZVAL(zserver);
+		array_init(zserver);
+		for (i = 0; i < MONGO_STATS_OP_COUNT; i++) {
+			if (!ops[i].count) {
+				continue;
+			}
+			MAKE_STD_ZVAL(zop);
+			array_init(zop);
+			add_op(zop, &ops[i]);
+			add_assoc_zval(zserver, mongo_stats_op_names[i], zop);
+		}
+
+		if (zend_hash_num_elements(Z_ARRVAL_P(zserver)) == 0) {
+			zval_ptr_dtor(&zserver);
+			continue;
+		}
+		add_assoc_zval(return_value, server->host, zserver);
+	}
+}
+
+/* {{{ proto array MongoStats::get()
+   Returns the timings and counters of everything this process has sent since
+   it started (or since MongoStats::reset()), per server and operation */
+PHP_METHOD(MongoStats, get)
+{
+	get_stats(return_value, 0 TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ proto array MongoStats::getRequest()
+   Returns the same as MongoStats::get(), for the current request only */
+PHP_METHOD(MongoStats, getRequest)
+{
+	get_stats(return_value, 1 TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ proto void MongoStats::reset()
+   Drops all timings and counters */
+PHP_METHOD(MongoStats, reset)
+{
+	mongo_stats_reset(MonGlo(manager));
+}
+/* }}} */
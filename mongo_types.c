@@ -108,6 +108,111 @@ void generate_id(char *data TSRMLS_DC) {
 #endif /* PHP_C_BIGENDIAN */
 }
 
+void php_mongo_id_to_hex(char *id, char *dest) {
+  static const char hex[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0; i < OID_SIZE; i++) {
+    unsigned char x = (unsigned char)id[i];
+
+    dest[2*i] = hex[x >> 4];
+    dest[2*i+1] = hex[x & 15];
+  }
+  dest[2*OID_SIZE] = '\0';
+}
+
+/*
+ * Fills in the $id property from the raw id, unless that has been done
+ * already. Decoding and generating MongoIds only stores the 12 bytes, the
+ * hex string is made the first time anything looks at the properties.
+ */
+static void php_mongo_id_populate(zval *object TSRMLS_DC) {
+  mongo_id *id = (mongo_id*)zend_object_store_get_object(object TSRMLS_CC);
+  zval *str;
+
+  if (MonGlo(no_id) || !id || !id->id || id->id_str_set) {
+    return;
+  }
+
+  // set this first, as zend_update_property goes through the handlers
+  id->id_str_set = 1;
+
+  MAKE_STD_ZVAL(str);
+  Z_TYPE_P(str) = IS_STRING;
+  Z_STRLEN_P(str) = 2*OID_SIZE;
+  Z_STRVAL_P(str) = (char*)emalloc(2*OID_SIZE+1);
+  php_mongo_id_to_hex(id->id, Z_STRVAL_P(str));
+
+  zend_update_property(mongo_ce_Id, object, "$id", strlen("$id"), str TSRMLS_CC);
+  zval_ptr_dtor(&str);
+}
+
+void php_mongo_id_reset_str(zval *object TSRMLS_DC) {
+  mongo_id *id = (mongo_id*)zend_object_store_get_object(object TSRMLS_CC);
+
+  // if the old $id has been handed out, keep it in sync
+  if (id->id_str_set) {
+    id->id_str_set = 0;
+    php_mongo_id_populate(object TSRMLS_CC);
+  }
+}
+
+#if PHP_VERSION_ID >= 50400
+zval *php_mongo_id_read_property(zval *object, zval *member, int type, const zend_literal *key TSRMLS_DC)
+{
+  php_mongo_id_populate(object TSRMLS_CC);
+  return (zend_get_std_object_handlers())->read_property(object, member, type, key TSRMLS_CC);
+}
+
+int php_mongo_id_has_property(zval *object, zval *member, int has_set_exists, const zend_literal *key TSRMLS_DC)
+{
+  php_mongo_id_populate(object TSRMLS_CC);
+  return (zend_get_std_object_handlers())->has_property(object, member, has_set_exists, key TSRMLS_CC);
+}
+
+void php_mongo_id_write_property(zval *object, zval *member, zval *value, const zend_literal *key TSRMLS_DC)
+{
+  php_mongo_id_populate(object TSRMLS_CC);
+  (zend_get_std_object_handlers())->write_property(object, member, value, key TSRMLS_CC);
+}
+
+zval **php_mongo_id_get_property_ptr_ptr(zval *object, zval *member, const zend_literal *key TSRMLS_DC)
+{
+  php_mongo_id_populate(object TSRMLS_CC);
+  return (zend_get_std_object_handlers())->get_property_ptr_ptr(object, member, key TSRMLS_CC);
+}
+#else
+zval *php_mongo_id_read_property(zval *object, zval *member, int type TSRMLS_DC)
+{
+  php_mongo_id_populate(object TSRMLS_CC);
+  return (zend_get_std_object_handlers())->read_property(object, member, type TSRMLS_CC);
+}
+
+int php_mongo_id_has_property(zval *object, zval *member, int has_set_exists TSRMLS_DC)
+{
+  php_mongo_id_populate(object TSRMLS_CC);
+  return (zend_get_std_object_handlers())->has_property(object, member, has_set_exists TSRMLS_CC);
+}
+
+void php_mongo_id_write_property(zval *object, zval *member, zval *value TSRMLS_DC)
+{
+  php_mongo_id_populate(object TSRMLS_CC);
+  (zend_get_std_object_handlers())->write_property(object, member, value TSRMLS_CC);
+}
+
+zval **php_mongo_id_get_property_ptr_ptr(zval *object, zval *member TSRMLS_DC)
+{
+  php_mongo_id_populate(object TSRMLS_CC);
+  return (zend_get_std_object_handlers())->get_property_ptr_ptr(object, member TSRMLS_CC);
+}
+#endif
+
+HashTable *php_mongo_id_get_properties(zval *object TSRMLS_DC)
+{
+  php_mongo_id_populate(object TSRMLS_CC);
+  return zend_std_get_properties(object TSRMLS_CC);
+}
+
 int php_mongo_id_serialize(zval *struc, unsigned char **serialized_data, zend_uint *serialized_length, zend_serialize_data *var_hash TSRMLS_DC) {
   zval str;
   MONGO_METHOD(MongoId, __toString, &str, struc);
@@ -213,7 +318,7 @@ void mongo_init_MongoId(TSRMLS_D) {
 /* {{{ MongoId::__construct()
  */
 PHP_METHOD(MongoId, __construct) {
-  zval *id = 0, *str = 0;
+  zval *id = 0;
   mongo_id *this_id = (mongo_id*)zend_object_store_get_object(getThis() TSRMLS_CC);
 
   if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|z", &id) == FAILURE) {
@@ -242,6 +347,7 @@ PHP_METHOD(MongoId, __construct) {
     }
 
     if (!MonGlo(no_id)) {
+      this_id->id_str_set = 1;
       zend_update_property(mongo_ce_Id, getThis(), "$id", strlen("$id"), id TSRMLS_CC);
     }
   }
@@ -250,23 +356,11 @@ PHP_METHOD(MongoId, __construct) {
            Z_OBJCE_P(id) == mongo_ce_Id) {
     mongo_id *that_id = (mongo_id*)zend_object_store_get_object(id TSRMLS_CC);
     memcpy(this_id->id, that_id->id, OID_SIZE);
-
-    if (!MonGlo(no_id)) {
-      zval *str = zend_read_property(mongo_ce_Id, id, "$id", strlen("$id"), NOISY TSRMLS_CC);
-      zend_update_property(mongo_ce_Id, getThis(), "$id", strlen("$id"), str TSRMLS_CC);
-    }
+    php_mongo_id_reset_str(getThis() TSRMLS_CC);
   }
   else {
     generate_id(this_id->id TSRMLS_CC);
-
-    if (!MonGlo(no_id)) {
-      MAKE_STD_ZVAL(str);
-      ZVAL_NULL(str);
-
-      MONGO_METHOD(MongoId, __toString, str, getThis());
-      zend_update_property(mongo_ce_Id, getThis(), "$id", strlen("$id"), str TSRMLS_CC);
-      zval_ptr_dtor(&str);
-    }
+    php_mongo_id_reset_str(getThis() TSRMLS_CC);
   }
 }
 /* }}} */
@@ -275,37 +369,16 @@ PHP_METHOD(MongoId, __construct) {
 /* {{{ MongoId::__toString()
  */
 PHP_METHOD(MongoId, __toString) {
-  int i;
   mongo_id *this_id;
-	char *id_str;
   char *id;
 
   this_id = (mongo_id*)zend_object_store_get_object(getThis() TSRMLS_CC);
   MONGO_CHECK_INITIALIZED_STRING(this_id->id, MongoId);
 
   id = (char*)emalloc(25);
-  id_str = this_id->id;
-
-  for(i=0; i<12; i++) {
-    int x = *id_str;
-    char digit1, digit2;
-
-    if (*id_str < 0) {
-      x = 256 + *id_str;
-    }
-
-    digit1 = x / 16;
-    digit2 = x % 16;
+  php_mongo_id_to_hex(this_id->id, id);
 
-    id[2*i]   = (digit1 < 10) ? '0' + digit1 : digit1 - 10 + 'a';
-    id[2*i+1] = (digit2 < 10) ? '0' + digit2 : digit2 - 10 + 'a';
-
-    id_str++;
-  }
-
-  id[24] = '\0';
-
-  RETURN_STRING(id, NO_DUP);
+  RETURN_STRINGL(id, 24, NO_DUP);
 }
 /* }}} */
 
@@ -382,38 +455,412 @@ PHP_METHOD(MongoId, getHostname) {
 }
 /* }}} */
 
+/*
+ * C storage for MongoDate, MongoBinData, MongoInt32 and MongoInt64
+ *
+ * Decoding and serializing these only touches the C fields. The properties
+ * are filled in from them the first time they are used. Writes through
+ * write_property are copied back to the C fields straight away. Anything that
+ * can change the properties behind our back (references, get_properties)
+ * makes the C fields be read back from the properties whenever they are
+ * needed.
+ */
+#if defined(_MSC_VER)
+# define strtoll(s, f, b) _atoi64(s)
+#elif !defined(HAVE_STRTOLL)
+# if defined(HAVE_ATOLL)
+#  define strtoll(s, f, b) atoll(s)
+# else
+#  define strtoll(s, f, b) strtol(s, f, b)
+# endif
+#endif
+
+struct _mongo_native_ops {
+  size_t size;
+  void (*to_properties)(zval *object, mongo_native_object *obj TSRMLS_DC);
+  void (*from_properties)(zval *object, mongo_native_object *obj TSRMLS_DC);
+  void (*free_fields)(mongo_native_object *obj);
+};
+
+zend_object_handlers mongo_native_handlers;
+
+static void native_ensure_properties(zval *object, mongo_native_object *obj TSRMLS_DC) {
+  if (obj->state == MONGO_NATIVE_ONLY) {
+    // zend_update_property goes through write_property, which must not copy
+    // half-written properties back
+    obj->state = MONGO_NATIVE_WRITING;
+    obj->ops->to_properties(object, obj TSRMLS_CC);
+    obj->state = MONGO_NATIVE_SYNCED;
+  }
+}
+
+static void native_expose_properties(zval *object TSRMLS_DC) {
+  mongo_native_object *obj = (mongo_native_object*)zend_object_store_get_object(object TSRMLS_CC);
+
+  native_ensure_properties(object, obj TSRMLS_CC);
+  if (obj->state == MONGO_NATIVE_SYNCED) {
+    obj->state = MONGO_NATIVE_PROPS;
+  }
+}
+
+void* php_mongo_native_get(zval *object TSRMLS_DC) {
+  mongo_native_object *obj = (mongo_native_object*)zend_object_store_get_object(object TSRMLS_CC);
+
+  if (obj->state == MONGO_NATIVE_PROPS) {
+    obj->ops->from_properties(object, obj TSRMLS_CC);
+  }
+  return obj;
+}
+
+void php_mongo_native_changed(void *obj) {
+  ((mongo_native_object*)obj)->state = MONGO_NATIVE_ONLY;
+}
+
+#if PHP_VERSION_ID >= 50400
+static zval *native_read_property(zval *object, zval *member, int type, const zend_literal *key TSRMLS_DC)
+{
+  native_ensure_properties(object, (mongo_native_object*)zend_object_store_get_object(object TSRMLS_CC) TSRMLS_CC);
+  return (zend_get_std_object_handlers())->read_property(object, member, type, key TSRMLS_CC);
+}
+
+static int native_has_property(zval *object, zval *member, int has_set_exists, const zend_literal *key TSRMLS_DC)
+{
+  native_ensure_properties(object, (mongo_native_object*)zend_object_store_get_object(object TSRMLS_CC) TSRMLS_CC);
+  return (zend_get_std_object_handlers())->has_property(object, member, has_set_exists, key TSRMLS_CC);
+}
+
+static void native_write_property(zval *object, zval *member, zval *value, const zend_literal *key TSRMLS_DC)
+{
+  mongo_native_object *obj = (mongo_native_object*)zend_object_store_get_object(object TSRMLS_CC);
+
+  native_ensure_properties(object, obj TSRMLS_CC);
+  (zend_get_std_object_handlers())->write_property(object, member, value, key TSRMLS_CC);
+  if (obj->state == MONGO_NATIVE_SYNCED) {
+    obj->ops->from_properties(object, obj TSRMLS_CC);
+  }
+}
+
+static zval **native_get_property_ptr_ptr(zval *object, zval *member, const zend_literal *key TSRMLS_DC)
+{
+  native_expose_properties(object TSRMLS_CC);
+  return (zend_get_std_object_handlers())->get_property_ptr_ptr(object, member, key TSRMLS_CC);
+}
+
+static void native_unset_property(zval *object, zval *member, const zend_literal *key TSRMLS_DC)
+{
+  native_expose_properties(object TSRMLS_CC);
+  (zend_get_std_object_handlers())->unset_property(object, member, key TSRMLS_CC);
+}
+#else
+static zval *native_read_property(zval *object, zval *member, int type TSRMLS_DC)
+{
+  native_ensure_properties(object, (mongo_native_object*)zend_object_store_get_object(object TSRMLS_CC) TSRMLS_CC);
+  return (zend_get_std_object_handlers())->read_property(object, member, type TSRMLS_CC);
+}
+
+static int native_has_property(zval *object, zval *member, int has_set_exists TSRMLS_DC)
+{
+  native_ensure_properties(object, (mongo_native_object*)zend_object_store_get_object(object TSRMLS_CC) TSRMLS_CC);
+  return (zend_get_std_object_handlers())->has_property(object, member, has_set_exists TSRMLS_CC);
+}
+
+static void native_write_property(zval *object, zval *member, zval *value TSRMLS_DC)
+{
+  mongo_native_object *obj = (mongo_native_object*)zend_object_store_get_object(object TSRMLS_CC);
+
+  native_ensure_properties(object, obj TSRMLS_CC);
+  (zend_get_std_object_handlers())->write_property(object, member, value TSRMLS_CC);
+  if (obj->state == MONGO_NATIVE_SYNCED) {
+    obj->ops->from_properties(object, obj TSRMLS_CC);
+  }
+}
+
+static zval **native_get_property_ptr_ptr(zval *object, zval *member TSRMLS_DC)
+{
+  native_expose_properties(object TSRMLS_CC);
+  return (zend_get_std_object_handlers())->get_property_ptr_ptr(object, member TSRMLS_CC);
+}
+
+static void native_unset_property(zval *object, zval *member TSRMLS_DC)
+{
+  native_expose_properties(object TSRMLS_CC);
+  (zend_get_std_object_handlers())->unset_property(object, member TSRMLS_CC);
+}
+#endif
+
+static HashTable *native_get_properties(zval *object TSRMLS_DC)
+{
+  native_expose_properties(object TSRMLS_CC);
+  return zend_std_get_properties(object TSRMLS_CC);
+}
+
+// the standard handler compares the property tables directly
+static int native_compare_objects(zval *o1, zval *o2 TSRMLS_DC)
+{
+  native_ensure_properties(o1, (mongo_native_object*)zend_object_store_get_object(o1 TSRMLS_CC) TSRMLS_CC);
+  native_ensure_properties(o2, (mongo_native_object*)zend_object_store_get_object(o2 TSRMLS_CC) TSRMLS_CC);
+  return (zend_get_std_object_handlers())->compare_objects(o1, o2 TSRMLS_CC);
+}
+
+static void php_mongo_native_free(void *object TSRMLS_DC) {
+  mongo_native_object *obj = (mongo_native_object*)object;
+
+  if (obj) {
+    if (obj->ops->free_fields) {
+      obj->ops->free_fields(obj);
+    }
+    zend_object_std_dtor(&obj->std TSRMLS_CC);
+    efree(obj);
+  }
+}
+
+static zend_object_value native_new(zend_class_entry *class_type, const mongo_native_ops *ops TSRMLS_DC) {
+  zend_object_value retval;
+  mongo_native_object *intern;
+  zval *tmp;
+
+  intern = (mongo_native_object*)emalloc(ops->size);
+  memset(intern, 0, ops->size);
+
+  zend_object_std_init(&intern->std, class_type TSRMLS_CC);
+  init_properties(intern);
+  intern->ops = ops;
+
+  retval.handle = zend_objects_store_put(intern,
+     (zend_objects_store_dtor_t) zend_objects_destroy_object,
+     php_mongo_native_free, NULL TSRMLS_CC);
+  retval.handlers = &mongo_native_handlers;
+
+  return retval;
+}
+
+static zend_object_value native_clone(zval *object TSRMLS_DC) {
+  mongo_native_object *old = (mongo_native_object*)zend_object_store_get_object(object TSRMLS_CC), *intern;
+  zend_object_value retval;
+
+  native_ensure_properties(object, old TSRMLS_CC);
+
+  // the C fields of the clone are read from the copied properties
+  retval = native_new(old->std.ce, old->ops TSRMLS_CC);
+  intern = (mongo_native_object*)zend_object_store_get_object_by_handle(retval.handle TSRMLS_CC);
+  intern->state = MONGO_NATIVE_PROPS;
+
+  zend_objects_clone_members(&intern->std, retval, &old->std, Z_OBJ_HANDLE_P(object) TSRMLS_CC);
+  return retval;
+}
+
+void php_mongo_native_init_handlers(TSRMLS_D) {
+  memcpy(&mongo_native_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+  mongo_native_handlers.clone_obj = native_clone;
+  mongo_native_handlers.read_property = native_read_property;
+  mongo_native_handlers.has_property = native_has_property;
+  mongo_native_handlers.write_property = native_write_property;
+  mongo_native_handlers.get_property_ptr_ptr = native_get_property_ptr_ptr;
+  mongo_native_handlers.unset_property = native_unset_property;
+  mongo_native_handlers.get_properties = native_get_properties;
+  mongo_native_handlers.compare_objects = native_compare_objects;
+}
+
+static long read_long_property(zend_class_entry *ce, zval *object, char *name TSRMLS_DC) {
+  zval *z = zend_read_property(ce, object, name, strlen(name), NOISY TSRMLS_CC), tmp;
+
+  if (Z_TYPE_P(z) == IS_LONG) {
+    return Z_LVAL_P(z);
+  }
+
+  tmp = *z;
+  zval_copy_ctor(&tmp);
+  convert_to_long(&tmp);
+  return Z_LVAL(tmp);
+}
+
+static int64_t read_int64_property(zend_class_entry *ce, zval *object, int is_int32 TSRMLS_DC) {
+  zval *z = zend_read_property(ce, object, "value", strlen("value"), NOISY TSRMLS_CC), tmp;
+  int64_t value;
+
+  if (Z_TYPE_P(z) == IS_STRING) {
+    return is_int32 ? (int)strtol(Z_STRVAL_P(z), NULL, 10) : strtoll(Z_STRVAL_P(z), NULL, 10);
+  }
+
+  tmp = *z;
+  zval_copy_ctor(&tmp);
+  convert_to_string(&tmp);
+  value = is_int32 ? (int)strtol(Z_STRVAL(tmp), NULL, 10) : strtoll(Z_STRVAL(tmp), NULL, 10);
+  zval_dtor(&tmp);
+
+  return value;
+}
+
+static void date_to_properties(zval *object, mongo_native_object *obj TSRMLS_DC) {
+  mongo_date *date = (mongo_date*)obj;
+
+  zend_update_property_long(mongo_ce_Date, object, "sec", strlen("sec"), date->sec TSRMLS_CC);
+  zend_update_property_long(mongo_ce_Date, object, "usec", strlen("usec"), date->usec TSRMLS_CC);
+}
+
+static void date_from_properties(zval *object, mongo_native_object *obj TSRMLS_DC) {
+  mongo_date *date = (mongo_date*)obj;
+
+  date->sec = read_long_property(mongo_ce_Date, object, "sec" TSRMLS_CC);
+  date->usec = read_long_property(mongo_ce_Date, object, "usec" TSRMLS_CC);
+}
+
+static void bin_data_to_properties(zval *object, mongo_native_object *obj TSRMLS_DC) {
+  mongo_bin_data *bin = (mongo_bin_data*)obj;
+
+  zend_update_property_stringl(mongo_ce_BinData, object, "bin", strlen("bin"), bin->bin ? bin->bin : "", bin->bin_len TSRMLS_CC);
+  zend_update_property_long(mongo_ce_BinData, object, "type", strlen("type"), bin->type TSRMLS_CC);
+}
+
+static void bin_data_from_properties(zval *object, mongo_native_object *obj TSRMLS_DC) {
+  mongo_bin_data *bin = (mongo_bin_data*)obj;
+  zval *z = zend_read_property(mongo_ce_BinData, object, "bin", strlen("bin"), NOISY TSRMLS_CC), tmp;
+
+  if (bin->bin) {
+    efree(bin->bin);
+  }
+
+  tmp = *z;
+  zval_copy_ctor(&tmp);
+  convert_to_string(&tmp);
+  bin->bin = Z_STRVAL(tmp);
+  bin->bin_len = Z_STRLEN(tmp);
+
+  bin->type = read_long_property(mongo_ce_BinData, object, "type" TSRMLS_CC);
+}
+
+static void bin_data_free_fields(mongo_native_object *obj) {
+  mongo_bin_data *bin = (mongo_bin_data*)obj;
+
+  if (bin->bin) {
+    efree(bin->bin);
+  }
+}
+
+static void int_to_properties(zval *object, zend_class_entry *ce, mongo_int *i TSRMLS_DC) {
+  char *str;
+  int len;
+
+#ifdef WIN32
+  len = spprintf(&str, 0, "%I64d", i->value);
+#else
+  len = spprintf(&str, 0, "%lld", (long long int)i->value);
+#endif
+  zend_update_property_stringl(ce, object, "value", strlen("value"), str, len TSRMLS_CC);
+  efree(str);
+}
+
+static void int32_to_properties(zval *object, mongo_native_object *obj TSRMLS_DC) {
+  int_to_properties(object, mongo_ce_Int32, (mongo_int*)obj TSRMLS_CC);
+}
+
+static void int32_from_properties(zval *object, mongo_native_object *obj TSRMLS_DC) {
+  ((mongo_int*)obj)->value = read_int64_property(mongo_ce_Int32, object, 1 TSRMLS_CC);
+}
+
+static void int64_to_properties(zval *object, mongo_native_object *obj TSRMLS_DC) {
+  int_to_properties(object, mongo_ce_Int64, (mongo_int*)obj TSRMLS_CC);
+}
+
+static void int64_from_properties(zval *object, mongo_native_object *obj TSRMLS_DC) {
+  ((mongo_int*)obj)->value = read_int64_property(mongo_ce_Int64, object, 0 TSRMLS_CC);
+}
+
+static const mongo_native_ops mongo_date_ops = {
+  sizeof(mongo_date), date_to_properties, date_from_properties, NULL
+};
+static const mongo_native_ops mongo_bin_data_ops = {
+  sizeof(mongo_bin_data), bin_data_to_properties, bin_data_from_properties, bin_data_free_fields
+};
+static const mongo_native_ops mongo_int32_ops = {
+  sizeof(mongo_int), int32_to_properties, int32_from_properties, NULL
+};
+static const mongo_native_ops mongo_int64_ops = {
+  sizeof(mongo_int), int64_to_properties, int64_from_properties, NULL
+};
+
+static zend_object_value php_mongo_date_new(zend_class_entry *class_type TSRMLS_DC) {
+  return native_new(class_type, &mongo_date_ops TSRMLS_CC);
+}
+
+static zend_object_value php_mongo_bin_data_new(zend_class_entry *class_type TSRMLS_DC) {
+  return native_new(class_type, &mongo_bin_data_ops TSRMLS_CC);
+}
+
+static zend_object_value php_mongo_int32_new(zend_class_entry *class_type TSRMLS_DC) {
+  return native_new(class_type, &mongo_int32_ops TSRMLS_CC);
+}
+
+static zend_object_value php_mongo_int64_new(zend_class_entry *class_type TSRMLS_DC) {
+  return native_new(class_type, &mongo_int64_ops TSRMLS_CC);
+}
+
+void php_mongo_date_init(zval *value, long sec, long usec TSRMLS_DC) {
+  mongo_date *date;
+
+  object_init_ex(value, mongo_ce_Date);
+  date = (mongo_date*)zend_object_store_get_object(value TSRMLS_CC);
+  date->sec = sec;
+  date->usec = usec;
+  php_mongo_native_changed(date);
+}
+
+void php_mongo_bin_data_init(zval *value, char *bin, int bin_len, long type TSRMLS_DC) {
+  mongo_bin_data *obj;
+
+  object_init_ex(value, mongo_ce_BinData);
+  obj = (mongo_bin_data*)zend_object_store_get_object(value TSRMLS_CC);
+  obj->bin = estrndup(bin, bin_len);
+  obj->bin_len = bin_len;
+  obj->type = type;
+  php_mongo_native_changed(obj);
+}
+
+void php_mongo_int64_init(zval *value, int64_t num TSRMLS_DC) {
+  mongo_int *obj;
+
+  object_init_ex(value, mongo_ce_Int64);
+  obj = (mongo_int*)zend_object_store_get_object(value TSRMLS_CC);
+  obj->value = num;
+  php_mongo_native_changed(obj);
+}
+
 /* {{{ MongoDate::__construct
  */
 PHP_METHOD(MongoDate, __construct) {
   long arg1 = 0, arg2 = 0;
+  mongo_date *date;
 
   if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|ll", &arg1, &arg2) == FAILURE) {
     return;
   }
 
+  date = (mongo_date*)php_mongo_native_get(getThis() TSRMLS_CC);
+
   switch (ZEND_NUM_ARGS()) {
   case 2:
-    zend_update_property_long(mongo_ce_Date, getThis(), "usec", strlen("usec"), arg2 TSRMLS_CC);
+    date->usec = arg2;
 
     // fallthrough
   case 1:
-    zend_update_property_long(mongo_ce_Date, getThis(), "sec", strlen("sec"), arg1 TSRMLS_CC);
+    date->sec = arg1;
     // usec is already 0, if not set above
     break;
   case 0: {
 #ifdef WIN32
-    time_t sec = time(0);
-    zend_update_property_long(mongo_ce_Date, getThis(), "sec", strlen("sec"), sec TSRMLS_CC);
-    zend_update_property_long(mongo_ce_Date, getThis(), "usec", strlen("usec"), 0 TSRMLS_CC);
+    date->sec = time(0);
+    date->usec = 0;
 #else
     struct timeval time;
     gettimeofday(&time, NULL);
 
-    zend_update_property_long(mongo_ce_Date, getThis(), "sec", strlen("sec"), time.tv_sec TSRMLS_CC);
-    zend_update_property_long(mongo_ce_Date, getThis(), "usec", strlen("usec"), (time.tv_usec/1000)*1000 TSRMLS_CC);
+    date->sec = time.tv_sec;
+    date->usec = (time.tv_usec/1000)*1000;
 #endif
   }
   }
+
+  php_mongo_native_changed(date);
 }
 /* }}} */
 
@@ -421,14 +868,11 @@ PHP_METHOD(MongoDate, __construct) {
 /* {{{ MongoDate::__toString()
  */
 PHP_METHOD(MongoDate, __toString) {
-  zval *zsec = zend_read_property( mongo_ce_Date, getThis(), "sec", strlen("sec"), NOISY TSRMLS_CC );
-  long sec = Z_LVAL_P( zsec );
-  zval *zusec = zend_read_property( mongo_ce_Date, getThis(), "usec", strlen("usec"), NOISY TSRMLS_CC );
-  long usec = Z_LVAL_P( zusec );
-  double dusec = (double)usec/1000000;
+  mongo_date *date = (mongo_date*)php_mongo_native_get(getThis() TSRMLS_CC);
+  double dusec = (double)date->usec/1000000;
   char *str;
 
-  spprintf(&str, 0, "%.8f %ld", dusec, sec);
+  spprintf(&str, 0, "%.8f %ld", dusec, date->sec);
   RETURN_STRING(str, 0);
 }
 /* }}} */
@@ -445,6 +889,7 @@ void mongo_init_MongoDate(TSRMLS_D) {
   zend_class_entry ce;
 
   INIT_CLASS_ENTRY(ce, "MongoDate", MongoDate_methods);
+  ce.create_object = php_mongo_date_new;
   mongo_ce_Date = zend_register_internal_class(&ce TSRMLS_CC);
 
   zend_declare_property_long(mongo_ce_Date, "sec", strlen("sec"), 0, ZEND_ACC_PUBLIC TSRMLS_CC);
@@ -456,6 +901,7 @@ void mongo_init_MongoDate(TSRMLS_D) {
 PHP_METHOD(MongoBinData, __construct) {
   char *bin;
   long bin_len, type = 2;
+  mongo_bin_data *obj;
 
   if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|l", &bin, &bin_len, &type) == FAILURE) {
     return;
@@ -465,8 +911,14 @@ PHP_METHOD(MongoBinData, __construct) {
       php_error_docref(NULL TSRMLS_CC, MONGO_E_DEPRECATED, "The default value for type will change to 0 in the future. Please pass in '2' explicitly.");
   }
 
-  zend_update_property_stringl(mongo_ce_BinData, getThis(), "bin", strlen("bin"), bin, bin_len TSRMLS_CC);
-  zend_update_property_long(mongo_ce_BinData, getThis(), "type", strlen("type"), type TSRMLS_CC);
+  obj = (mongo_bin_data*)zend_object_store_get_object(getThis() TSRMLS_CC);
+  if (obj->bin) {
+    efree(obj->bin);
+  }
+  obj->bin = estrndup(bin, bin_len);
+  obj->bin_len = bin_len;
+  obj->type = type;
+  php_mongo_native_changed(obj);
 }
 /* }}} */
 
@@ -489,6 +941,7 @@ void mongo_init_MongoBinData(TSRMLS_D) {
   zend_class_entry ce;
 
   INIT_CLASS_ENTRY(ce, "MongoBinData", MongoBinData_methods);
+  ce.create_object = php_mongo_bin_data_new;
   mongo_ce_BinData = zend_register_internal_class(&ce TSRMLS_CC);
 
   // fields
@@ -862,6 +1315,7 @@ static zend_function_entry MongoInt32_methods[] = {
 void mongo_init_MongoInt32(TSRMLS_D) {
   zend_class_entry ce;
   INIT_CLASS_ENTRY(ce, "MongoInt32", MongoInt32_methods);
+  ce.create_object = php_mongo_int32_new;
   mongo_ce_Int32 = zend_register_internal_class(&ce TSRMLS_CC);
 
   zend_declare_property_string(mongo_ce_Int32, "value", strlen("value"), "", ZEND_ACC_PUBLIC TSRMLS_CC);
@@ -902,6 +1356,7 @@ static zend_function_entry MongoInt64_methods[] = {
 void mongo_init_MongoInt64(TSRMLS_D) {
   zend_class_entry ce;
   INIT_CLASS_ENTRY(ce, "MongoInt64", MongoInt64_methods);
+  ce.create_object = php_mongo_int64_new;
   mongo_ce_Int64 = zend_register_internal_class(&ce TSRMLS_CC);
 
   zend_declare_property_string(mongo_ce_Int64, "value", strlen("value"), "", ZEND_ACC_PUBLIC TSRMLS_CC);
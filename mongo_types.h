@@ -51,6 +51,33 @@ int php_mongo_id_serialize(zval*, unsigned char**, zend_uint*, zend_serialize_da
 int php_mongo_id_unserialize(zval**, zend_class_entry*, const unsigned char*, zend_uint, zend_unserialize_data* TSRMLS_DC);
 int php_mongo_compare_ids(zval*, zval* TSRMLS_DC);
 
+/* writes the 24 character hex form of a 12 byte id (and a \0) to dest */
+void php_mongo_id_to_hex(char *id, char *dest);
+/* for when the raw id changes after $id may have been filled in */
+void php_mongo_id_reset_str(zval* TSRMLS_DC);
+#if PHP_VERSION_ID >= 50400
+zval *php_mongo_id_read_property(zval*, zval*, int, const zend_literal* TSRMLS_DC);
+int php_mongo_id_has_property(zval*, zval*, int, const zend_literal* TSRMLS_DC);
+void php_mongo_id_write_property(zval*, zval*, zval*, const zend_literal* TSRMLS_DC);
+zval **php_mongo_id_get_property_ptr_ptr(zval*, zval*, const zend_literal* TSRMLS_DC);
+#else
+zval *php_mongo_id_read_property(zval*, zval*, int TSRMLS_DC);
+int php_mongo_id_has_property(zval*, zval*, int TSRMLS_DC);
+void php_mongo_id_write_property(zval*, zval*, zval* TSRMLS_DC);
+zval **php_mongo_id_get_property_ptr_ptr(zval*, zval* TSRMLS_DC);
+#endif
+HashTable *php_mongo_id_get_properties(zval* TSRMLS_DC);
+
+void php_mongo_native_init_handlers(TSRMLS_D);
+/* returns the mongo_date, mongo_bin_data or mongo_int of object, with its C
+ * fields up to date */
+void* php_mongo_native_get(zval *object TSRMLS_DC);
+/* call after changing the C fields, so the properties are filled in again */
+void php_mongo_native_changed(void *obj);
+void php_mongo_date_init(zval *value, long sec, long usec TSRMLS_DC);
+void php_mongo_bin_data_init(zval *value, char *bin, int bin_len, long type TSRMLS_DC);
+void php_mongo_int64_init(zval *value, int64_t num TSRMLS_DC);
+
 PHP_METHOD(MongoRegex, __construct);
 PHP_METHOD(MongoRegex, __toString);
 
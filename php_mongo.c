@@ -29,10 +29,17 @@
 #include "mongo.h"
 #include "cursor.h"
 #include "mongo_types.h"
+#include "gridfs_cache.h"
+#include "result_cache.h"
+#include "mongo_stats.h"
 
 #include "util/log.h"
 
 #include "mcon/manager.h"
+#include "mcon/io.h"
+#include "mcon/topology_cache.h"
+#include "mcon/stats.h"
+#include "mcon/trace.h"
 
 extern zend_object_handlers mongo_default_handlers,
   mongo_id_handlers;
@@ -61,7 +68,6 @@ static PHP_GINIT_FUNCTION(mongo);
 static PHP_GSHUTDOWN_FUNCTION(mongo);
 
 #if WIN32
-extern HANDLE cursor_mutex;
 extern HANDLE io_mutex;
 extern HANDLE pool_mutex;
 #endif
@@ -83,7 +89,7 @@ zend_module_entry mongo_module_entry = {
   PHP_MINIT(mongo),
   PHP_MSHUTDOWN(mongo),
   PHP_RINIT(mongo),
-  NULL,
+  PHP_RSHUTDOWN(mongo),
   PHP_MINFO(mongo),
   PHP_MONGO_VERSION,
 #if ZEND_MODULE_API_NO >= 20060613
@@ -117,10 +123,73 @@ STD_PHP_INI_ENTRY("mongo.allow_empty_keys", "0", PHP_INI_ALL, OnUpdateLong, allo
 STD_PHP_INI_ENTRY("mongo.no_id", "0", PHP_INI_SYSTEM, OnUpdateLong, no_id, zend_mongo_globals, mongo_globals)
 STD_PHP_INI_ENTRY("mongo.ping_interval", "5", PHP_INI_ALL, OnUpdateLong, ping_interval, zend_mongo_globals, mongo_globals)
 STD_PHP_INI_ENTRY("mongo.is_master_interval", "60", PHP_INI_ALL, OnUpdateLong, ismaster_interval, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.write_behind", "0", PHP_INI_ALL, OnUpdateLong, write_behind, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.index_cache_ttl", "0", PHP_INI_ALL, OnUpdateLong, index_cache_ttl, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.topology_cache", "", PHP_INI_SYSTEM, OnUpdateString, topology_cache, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.pool_size", "1", PHP_INI_SYSTEM, OnUpdateLong, pool_size, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.share_auth_sockets", "0", PHP_INI_SYSTEM, OnUpdateLong, share_auth_sockets, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.eject_time", "5", PHP_INI_SYSTEM, OnUpdateLong, eject_time, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.gridfs_cache_size", "0", PHP_INI_SYSTEM, OnUpdateLong, gridfs_cache_size, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.result_cache_size", "0", PHP_INI_SYSTEM, OnUpdateLong, result_cache_size, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.stats", "0", PHP_INI_SYSTEM, OnUpdateLong, stats, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.cursor_buffer_limit", "0", PHP_INI_ALL, OnUpdateLong, cursor_buffer_limit, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.hedge_delay", "0", PHP_INI_SYSTEM, OnUpdateLong, hedge_delay, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.hedge_percentile", "0", PHP_INI_SYSTEM, OnUpdateLong, hedge_percentile, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.trace_buffer", "0", PHP_INI_SYSTEM, OnUpdateLong, trace_buffer, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.tcp_nodelay", "1", PHP_INI_SYSTEM, OnUpdateLong, tcp_nodelay, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.tcp_keepalive", "1", PHP_INI_SYSTEM, OnUpdateLong, tcp_keepalive, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.tcp_keepalive_idle", "0", PHP_INI_SYSTEM, OnUpdateLong, tcp_keepalive_idle, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.tcp_keepalive_interval", "0", PHP_INI_SYSTEM, OnUpdateLong, tcp_keepalive_interval, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.tcp_keepalive_count", "0", PHP_INI_SYSTEM, OnUpdateLong, tcp_keepalive_count, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.socket_send_buffer", "0", PHP_INI_SYSTEM, OnUpdateLong, socket_send_buffer, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.socket_receive_buffer", "0", PHP_INI_SYSTEM, OnUpdateLong, socket_receive_buffer, zend_mongo_globals, mongo_globals)
+STD_PHP_INI_ENTRY("mongo.socket_timeout_ms", "0", PHP_INI_SYSTEM, OnUpdateLong, socket_timeout_ms, zend_mongo_globals, mongo_globals)
 PHP_INI_END()
 /* }}} */
 
 
+/* Applies the INI settings to the manager of this thread. Under ZTS, each
+ * thread has a manager of its own (see GINIT), so this is done again on the
+ * first request of every thread. */
+static void php_mongo_configure_manager(TSRMLS_D)
+{
+	mongo_con_manager *manager = MonGlo(manager);
+
+	if (MonGlo(manager_configured)) {
+		return;
+	}
+	MonGlo(manager_configured) = 1;
+
+	/* Pooling is opt-in, 1 keeps a single socket per server */
+	if (MonGlo(pool_size) > 0) {
+		manager->pool_size = MonGlo(pool_size);
+	}
+	manager->share_auth = MonGlo(share_auth_sockets) > 0;
+	if (MonGlo(eject_time) >= 0) {
+		manager->eject_time = MonGlo(eject_time);
+	}
+	manager->stats_enabled = MonGlo(stats) > 0;
+	if (MonGlo(hedge_delay) > 0) {
+		manager->hedge_delay = MonGlo(hedge_delay);
+	}
+	if (MonGlo(hedge_percentile) > 0 && MonGlo(hedge_percentile) < 100) {
+		manager->hedge_percentile = MonGlo(hedge_percentile);
+	}
+	if (MonGlo(trace_buffer) > 0) {
+		manager->trace = mongo_trace_init(MonGlo(trace_buffer));
+	}
+
+	/* The connection string can override each of these */
+	manager->socket_options.nodelay = MonGlo(tcp_nodelay);
+	manager->socket_options.keepalive = MonGlo(tcp_keepalive);
+	manager->socket_options.keepalive_idle = MonGlo(tcp_keepalive_idle);
+	manager->socket_options.keepalive_interval = MonGlo(tcp_keepalive_interval);
+	manager->socket_options.keepalive_count = MonGlo(tcp_keepalive_count);
+	manager->socket_options.send_buffer = MonGlo(socket_send_buffer);
+	manager->socket_options.receive_buffer = MonGlo(socket_receive_buffer);
+	manager->socket_options.socket_timeout = MonGlo(socket_timeout_ms);
+}
+
 /* {{{ PHP_MINIT_FUNCTION
  */
 PHP_MINIT_FUNCTION(mongo) {
@@ -131,6 +200,19 @@ PHP_MINIT_FUNCTION(mongo) {
 #endif /* ZEND_MODULE_API_NO < 20060613 */
 
   REGISTER_INI_ENTRIES();
+
+	php_mongo_configure_manager(TSRMLS_C);
+
+	/* Opened before the FPM/Apache workers are forked, so that they all share it */
+	if (MonGlo(topology_cache) && *MonGlo(topology_cache)) {
+		char *error_message = NULL;
+
+		MonGlo(manager)->topology_cache = mongo_topology_cache_open(MonGlo(topology_cache), &error_message);
+		if (!MonGlo(manager)->topology_cache) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "%s", error_message);
+			free(error_message);
+		}
+	}
 /*
   le_pconnection = zend_register_list_destructors_ex(NULL, mongo_util_pool_shutdown, PHP_CONNECTION_RES_NAME, module_number);
   le_pserver = zend_register_list_destructors_ex(NULL, mongo_util_server_shutdown, PHP_SERVER_RES_NAME, module_number);
@@ -160,7 +242,14 @@ PHP_MINIT_FUNCTION(mongo) {
   mongo_init_MongoInt32(TSRMLS_C);
   mongo_init_MongoInt64(TSRMLS_C);
 
+  mongo_init_MongoLazyDocument(TSRMLS_C);
+  mongo_init_MongoBSONIterator(TSRMLS_C);
+  mongo_init_MongoCursorGroup(TSRMLS_C);
+  mongo_init_MongoTailer(TSRMLS_C);
+  mongo_init_MongoWriteResult(TSRMLS_C);
+
   mongo_init_MongoLog(TSRMLS_C);
+  mongo_init_MongoStats(TSRMLS_C);
 
   /*
    * MongoMaxKey and MongoMinKey are completely non-interactive: they have no
@@ -176,18 +265,25 @@ PHP_MINIT_FUNCTION(mongo) {
   memcpy(&mongo_default_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
   mongo_default_handlers.clone_obj = NULL;
 
-  // add compare_objects for MongoId
+  // add compare_objects for MongoId, and fill in $id when it is used
   memcpy(&mongo_id_handlers, &mongo_default_handlers, sizeof(zend_object_handlers));
   mongo_id_handlers.compare_objects = php_mongo_compare_ids;
+  mongo_id_handlers.read_property = php_mongo_id_read_property;
+  mongo_id_handlers.has_property = php_mongo_id_has_property;
+  mongo_id_handlers.write_property = php_mongo_id_write_property;
+  mongo_id_handlers.get_property_ptr_ptr = php_mongo_id_get_property_ptr_ptr;
+  mongo_id_handlers.get_properties = php_mongo_id_get_properties;
+
+  // MongoDate, MongoBinData and the integer types keep their values in C
+  php_mongo_native_init_handlers(TSRMLS_C);
 
   // start random number generator
   srand(time(0));
 
 #ifdef WIN32
-  cursor_mutex = CreateMutex(NULL, FALSE, NULL);
   pool_mutex = CreateMutex(NULL, FALSE, NULL);
   io_mutex = CreateMutex(NULL, FALSE, NULL);
-  if (cursor_mutex == NULL || pool_mutex == NULL || io_mutex == NULL) {
+  if (pool_mutex == NULL || io_mutex == NULL) {
     php_error_docref(NULL TSRMLS_CC, E_WARNING, "Windows couldn't create a mutex: %s", GetLastError());
     return FAILURE;
   }
@@ -221,7 +317,8 @@ static PHP_GINIT_FUNCTION(mongo)
   mongo_globals->errmsg = 0;
 
   mongo_globals->max_send_size = 64 * 1024 * 1024;
-  mongo_globals->pool_size = -1;
+  mongo_globals->pool_size = 1;
+  mongo_globals->eject_time = MONGO_MANAGER_DEFAULT_EJECT_TIME;
 
   hostname = host_start;
   // from the gnu manual:
@@ -271,14 +368,22 @@ static PHP_GINIT_FUNCTION(mongo)
 #endif
 
 	mongo_globals->manager = mongo_init();
+	mongo_globals->manager_configured = 0;
 	TSRMLS_SET_CTX(mongo_globals->manager->log_context);
 	mongo_globals->manager->log_function = php_mcon_log_wrapper;
+	mongo_globals->manager->log_modules = 0;
+	mongo_globals->manager->log_levels = 0;
+
+	mongo_globals->gridfs_cache = php_mongo_gridfs_cache_init();
+	mongo_globals->result_cache = php_mongo_result_cache_init();
 }
 /* }}} */
 
 PHP_GSHUTDOWN_FUNCTION(mongo)
 {
 	mongo_deinit(mongo_globals->manager);
+	php_mongo_gridfs_cache_dtor(mongo_globals->gridfs_cache);
+	php_mongo_result_cache_dtor(mongo_globals->result_cache);
 }
 
 /* {{{ PHP_MSHUTDOWN_FUNCTION
@@ -288,7 +393,7 @@ PHP_MSHUTDOWN_FUNCTION(mongo) {
 
 #if WIN32
   // 0 is failure
-  if (CloseHandle(cursor_mutex) == 0 || CloseHandle(pool_mutex) == 0 || CloseHandle(io_mutex) == 0) {
+  if (CloseHandle(pool_mutex) == 0 || CloseHandle(io_mutex) == 0) {
     php_error_docref(NULL TSRMLS_CC, E_WARNING, "Windows couldn't destroy a mutex: %s", GetLastError());
     return FAILURE;
   }
@@ -303,6 +408,38 @@ PHP_MSHUTDOWN_FUNCTION(mongo) {
  */
 PHP_RINIT_FUNCTION(mongo)
 {
+	php_mongo_configure_manager(TSRMLS_C);
+
+	/* MongoStats::getRequest() only covers this request */
+	mongo_stats_request_reset(MonGlo(manager));
+	MonGlo(cursor_buffer_used) = 0;
+	/* Connections are only bound for a request, see mongo_get_read_write_connection */
+	mongo_manager_unbind_all(MonGlo(manager));
+
+	return SUCCESS;
+}
+/* }}} */
+
+
+/* {{{ PHP_RSHUTDOWN_FUNCTION
+ */
+PHP_RSHUTDOWN_FUNCTION(mongo)
+{
+	mongo_con_manager_item *item;
+	char *error_message = NULL;
+
+	/* Writes queued with mongo.write_behind must not outlive the request */
+	for (item = MonGlo(manager)->connections; item; item = item->next) {
+		if (item->connection->write_buf_len && mongo_io_flush(item->connection, NULL, 0, &error_message) == -1) {
+			mongo_manager_log(MonGlo(manager), MLOG_IO, MLOG_WARN, "Couldn't send queued writes on %s: %s", item->hash, error_message);
+			free(error_message);
+			error_message = NULL;
+		}
+	}
+
+	/* Once the request is done, nobody waits for the pings that are due */
+	mongo_manager_check_idle_connections(MonGlo(manager));
+
 	return SUCCESS;
 }
 /* }}} */
@@ -24,6 +24,12 @@
 #include "mcon/types.h"
 #include "mcon/read_preference.h"
 
+#ifdef WIN32
+#  include "win32/time.h"
+#else
+#  include <sys/time.h>
+#endif
+
 // resource names
 #define PHP_CONNECTION_RES_NAME "mongo connection"
 #define PHP_SERVER_RES_NAME "mongo server info"
@@ -77,6 +83,11 @@
 // if _id field should be added
 #define PREP 1
 #define NO_PREP 0
+/* Like PREP, but a missing _id is generated straight into the buffer instead
+ * of through a MongoId object. It is then added to the document as its hex
+ * string (PREP_ID_STRING), or not at all (PREP_ID_NONE). */
+#define PREP_ID_STRING 2
+#define PREP_ID_NONE 3
 
 #define NOISY 0
 #define QUIET 1
@@ -237,6 +248,21 @@ typedef struct {
   char *end;
 } buffer;
 
+/* Field names seen in the previous documents of a result set, by position.
+ * Lets bson_to_zval skip hashing the same keys over and over. */
+#define MONGO_KEY_CACHE_SIZE 64
+
+typedef struct {
+  char  *name;
+  int    name_len; /* Including the trailing \0 */
+  ulong  h;        /* Hash of name, or the index for numeric names */
+  int    numeric;
+} mongo_key_cache_item;
+
+typedef struct {
+  mongo_key_cache_item items[MONGO_KEY_CACHE_SIZE];
+} mongo_key_cache;
+
 #define CREATE_MSG_HEADER(rid, rto, opcode)     \
   header.length = 0;                            \
   header.request_id = rid;                      \
@@ -360,7 +386,7 @@ typedef struct {
 
 #define REPLY_HEADER_LEN 36
 
-typedef struct {
+typedef struct _mongo_cursor {
   zend_object std;
 
 	/* Connection */
@@ -393,6 +419,8 @@ typedef struct {
   int num;
   // results
   buffer buf;
+	/* Allocated size of buf, which is reused for every reply */
+	int buf_size;
 
   // cursor_id indicates if there are more results to fetch.  If cursor_id is 0,
   // the cursor is "dead."  If cursor_id != 0, server is set to the server that
@@ -407,9 +435,81 @@ typedef struct {
   zval *current;
   int retry;
 
+	/* When retrying the query has to stop, set at the first retry from the
+	 * cursor's timeout (tv_sec is 0 if there is no timeout) */
+	struct timeval retry_deadline;
+
 	mongo_read_preference read_pref;
 
 	int dead;
+
+	/* Whether to return MongoLazyDocument objects instead of arrays */
+	zend_bool lazy;
+
+	/* Whether to return each document as a string of raw BSON */
+	zend_bool raw;
+
+	/* Tree of the fields to decode (see MongoCursor::decodeFields), or NULL
+	 * to decode everything */
+	zval *decode_fields;
+
+	/* Field names of the returned documents, shared by all batches */
+	mongo_key_cache *key_cache;
+
+	/* Share of a batch after which the next batch is requested in the
+	 * background (see MongoCursor::prefetch), or 0 to not prefetch */
+	double prefetch;
+
+	/* Whether a prefetched OP_GET_MORE has been sent, but not read */
+	zend_bool prefetch_pending;
+
+	/* The owner of the reply that comes after this cursor's on the connection.
+	 * connection->pending_reply is the first of these, replies arrive in the
+	 * order the requests were sent. */
+	struct _mongo_cursor *next_pending;
+
+	/* Reply to the prefetched OP_GET_MORE, if it had to be read before the
+	 * current batch was used up (prefetch_ready). Swapped with buf when
+	 * the current batch runs out, so both allocations are reused. */
+	buffer prefetch_buf;
+	int prefetch_buf_size;
+	zend_bool prefetch_ready;
+
+	/* Size in bytes that the replies to OP_GET_MORE should have (see
+	 * MongoCursor::batchBytes), or 0 to go by batch_size, and a moving
+	 * average of the size of the documents in the replies so far */
+	int batch_bytes;
+	int avg_doc_size;
+
+	/* Whether the receive buffers count towards mongo.cursor_buffer_limit,
+	 * and how many bytes of them are counted in MonGlo(cursor_buffer_used) */
+	zend_bool budgeted;
+	int budget_bytes;
+
+	/* This cursor's entry in the cursor_list, or NULL if it has none */
+	struct _cursor_node *node;
+
+	/* Whether the cursor has checked its connection out of the pool (see
+	 * mongo_manager_connection_checkout), and has to check it back in */
+	zend_bool checked_out;
+
+	/* When the request that php_mongo_get_reply waits for was sent, to time
+	 * the round trip with (tv_sec is 0 if it should not be timed) */
+	struct timeval sent_at;
+
+	/* Times that same request for MongoStats, as an operation of type
+	 * stats_op (one of the MONGO_STATS_OP_* constants) */
+	mongo_stats_probe stats_probe;
+	int stats_op;
+
+	/* Whether the query is a command that returns a cursor document (see
+	 * MongoCollection::aggregateCursor), whose first batch is unpacked from
+	 * the reply before it is iterated */
+	zend_bool command_cursor;
+
+	/* The namespace of the command's cursor, which the OP_GET_MORE requests
+	 * go to, or NULL until the command's reply has been read */
+	char *cursor_ns;
 } mongo_cursor;
 
 /*
@@ -422,6 +522,10 @@ typedef struct {
  *
  * When a connection is killed, we sweep through the list and kill all the
  * cursors for that link.
+ *
+ * The list lives in EG(persistent_list), which is per thread under ZTS, so it
+ * needs no locking. Each cursor points at its own node, so adding and removing
+ * a cursor never walks the list.
  */
 typedef struct _cursor_node {
   int64_t cursor_id;
@@ -434,8 +538,118 @@ typedef struct _cursor_node {
 typedef struct {
   zend_object std;
   char *id;
+  // the $id property is only filled in when it is first read
+  zend_bool id_str_set;
 } mongo_id;
 
+/*
+ * MongoDate, MongoBinData, MongoInt32 and MongoInt64 keep their values in C
+ * fields, their properties are only filled in when something looks at them.
+ * They all start like mongo_native_object, see mongo_types.c.
+ */
+#define MONGO_NATIVE_SYNCED 0  /* the properties and the C fields agree */
+#define MONGO_NATIVE_ONLY 1    /* only the C fields are set */
+#define MONGO_NATIVE_PROPS 2   /* the properties may have been changed directly */
+#define MONGO_NATIVE_WRITING 3 /* the properties are being filled in */
+
+typedef struct _mongo_native_ops mongo_native_ops;
+
+typedef struct {
+  zend_object std;
+  const mongo_native_ops *ops;
+  int state;
+} mongo_native_object;
+
+typedef struct {
+  zend_object std;
+  const mongo_native_ops *ops;
+  int state;
+
+  long sec;
+  long usec;
+} mongo_date;
+
+typedef struct {
+  zend_object std;
+  const mongo_native_ops *ops;
+  int state;
+
+  char *bin;
+  int bin_len;
+  long type;
+} mongo_bin_data;
+
+/* MongoInt32 and MongoInt64 */
+typedef struct {
+  zend_object std;
+  const mongo_native_ops *ops;
+  int state;
+
+  int64_t value;
+} mongo_int;
+
+/* Raw BSON shared by a MongoLazyDocument and the sub-documents read from it */
+typedef struct {
+	char *data;
+	int   refcount;
+} mongo_lazy_buffer;
+
+typedef struct {
+	zend_object std;
+
+	mongo_lazy_buffer *buffer;
+	char *doc;         /* Start of this document inside buffer->data */
+	HashTable *fields; /* Fields that have been decoded already */
+} mongo_lazy_document;
+
+typedef struct {
+	zend_object std;
+
+	zval *source;       /* The string or stream resource being read */
+	php_stream *stream; /* NULL when reading from a string */
+	off_t start;        /* Position of the stream when the iterator was made */
+	long offset;        /* Of the next document, from the start */
+
+	char *buf;          /* Holds the current document when reading a stream */
+	int buf_size;
+
+	zval *current;
+	long key;
+	mongo_key_cache *key_cache;
+} mongo_bson_iterator;
+
+typedef struct {
+	zend_object std;
+
+	zval *cursors;        /* Array of the MongoCursors in the group */
+	zend_bool started;    /* Whether their queries have been sent */
+
+	zval *current;        /* The current document */
+	zval *current_cursor; /* The cursor it came from */
+	long key;
+} mongo_cursor_group;
+
+typedef struct {
+	zend_object std;
+
+	zval *collection;        /* The MongoCollection that is tailed */
+	zval *query;             /* As given, without the condition to resume from */
+	char *field;             /* That the entries are ordered by, "ts" by default */
+	zval *last;              /* Value of field in the last entry seen, or NULL */
+	zval *cursor;            /* NULL until it's opened, and again once it died */
+	long batch_size;
+	zend_bool oplog_replay;  /* Whether OP_QUERY's OplogReplay flag is used */
+} mongo_tailer;
+
+typedef struct {
+	zend_object std;
+
+	mongo_cursor cursor;  /* Reads the getlasterror reply, queued on its connection */
+	char *hash;           /* Of that connection, which may be gone by the time the reply is read */
+	zval *result;         /* The decoded reply, once it has been read */
+	zend_bool sent;       /* Whether the write has been sent */
+} mongo_write_result;
+
 
 typedef struct {
   zend_object std;
@@ -457,6 +671,10 @@ typedef struct {
   zval *ns;
 
 	mongo_read_preference read_pref;
+
+	/* Seconds that findOne and count results stay in the result cache, 0 to
+	 * not cache them (see MongoCollection::setCacheTTL) */
+	long cache_ttl;
 } mongo_collection;
 
 
@@ -471,6 +689,7 @@ typedef struct {
 PHP_MINIT_FUNCTION(mongo);
 PHP_MSHUTDOWN_FUNCTION(mongo);
 PHP_RINIT_FUNCTION(mongo);
+PHP_RSHUTDOWN_FUNCTION(mongo);
 PHP_MINFO_FUNCTION(mongo);
 
 /*
@@ -527,6 +746,11 @@ void mongo_init_MongoDBRef(TSRMLS_D);
 void mongo_init_MongoTimestamp(TSRMLS_D);
 void mongo_init_MongoInt32(TSRMLS_D);
 void mongo_init_MongoInt64(TSRMLS_D);
+void mongo_init_MongoLazyDocument(TSRMLS_D);
+void mongo_init_MongoBSONIterator(TSRMLS_D);
+void mongo_init_MongoCursorGroup(TSRMLS_D);
+void mongo_init_MongoTailer(TSRMLS_D);
+void mongo_init_MongoWriteResult(TSRMLS_D);
 
 /* Shared helper functions */
 void php_mongo_add_tagsets(zval *return_value, mongo_read_preference *rp);
@@ -555,7 +779,57 @@ int ts_inc;
 char *errmsg;
 int response_num;
 int max_send_size;
-int pool_size;
+
+	/* Sockets per server that cursors can check out, so that one with a
+	 * reply still coming does not hold up the others. 1 (the default) turns
+	 * pooling off. */
+	long pool_size;
+
+	/* Lets the credentials of all connection strings share the sockets to a
+	 * server, see mongo_manager_connection_authenticate */
+	long share_auth_sockets;
+
+	/* Seconds that a mongos which failed is skipped for, see
+	 * mongo_manager_server_eject */
+	long eject_time;
+
+	/* Bytes of GridFS chunks that are kept between requests, see
+	 * php_mongo_gridfs_cache_find */
+	long gridfs_cache_size;
+	struct _gridfs_cache *gridfs_cache;
+
+	/* Bytes of findOne and count results that are kept between requests, for
+	 * the collections and queries that ask for it, see
+	 * php_mongo_result_cache_find */
+	long result_cache_size;
+	struct _result_cache *result_cache;
+
+	/* Whether requests are timed and counted for MongoStats */
+	long stats;
+
+	/* Bytes that the receive buffers of all MongoCursor objects of a request
+	 * may take up together (0 for no limit), and how many they do */
+	long cursor_buffer_limit;
+	long cursor_buffer_used;
+
+	/* Hedged reads for queries that may go to several members, see
+	 * mongo_con_manager.hedge_delay */
+	long hedge_delay;
+	long hedge_percentile;
+
+	/* Events that are kept for MongoLog::dumpTrace, 0 to not trace at all */
+	long trace_buffer;
+
+	/* Defaults for the socket options of the connection string, see
+	 * mongo_socket_options */
+	long tcp_nodelay;
+	long tcp_keepalive;
+	long tcp_keepalive_idle;
+	long tcp_keepalive_interval;
+	long tcp_keepalive_count;
+	long socket_send_buffer;
+	long socket_receive_buffer;
+	long socket_timeout_ms;
 
 	long log_level;
 	long log_module;
@@ -565,7 +839,23 @@ int pool_size;
 	long ping_interval;
 	long ismaster_interval;
 
+	/* Bytes of unacknowledged writes to queue per connection before sending
+	 * them, or 0 to send every write straight away */
+	long write_behind;
+
+	/* Seconds for which unacknowledged ensureIndex() calls skip index specs
+	 * that an acknowledged one ensured on the connection already, or 0 to
+	 * always send them */
+	long index_cache_ttl;
+
+	/* File in which the ping and ismaster results are shared with the other
+	 * processes, or empty for none */
+	char *topology_cache;
+
 	mongo_con_manager *manager;
+	/* Whether the INI settings were applied to manager yet, see
+	 * php_mongo_configure_manager */
+	zend_bool manager_configured;
 ZEND_END_MODULE_GLOBALS(mongo)
 
 #ifdef ZTS
@@ -604,6 +894,15 @@ extern zend_module_entry mongo_module_entry;
  * 15: Reading from slaves won't work without using the replicaSet option on connect
  * 16: No server found for reads
  * 17: The MongoCollection object has not been correctly initialized by its constructor
+ * 18: MongoLazyDocument is read-only, use toArray() to get a modifiable copy
+ * 19: invalid BSON document of <size> bytes
+ * 20: invalid BSON document length <len> at offset <offset>
+ * 21: unexpected end of BSON data at offset <offset>
+ * 22: cannot rewind the BSON stream
+ * 23: MongoBSONIterator expects a string or a stream
+ * 24: MongoCursorGroup expects MongoCursor objects
+ * 25: invalid operation at index <index>
+ * 26: MongoTailer expects a non-empty field name
  *
  * MongoConnectionException:
  * 0: connection to <host> failed: <errmsg>
@@ -641,6 +940,9 @@ extern zend_module_entry mongo_module_entry;
  * 18: Trying to get more, but cannot find server
  * 19: max number of retries exhausted, couldn't send query
  * 20: something exceptional has happened, and the cursor is now dead
+ * 21: invalid document length: <len>
+ * 22: the prefetch share must be between 0 and 1
+ * 23: the reply to this write has been lost
  * various: database error
  */
 
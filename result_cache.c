@@ -0,0 +1,216 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <php.h>
+#include <time.h>
+
+#include "php_mongo.h"
+#include "bson.h"
+#include "result_cache.h"
+#include "mcon/read_preference.h"
+#include "mcon/utils.h"
+
+ZEND_EXTERN_MODULE_GLOBALS(mongo);
+
+result_cache *php_mongo_result_cache_init(void)
+{
+	result_cache *cache = pemalloc(sizeof(result_cache), 1);
+
+	memset(cache, 0, sizeof(result_cache));
+	zend_hash_init(&cache->entries, 64, NULL, NULL, 1);
+
+	return cache;
+}
+
+static void result_cache_entry_dtor(result_cache_entry *entry)
+{
+	pefree(entry->key, 1);
+	pefree(entry->ns, 1);
+	pefree(entry->data, 1);
+	pefree(entry, 1);
+}
+
+void php_mongo_result_cache_dtor(result_cache *cache)
+{
+	result_cache_entry *entry, *next;
+
+	for (entry = cache->first; entry; entry = next) {
+		next = entry->next;
+		result_cache_entry_dtor(entry);
+	}
+	zend_hash_destroy(&cache->entries);
+	pefree(cache, 1);
+}
+
+static void result_cache_unlink(result_cache *cache, result_cache_entry *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->first = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->last = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void result_cache_link_first(result_cache *cache, result_cache_entry *entry)
+{
+	entry->next = cache->first;
+	if (cache->first) {
+		cache->first->prev = entry;
+	} else {
+		cache->last = entry;
+	}
+	cache->first = entry;
+}
+
+static size_t result_cache_entry_size(result_cache_entry *entry)
+{
+	return sizeof(result_cache_entry) + entry->key_len + strlen(entry->ns) + 1 + entry->data_len;
+}
+
+static void result_cache_remove(result_cache *cache, result_cache_entry *entry)
+{
+	result_cache_unlink(cache, entry);
+	zend_hash_del(&cache->entries, entry->key, entry->key_len);
+	cache->size -= result_cache_entry_size(entry);
+	result_cache_entry_dtor(entry);
+}
+
+/* The servers go into the key as the hash of the first one, which has the
+ * host, the replica set and the credentials, so that a result is only found
+ * again through an equivalent connection */
+int php_mongo_result_cache_key(buffer *key, char kind, zval *zlink, char *ns, zval *query, zval *fields, mongo_read_preference *rp TSRMLS_DC)
+{
+	mongo_link *link;
+	char *hash, *tagset;
+	int i;
+
+	if (MonGlo(result_cache_size) <= 0 || !MonGlo(result_cache)) {
+		return FAILURE;
+	}
+	link = (mongo_link*)zend_object_store_get_object(zlink TSRMLS_CC);
+	if (!link || !link->servers || link->servers->count < 1) {
+		return FAILURE;
+	}
+
+	CREATE_BUF((*key), INITIAL_BUF_SIZE);
+	php_mongo_serialize_byte(key, kind);
+
+	hash = mongo_server_create_hash(link->servers->server[0]);
+	php_mongo_serialize_string(key, hash, strlen(hash));
+	free(hash);
+	php_mongo_serialize_string(key, ns, strlen(ns));
+
+	if (query) {
+		zval_to_bson(key, HASH_P(query), NO_PREP TSRMLS_CC);
+	}
+	php_mongo_serialize_byte(key, 0);
+	if (fields && !EG(exception)) {
+		zval_to_bson(key, HASH_P(fields), NO_PREP TSRMLS_CC);
+	}
+	php_mongo_serialize_byte(key, 0);
+
+	if (rp) {
+		php_mongo_serialize_int(key, rp->type);
+		for (i = 0; i < rp->tagset_count; i++) {
+			tagset = mongo_read_preference_squash_tagset(rp->tagsets[i]);
+			php_mongo_serialize_string(key, tagset ? tagset : "", tagset ? strlen(tagset) : 0);
+			free(tagset);
+		}
+	}
+
+	if (EG(exception)) {
+		efree(key->start);
+		return FAILURE;
+	}
+	return SUCCESS;
+}
+
+char *php_mongo_result_cache_find(buffer *key, int *len TSRMLS_DC)
+{
+	result_cache *cache = MonGlo(result_cache);
+	result_cache_entry **found, *entry = NULL;
+
+	if (zend_hash_find(&cache->entries, key->start, key->pos - key->start, (void**)&found) == SUCCESS) {
+		entry = *found;
+
+		if (entry->expires <= time(NULL)) {
+			result_cache_remove(cache, entry);
+			entry = NULL;
+		} else {
+			result_cache_unlink(cache, entry);
+			result_cache_link_first(cache, entry);
+			*len = entry->data_len;
+		}
+	}
+
+	return entry ? entry->data : NULL;
+}
+
+void php_mongo_result_cache_store(buffer *key, char *ns, char *data, int len, long ttl TSRMLS_DC)
+{
+	result_cache *cache = MonGlo(result_cache);
+	result_cache_entry **found, *entry;
+	size_t size;
+
+	if (zend_hash_find(&cache->entries, key->start, key->pos - key->start, (void**)&found) == SUCCESS) {
+		result_cache_remove(cache, *found);
+	}
+
+	size = sizeof(result_cache_entry) + (key->pos - key->start) + strlen(ns) + 1 + len;
+	if (size > (size_t)MonGlo(result_cache_size)) {
+		return;
+	}
+
+	while (cache->last && cache->size + size > (size_t)MonGlo(result_cache_size)) {
+		result_cache_remove(cache, cache->last);
+	}
+
+	entry = pemalloc(sizeof(result_cache_entry), 1);
+	memset(entry, 0, sizeof(result_cache_entry));
+	entry->key_len = key->pos - key->start;
+	entry->key = pemalloc(entry->key_len, 1);
+	memcpy(entry->key, key->start, entry->key_len);
+	entry->ns = pestrdup(ns, 1);
+	entry->data_len = len;
+	entry->data = pemalloc(len ? len : 1, 1);
+	memcpy(entry->data, data, len);
+	entry->expires = time(NULL) + ttl;
+
+	zend_hash_update(&cache->entries, entry->key, entry->key_len, &entry, sizeof(result_cache_entry*), NULL);
+	result_cache_link_first(cache, entry);
+	cache->size += size;
+}
+
+void php_mongo_result_cache_invalidate(char *ns TSRMLS_DC)
+{
+	result_cache *cache = MonGlo(result_cache);
+	result_cache_entry *entry, *next;
+
+	if (!cache) {
+		return;
+	}
+	for (entry = cache->first; entry; entry = next) {
+		next = entry->next;
+		if (!ns || strcmp(entry->ns, ns) == 0) {
+			result_cache_remove(cache, entry);
+		}
+	}
+}
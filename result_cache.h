@@ -0,0 +1,74 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MONGO_RESULT_CACHE_H
+#define MONGO_RESULT_CACHE_H 1
+
+/* A result in the cache, the list runs from the most to the least recently
+ * used one */
+typedef struct _result_cache_entry {
+	char  *key;      /* see php_mongo_result_cache_key */
+	int    key_len;
+	char  *ns;       /* for php_mongo_result_cache_invalidate */
+	char  *data;     /* the BSON of the reply document, or nothing for none */
+	int    data_len;
+	time_t expires;
+
+	struct _result_cache_entry *prev;
+	struct _result_cache_entry *next;
+} result_cache_entry;
+
+/* Replies to findOne and count, for mongo.result_cache_size bytes. Like the
+ * GridFS cache it lives as long as the process (or thread). */
+typedef struct _result_cache {
+	HashTable           entries;
+	result_cache_entry *first;
+	result_cache_entry *last;
+	size_t              size;
+} result_cache;
+
+result_cache *php_mongo_result_cache_init(void);
+void php_mongo_result_cache_dtor(result_cache *cache);
+
+/**
+ * Creates the key of a request, out of its kind ('f' for findOne and 'c' for
+ * count), the servers of the link, the namespace, the BSON of the query and
+ * fields (either may be NULL) and the read preference (or NULL). Returns
+ * FAILURE when the request isn't cached: mongo.result_cache_size is 0, or the
+ * query can't be serialized.
+ */
+int php_mongo_result_cache_key(buffer *key, char kind, zval *zlink, char *ns, zval *query, zval *fields, mongo_read_preference *rp TSRMLS_DC);
+
+/**
+ * Returns the reply document stored for key, setting len to its length (0
+ * when the request found nothing), or NULL if there is none that is recent
+ * enough. The data belongs to the cache and is only valid until the next
+ * result is stored.
+ */
+char *php_mongo_result_cache_find(buffer *key, int *len TSRMLS_DC);
+
+/**
+ * Stores a copy of the reply document data for ttl seconds, taking the least
+ * recently used results out if the cache would grow over
+ * mongo.result_cache_size.
+ */
+void php_mongo_result_cache_store(buffer *key, char *ns, char *data, int len, long ttl TSRMLS_DC);
+
+/**
+ * Drops the results for the namespace ns, or all of them if ns is NULL.
+ */
+void php_mongo_result_cache_invalidate(char *ns TSRMLS_DC);
+
+#endif
@@ -0,0 +1,308 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <php.h>
+#include <zend_interfaces.h>
+#include <zend_exceptions.h>
+
+#ifdef WIN32
+#  ifndef int64_t
+     typedef __int64 int64_t;
+#  endif
+#endif
+
+#include "php_mongo.h"
+#include "collection.h"
+#include "cursor.h"
+#include "tailer.h"
+
+extern zend_class_entry *mongo_ce_Exception,
+  *mongo_ce_Collection,
+  *mongo_ce_ConnectionException,
+  *mongo_ce_CursorException;
+
+extern zend_object_handlers mongo_default_handlers;
+
+zend_class_entry *mongo_ce_Tailer = NULL;
+
+#define PHP_MONGO_GET_TAILER(obj)                                         \
+  tailer = (mongo_tailer*)zend_object_store_get_object((obj) TSRMLS_CC);  \
+  MONGO_CHECK_INITIALIZED(tailer->collection, MongoTailer);
+
+static void close_cursor(mongo_tailer *tailer)
+{
+	if (tailer->cursor) {
+		zval_ptr_dtor(&tailer->cursor);
+		tailer->cursor = NULL;
+	}
+}
+
+/* Creates the tailable cursor, which starts after the last entry seen if
+ * there is one. Returns FAILURE if an exception was thrown. */
+static int open_cursor(mongo_tailer *tailer TSRMLS_DC)
+{
+	zval *query, *gt, *tmp;
+	mongo_cursor *cursor;
+
+	MAKE_STD_ZVAL(query);
+	array_init(query);
+	zend_hash_copy(Z_ARRVAL_P(query), Z_ARRVAL_P(tailer->query), (copy_ctor_func_t)zval_add_ref, &tmp, sizeof(zval*));
+
+	if (tailer->last) {
+		zval **condition;
+
+		/* The operators of the query on the field still apply, next to the
+		 * $gt (see the constructor) */
+		MAKE_STD_ZVAL(gt);
+		array_init(gt);
+		if (zend_hash_find(Z_ARRVAL_P(query), tailer->field, strlen(tailer->field) + 1, (void**)&condition) == SUCCESS) {
+			zend_hash_copy(Z_ARRVAL_P(gt), Z_ARRVAL_PP(condition), (copy_ctor_func_t)zval_add_ref, &tmp, sizeof(zval*));
+		}
+		add_assoc_zval(gt, "$gt", tailer->last);
+		zval_add_ref(&tailer->last);
+		add_assoc_zval(query, tailer->field, gt);
+	}
+
+	MAKE_STD_ZVAL(tailer->cursor);
+	MONGO_METHOD1(MongoCollection, find, tailer->cursor, tailer->collection, query);
+	zval_ptr_dtor(&query);
+	if (EG(exception)) {
+		close_cursor(tailer);
+		return FAILURE;
+	}
+
+	/* Without a condition on ts, the server has nothing to replay from */
+	cursor = (mongo_cursor*)zend_object_store_get_object(tailer->cursor TSRMLS_CC);
+	php_mongo_cursor_tail(cursor, tailer->oplog_replay && tailer->last);
+	if (tailer->batch_size) {
+		cursor->batch_size = tailer->batch_size;
+	}
+	return SUCCESS;
+}
+
+/* Remembers where the entries in batch end, to resume from there */
+static void track_last(mongo_tailer *tailer, zval *batch TSRMLS_DC)
+{
+	zval **entry, **value;
+
+	zend_hash_internal_pointer_end(Z_ARRVAL_P(batch));
+	if (zend_hash_get_current_data(Z_ARRVAL_P(batch), (void**)&entry) == FAILURE || Z_TYPE_PP(entry) != IS_ARRAY) {
+		return;
+	}
+	if (zend_hash_find(Z_ARRVAL_PP(entry), tailer->field, strlen(tailer->field) + 1, (void**)&value) == FAILURE) {
+		return;
+	}
+
+	if (tailer->last) {
+		zval_ptr_dtor(&tailer->last);
+	}
+	tailer->last = *value;
+	zval_add_ref(&tailer->last);
+}
+
+/* {{{ MongoTailer::__construct(MongoCollection collection [, array query [, array options]])
+ * Options are ts (the value of the field to resume after), field (that the
+ * entries are ordered by, "ts"), batchSize and oplogReplay (true by default,
+ * only used when field is ts) */
+PHP_METHOD(MongoTailer, __construct)
+{
+	mongo_tailer *tailer;
+	zval *collection, *query = NULL, *options = NULL, **value;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "O|aa", &collection, mongo_ce_Collection, &query, &options) == FAILURE) {
+		return;
+	}
+
+	tailer = (mongo_tailer*)zend_object_store_get_object(getThis() TSRMLS_CC);
+	tailer->oplog_replay = 1;
+
+	if (options) {
+		if (zend_hash_find(Z_ARRVAL_P(options), "field", strlen("field") + 1, (void**)&value) == SUCCESS) {
+			convert_to_string_ex(value);
+			if (Z_STRLEN_PP(value) == 0) {
+				zend_throw_exception(mongo_ce_Exception, "MongoTailer expects a non-empty field name", 26 TSRMLS_CC);
+				return;
+			}
+			tailer->field = estrndup(Z_STRVAL_PP(value), Z_STRLEN_PP(value));
+		}
+		if (zend_hash_find(Z_ARRVAL_P(options), "ts", strlen("ts") + 1, (void**)&value) == SUCCESS && Z_TYPE_PP(value) != IS_NULL) {
+			tailer->last = *value;
+			zval_add_ref(&tailer->last);
+		}
+		if (zend_hash_find(Z_ARRVAL_P(options), "batchSize", strlen("batchSize") + 1, (void**)&value) == SUCCESS) {
+			convert_to_long_ex(value);
+			tailer->batch_size = Z_LVAL_PP(value);
+		}
+		if (zend_hash_find(Z_ARRVAL_P(options), "oplogReplay", strlen("oplogReplay") + 1, (void**)&value) == SUCCESS) {
+			convert_to_boolean_ex(value);
+			tailer->oplog_replay = Z_BVAL_PP(value);
+		}
+	}
+	if (!tailer->field) {
+		tailer->field = estrdup("ts");
+	}
+	if (strcmp(tailer->field, "ts") != 0) {
+		tailer->oplog_replay = 0;
+	}
+
+	/* The cursor resumes with a $gt on the field, which can only be added to
+	 * the other operators of a condition on it */
+	if (query && zend_hash_find(Z_ARRVAL_P(query), tailer->field, strlen(tailer->field) + 1, (void**)&value) == SUCCESS) {
+		if (Z_TYPE_PP(value) != IS_ARRAY || zend_hash_exists(Z_ARRVAL_PP(value), "$gt", strlen("$gt") + 1)) {
+			zend_throw_exception_ex(mongo_ce_Exception, 26 TSRMLS_CC, "MongoTailer expects the condition on %s to be an array of operators without $gt, use the ts option to start after a value", tailer->field);
+			return;
+		}
+	}
+
+	if (query) {
+		zval_add_ref(&query);
+	} else {
+		MAKE_STD_ZVAL(query);
+		array_init(query);
+	}
+	tailer->query = query;
+
+	tailer->collection = collection;
+	zval_add_ref(&collection);
+}
+/* }}} */
+
+/* {{{ MongoTailer::next()
+ * Returns the entries of the next reply, which is an empty array when none
+ * came in while the server waited for data. A cursor that died, or that
+ * failed, is replaced by one that starts after the last entry seen. */
+PHP_METHOD(MongoTailer, next)
+{
+	mongo_tailer *tailer;
+	mongo_cursor *cursor;
+	zend_class_entry *ce;
+	int attempt;
+	PHP_MONGO_GET_TAILER(getThis());
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (!tailer->cursor && open_cursor(tailer TSRMLS_CC) == FAILURE) {
+			return;
+		}
+		cursor = (mongo_cursor*)zend_object_store_get_object(tailer->cursor TSRMLS_CC);
+
+		MONGO_METHOD(MongoCursor, nextBatch, return_value, tailer->cursor);
+
+		if (EG(exception)) {
+			/* The connection or the cursor is gone, so a new one is tried
+			 * once, from where the old one was */
+			ce = Z_OBJCE_P(EG(exception));
+			close_cursor(tailer);
+			if (attempt > 0 || (!instanceof_function(ce, mongo_ce_CursorException TSRMLS_CC) && !instanceof_function(ce, mongo_ce_ConnectionException TSRMLS_CC))) {
+				return;
+			}
+			zend_clear_exception(TSRMLS_C);
+			zval_dtor(return_value);
+			ZVAL_NULL(return_value);
+			continue;
+		}
+
+		if (Z_TYPE_P(return_value) == IS_ARRAY) {
+			track_last(tailer, return_value TSRMLS_CC);
+		}
+		if (cursor->cursor_id == 0) {
+			close_cursor(tailer);
+		}
+		return;
+	}
+}
+/* }}} */
+
+/* {{{ MongoTailer::getTimestamp()
+ * The field of the last entry seen (its ts), for resuming later */
+PHP_METHOD(MongoTailer, getTimestamp)
+{
+	mongo_tailer *tailer;
+	PHP_MONGO_GET_TAILER(getThis());
+
+	if (!tailer->last) {
+		RETURN_NULL();
+	}
+	RETURN_ZVAL(tailer->last, 1, 0);
+}
+/* }}} */
+
+/* {{{ MongoTailer::getCursor()
+ * The cursor that is currently tailed, if any */
+PHP_METHOD(MongoTailer, getCursor)
+{
+	mongo_tailer *tailer;
+	PHP_MONGO_GET_TAILER(getThis());
+
+	if (!tailer->cursor) {
+		RETURN_NULL();
+	}
+	RETURN_ZVAL(tailer->cursor, 1, 0);
+}
+/* }}} */
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo___construct, 0, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_OBJ_INFO(0, collection, MongoCollection, 0)
+	ZEND_ARG_ARRAY_INFO(0, query, 0)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_no_parameters, 0, ZEND_RETURN_VALUE, 0)
+ZEND_END_ARG_INFO()
+
+static zend_function_entry MongoTailer_methods[] = {
+	PHP_ME(MongoTailer, __construct, arginfo___construct, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoTailer, next, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoTailer, getTimestamp, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoTailer, getCursor, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	{ NULL, NULL, NULL }
+};
+
+static void php_mongo_tailer_free(void *object TSRMLS_DC)
+{
+	mongo_tailer *tailer = (mongo_tailer*)object;
+
+	if (tailer) {
+		close_cursor(tailer);
+		if (tailer->last) {
+			zval_ptr_dtor(&tailer->last);
+		}
+		if (tailer->query) {
+			zval_ptr_dtor(&tailer->query);
+		}
+		if (tailer->collection) {
+			zval_ptr_dtor(&tailer->collection);
+		}
+		if (tailer->field) {
+			efree(tailer->field);
+		}
+
+		zend_object_std_dtor(&tailer->std TSRMLS_CC);
+		efree(tailer);
+	}
+}
+
+static zend_object_value php_mongo_tailer_new(zend_class_entry *class_type TSRMLS_DC)
+{
+	php_mongo_obj_new(mongo_tailer);
+}
+
+void mongo_init_MongoTailer(TSRMLS_D)
+{
+	zend_class_entry ce;
+
+	INIT_CLASS_ENTRY(ce, "MongoTailer", MongoTailer_methods);
+	ce.create_object = php_mongo_tailer_new;
+	mongo_ce_Tailer = zend_register_internal_class(&ce TSRMLS_CC);
+}
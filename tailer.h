@@ -0,0 +1,26 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MONGO_TAILER_H
+#define MONGO_TAILER_H 1
+
+void mongo_init_MongoTailer(TSRMLS_D);
+
+PHP_METHOD(MongoTailer, __construct);
+PHP_METHOD(MongoTailer, next);
+PHP_METHOD(MongoTailer, getTimestamp);
+PHP_METHOD(MongoTailer, getCursor);
+
+#endif
@@ -0,0 +1,109 @@
+<?php
+/*
+ * Benchmarks the extension's BSON codec (zval_to_bson, bson_to_zval and, for
+ * the string corpus, the UTF-8 validation) through bson_encode() and
+ * bson_decode(). No server is needed for that.
+ *
+ * With a server, the php_mongo_write_* message builders are timed as well,
+ * through unacknowledged inserts, updates and removes. mongo.write_behind
+ * queues the messages instead of sending each of them, so that the socket is
+ * only written to every 64MB. Any server will do, as no reply is read; the
+ * wire replayer (see wire/wire.c) with an empty recording is enough.
+ *
+ * The memory column is what one encoded string or decoded array takes.
+ *
+ * Usage: php bson-bench.php [rounds [server]]
+ */
+
+$rounds = isset($argv[1]) ? (int)$argv[1] : 20000;
+$server = isset($argv[2]) ? $argv[2] : null;
+
+function nested($depth) {
+    $doc = array();
+    for ($i = 0; $i < 8; $i++) {
+        $doc["f$i"] = $i * $depth;
+    }
+    if ($depth > 0) {
+        for ($i = 0; $i < 3; $i++) {
+            $doc[] = nested($depth - 1);
+        }
+    }
+    return $doc;
+}
+
+$blob = str_repeat("\0\1\2\3", 1024);
+$text = str_repeat("abcdefghijklmnopqrstuvwxyz", 40);
+
+$corpora = array(
+    "small-flat" => array("name" => "derick", "age" => 35, "city" => "London", "visits" => 1234567),
+    "large-nested" => nested(4),
+    "binary-heavy" => array(),
+    "string-heavy" => array(),
+);
+for ($i = 0; $i < 8; $i++) {
+    $corpora["binary-heavy"]["bin$i"] = new MongoBinData($blob);
+}
+for ($i = 0; $i < 32; $i++) {
+    $corpora["string-heavy"]["s$i"] = $text;
+}
+
+function report($corpus, $what, $elapsed, $bytes, $mem) {
+    printf("%-14s %-8s %10.1f MB/s %10d bytes held\n",
+        $corpus, $what, $bytes / $elapsed / (1024 * 1024), $mem);
+}
+
+foreach ($corpora as $name => $doc) {
+    $bson = bson_encode($doc);
+    $bytes = strlen($bson) * $rounds;
+
+    /* What the last result holds is measured while it is still around */
+    $mem = memory_get_usage();
+    $start = microtime(true);
+    for ($i = 0; $i < $rounds; $i++) {
+        $tmp = bson_encode($doc);
+    }
+    $elapsed = microtime(true) - $start;
+    report($name, "encode", $elapsed, $bytes, memory_get_usage() - $mem);
+    unset($tmp);
+
+    $mem = memory_get_usage();
+    $start = microtime(true);
+    for ($i = 0; $i < $rounds; $i++) {
+        $tmp = bson_decode($bson);
+    }
+    $elapsed = microtime(true) - $start;
+    report($name, "decode", $elapsed, $bytes, memory_get_usage() - $mem);
+    unset($tmp);
+}
+
+if (!$server) {
+    exit(0);
+}
+
+ini_set("mongo.write_behind", 64 * 1024 * 1024);
+$m = new Mongo($server);
+$c = $m->selectCollection("bsonbench", "messages");
+
+foreach ($corpora as $name => $doc) {
+    $bytes = strlen(bson_encode($doc)) * $rounds;
+
+    $start = microtime(true);
+    for ($i = 0; $i < $rounds; $i++) {
+        $doc["_id"] = $i;
+        $c->insert($doc);
+    }
+    report($name, "insert", microtime(true) - $start, $bytes, 0);
+    unset($doc["_id"]);
+
+    $start = microtime(true);
+    for ($i = 0; $i < $rounds; $i++) {
+        $c->update(array("_id" => $i), $doc);
+    }
+    report($name, "update", microtime(true) - $start, $bytes, 0);
+
+    $start = microtime(true);
+    for ($i = 0; $i < $rounds; $i++) {
+        $c->remove($doc);
+    }
+    report($name, "remove", microtime(true) - $start, $bytes, 0);
+}
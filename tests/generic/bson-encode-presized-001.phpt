@@ -0,0 +1,27 @@
+--TEST--
+BSON: encoding documents larger than the initial buffer
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$doc = array(
+    'text' => str_repeat("lorem ipsum ", 100000),
+    'list' => range(0, 5000),
+    'nested' => array('a' => array('b' => str_repeat('x', 10000)), -5 => 3.5),
+    'bin' => new MongoBinData(str_repeat("\x01", 9000), 2),
+    'code' => new MongoCode('return x;', array('x' => str_repeat('y', 5000))),
+    'regex' => new MongoRegex('/foo.*/i'),
+    'date' => new MongoDate(1234567890),
+    'id' => new MongoId('4f06e55e44670ab92d000000'),
+    'null' => null,
+    'bool' => true,
+);
+
+$bson = bson_encode($doc);
+$header = unpack('Vlength', $bson);
+var_dump($header['length'] === strlen($bson));
+var_dump(bson_decode($bson) == $doc);
+?>
+--EXPECT--
+bool(true)
+bool(true)
@@ -0,0 +1,13 @@
+--TEST--
+BSON: measuring a recursive document ends in the encoder's error
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$doc = array('a' => 1);
+$doc['self'] = &$doc;
+bson_encode($doc);
+echo "not reached\n";
+?>
+--EXPECTF--
+Fatal error: Nesting level too deep - recursive dependency? in %s on line %d
@@ -0,0 +1,46 @@
+--TEST--
+MongoBSONIterator: reading concatenated documents from a string and a stream
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$data = "";
+for ($i = 0; $i < 3; $i++) {
+    $data .= bson_encode(array('_id' => $i, 'name' => "doc $i"));
+}
+
+foreach (new MongoBSONIterator($data) as $key => $doc) {
+    echo $key, ": ", $doc['_id'], " ", $doc['name'], "\n";
+}
+
+$stream = fopen("php://memory", "w+");
+fwrite($stream, $data);
+rewind($stream);
+
+$it = new MongoBSONIterator($stream);
+foreach ($it as $key => $doc) {
+    echo $key, ": ", $doc['name'], "\n";
+}
+// rewinding seeks back in the stream
+foreach ($it as $key => $doc) {
+    echo $key, ": ", $doc['name'], "\n";
+}
+
+try {
+    foreach (new MongoBSONIterator($data . "\x10\x00") as $doc) {
+    }
+} catch (MongoException $e) {
+    echo $e->getCode(), ": ", $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+0: 0 doc 0
+1: 1 doc 1
+2: 2 doc 2
+0: doc 0
+1: doc 1
+2: doc 2
+0: doc 0
+1: doc 1
+2: doc 2
+21: unexpected end of BSON data at offset 90
@@ -0,0 +1,32 @@
+--TEST--
+BSON: UTF-8 validation of long strings
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+$ascii = str_repeat("abcdefgh", 100);
+$strings = array(
+    $ascii,
+    $ascii . "\xc3\xa9" . $ascii,
+    $ascii . "\xe2\x82\xac\xf0\x9d\x84\x9e",
+    $ascii . "\xff" . $ascii,
+    $ascii . "\xe2\x82",
+    str_repeat("x", 33) . "\x80",
+);
+
+foreach ($strings as $s) {
+    try {
+        $doc = bson_decode(bson_encode(array('s' => $s)));
+        var_dump($doc['s'] === $s);
+    } catch (MongoException $e) {
+        echo $e->getCode(), ": ", $e->getMessage(), "\n";
+    }
+}
+?>
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+12: non-utf8 string: %s
+12: non-utf8 string: %s
+12: non-utf8 string: %s
@@ -51,16 +51,12 @@ Setting flag #1
 Setting flag #2
 Setting flag #3
 
-Warning: MongoCursor::setFlag(): The CURSOR_FLAG_OPLOG_REPLAY(3) and CURSOR_FLAG_EXHAUST(6) flags are not supported. in %sbug00389.php on line %d
+Warning: MongoCursor::setFlag(): The CURSOR_FLAG_OPLOG_REPLAY(3) flag is not supported. in %sbug00389.php on line %d
 
 Warning: Invalid argument supplied for foreach() in %sbug00389.php on line %d
 Setting flag #4
 Setting flag #5
 Setting flag #6
-
-Warning: MongoCursor::setFlag(): The CURSOR_FLAG_OPLOG_REPLAY(3) and CURSOR_FLAG_EXHAUST(6) flags are not supported. in %sbug00389.php on line %d
-
-Warning: Invalid argument supplied for foreach() in %sbug00389.php on line %d
 Setting flag #7
 Setting flag #8
 Setting flag #9
@@ -0,0 +1,46 @@
+--TEST--
+GridFS: Chunks come from the chunk cache for as long as the file is unchanged
+--SKIPIF--
+<?php require_once dirname(__FILE__) . "/skipif.inc"; ?>
+--INI--
+mongo.gridfs_cache_size=1048576
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+
+$m = mongo();
+$grid = $m->selectDB(dbname())->getGridFS();
+$grid->drop();
+
+$id = $grid->storeBytes(str_repeat("a", 2500), array("filename" => "avatar.png", "chunkSize" => 1000));
+$file = $grid->findOne(array("filename" => "avatar.png"));
+var_dump($file->getBytes() === str_repeat("a", 2500));
+
+// the chunks change behind the cache's back, which they don't do in GridFS
+$grid->chunks->update(array("files_id" => $id), array('$set' => array("data" => new MongoBinData(str_repeat("b", 1000)))), array("multiple" => true));
+
+$file = $grid->findOne(array("filename" => "avatar.png"));
+var_dump($file->getBytes() === str_repeat("a", 2500));
+var_dump($file->getBytes(1500, 200) === str_repeat("a", 200));
+var_dump(stream_get_contents($file->getResource()) === str_repeat("a", 2500));
+
+// a new md5 means a new version of the file
+$grid->update(array("_id" => $id), array('$set' => array("md5" => "changed")));
+$file = $grid->findOne(array("filename" => "avatar.png"));
+var_dump($file->getBytes(0, 1000) === str_repeat("b", 1000));
+
+// the same _id and md5 in another bucket is another file
+$other = $m->selectDB(dbname())->getGridFS("other");
+$other->drop();
+$other->storeBytes(str_repeat("c", 2500), array("_id" => $id, "filename" => "avatar.png", "chunkSize" => 1000));
+$other->update(array("_id" => $id), array('$set' => array("md5" => "changed")));
+$file = $other->findOne(array("filename" => "avatar.png"));
+var_dump($file->getBytes(0, 1000) === str_repeat("c", 1000));
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
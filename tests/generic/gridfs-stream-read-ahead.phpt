@@ -0,0 +1,57 @@
+--TEST--
+GridFS: Reading a stream in order, after seeks and with a missing chunk
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = Mongo();
+$db = $m->selectDb('phpunit');
+$grid = $db->getGridFS('wrapper');
+$grid->drop();
+
+$bytes = "";
+for ($i = 0; $i < 2000; $i++) {
+    $bytes .= sha1($i);
+}
+$id = $grid->storeBytes($bytes, array("filename" => "read-ahead.txt", "chunkSize" => 1000));
+$file = $grid->findOne(array('filename' => 'read-ahead.txt'));
+
+// in order, which goes through one cursor over all 80 chunks
+$fp = $file->getResource();
+$tmp = "";
+while (!feof($fp)) {
+    $tmp .= fread($fp, 777);
+}
+var_dump($bytes === $tmp);
+
+// back to the start and on from there
+fseek($fp, 0, SEEK_SET);
+var_dump(fread($fp, 2500) === substr($bytes, 0, 2500));
+
+// somewhere in the middle, and on from there
+fseek($fp, 41234, SEEK_SET);
+var_dump(fread($fp, 100) === substr($bytes, 41234, 100));
+$tmp = "";
+while (!feof($fp)) {
+    $tmp .= fread($fp, 8192);
+}
+var_dump($tmp === substr($bytes, 41334));
+
+// a missing chunk is noticed instead of shifting the ones after it
+$db->selectCollection('wrapper.chunks')->remove(array('files_id' => $id, 'n' => 40));
+$fp = $file->getResource();
+try {
+    while (!feof($fp)) {
+        fread($fp, 8192);
+    }
+} catch (MongoGridFSException $e) {
+    echo $e->getMessage(), "\n";
+}
+?>
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+%Schunk 40 is missing
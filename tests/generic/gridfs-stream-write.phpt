@@ -0,0 +1,63 @@
+--TEST--
+GridFS: Writing a file through a stream
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = Mongo();
+$db = $m->selectDb(dbname());
+$grid = $db->getGridFS('wrapper');
+$grid->drop();
+
+$bytes = "";
+$fp = $grid->openWriteStream(array("filename" => "written.txt", "chunkSize" => 1000));
+for ($i = 0; $i < 2000; $i++) {
+    fwrite($fp, sha1($i));
+    $bytes .= sha1($i);
+}
+$stat = fstat($fp);
+var_dump($stat['size']);
+
+// the chunks are sent as they fill, the file only when the stream is closed
+var_dump($grid->findOne(array('filename' => 'written.txt')));
+var_dump($grid->chunks->count());
+fclose($fp);
+
+$file = $grid->findOne(array('filename' => 'written.txt'));
+var_dump($file->file['length'], $file->file['chunkSize']);
+var_dump($file->file['md5'] === md5($bytes));
+var_dump($file->getBytes() === $bytes);
+var_dump($grid->chunks->count());
+
+// an empty file
+$fp = $grid->openWriteStream(array("filename" => "empty.txt"));
+fclose($fp);
+$file = $grid->findOne(array('filename' => 'empty.txt'));
+var_dump($file->file['length'], $file->file['md5'] === md5(''));
+
+// a duplicate _id fails on close and takes the chunks with it
+$fp = $grid->openWriteStream(array("_id" => $file->file['_id'], "filename" => "dup.txt", "chunkSize" => 1000));
+fwrite($fp, str_repeat("x", 2500));
+try {
+    fclose($fp);
+} catch (MongoException $e) {
+    echo get_class($e), "\n";
+}
+var_dump($grid->findOne(array('filename' => 'dup.txt')));
+var_dump($grid->chunks->count());
+?>
+--EXPECTF--
+int(80000)
+NULL
+int(80)
+int(80000)
+int(1000)
+bool(true)
+bool(true)
+int(80)
+int(0)
+bool(true)
+%s
+NULL
+int(80)
@@ -0,0 +1,38 @@
+--TEST--
+INI: mongo.index_cache_ttl skips index specs that were ensured already
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--INI--
+mongo.index_cache_ttl=60
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "index_cache");
+$c->drop();
+
+var_dump($c->ensureIndex(array('a' => 1)));
+$ack = $c->ensureIndex(array('a' => 1), array('safe' => true));
+var_dump($ack['ok'], $ack['err']);
+var_dump(count($c->getIndexInfo()));
+
+// a different spec is sent
+$ack = $c->ensureIndex(array('b' => 1), array('unique' => true, 'safe' => true));
+var_dump($ack['err']);
+var_dump(count($c->getIndexInfo()));
+
+// dropping the indexes through the driver forgets them
+$c->deleteIndexes();
+var_dump(count($c->getIndexInfo()));
+$c->ensureIndex(array('a' => 1), array('safe' => true));
+var_dump(count($c->getIndexInfo()));
+?>
+--EXPECT--
+bool(true)
+float(1)
+NULL
+int(2)
+NULL
+int(3)
+int(1)
+int(2)
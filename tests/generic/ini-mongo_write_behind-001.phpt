@@ -0,0 +1,40 @@
+--TEST--
+INI: mongo.write_behind queues unacknowledged writes until the next request
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--INI--
+mongo.write_behind=65536
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "write_behind");
+$c->drop();
+
+for ($i = 0; $i < 50; $i++) {
+    $c->insert(array('_id' => $i, 'n' => 0));
+    $c->update(array('_id' => $i), array('$inc' => array('n' => 1)));
+}
+$c->remove(array('_id' => 0));
+
+// the queued writes go out ahead of the query
+var_dump($c->count());
+var_dump($c->findOne(array('_id' => 49)));
+
+// a safe write also sends the queue first
+$c->insert(array('_id' => 100));
+try {
+    $c->insert(array('_id' => 100), array('safe' => true));
+} catch (MongoCursorException $e) {
+    var_dump($e->getCode());
+}
+?>
+--EXPECT--
+int(49)
+array(2) {
+  ["_id"]=>
+  int(49)
+  ["n"]=>
+  int(1)
+}
+int(11000)
@@ -0,0 +1,52 @@
+--TEST--
+MongoDate, MongoBinData, MongoInt32 and MongoInt64 keep their values through decoding and property changes
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+ini_set('mongo.long_as_object', 1);
+
+$doc = array(
+    'date' => new MongoDate(1234567890, 123000),
+    'bin' => new MongoBinData("abc", 0),
+    'int32' => new MongoInt32("42"),
+    'int64' => new MongoInt64("12345678901234"),
+);
+$decoded = bson_decode(bson_encode($doc));
+
+var_dump($decoded['date']->sec, $decoded['date']->usec, (string)$decoded['date']);
+var_dump($decoded['bin']->bin, $decoded['bin']->type);
+var_dump($decoded['int64']->value);
+var_dump($decoded['date'] == $doc['date']);
+
+// writing a property changes what is serialized
+$decoded['date']->sec = 1;
+$decoded['bin']->bin = "xyz";
+$doc['int32']->value = "7";
+$again = bson_decode(bson_encode(array('date' => $decoded['date'], 'bin' => $decoded['bin'], 'int32' => $doc['int32'])));
+var_dump($again['date']->sec, $again['bin']->bin, $again['int32']);
+
+// so does changing a property through a reference
+$usec = &$decoded['date']->usec;
+$usec = 5000;
+$again = bson_decode(bson_encode(array('date' => $decoded['date'])));
+var_dump($again['date']->usec);
+
+$clone = clone $decoded['date'];
+$clone->sec = 2;
+var_dump($decoded['date']->sec, $clone->sec);
+?>
+--EXPECT--
+int(1234567890)
+int(123000)
+string(21) "0.12300000 1234567890"
+string(3) "abc"
+int(0)
+string(14) "12345678901234"
+bool(true)
+int(1)
+string(3) "xyz"
+int(7)
+int(5000)
+int(1)
+int(2)
@@ -0,0 +1,51 @@
+--TEST--
+MongoCollection::aggregateCursor() streams the results in batches
+--SKIPIF--
+<?php $needs = "2.5.3"; require dirname( __FILE__ ) . "/skipif.inc" ?>
+--FILE--
+<?php
+require dirname( __FILE__ ) . "/../utils.inc";
+
+$m = mongo();
+$c = $m->selectDB("phpunit")->selectCollection("aggregatecursor");
+$c->drop();
+for ($i = 0; $i < 250; $i++) {
+    $c->insert(array("x" => $i, "even" => $i % 2 == 0));
+}
+
+$cursor = $c->aggregateCursor(
+    array(array('$match' => array("even" => true)), array('$sort' => array("x" => 1))),
+    array("batchSize" => 10)
+);
+var_dump($cursor instanceof MongoCursor);
+
+$count = 0;
+$last = -2;
+foreach ($cursor as $doc) {
+    if ($doc["x"] != $last + 2) {
+        echo "out of order: ", $doc["x"], "\n";
+    }
+    $last = $doc["x"];
+    $count++;
+}
+var_dump($count, $last);
+
+// rewinding runs the pipeline again
+$count = 0;
+foreach ($cursor as $doc) {
+    $count++;
+}
+var_dump($count);
+
+try {
+    $c->aggregateCursor(array(array('$nosuchstage' => 1)))->getNext();
+} catch (MongoCursorException $e) {
+    echo "failed\n";
+}
+?>
+--EXPECT--
+bool(true)
+int(125)
+int(248)
+int(125)
+failed
@@ -0,0 +1,39 @@
+--TEST--
+MongoCollection::batchInsert() with the ids option
+--SKIPIF--
+<?php require dirname( __FILE__ ) . "/skipif.inc" ?>
+--FILE--
+<?php
+require dirname( __FILE__ ) . "/../utils.inc";
+
+$m = mongo();
+$c = $m->selectDB("phpunit")->selectCollection("batchinsert_ids");
+$c->drop();
+
+$docs = array(array("x" => 1), array("x" => 2, "_id" => "mine"));
+$c->batchInsert($docs, array("ids" => false));
+var_dump(isset($docs[0]["_id"]), $docs[1]["_id"]);
+
+$docs = array(array("x" => 3), array("x" => 4));
+$c->batchInsert($docs, array("ids" => "string"));
+var_dump(is_string($docs[0]["_id"]), strlen($docs[0]["_id"]));
+$string_id = $docs[0]["_id"];
+
+$docs = array(array("x" => 5));
+$c->batchInsert($docs);
+var_dump(get_class($docs[0]["_id"]));
+
+// the ids are ObjectIds in the database either way
+$doc = $c->findOne(array("_id" => new MongoId($string_id)));
+var_dump(get_class($doc["_id"]), $doc["x"]);
+var_dump($c->count(array("_id" => array('$type' => 7))));
+?>
+--EXPECT--
+bool(false)
+string(4) "mine"
+bool(true)
+int(24)
+string(7) "MongoId"
+string(7) "MongoId"
+int(3)
+int(4)
@@ -0,0 +1,29 @@
+--TEST--
+MongoCollection::batchInsert() splits batches that are too large for one message
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "batchinsert_split");
+$c->drop();
+
+$blob = str_repeat('x', 1024 * 1024);
+$docs = array();
+for ($i = 0; $i < 40; $i++) {
+    $docs[] = array('_id' => $i, 'blob' => $blob);
+}
+
+$result = $c->batchInsert($docs, array('safe' => true));
+var_dump($result['ok']);
+var_dump($c->count());
+var_dump($c->findOne(array('_id' => 39), array('_id' => 1)));
+?>
+--EXPECT--
+float(1)
+int(40)
+array(1) {
+  ["_id"]=>
+  int(39)
+}
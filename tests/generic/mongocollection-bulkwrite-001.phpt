@@ -0,0 +1,55 @@
+--TEST--
+MongoCollection::bulkWrite() sends all writes and reads the acknowledgements at once
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "bulkwrite");
+$c->drop();
+
+var_dump($c->bulkWrite(array(
+    array('insert', array('_id' => 1, 'n' => 1)),
+    array('insert', array('_id' => 2, 'n' => 2)),
+    array('update', array('_id' => 1), array('$inc' => array('n' => 10))),
+)));
+var_dump($c->count());
+
+$acks = $c->bulkWrite(array(
+    array('insert', array('_id' => 3)),
+    array('insert', array('_id' => 3)),
+    array('update', array('n' => array('$gt' => 0)), array('$set' => array('x' => 1)), array('multiple' => true)),
+    array('update', array('_id' => 4), array('n' => 4), array('upsert' => true)),
+    array('remove', array('_id' => 2), array('justOne' => true)),
+), array('safe' => true));
+
+var_dump(count($acks));
+var_dump($acks[0]['err'], $acks[1]['code'], $acks[2]['n'], $acks[3]['updatedExisting'], $acks[4]['n']);
+var_dump($c->findOne(array('_id' => 1)));
+
+try {
+    $c->bulkWrite(array(array('upsert', array())));
+} catch (MongoException $e) {
+    var_dump($e->getCode(), $e->getMessage());
+}
+?>
+--EXPECT--
+bool(true)
+int(2)
+int(5)
+NULL
+int(11000)
+int(2)
+bool(false)
+int(1)
+array(3) {
+  ["_id"]=>
+  int(1)
+  ["n"]=>
+  int(11)
+  ["x"]=>
+  int(1)
+}
+int(25)
+string(29) "invalid operation at index 0"
@@ -0,0 +1,55 @@
+--TEST--
+MongoCollection::findByIds() returns a list of the documents
+--SKIPIF--
+<?php require dirname( __FILE__ ) . "/skipif.inc" ?>
+--FILE--
+<?php
+require dirname( __FILE__ ) . "/../utils.inc";
+
+$m = mongo();
+$c = $m->selectDB("phpunit")->selectCollection("findbyids");
+$c->drop();
+
+$ids = array();
+for ($i = 0; $i < 2500; $i++) {
+    $c->insert(array("_id" => $i, "x" => $i * 2));
+    $ids[] = $i;
+}
+$c->insert(array("_id" => "foo", "x" => "bar"));
+$mongoid = new MongoId();
+$c->insert(array("_id" => $mongoid, "x" => "baz"));
+// ids that would share a key in an array keyed by _id
+$c->insert(array("_id" => "5", "x" => "five"));
+$c->insert(array("_id" => (string) $mongoid, "x" => "hex"));
+
+// more ids than fit in a single query, and some that don't exist
+$ids[] = 99999;
+$ids[] = "foo";
+$ids[] = $mongoid;
+$ids[] = "5";
+$ids[] = (string) $mongoid;
+
+$docs = $c->findByIds($ids, array("x" => 1));
+var_dump(count($docs), array_keys($docs) === range(0, count($docs) - 1));
+
+$x = array();
+foreach ($docs as $doc) {
+    $x[] = $doc["x"];
+}
+var_dump(in_array(0, $x, true), in_array(4998, $x, true), in_array(5 * 2, $x, true));
+var_dump(in_array("bar", $x, true), in_array("baz", $x, true), in_array("five", $x, true), in_array("hex", $x, true));
+
+var_dump($c->findByIds(array()));
+?>
+--EXPECT--
+int(2504)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+array(0) {
+}
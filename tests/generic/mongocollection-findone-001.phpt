@@ -0,0 +1,51 @@
+--TEST--
+MongoCollection::findOne() returns the first matching document
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "findone");
+$c->drop();
+
+for ($i = 0; $i < 10; $i++) {
+    $c->insert(array('_id' => $i, 'x' => $i * 2, 'y' => 'foo'));
+}
+
+var_dump($c->findOne(array('_id' => 3)));
+var_dump($c->findOne(array('_id' => 42)));
+var_dump($c->findOne(array('x' => 8), array('y')));
+var_dump($c->findOne(array('x' => 8), array('y' => 0)));
+var_dump(is_array($c->findOne()));
+
+try {
+    $c->findOne(array('x' => array('$nonsense' => 1)));
+} catch (MongoCursorException $e) {
+    var_dump(is_array($e->doc));
+}
+?>
+--EXPECT--
+array(3) {
+  ["_id"]=>
+  int(3)
+  ["x"]=>
+  int(6)
+  ["y"]=>
+  string(3) "foo"
+}
+NULL
+array(2) {
+  ["_id"]=>
+  int(4)
+  ["y"]=>
+  string(3) "foo"
+}
+array(2) {
+  ["_id"]=>
+  int(4)
+  ["x"]=>
+  int(8)
+}
+bool(true)
+bool(true)
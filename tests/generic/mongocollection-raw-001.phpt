@@ -0,0 +1,57 @@
+--TEST--
+MongoCollection: inserting and reading raw BSON
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "raw");
+$c->drop();
+
+$c->insert(bson_encode(array('_id' => 1, 'a' => 'one')), array('safe' => true));
+$c->batchInsert(array(
+    bson_encode(array('_id' => 2, 'a' => 'two')),
+    array('_id' => 3, 'a' => 'three'),
+), array('safe' => true));
+
+foreach ($c->find()->sort(array('_id' => 1))->raw() as $key => $bson) {
+    var_dump($key, is_string($bson), bson_decode($bson));
+}
+
+foreach (array("", "\x05\x00\x00\x00\x00", "\x06\x00\x00\x00\x00") as $bad) {
+    try {
+        $c->insert($bad);
+    } catch (MongoException $e) {
+        echo $e->getCode(), ": ", $e->getMessage(), "\n";
+    }
+}
+?>
+--EXPECT--
+string(1) "1"
+bool(true)
+array(2) {
+  ["_id"]=>
+  int(1)
+  ["a"]=>
+  string(3) "one"
+}
+string(1) "2"
+bool(true)
+array(2) {
+  ["_id"]=>
+  int(2)
+  ["a"]=>
+  string(3) "two"
+}
+string(1) "3"
+bool(true)
+array(2) {
+  ["_id"]=>
+  int(3)
+  ["a"]=>
+  string(5) "three"
+}
+19: invalid BSON document of 0 bytes
+4: no elements in doc
+19: invalid BSON document of 5 bytes
@@ -0,0 +1,49 @@
+--TEST--
+MongoCollection: findOne and count results come from the result cache while they are fresh
+--SKIPIF--
+<?php require_once dirname(__FILE__) . "/skipif.inc"; ?>
+--INI--
+mongo.result_cache_size=1048576
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+
+$m = mongo();
+$c = $m->selectCollection(dbname(), "resultcache");
+$c->drop();
+$c->insert(array("_id" => "config", "v" => 1), array("safe" => true));
+
+var_dump($c->setCacheTTL(60), $c->getCacheTTL());
+$doc = $c->findOne(array("_id" => "config"));
+var_dump($doc["v"], $c->count());
+var_dump($c->findOne(array("_id" => "missing")));
+
+// a command changes the document behind the cache's back
+$m->selectDB(dbname())->command(array("findAndModify" => "resultcache", "query" => array("_id" => "config"), "update" => array('$set' => array("v" => 2))));
+$doc = $c->findOne(array("_id" => "config"));
+var_dump($doc["v"]);
+$doc = $c->findOne(array("_id" => "config"), array(), array("cacheTTL" => 0));
+var_dump($doc["v"]);
+
+$c->invalidateCache();
+$doc = $c->findOne(array("_id" => "config"));
+var_dump($doc["v"]);
+
+// writes through the driver drop the results of the collection
+$c->insert(array("_id" => "other"), array("safe" => true));
+var_dump($c->count());
+$c->findAndModify(array("_id" => "config"), array('$set' => array("v" => 3)));
+$doc = $c->findOne(array("_id" => "config"));
+var_dump($doc["v"]);
+?>
+--EXPECT--
+int(0)
+int(60)
+int(1)
+int(1)
+NULL
+int(1)
+int(2)
+int(2)
+int(2)
+int(3)
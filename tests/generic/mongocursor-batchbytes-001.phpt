@@ -0,0 +1,36 @@
+--TEST--
+MongoCursor::batchBytes() sizes OP_GET_MORE replies by the size of the documents
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "batchbytes");
+$c->drop();
+
+/* documents of 1022 bytes each */
+for ($i = 0; $i < 20; $i++) {
+    $c->insert(array('_id' => $i, 'x' => str_repeat("x", 1000)), array("safe" => true));
+}
+
+function sizes($cursor) {
+    $sizes = array();
+    while ($batch = $cursor->nextBatch()) {
+        $sizes[] = count($batch);
+    }
+    return implode(",", $sizes);
+}
+
+/* the first reply goes by batchSize */
+echo sizes($c->find()->sort(array('_id' => 1))->batchSize(4)->batchBytes(5200)), "\n";
+echo sizes($c->find()->sort(array('_id' => 1))->batchSize(4)->batchBytes(0)), "\n";
+
+/* the buffer of 4 documents leaves room for 2 more under the limit */
+ini_set("mongo.cursor_buffer_limit", 3000);
+echo sizes($c->find()->sort(array('_id' => 1))->batchSize(4)), "\n";
+?>
+--EXPECT--
+4,5,5,5,1
+4,4,4,4,4
+4,2,2,2,2,2,2,2,2
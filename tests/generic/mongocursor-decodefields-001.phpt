@@ -0,0 +1,59 @@
+--TEST--
+MongoCursor::decodeFields() only decodes the given fields
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "decodefields");
+$c->drop();
+
+$c->insert(array(
+    '_id' => 1,
+    'name' => 'one',
+    'big' => str_repeat('x', 10000),
+    'sub' => array('a' => 1, 'b' => array('c' => 2, 'd' => 3), 'e' => 4),
+));
+
+$doc = $c->find()->decodeFields(array('name', 'sub.b.c', 'sub.e', 'missing'))->getNext();
+var_dump($doc);
+
+$doc = $c->find()->decodeFields(array('sub.a', 'sub'))->getNext();
+var_dump(array_keys($doc), count($doc['sub']));
+
+$doc = $c->find()->decodeFields(array())->getNext();
+var_dump(count($doc));
+
+try {
+    $c->find()->decodeFields(array(1));
+} catch (MongoException $e) {
+    echo $e->getCode(), ": ", $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+array(3) {
+  ["_id"]=>
+  int(1)
+  ["name"]=>
+  string(3) "one"
+  ["sub"]=>
+  array(2) {
+    ["b"]=>
+    array(1) {
+      ["c"]=>
+      int(2)
+    }
+    ["e"]=>
+    int(4)
+  }
+}
+array(2) {
+  [0]=>
+  string(3) "_id"
+  [1]=>
+  string(3) "sub"
+}
+int(3)
+int(4)
+8: field names must be strings
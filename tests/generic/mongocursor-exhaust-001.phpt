@@ -0,0 +1,40 @@
+--TEST--
+MongoCursor::exhaust() streams all batches
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "exhaust");
+$c->drop();
+
+for ($i = 0; $i < 300; $i++) {
+    $c->insert(array('_id' => $i));
+}
+
+$ids = array();
+foreach ($c->find()->sort(array('_id' => 1))->batchSize(20)->exhaust() as $doc) {
+    $ids[] = $doc['_id'];
+}
+var_dump(count($ids), $ids === range(0, 299));
+
+// the connection can be used while the stream is still coming in
+$cursor = $c->find()->batchSize(20)->exhaust();
+$cursor->next();
+var_dump($c->count());
+var_dump(count(iterator_to_array($cursor)));
+
+// abandoning the stream leaves the connection usable
+$cursor = $c->find()->batchSize(20)->exhaust();
+$cursor->next();
+unset($cursor);
+$doc = $c->findOne(array('_id' => 42));
+var_dump($doc['_id']);
+?>
+--EXPECT--
+int(300)
+bool(true)
+int(300)
+int(300)
+int(42)
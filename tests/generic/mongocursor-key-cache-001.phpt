@@ -0,0 +1,48 @@
+--TEST--
+MongoCursor: field names are the same for every document of a result set
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "keycache");
+$c->drop();
+
+$c->insert(array('_id' => 1, 'a' => 1, '5' => 'five', '01' => 'zero-one'));
+$c->insert(array('_id' => 2, 'b' => 2, '-3' => 'minus three'));
+$c->insert(array('_id' => 3, 'a' => 3, '5' => 'five again', '01' => 'zero-one'));
+
+foreach ($c->find()->sort(array('_id' => 1)) as $doc) {
+    var_dump($doc);
+}
+?>
+--EXPECTF--
+array(4) {
+  ["_id"]=>
+  int(1)
+  ["a"]=>
+  int(1)
+  [5]=>
+  string(4) "five"
+  ["01"]=>
+  string(8) "zero-one"
+}
+array(3) {
+  ["_id"]=>
+  int(2)
+  ["b"]=>
+  int(2)
+  [-3]=>
+  string(11) "minus three"
+}
+array(4) {
+  ["_id"]=>
+  int(3)
+  ["a"]=>
+  int(3)
+  [5]=>
+  string(10) "five again"
+  ["01"]=>
+  string(8) "zero-one"
+}
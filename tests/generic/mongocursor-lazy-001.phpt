@@ -0,0 +1,62 @@
+--TEST--
+MongoCursor::lazy() returns read-only documents that decode on access
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "lazy");
+$c->drop();
+
+$c->insert(array('_id' => 1, 'name' => 'first', 'n' => 42, 'sub' => array('a' => 'b', 'list' => array(3, 4))));
+$c->insert(array('_id' => 2, 'name' => 'second', 'n' => 43));
+
+foreach ($c->find()->sort(array('_id' => 1))->lazy() as $key => $doc) {
+    var_dump(get_class($doc), $key, $doc['name'], $doc['n'], count($doc->toArray()) == $doc->count());
+    var_dump(isset($doc['sub']), isset($doc['missing']), $doc['missing']);
+    if (isset($doc['sub'])) {
+        var_dump(get_class($doc['sub']), $doc['sub']['a'], $doc['sub']['list'][1]);
+        var_dump($doc['sub']['list']->toArray());
+    }
+}
+
+$doc = $c->find(array('_id' => 1))->lazy()->getNext();
+try {
+    $doc['name'] = 'changed';
+} catch (MongoException $e) {
+    var_dump($e->getCode(), $e->getMessage());
+}
+
+$doc = $c->find(array('_id' => 2))->lazy(false)->getNext();
+var_dump(is_array($doc));
+?>
+--EXPECT--
+string(17) "MongoLazyDocument"
+string(1) "1"
+string(5) "first"
+int(42)
+bool(true)
+bool(true)
+bool(false)
+NULL
+string(17) "MongoLazyDocument"
+string(1) "b"
+int(4)
+array(2) {
+  [0]=>
+  int(3)
+  [1]=>
+  int(4)
+}
+string(17) "MongoLazyDocument"
+string(1) "2"
+string(6) "second"
+int(43)
+bool(true)
+bool(false)
+bool(false)
+NULL
+int(18)
+string(70) "MongoLazyDocument is read-only, use toArray() to get a modifiable copy"
+bool(true)
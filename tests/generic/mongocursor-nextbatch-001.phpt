@@ -0,0 +1,56 @@
+--TEST--
+MongoCursor::nextBatch() returns the documents of a reply at once
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "nextbatch");
+$c->drop();
+
+for ($i = 0; $i < 25; $i++) {
+    $c->insert(array('_id' => $i, 'x' => "doc $i"));
+}
+
+$cursor = $c->find()->sort(array('_id' => 1))->batchSize(10);
+$sizes = array();
+$ids = array();
+while ($batch = $cursor->nextBatch(4)) {
+    $sizes[] = count($batch);
+    foreach ($batch as $doc) {
+        $ids[] = $doc['_id'];
+    }
+}
+echo implode(",", $sizes), "\n";
+var_dump($ids === range(0, 24));
+
+$cursor = $c->find()->sort(array('_id' => 1))->batchSize(10);
+var_dump(count($cursor->nextBatch()));
+$doc = $cursor->getNext();
+var_dump($doc['_id']);
+
+$cursor = $c->find()->limit(7)->batchSize(5);
+$total = 0;
+while ($batch = $cursor->nextBatch()) {
+    $total += count($batch);
+}
+var_dump($total);
+
+$batch = $c->find()->sort(array('_id' => 1))->raw()->nextBatch(1);
+var_dump(is_string($batch[0]));
+
+try {
+    $c->find(array('$where' => 'this is not valid javascript'))->nextBatch();
+} catch (MongoCursorException $e) {
+    echo "exception\n";
+}
+?>
+--EXPECT--
+4,4,2,4,4,2,4,1
+bool(true)
+int(10)
+int(10)
+int(7)
+bool(true)
+exception
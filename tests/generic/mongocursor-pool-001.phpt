@@ -0,0 +1,38 @@
+--TEST--
+MongoCursor: a cursor with a reply still coming gets a socket of its own
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--INI--
+mongo.pool_size=2
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "pool");
+$c->drop();
+
+for ($i = 0; $i < 200; $i++) {
+    $c->insert(array('_id' => $i));
+}
+
+// the findOne() queries go out on the second socket while the first one has
+// a prefetched batch coming
+$found = 0;
+$cursor = $c->find()->sort(array('_id' => 1))->batchSize(20)->prefetch(0.1);
+foreach ($cursor as $doc) {
+    $one = $c->findOne(array('_id' => $doc['_id']));
+    $found += $one['_id'] === $doc['_id'];
+}
+var_dump($found);
+
+// with both sockets busy, the cursors share one
+$a = $c->find()->batchSize(20)->prefetch(0.1);
+$b = $c->find()->batchSize(20)->prefetch(0.1);
+$d = $c->find()->batchSize(20)->prefetch(0.1);
+var_dump(count(iterator_to_array($a)), count(iterator_to_array($b)), count(iterator_to_array($d)));
+?>
+--EXPECT--
+int(200)
+int(200)
+int(200)
+int(200)
@@ -0,0 +1,46 @@
+--TEST--
+MongoCursor::prefetch() requests the next batch ahead of time
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "prefetch");
+$c->drop();
+
+for ($i = 0; $i < 500; $i++) {
+    $c->insert(array('_id' => $i));
+}
+
+$ids = array();
+foreach ($c->find()->sort(array('_id' => 1))->batchSize(50)->prefetch() as $doc) {
+    $ids[] = $doc['_id'];
+}
+var_dump(count($ids), $ids === range(0, 499));
+
+// other queries on the connection while a batch is being prefetched
+$count = 0;
+$cursor = $c->find()->batchSize(50)->prefetch(0.1);
+foreach ($cursor as $doc) {
+    if ($count++ % 10 == 0) {
+        $c->findOne(array('_id' => $doc['_id']));
+    }
+}
+var_dump($count);
+
+$cursor = $c->find()->limit(120)->batchSize(50)->prefetch(0.9);
+var_dump(count(iterator_to_array($cursor)));
+
+try {
+    $c->find()->prefetch(2);
+} catch (MongoCursorException $e) {
+    var_dump($e->getCode());
+}
+?>
+--EXPECT--
+int(500)
+bool(true)
+int(500)
+int(120)
+int(22)
@@ -0,0 +1,64 @@
+--TEST--
+MongoCursorGroup iterates over several cursors at once
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "cursorgroup");
+$c->drop();
+
+for ($i = 0; $i < 100; $i++) {
+    $c->insert(array('_id' => $i));
+}
+
+$low = $c->find(array('_id' => array('$lt' => 50)))->batchSize(7);
+$high = $c->find(array('_id' => array('$gte' => 50)))->batchSize(11);
+
+$group = new MongoCursorGroup(array($low, $high));
+$ids = array();
+$keys = array();
+$from = array();
+foreach ($group as $key => $doc) {
+    $ids[] = $doc['_id'];
+    $keys[] = $key;
+    $from[$group->getCursor() === $low ? 'low' : 'high'][] = $doc['_id'];
+}
+sort($ids);
+var_dump($ids === range(0, 99), $keys === range(0, 99));
+var_dump(count($from['low']), max($from['low']), min($from['high']));
+
+// a second pass runs the queries again
+$count = 0;
+foreach ($group as $doc) {
+    $count++;
+}
+var_dump($count);
+
+$group = new MongoCursorGroup();
+$group->add($c->find()->limit(3))->add($c->find()->limit(4));
+var_dump(count(iterator_to_array($group)));
+
+try {
+    $group->add($c->find());
+} catch (MongoCursorException $e) {
+    echo $e->getMessage(), "\n";
+}
+
+try {
+    new MongoCursorGroup(array($c->find(), 42));
+} catch (MongoException $e) {
+    echo $e->getMessage(), "\n";
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+int(50)
+int(49)
+int(50)
+int(100)
+int(7)
+cannot modify cursor group after beginning iteration
+MongoCursorGroup expects MongoCursor objects
@@ -0,0 +1,40 @@
+--TEST--
+MongoGridFS::storeBytes() with more chunks than fit in one message
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$db = $mongo->selectDB(dbname());
+
+$gridfs = $db->getGridFS();
+$gridfs->drop();
+
+// 17MB in chunks of 256KB go out as two groups of inserts
+$bytes = str_repeat(sha1("chunk"), 17 * 1024 * 1024 / 40);
+$id = $gridfs->storeBytes($bytes, array('filename' => 'large'));
+
+var_dump($gridfs->chunks->count(array('files_id' => $id)));
+$file = $gridfs->findOne(array('filename' => 'large'));
+var_dump($file->getSize() === strlen($bytes));
+var_dump($file->getBytes() === $bytes);
+
+// a chunk that is in the way fails the upload, and the chunks that did get
+// stored are removed again
+$gridfs->chunks->insert(array('files_id' => 'taken', 'n' => 3, 'data' => new MongoBinData('x')));
+try {
+    $gridfs->storeBytes($bytes, array('_id' => 'taken'));
+    var_dump(false);
+} catch (MongoGridFSException $e) {
+    var_dump(true);
+}
+var_dump($gridfs->chunks->count(array('files_id' => 'taken')));
+var_dump($gridfs->findOne(array('_id' => 'taken')));
+--EXPECT--
+int(68)
+bool(true)
+bool(true)
+bool(true)
+int(1)
+NULL
@@ -0,0 +1,35 @@
+--TEST--
+MongoGridFS::storeBytes() computes the md5 while storing the chunks
+--SKIPIF--
+<?php require dirname(__FILE__) . "/skipif.inc";?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$mongo = mongo();
+$db = $mongo->selectDB(dbname());
+
+$gridfs = $db->getGridFS();
+$gridfs->drop();
+
+$bytes = str_repeat("0123456789", 100000);
+
+$gridfs->storeBytes($bytes, array('filename' => 'client', 'chunkSize' => 30000));
+$file = $gridfs->findOne(array('filename' => 'client'));
+var_dump($file->file['md5'] === md5($bytes));
+
+$gridfs->storeBytes($bytes, array('filename' => 'verified'), array('verifyMD5' => true));
+$file = $gridfs->findOne(array('filename' => 'verified'));
+var_dump($file->file['md5'] === md5($bytes));
+
+$gridfs->storeBytes('', array('filename' => 'empty'));
+$file = $gridfs->findOne(array('filename' => 'empty'));
+var_dump($file->file['md5'] === md5(''));
+
+$gridfs->storeBytes($bytes, array('filename' => 'given', 'md5' => 'mine'));
+$file = $gridfs->findOne(array('filename' => 'given'));
+var_dump($file->file['md5']);
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+string(4) "mine"
@@ -0,0 +1,57 @@
+--TEST--
+MongoGridFSFile::getBytes() and write() with an offset and a length
+--SKIPIF--
+<?php require_once dirname(__FILE__) . "/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+
+$m = mongo();
+$grid = $m->selectDB(dbname())->getGridFS();
+$grid->drop();
+
+$bytes = "";
+for ($i = 0; $i < 1000; $i++) {
+    $bytes .= sha1($i);
+}
+$id = $grid->storeBytes($bytes, array("filename" => "range.txt", "chunkSize" => 1000));
+$file = $grid->get($id);
+
+// within one chunk, across chunk boundaries and up to the end
+foreach (array(array(0, 10), array(995, 10), array(1500, 3000), array(39990, 10), array(39990, -1), array(39995, 100)) as $range) {
+    var_dump($file->getBytes($range[0], $range[1]) === substr($bytes, $range[0], $range[1] < 0 ? strlen($bytes) : $range[1]));
+}
+var_dump($file->getBytes(30000) === substr($bytes, 30000));
+var_dump($file->getBytes(50000, 10));
+var_dump($file->getBytes(100, 0));
+var_dump($file->getBytes() === $bytes);
+
+try {
+    $file->getBytes(-1, 10);
+} catch (MongoGridFSException $e) {
+    var_dump($e->getMessage());
+}
+
+$filename = tempnam(sys_get_temp_dir(), "gridfs");
+var_dump($file->write($filename, 2500, 2000));
+var_dump(file_get_contents($filename) === substr($bytes, 2500, 2000));
+var_dump($file->write($filename, 39000));
+var_dump(file_get_contents($filename) === substr($bytes, 39000));
+unlink($filename);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+string(0) ""
+string(0) ""
+bool(true)
+string(29) "the offset can not be negative"
+int(2000)
+bool(true)
+int(1000)
+bool(true)
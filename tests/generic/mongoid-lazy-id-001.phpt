@@ -0,0 +1,38 @@
+--TEST--
+MongoId: $id is filled in when it is used
+--FILE--
+<?php
+$id = new MongoId("4f06e55e44670ab92d000000");
+$decoded = bson_decode(bson_encode(array('_id' => $id)));
+$decoded = $decoded['_id'];
+
+var_dump($decoded->{'$id'});
+var_dump(isset($decoded->{'$id'}));
+var_dump($decoded == $id);
+var_dump((string)$decoded);
+
+$decoded = bson_decode(bson_encode(array('_id' => $id)));
+var_dump($decoded['_id']);
+
+$generated = new MongoId();
+var_dump(strlen($generated->{'$id'}), $generated->{'$id'} === (string)$generated);
+
+$copy = new MongoId($decoded['_id']);
+var_dump($copy->{'$id'});
+
+$decoded['_id']->{'$id'} = "changed";
+var_dump($decoded['_id']->{'$id'});
+?>
+--EXPECTF--
+string(24) "4f06e55e44670ab92d000000"
+bool(true)
+bool(true)
+string(24) "4f06e55e44670ab92d000000"
+object(MongoId)#%d (1) {
+  ["$id"]=>
+  string(24) "4f06e55e44670ab92d000000"
+}
+int(24)
+bool(true)
+string(24) "4f06e55e44670ab92d000000"
+string(7) "changed"
@@ -0,0 +1,38 @@
+--TEST--
+MongoLog::dumpTrace() returns the most recent events of the trace buffer
+--SKIPIF--
+<?php require_once dirname(__FILE__) . "/skipif.inc"; ?>
+--INI--
+mongo.trace_buffer=32
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+
+$m = mongo();
+$c = $m->selectDB(dbname())->trace;
+$c->drop();
+MongoLog::dumpTrace(true);
+
+$c->insert(array("x" => 1));
+$c->findOne();
+foreach (MongoLog::dumpTrace() as $line) {
+    // server selection is traced too, depending on the setup
+    $event = preg_replace('/^[0-9.]+ ([a-z ]+):.*/', '\1', $line);
+    if (in_array($event, array("send write", "send query", "reply"))) {
+        echo $event, "\n";
+    }
+}
+
+for ($i = 0; $i < 40; $i++) {
+    $c->findOne();
+}
+var_dump(count(MongoLog::dumpTrace(true)));
+var_dump(MongoLog::dumpTrace());
+?>
+--EXPECT--
+send write
+send query
+reply
+int(32)
+array(0) {
+}
@@ -0,0 +1,50 @@
+--TEST--
+MongoStats: Operations are timed and counted per server
+--SKIPIF--
+<?php require_once dirname(__FILE__) . "/skipif.inc"; ?>
+--INI--
+mongo.stats=1
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+
+$m = mongo();
+$c = $m->selectDB(dbname())->stats;
+$c->drop();
+
+MongoStats::reset();
+var_dump(MongoStats::get());
+
+for ($i = 0; $i < 3; $i++) {
+    $c->insert(array("x" => $i), array("safe" => true));
+}
+$c->findOne(array("x" => 1));
+$c->count();
+
+$stats = MongoStats::getRequest();
+var_dump(count($stats));
+$server = current($stats);
+
+var_dump($server["insert"]["count"], $server["insert"]["failures"]);
+var_dump($server["query"]["count"]);
+var_dump($server["command"]["count"] >= 1);
+var_dump($server["query"]["bytes_sent"] > 0, $server["query"]["bytes_received"] > 0);
+var_dump($server["insert"]["p50"] <= $server["insert"]["p99"]);
+var_dump(array_sum($server["insert"]["histogram"]));
+
+$total = MongoStats::get();
+var_dump(current($total) == $server);
+?>
+--EXPECT--
+array(0) {
+}
+int(1)
+int(3)
+int(0)
+int(1)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(3)
+bool(true)
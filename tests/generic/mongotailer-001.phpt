@@ -0,0 +1,48 @@
+--TEST--
+MongoTailer reads a capped collection in batches and resumes after the last entry
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$db = $m->selectDB(dbname());
+$db->dropCollection("tailer");
+$c = $db->createCollection("tailer", true, 100000);
+
+for ($i = 0; $i < 10; $i++) {
+    $c->insert(array('ts' => $i), array("safe" => true));
+}
+
+$tailer = new MongoTailer($c, array(), array("batchSize" => 4));
+$seen = array();
+foreach ($tailer->next() as $entry) {
+    $seen[] = $entry['ts'];
+}
+echo implode(",", $seen), "\n";
+var_dump($tailer->getTimestamp());
+
+while (count($seen) < 10) {
+    foreach ($tailer->next() as $entry) {
+        $seen[] = $entry['ts'];
+    }
+}
+echo implode(",", $seen), "\n";
+
+/* A new tailer picks up where the old one stopped */
+$c->insert(array('ts' => 10), array("safe" => true));
+$c->insert(array('ts' => 11), array("safe" => true));
+$resumed = new MongoTailer($c, array(), array("ts" => $tailer->getTimestamp(), "oplogReplay" => false));
+$ts = array();
+foreach ($resumed->next() as $entry) {
+    $ts[] = $entry['ts'];
+}
+echo implode(",", $ts), "\n";
+var_dump($resumed->getCursor() instanceof MongoCursor);
+?>
+--EXPECT--
+0,1,2,3
+int(3)
+0,1,2,3,4,5,6,7,8,9
+10,11
+bool(true)
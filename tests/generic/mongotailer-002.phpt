@@ -0,0 +1,37 @@
+--TEST--
+MongoTailer keeps the query's own operators on the field it resumes from
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$db = $m->selectDB(dbname());
+$db->dropCollection("tailer");
+$c = $db->createCollection("tailer", true, 100000);
+
+for ($i = 0; $i < 10; $i++) {
+    $c->insert(array('ts' => $i), array("safe" => true));
+}
+
+$tailer = new MongoTailer($c, array('ts' => array('$lt' => 6)), array("ts" => 1, "batchSize" => 2, "oplogReplay" => false));
+$seen = array();
+for ($i = 0; $i < 4; $i++) {
+    foreach ($tailer->next() as $entry) {
+        $seen[] = $entry['ts'];
+    }
+}
+echo implode(",", $seen), "\n";
+
+foreach (array(array('ts' => 3), array('ts' => array('$gt' => 3))) as $query) {
+    try {
+        new MongoTailer($c, $query);
+    } catch (MongoException $e) {
+        echo $e->getCode(), ": ", $e->getMessage(), "\n";
+    }
+}
+?>
+--EXPECT--
+2,3,4,5
+26: MongoTailer expects the condition on ts to be an array of operators without $gt, use the ts option to start after a value
+26: MongoTailer expects the condition on ts to be an array of operators without $gt, use the ts option to start after a value
@@ -0,0 +1,62 @@
+--TEST--
+MongoWriteResult: acknowledged writes with the "async" option
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+$m = mongo();
+$c = $m->selectCollection(dbname(), "writeresult");
+$c->drop();
+
+$r = $c->insert(array('_id' => 1), array('async' => true));
+var_dump(get_class($r));
+$ack = $r->getResult();
+var_dump($ack['ok'], $ack['err'], $r->isReady());
+
+// several writes in flight at once, read back in any order
+$results = array();
+for ($i = 2; $i <= 5; $i++) {
+    $results[$i] = $c->insert(array('_id' => $i), array('async' => true, 'safe' => true));
+}
+$update = $c->update(array('_id' => 5), array('$set' => array('x' => 1)), array('async' => true));
+$ack = $update->getResult();
+var_dump($ack['n'], $ack['updatedExisting']);
+foreach ($results as $r) {
+    var_dump($r->isReady());
+}
+
+// a query on the connection collects the replies ahead of its own
+$dup = $c->insert(array('_id' => 1), array('async' => true));
+var_dump($c->findOne(array('_id' => 5)));
+var_dump($dup->isReady());
+try {
+    $dup->getResult();
+} catch (MongoCursorException $e) {
+    var_dump($e->getCode());
+}
+
+// results that are never asked for do not get in the way
+$c->remove(array('_id' => 2), array('async' => true));
+var_dump($c->count());
+?>
+--EXPECT--
+string(16) "MongoWriteResult"
+float(1)
+NULL
+bool(true)
+int(1)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+array(2) {
+  ["_id"]=>
+  int(5)
+  ["x"]=>
+  int(1)
+}
+bool(true)
+int(11000)
+int(4)
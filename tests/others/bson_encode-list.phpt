@@ -0,0 +1,26 @@
+--TEST--
+bson_encode() writes lists as BSON arrays with their index as key
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--FILE--
+<?php
+// a list of scalars, and an array that isn't a list as its keys are out of order
+$input = array('a' => array(1, 2.5, true, null, 'x'), 'b' => array(1 => 1, 0 => 0));
+echo bin2hex(bson_encode($input)), "\n";
+
+// the keys of long lists go past a few powers of ten
+$list = range(0, 1500);
+$list[] = array('nested');
+$list[] = new MongoId('4ff5f0e21396f8a406000000');
+$output = bson_decode(bson_encode(array('list' => $list)));
+var_dump($output['list'] == $list);
+var_dump(substr_count(bson_encode(array('list' => $list)), "\x101000\x00"));
+
+// a list inside a list
+echo bin2hex(bson_encode(array(array(1, 2)))), "\n";
+?>
+--EXPECT--
+4500000004610027000000103000010000000131000000000000000440083200010a3300023400020000007800000362001300000010310001000000103000000000000000
+bool(true)
+int(1)
+1b0000000430001300000010300001000000103100020000000000
@@ -0,0 +1,41 @@
+--TEST--
+Hedged reads: queries that may go to a secondary still return their documents
+--SKIPIF--
+<?php require_once dirname(__FILE__) ."/skipif.inc"; ?>
+--INI--
+mongo.pool_size=4
+mongo.hedge_delay=1
+mongo.trace_buffer=1000
+--FILE--
+<?php
+require_once dirname(__FILE__) . "/../utils.inc";
+
+$m = mongo();
+$c = $m->selectDB(dbname())->hedge;
+$c->drop();
+for ($i = 0; $i < 20; $i++) {
+	$c->insert(array("_id" => $i, "x" => str_repeat("x", 1000)), array("safe" => 2));
+}
+
+$c->setReadPreference(Mongo::RP_SECONDARY_PREFERRED);
+$found = 0;
+for ($j = 0; $j < 20; $j++) {
+	$doc = $c->findOne(array("_id" => $j, '$where' => "sleep(5) || true"));
+	$found += $doc["_id"] === $j;
+	$found += count(iterator_to_array($c->find(array("_id" => array('$lt' => 5))))) === 5;
+}
+var_dump($found);
+
+/* Whether a query was hedged depends on the timing, but the first reply
+ * always wins */
+$hedges = 0;
+foreach (MongoLog::dumpTrace() as $line) {
+	if (preg_match('/hedge: request (\d+), socket (\d+) after \d+ms, socket (\d+) answered first/', $line)) {
+		$hedges++;
+	}
+}
+var_dump($hedges <= 40);
+?>
+--EXPECT--
+int(40)
+bool(true)
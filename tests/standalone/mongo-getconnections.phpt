@@ -25,11 +25,13 @@ array(1) {
       int(%d)
     }
     ["connection"]=>
-    array(8) {
+    array(9) {
       ["last_ping"]=>
       int(%d)
       ["last_ismaster"]=>
       int(0)
+      ["last_reply"]=>
+      int(%d)
       ["ping_ms"]=>
       int(%d)
       ["connection_type"]=>
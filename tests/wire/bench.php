@@ -0,0 +1,116 @@
+<?php
+/*
+ * Benchmarks of the driver's I/O path, to be run against the wire recorder
+ * and then, as often as needed, against its replay (see wire.c):
+ *
+ *   wire record -o scan.wire 127.0.0.1:37017=127.0.0.1:27017 &
+ *   php bench.php cursor mongodb://127.0.0.1:37017
+ *   wire replay -i scan.wire -d 1 -b 100000000 &
+ *   php bench.php cursor mongodb://127.0.0.1:37017
+ *
+ * Scenarios are cursor (scanning a collection), safe-writes (inserts that
+ * each wait for getLastError), gridfs (storing a file and reading it back as
+ * a stream) and failover (reads with a secondary preferred while a member
+ * goes away, with "wire replay -k"; the server is then a seed list with
+ * ?replicaSet=name).
+ * Every run does the same requests, so that they can be replayed.
+ *
+ * Usage: php bench.php scenario [server [rounds]]
+ */
+
+$scenario = isset($argv[1]) ? $argv[1] : "";
+$server   = isset($argv[2]) ? $argv[2] : "mongodb://127.0.0.1:37017";
+$rounds   = isset($argv[3]) ? (int)$argv[3] : 1000;
+
+function report($what, $count, $seconds, $bytes = 0) {
+    printf("%-12s %8d in %8.3fs: %10.1f/s", $what, $count, $seconds, $count / $seconds);
+    if ($bytes) {
+        printf(", %8.2f MB/s", $bytes / $seconds / 1048576);
+    }
+    echo "\n";
+}
+
+function cursor_scan($m, $rounds) {
+    $c = $m->selectCollection("wirebench", "scan");
+    $c->drop();
+    $doc = array("payload" => str_repeat("x", 512));
+    for ($i = 0; $i < 10000; $i++) {
+        $doc["_id"] = $i;
+        $c->insert($doc);
+    }
+
+    $start = microtime(true);
+    $docs = 0;
+    for ($i = 0; $i < $rounds / 100 + 1; $i++) {
+        foreach ($c->find()->batchSize(1000) as $doc) {
+            $docs++;
+        }
+    }
+    report("cursor", $docs, microtime(true) - $start, $docs * strlen(bson_encode($doc)));
+}
+
+function safe_writes($m, $rounds) {
+    $c = $m->selectCollection("wirebench", "writes");
+    $c->drop();
+
+    $start = microtime(true);
+    for ($i = 0; $i < $rounds; $i++) {
+        $c->insert(array("_id" => $i, "x" => $i), array("safe" => true));
+    }
+    report("safe-writes", $rounds, microtime(true) - $start);
+}
+
+function gridfs_stream($m, $rounds) {
+    $grid = $m->selectDB("wirebench")->getGridFS();
+    $grid->drop();
+    $bytes = str_repeat("0123456789abcdef", 4 * 65536);
+    $grid->storeBytes($bytes, array("_id" => "bench", "filename" => "bench"));
+
+    $start = microtime(true);
+    $total = 0;
+    for ($i = 0; $i < $rounds / 100 + 1; $i++) {
+        $stream = $grid->findOne(array("_id" => "bench"))->getResource();
+        while (!feof($stream)) {
+            $total += strlen(fread($stream, 65536));
+        }
+        fclose($stream);
+    }
+    report("gridfs", $i, microtime(true) - $start, $total);
+}
+
+function failover($m, $rounds) {
+    $c = $m->selectCollection("wirebench", "failover");
+    $c->drop();
+    for ($i = 0; $i < 100; $i++) {
+        $c->insert(array("_id" => $i), array("safe" => true));
+    }
+    $c->setReadPreference(Mongo::RP_SECONDARY_PREFERRED);
+
+    $start = microtime(true);
+    $failed = $slowest = 0;
+    for ($i = 0; $i < $rounds; $i++) {
+        $t = microtime(true);
+        try {
+            $c->findOne(array("_id" => $i % 100));
+        } catch (MongoException $e) {
+            $failed++;
+        }
+        $slowest = max($slowest, microtime(true) - $t);
+    }
+    report("failover", $rounds, microtime(true) - $start);
+    printf("%d failed, the slowest took %.3fs\n", $failed, $slowest);
+}
+
+$scenarios = array(
+    "cursor" => "cursor_scan",
+    "safe-writes" => "safe_writes",
+    "gridfs" => "gridfs_stream",
+    "failover" => "failover",
+);
+if (!isset($scenarios[$scenario])) {
+    echo "usage: php bench.php ", implode("|", array_keys($scenarios)), " [server [rounds]]\n";
+    exit(1);
+}
+
+$m = new Mongo($server);
+$scenarios[$scenario]($m, $rounds);
@@ -0,0 +1,884 @@
+/* Records the wire traffic between the driver and one or more mongods, and
+ * replays the recorded replies from a fake server, so that the driver's send
+ * and receive code can be benchmarked without live servers and with a
+ * network that behaves the same on every run (see bench.php).
+ *
+ *   wire record -o FILE LISTEN=UPSTREAM [LISTEN=UPSTREAM...]
+ *     Forwards every connection to LISTEN to UPSTREAM and writes all
+ *     messages to FILE. Every string UPSTREAM in a reply (as in the hosts of
+ *     an isMaster reply) is replaced by LISTEN, so for a replica set the
+ *     UPSTREAMs have to be given as in the replica set config, and the
+ *     driver only ever talks to the recorder.
+ *
+ *   wire replay -i FILE [-d MS] [-j MS] [-b BYTES] [-s SEED] [-k SERVER:SEC]
+ *     Listens on the LISTEN addresses of the recording and answers every
+ *     query or getmore with the recorded replies to the next request like it
+ *     (same opcode, namespace and first field of the query) on that server,
+ *     starting over once they have all been used. Replies are delayed by the
+ *     recorded round trip time, or MS milliseconds with -d, plus or minus up
+ *     to the -j jitter, and sent at no more than BYTES per second with -b.
+ *     -k SERVER:SEC makes the SERVERth address (counting from 0) go away SEC
+ *     seconds after start, to benchmark failover.
+ *
+ * Build with: gcc -Wall -O2 -o wire wire.c
+ *
+ * The recording starts with "MONGOWIRE1\n", the number of servers and for
+ * each its LISTEN address as an int32 length and the string. Then comes every
+ * message as four int32s (server, connection, 0 for requests and 1 for
+ * replies, microseconds since the start) and the message itself, which
+ * starts with its length. Integers are little endian, as on the wire. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAGIC "MONGOWIRE1\n"
+#define MAX_SERVERS 16
+#define MAX_LINKS 256
+#define MAX_MESSAGE (48 * 1024 * 1024)
+#define CHUNK_SIZE 16384
+
+#define OP_REPLY 1
+#define OP_QUERY 2004
+#define OP_GET_MORE 2005
+
+/* header, flags, cursor ID, starting from, number returned */
+#define REPLY_HEADER_SIZE 36
+
+typedef struct {
+	char *d;
+	int   l;
+	int   a;
+} wire_buf;
+
+typedef struct {
+	char *listen;
+	char *upstream;
+	int   fd;
+	int   killed;
+	int   kill_after;
+} wire_server;
+
+static wire_server servers[MAX_SERVERS];
+static int server_count = 0;
+
+static long usec_since(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_usec - start->tv_usec);
+}
+
+static int get_int(const char *p)
+{
+	int i;
+
+	memcpy(&i, p, 4);
+	return i;
+}
+
+static void set_int(char *p, int i)
+{
+	memcpy(p, &i, 4);
+}
+
+static void buf_add(wire_buf *buf, const char *data, int len)
+{
+	if (buf->l + len > buf->a) {
+		buf->a = (buf->l + len) * 2;
+		buf->d = realloc(buf->d, buf->a);
+	}
+	memcpy(buf->d + buf->l, data, len);
+	buf->l += len;
+}
+
+static void buf_add_int(wire_buf *buf, int i)
+{
+	char tmp[4];
+
+	set_int(tmp, i);
+	buf_add(buf, tmp, 4);
+}
+
+/* Drops the first len bytes of buf */
+static void buf_shift(wire_buf *buf, int len)
+{
+	memmove(buf->d, buf->d + len, buf->l - len);
+	buf->l -= len;
+}
+
+/* Returns the length of the message at the start of buf once all of it is
+ * there, 0 if it isn't yet, or -1 if it makes no sense */
+static int complete_message(wire_buf *buf)
+{
+	int len;
+
+	if (buf->l < 16) {
+		return 0;
+	}
+	len = get_int(buf->d);
+	if (len < 16 || len > MAX_MESSAGE) {
+		return -1;
+	}
+	return buf->l >= len ? len : 0;
+}
+
+static int write_all(int fd, const char *data, int len)
+{
+	int written;
+
+	while (len > 0) {
+		written = write(fd, data, len);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return -1;
+		}
+		data += written;
+		len -= written;
+	}
+	return 0;
+}
+
+/* Resolves "host:port" */
+static struct addrinfo *resolve(const char *spec, int passive)
+{
+	struct addrinfo hints, *result;
+	char host[256];
+	const char *colon = strrchr(spec, ':');
+
+	if (!colon || colon - spec >= (int) sizeof(host)) {
+		fprintf(stderr, "'%s' is not host:port\n", spec);
+		return NULL;
+	}
+	memcpy(host, spec, colon - spec);
+	host[colon - spec] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	if (getaddrinfo(host, colon + 1, &hints, &result) != 0) {
+		fprintf(stderr, "can't resolve '%s'\n", spec);
+		return NULL;
+	}
+	return result;
+}
+
+static int listen_on(const char *spec)
+{
+	struct addrinfo *addr = resolve(spec, 1);
+	int fd, yes = 1;
+
+	if (!addr) {
+		return -1;
+	}
+	fd = socket(addr->ai_family, addr->ai_socktype, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if (bind(fd, addr->ai_addr, addr->ai_addrlen) == -1 || listen(fd, 64) == -1) {
+		fprintf(stderr, "can't listen on '%s': %s\n", spec, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addr);
+	return fd;
+}
+
+static int connect_to(const char *spec)
+{
+	struct addrinfo *addr = resolve(spec, 0);
+	int fd, yes = 1;
+
+	if (!addr) {
+		return -1;
+	}
+	fd = socket(addr->ai_family, addr->ai_socktype, 0);
+	if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+		fprintf(stderr, "can't connect to '%s': %s\n", spec, strerror(errno));
+		close(fd);
+		fd = -1;
+	} else {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	}
+	freeaddrinfo(addr);
+	return fd;
+}
+
+static int accept_on(int listen_fd)
+{
+	int fd = accept(listen_fd, NULL, NULL), yes = 1;
+
+	if (fd != -1) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	}
+	return fd;
+}
+
+/* The size of a BSON value of the given type at value, or -1 for types that
+ * are not known here */
+static int value_size(char type, const char *value)
+{
+	switch (type) {
+		case 1: case 9: case 17: case 18:
+			return 8;
+		case 2: case 13: case 14:
+			return 4 + get_int(value);
+		case 3: case 4: case 15:
+			return get_int(value);
+		case 5:
+			return 5 + get_int(value);
+		case 6: case 10: case 127: case -1:
+			return 0;
+		case 7:
+			return 12;
+		case 8:
+			return 1;
+		case 11:
+			return strlen(value) + 1 + strlen(value + strlen(value) + 1) + 1;
+		case 12:
+			return 4 + get_int(value) + 12;
+		case 16:
+			return 4;
+	}
+	return -1;
+}
+
+/* Copies the BSON document at doc to out, with every string that is the
+ * UPSTREAM of a server replaced by its LISTEN address */
+static void rewrite_document(const char *doc, wire_buf *out)
+{
+	const char *p = doc + 4, *end = doc + get_int(doc) - 1, *name, *value;
+	int start = out->l, size, i;
+	char type;
+
+	buf_add_int(out, 0);
+	while (p < end) {
+		type = *p;
+		name = p + 1;
+		value = name + strlen(name) + 1;
+		size = value_size(type, value);
+		if (size < 0 || value + size > end) {
+			/* not understood, so the rest is kept as it is */
+			buf_add(out, p, end - p);
+			break;
+		}
+
+		if (type == 3 || type == 4) {
+			buf_add(out, p, value - p);
+			rewrite_document(value, out);
+		} else if (type == 2) {
+			for (i = 0; i < server_count; i++) {
+				if (strcmp(value + 4, servers[i].upstream) == 0) {
+					break;
+				}
+			}
+			buf_add(out, p, value - p);
+			if (i < server_count) {
+				buf_add_int(out, strlen(servers[i].listen) + 1);
+				buf_add(out, servers[i].listen, strlen(servers[i].listen) + 1);
+			} else {
+				buf_add(out, value, size);
+			}
+		} else {
+			buf_add(out, p, value + size - p);
+		}
+		p = value + size;
+	}
+	buf_add(out, "", 1);
+	set_int(out->d + start, out->l - start);
+}
+
+/* Copies the reply message, rewriting its documents */
+static void rewrite_reply(const char *message, int len, wire_buf *out)
+{
+	const char *p = message + REPLY_HEADER_SIZE;
+
+	out->l = 0;
+	buf_add(out, message, REPLY_HEADER_SIZE);
+	while (p + 5 <= message + len && p + get_int(p) <= message + len && get_int(p) >= 5) {
+		rewrite_document(p, out);
+		p += get_int(p);
+	}
+	set_int(out->d, out->l);
+}
+
+typedef struct {
+	int      client;
+	int      upstream;
+	int      server;
+	int      id;
+	wire_buf from_client;
+	wire_buf from_upstream;
+} wire_link;
+
+static void record_message(FILE *out, wire_link *link, int direction, struct timeval *start, const char *message, int len)
+{
+	int fields[4];
+
+	fields[0] = link->server;
+	fields[1] = link->id;
+	fields[2] = direction;
+	fields[3] = usec_since(start);
+	fwrite(fields, 4, 4, out);
+	fwrite(message, 1, len, out);
+}
+
+/* Forwards the complete messages in from to fd, recording them, and returns
+ * -1 when from holds something that isn't a message */
+static int forward(FILE *out, wire_link *link, wire_buf *from, int fd, int direction, struct timeval *start)
+{
+	wire_buf rewritten = { NULL, 0, 0 };
+	int len, status = 0;
+
+	while ((len = complete_message(from)) > 0) {
+		if (direction == 1 && get_int(from->d + 12) == OP_REPLY && len >= REPLY_HEADER_SIZE) {
+			rewrite_reply(from->d, len, &rewritten);
+			record_message(out, link, direction, start, rewritten.d, rewritten.l);
+			status = write_all(fd, rewritten.d, rewritten.l);
+		} else {
+			record_message(out, link, direction, start, from->d, len);
+			status = write_all(fd, from->d, len);
+		}
+		buf_shift(from, len);
+		if (status == -1) {
+			break;
+		}
+	}
+	free(rewritten.d);
+	return len == -1 ? -1 : status;
+}
+
+static void close_link(wire_link *link)
+{
+	close(link->client);
+	close(link->upstream);
+	free(link->from_client.d);
+	free(link->from_upstream.d);
+	link->client = -1;
+}
+
+static int record(char *file)
+{
+	wire_link links[MAX_LINKS];
+	struct pollfd pfds[MAX_SERVERS + 2 * MAX_LINKS];
+	struct timeval start;
+	char data[CHUNK_SIZE];
+	FILE *out;
+	int i, j, n, got, fd, link_count = 0, connections = 0;
+	wire_link *link;
+	wire_buf *from;
+
+	if (!(out = fopen(file, "wb"))) {
+		fprintf(stderr, "can't write '%s': %s\n", file, strerror(errno));
+		return 1;
+	}
+	fwrite(MAGIC, 1, strlen(MAGIC), out);
+	fwrite(&server_count, 4, 1, out);
+	for (i = 0; i < server_count; i++) {
+		n = strlen(servers[i].listen);
+		fwrite(&n, 4, 1, out);
+		fwrite(servers[i].listen, 1, n, out);
+		if ((servers[i].fd = listen_on(servers[i].listen)) == -1) {
+			return 1;
+		}
+		printf("recording %s for %s\n", servers[i].upstream, servers[i].listen);
+	}
+	fflush(stdout);
+	gettimeofday(&start, NULL);
+
+	while (1) {
+		n = 0;
+		for (i = 0; i < server_count; i++) {
+			pfds[n].fd = servers[i].fd;
+			pfds[n++].events = POLLIN;
+		}
+		for (i = 0; i < link_count; i++) {
+			pfds[n].fd = links[i].client;
+			pfds[n++].events = POLLIN;
+			pfds[n].fd = links[i].upstream;
+			pfds[n++].events = POLLIN;
+		}
+		if (poll(pfds, n, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (i = 0; i < server_count; i++) {
+			if (!(pfds[i].revents & POLLIN) || (fd = accept_on(servers[i].fd)) == -1) {
+				continue;
+			}
+			if (link_count == MAX_LINKS) {
+				close(fd);
+				continue;
+			}
+			link = &links[link_count];
+			memset(link, 0, sizeof(wire_link));
+			link->client = fd;
+			link->server = i;
+			link->id = connections++;
+			if ((link->upstream = connect_to(servers[i].upstream)) == -1) {
+				close(fd);
+				continue;
+			}
+			link_count++;
+		}
+
+		for (i = 0; i < link_count; i++) {
+			link = &links[i];
+			for (j = 0; j < 2 && link->client != -1; j++) {
+				struct pollfd *p = &pfds[server_count + 2 * i + j];
+
+				if (!(p->revents & (POLLIN | POLLHUP | POLLERR))) {
+					continue;
+				}
+				from = j ? &link->from_upstream : &link->from_client;
+				got = read(p->fd, data, sizeof(data));
+				if (got <= 0) {
+					close_link(link);
+					break;
+				}
+				buf_add(from, data, got);
+				if (forward(out, link, from, j ? link->client : link->upstream, j, &start) == -1) {
+					close_link(link);
+				}
+			}
+		}
+
+		/* drop the links that were closed */
+		for (i = 0, j = 0; i < link_count; i++) {
+			if (links[i].client != -1) {
+				links[j++] = links[i];
+			}
+		}
+		link_count = j;
+		fflush(out);
+	}
+
+	fclose(out);
+	return 0;
+}
+
+typedef struct {
+	int    server;
+	int    connection;
+	int    request_id;
+	int    last_reply_id;
+	long   at;
+	char   key[300];
+	int    used;
+	int    reply_count;
+	char **replies;
+	long   rtt;
+} wire_exchange;
+
+static wire_exchange *exchanges = NULL;
+static int exchange_count = 0;
+
+static int latency_ms = -1, jitter_ms = 0;
+static long bandwidth = 0;
+
+/* Requests that are answered the same way have the same key */
+static int request_key(const char *message, int len, char *key, int key_len)
+{
+	int op = get_int(message + 12);
+	const char *ns = message + 20, *query;
+
+	if ((op != OP_QUERY && op != OP_GET_MORE) || len < 21 || !memchr(ns, '\0', len - 20)) {
+		return 0;
+	}
+	if (op == OP_GET_MORE) {
+		snprintf(key, key_len, "getmore %s", ns);
+		return 1;
+	}
+
+	query = ns + strlen(ns) + 1 + 8;
+	if (query + 5 < message + len && query[4] != '\0') {
+		snprintf(key, key_len, "query %s %s", ns, query + 5);
+	} else {
+		snprintf(key, key_len, "query %s", ns);
+	}
+	return 1;
+}
+
+/* The exchange on the same connection that the reply belongs to: the one of
+ * the request it answers, or with an exhaust cursor the one of the reply
+ * before it */
+static wire_exchange *find_exchange(int server, int connection, int response_to)
+{
+	int i;
+
+	for (i = exchange_count - 1; i >= 0; i--) {
+		wire_exchange *e = &exchanges[i];
+
+		if (e->server == server && e->connection == connection && (e->request_id == response_to || (e->reply_count && e->last_reply_id == response_to))) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static int load(char *file)
+{
+	FILE *in;
+	char magic[sizeof(MAGIC)], *message;
+	int fields[4], len, i, allocated = 0;
+	wire_exchange *e;
+
+	if (!(in = fopen(file, "rb"))) {
+		fprintf(stderr, "can't read '%s': %s\n", file, strerror(errno));
+		return -1;
+	}
+	if (fread(magic, 1, strlen(MAGIC), in) != strlen(MAGIC) || memcmp(magic, MAGIC, strlen(MAGIC)) != 0 || fread(&server_count, 4, 1, in) != 1 || server_count < 1 || server_count > MAX_SERVERS) {
+		fprintf(stderr, "'%s' is not a recording\n", file);
+		return -1;
+	}
+	for (i = 0; i < server_count; i++) {
+		if (fread(&len, 4, 1, in) != 1 || len < 1 || len > 300) {
+			fprintf(stderr, "'%s' is not a recording\n", file);
+			return -1;
+		}
+		servers[i].listen = calloc(1, len + 1);
+		if (fread(servers[i].listen, 1, len, in) != (size_t) len) {
+			return -1;
+		}
+	}
+
+	while (fread(fields, 4, 4, in) == 4 && fread(&len, 4, 1, in) == 1) {
+		if (len < 16 || len > MAX_MESSAGE || fields[0] < 0 || fields[0] >= server_count) {
+			fprintf(stderr, "'%s' is broken\n", file);
+			return -1;
+		}
+		message = malloc(len);
+		set_int(message, len);
+		if (fread(message + 4, 1, len - 4, in) != (size_t) (len - 4)) {
+			free(message);
+			break;
+		}
+
+		if (fields[2] == 0) {
+			if (exchange_count == allocated) {
+				allocated = allocated ? allocated * 2 : 256;
+				exchanges = realloc(exchanges, allocated * sizeof(wire_exchange));
+			}
+			e = &exchanges[exchange_count];
+			memset(e, 0, sizeof(wire_exchange));
+			if (request_key(message, len, e->key, sizeof(e->key))) {
+				e->server = fields[0];
+				e->connection = fields[1];
+				e->request_id = get_int(message + 4);
+				e->at = fields[3];
+				exchange_count++;
+			}
+			free(message);
+		} else if ((e = find_exchange(fields[0], fields[1], get_int(message + 8)))) {
+			e->replies = realloc(e->replies, (e->reply_count + 1) * sizeof(char*));
+			e->replies[e->reply_count++] = message;
+			e->last_reply_id = get_int(message + 4);
+			if (e->reply_count == 1) {
+				e->rtt = fields[3] - e->at;
+			}
+		} else {
+			free(message);
+		}
+	}
+	fclose(in);
+
+	/* requests that never got a reply recorded can't be replayed */
+	for (i = 0, len = 0; i < exchange_count; i++) {
+		if (exchanges[i].reply_count) {
+			exchanges[len++] = exchanges[i];
+		}
+	}
+	exchange_count = len;
+	return 0;
+}
+
+/* The recorded exchange to replay for the request: the first unused one like
+ * it, or once all of those have been used, the first one again */
+static wire_exchange *next_exchange(int server, const char *key)
+{
+	wire_exchange *first = NULL;
+	int i;
+
+	for (i = 0; i < exchange_count; i++) {
+		if (exchanges[i].server != server || strcmp(exchanges[i].key, key) != 0) {
+			continue;
+		}
+		if (!exchanges[i].used) {
+			exchanges[i].used = 1;
+			return &exchanges[i];
+		}
+		if (!first) {
+			first = &exchanges[i];
+		}
+	}
+	if (first) {
+		for (i = 0; i < exchange_count; i++) {
+			if (exchanges[i].server == server && strcmp(exchanges[i].key, key) == 0) {
+				exchanges[i].used = 0;
+			}
+		}
+		first->used = 1;
+	}
+	return first;
+}
+
+static void pause_us(long us)
+{
+	struct timespec ts;
+
+	if (us <= 0) {
+		return;
+	}
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+/* Sends the reply in chunks, as fast as the bandwidth allows */
+static int send_reply(int fd, const char *reply, int len)
+{
+	int chunk;
+
+	if (!bandwidth) {
+		return write_all(fd, reply, len);
+	}
+	while (len > 0) {
+		chunk = len > CHUNK_SIZE ? CHUNK_SIZE : len;
+		if (write_all(fd, reply, chunk) == -1) {
+			return -1;
+		}
+		pause_us(chunk * 1000000L / bandwidth);
+		reply += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/* The answer for requests that weren't recorded: { ok: 1 } for commands and
+ * no documents for queries */
+static void empty_reply(const char *request, const char *key, wire_buf *out)
+{
+	static const char ok[] = { 17, 0, 0, 0, 1, 'o', 'k', 0, 0, 0, 0, 0, 0, 0, (char) 0xf0, 0x3f, 0 };
+	int is_command = strstr(key, ".$cmd") != NULL;
+
+	out->l = 0;
+	buf_add_int(out, 0);
+	buf_add_int(out, 0);
+	buf_add_int(out, get_int(request + 4));
+	buf_add_int(out, OP_REPLY);
+	buf_add_int(out, 0);
+	buf_add(out, "\0\0\0\0\0\0\0\0", 8);
+	buf_add_int(out, 0);
+	buf_add_int(out, is_command);
+	if (is_command) {
+		buf_add(out, ok, sizeof(ok));
+	}
+	set_int(out->d, out->l);
+}
+
+static void serve(int fd, int server)
+{
+	wire_buf in = { NULL, 0, 0 }, reply = { NULL, 0, 0 };
+	char data[CHUNK_SIZE], key[300];
+	wire_exchange *e;
+	long delay;
+	int len, got, i;
+
+	while ((got = read(fd, data, sizeof(data))) > 0) {
+		buf_add(&in, data, got);
+		while ((len = complete_message(&in)) > 0) {
+			if (!request_key(in.d, len, key, sizeof(key))) {
+				/* writes and killCursors don't get a reply */
+				buf_shift(&in, len);
+				continue;
+			}
+
+			e = next_exchange(server, key);
+			delay = latency_ms >= 0 ? latency_ms * 1000L : (e ? e->rtt : 0);
+			if (jitter_ms) {
+				delay += (rand() % (2 * jitter_ms + 1) - jitter_ms) * 1000L;
+			}
+			pause_us(delay);
+
+			if (!e) {
+				fprintf(stderr, "nothing recorded for '%s'\n", key);
+				empty_reply(in.d, key, &reply);
+				if (send_reply(fd, reply.d, reply.l) == -1) {
+					return;
+				}
+			}
+			for (i = 0; e && i < e->reply_count; i++) {
+				len = get_int(e->replies[i]);
+				reply.l = 0;
+				buf_add(&reply, e->replies[i], len);
+				if (i == 0) {
+					set_int(reply.d + 8, get_int(in.d + 4));
+				}
+				if (send_reply(fd, reply.d, reply.l) == -1) {
+					return;
+				}
+			}
+			buf_shift(&in, get_int(in.d));
+		}
+		if (len == -1) {
+			return;
+		}
+	}
+}
+
+static int replay(char *file, int seed)
+{
+	struct pollfd pfds[MAX_SERVERS];
+	pid_t pids[MAX_LINKS];
+	int owners[MAX_LINKS], child_count = 0, connections = 0;
+	struct timeval start;
+	int i, j, fd;
+	pid_t pid;
+
+	if (load(file) == -1) {
+		return 1;
+	}
+	for (i = 0; i < server_count; i++) {
+		if ((servers[i].fd = listen_on(servers[i].listen)) == -1) {
+			return 1;
+		}
+		printf("replaying %s\n", servers[i].listen);
+	}
+	fflush(stdout);
+	signal(SIGPIPE, SIG_IGN);
+	gettimeofday(&start, NULL);
+
+	while (1) {
+		for (i = 0; i < server_count; i++) {
+			if (servers[i].kill_after >= 0 && !servers[i].killed && usec_since(&start) >= servers[i].kill_after * 1000000L) {
+				printf("%s goes away\n", servers[i].listen);
+				fflush(stdout);
+				close(servers[i].fd);
+				servers[i].killed = 1;
+				for (j = 0; j < child_count; j++) {
+					if (owners[j] == i) {
+						kill(pids[j], SIGKILL);
+					}
+				}
+			}
+			pfds[i].fd = servers[i].killed ? -1 : servers[i].fd;
+			pfds[i].events = POLLIN;
+		}
+
+		/* forget the children that are done */
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+			for (j = 0; j < child_count; j++) {
+				if (pids[j] == pid) {
+					pids[j] = pids[--child_count];
+					owners[j] = owners[child_count];
+					break;
+				}
+			}
+		}
+
+		if (poll(pfds, server_count, 100) <= 0) {
+			continue;
+		}
+		for (i = 0; i < server_count; i++) {
+			if (!(pfds[i].revents & POLLIN) || (fd = accept_on(servers[i].fd)) == -1) {
+				continue;
+			}
+			connections++;
+			pid = child_count < MAX_LINKS ? fork() : -1;
+			if (pid == 0) {
+				for (j = 0; j < server_count; j++) {
+					close(servers[j].fd);
+				}
+				srand(seed + connections);
+				serve(fd, i);
+				exit(0);
+			}
+			if (pid > 0) {
+				pids[child_count] = pid;
+				owners[child_count++] = i;
+			}
+			close(fd);
+		}
+	}
+	return 0;
+}
+
+static int usage(void)
+{
+	fprintf(stderr,
+		"usage: wire record -o FILE LISTEN=UPSTREAM [LISTEN=UPSTREAM...]\n"
+		"       wire replay -i FILE [-d MS] [-j MS] [-b BYTES] [-s SEED] [-k SERVER:SEC]\n");
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	char *file = NULL, *equals;
+	int i, seed = 1, server, seconds;
+
+	if (argc < 2) {
+		return usage();
+	}
+	for (i = 0; i < MAX_SERVERS; i++) {
+		servers[i].kill_after = -1;
+	}
+
+	if (strcmp(argv[1], "record") == 0) {
+		for (i = 2; i < argc; i++) {
+			if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+				file = argv[++i];
+			} else if ((equals = strchr(argv[i], '=')) && server_count < MAX_SERVERS) {
+				*equals = '\0';
+				servers[server_count].listen = argv[i];
+				servers[server_count++].upstream = equals + 1;
+			} else {
+				return usage();
+			}
+		}
+		if (!file || !server_count) {
+			return usage();
+		}
+		return record(file);
+	}
+
+	if (strcmp(argv[1], "replay") == 0) {
+		for (i = 2; i + 1 < argc; i += 2) {
+			if (strcmp(argv[i], "-i") == 0) {
+				file = argv[i + 1];
+			} else if (strcmp(argv[i], "-d") == 0) {
+				latency_ms = atoi(argv[i + 1]);
+			} else if (strcmp(argv[i], "-j") == 0) {
+				jitter_ms = atoi(argv[i + 1]);
+			} else if (strcmp(argv[i], "-b") == 0) {
+				bandwidth = atol(argv[i + 1]);
+			} else if (strcmp(argv[i], "-s") == 0) {
+				seed = atoi(argv[i + 1]);
+			} else if (strcmp(argv[i], "-k") == 0 && sscanf(argv[i + 1], "%d:%d", &server, &seconds) == 2 && server >= 0 && server < MAX_SERVERS) {
+				servers[server].kill_after = seconds;
+			} else {
+				return usage();
+			}
+		}
+		if (!file || i != argc) {
+			return usage();
+		}
+		return replay(file, seed);
+	}
+
+	return usage();
+}
@@ -19,6 +19,7 @@
 
 #include "../php_mongo.h"
 #include "log.h"
+#include "../mcon/trace.h"
 
 zend_class_entry *mongo_ce_Log;
 ZEND_EXTERN_MODULE_GLOBALS(mongo);
@@ -35,6 +36,7 @@ static zend_function_entry mongo_log_methods[] = {
   PHP_ME(MongoLog, getLevel, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
   PHP_ME(MongoLog, setModule, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
   PHP_ME(MongoLog, getModule, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
+	PHP_ME(MongoLog, dumpTrace, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
 #if PHP_VERSION_ID >= 50300
 	PHP_ME(MongoLog, setCallback, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
 	PHP_ME(MongoLog, getCallback, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
@@ -90,6 +92,7 @@ static void get_value(char *setting, zval *return_value TSRMLS_DC) {
 PHP_METHOD(MongoLog, setLevel)
 {
 	MonGlo(log_level) = set_value("level", return_value TSRMLS_CC);
+	MonGlo(manager)->log_levels = MonGlo(log_level);
 }
 
 PHP_METHOD(MongoLog, getLevel)
@@ -100,6 +103,7 @@ PHP_METHOD(MongoLog, getLevel)
 PHP_METHOD(MongoLog, setModule)
 {
 	MonGlo(log_module) = set_value("module", return_value TSRMLS_CC);
+	MonGlo(manager)->log_modules = MonGlo(log_module);
 }
 
 #if PHP_VERSION_ID >= 50300
@@ -159,6 +163,31 @@ PHP_METHOD(MongoLog, getModule)
 	get_value("module", return_value TSRMLS_CC);
 }
 
+static void add_trace_line(void *context, char *text)
+{
+	add_next_index_string((zval*) context, text, 1);
+}
+
+/* {{{ proto array MongoLog::dumpTrace([bool clear])
+   Returns the events that are in the trace buffer (see mongo.trace_buffer),
+   from the oldest to the newest, formatted as lines. With clear, the buffer is
+   emptied afterwards. */
+PHP_METHOD(MongoLog, dumpTrace)
+{
+	zend_bool clear = 0;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|b", &clear) == FAILURE) {
+		return;
+	}
+
+	array_init(return_value);
+	mongo_trace_dump(MonGlo(manager)->trace, add_trace_line, return_value);
+	if (clear) {
+		mongo_trace_clear(MonGlo(manager)->trace);
+	}
+}
+/* }}} */
+
 static char *level_name(int level)
 {
 	switch (level) {
@@ -185,10 +214,10 @@ void php_mongo_log(const int module, const int level TSRMLS_DC, const char *form
 {
 	if ((module & MonGlo(log_module)) && (level & MonGlo(log_level))) {
 		va_list  args;
-		char    *tmp = malloc(256);
+		char     tmp[256];
 
 		va_start(args, format);
-		vsnprintf(tmp, 256, format, args);
+		vsnprintf(tmp, sizeof(tmp), format, args);
 		va_end(args);
 
 		if (MonGlo(log_callback_info).function_name) {
@@ -196,8 +225,6 @@ void php_mongo_log(const int module, const int level TSRMLS_DC, const char *form
 		} else {
 			php_error(E_NOTICE, "%s %s: %s", module_name(module), level_name(level), tmp);
 		}
-
-		free(tmp);
 	}
 }
 
@@ -207,10 +234,10 @@ void php_mcon_log_wrapper(int module, int level, void *context, char *format, va
 
 	if ((module & MonGlo(log_module)) && (level & MonGlo(log_level))) {
 		va_list  tmp_args;
-		char    *tmp = malloc(256);
+		char     tmp[256];
 
 		va_copy(tmp_args, args);
-		vsnprintf(tmp, 256, format, tmp_args);
+		vsnprintf(tmp, sizeof(tmp), format, tmp_args);
 		va_end(tmp_args);
 
 		if (MonGlo(log_callback_info).function_name) {
@@ -218,7 +245,5 @@ void php_mcon_log_wrapper(int module, int level, void *context, char *format, va
 		} else {
 			php_error(E_NOTICE, "%s %s: %s", module_name(module), level_name(level), tmp);
 		}
-
-		free(tmp);
 	}
 }
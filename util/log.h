@@ -24,6 +24,7 @@ PHP_METHOD(MongoLog, setLevel);
 PHP_METHOD(MongoLog, getLevel);
 PHP_METHOD(MongoLog, setModule);
 PHP_METHOD(MongoLog, getModule);
+PHP_METHOD(MongoLog, dumpTrace);
 #if PHP_VERSION_ID >= 50300
 PHP_METHOD(MongoLog, setCallback);
 PHP_METHOD(MongoLog, getCallback);
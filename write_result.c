@@ -0,0 +1,209 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include <php.h>
+#include <zend_exceptions.h>
+
+#ifdef WIN32
+#  ifndef int64_t
+     typedef __int64 int64_t;
+#  endif
+#endif
+
+#include "php_mongo.h"
+#include "bson.h"
+#include "cursor.h"
+#include "write_result.h"
+#include "mcon/manager.h"
+
+extern zend_class_entry *mongo_ce_CursorException;
+
+extern zend_object_handlers mongo_default_handlers;
+
+zend_class_entry *mongo_ce_WriteResult = NULL;
+
+#define PHP_MONGO_GET_WRITE_RESULT(obj)                                             \
+  result = (mongo_write_result*)zend_object_store_get_object((obj) TSRMLS_CC);      \
+  MONGO_CHECK_INITIALIZED(result->sent, MongoWriteResult);
+
+void php_mongo_write_result_init(zval *zresult, mongo_connection *connection, int request_id, int timeout TSRMLS_DC)
+{
+	mongo_write_result *result;
+
+	object_init_ex(zresult, mongo_ce_WriteResult);
+	result = (mongo_write_result*)zend_object_store_get_object(zresult TSRMLS_CC);
+
+	result->sent = 1;
+	result->hash = estrdup(connection->hash);
+	result->cursor.connection = connection;
+	result->cursor.send.request_id = request_id;
+	result->cursor.timeout = timeout;
+
+	php_mongo_cursor_queue_pending(&result->cursor);
+}
+
+/* Returns the connection that the reply is still coming on, or NULL if the
+ * connection was closed (and maybe another one opened in its place) since the
+ * write was sent. It is looked up by its hash, and must still have the result
+ * queued as an owner. */
+static mongo_connection *result_connection(mongo_write_result *result TSRMLS_DC)
+{
+	mongo_cursor *owner;
+
+	if (!result->cursor.prefetch_pending || !mongo_manager_connection_has_socket(MonGlo(manager), result->hash, result->cursor.connection)) {
+		return NULL;
+	}
+	for (owner = (mongo_cursor*)result->cursor.connection->pending_reply; owner; owner = owner->next_pending) {
+		if (owner == &result->cursor) {
+			return result->cursor.connection;
+		}
+	}
+	return NULL;
+}
+
+/* Forgets the connection once it can't be used anymore */
+static void lose_connection(mongo_write_result *result)
+{
+	result->cursor.connection = NULL;
+	result->cursor.next_pending = NULL;
+	result->cursor.prefetch_pending = 0;
+}
+
+/* Reads and decodes the getlasterror reply, unless that has been done
+ * already. Returns FAILURE, with an exception thrown, if it can't be read. */
+static int fetch_result(mongo_write_result *result TSRMLS_DC)
+{
+	if (result->result) {
+		return SUCCESS;
+	}
+
+	/* reading the reply failed before, and the connection is gone */
+	if (result->cursor.dead) {
+		zend_throw_exception(mongo_ce_CursorException, "the reply to this write has been lost", 23 TSRMLS_CC);
+		return FAILURE;
+	}
+
+	if (result->cursor.prefetch_pending && !result_connection(result TSRMLS_CC)) {
+		lose_connection(result);
+		result->cursor.dead = 1;
+		zend_throw_exception(mongo_ce_CursorException, "the reply to this write has been lost", 23 TSRMLS_CC);
+		return FAILURE;
+	}
+
+	if (result->cursor.prefetch_pending && php_mongo_cursor_read_pending(&result->cursor TSRMLS_CC) == FAILURE) {
+		return FAILURE;
+	}
+	/* the reply is read, the connection may go away from here on */
+	result->cursor.connection = NULL;
+
+	MAKE_STD_ZVAL(result->result);
+	array_init(result->result);
+	if (result->cursor.prefetch_ready && result->cursor.num > 0) {
+		bson_to_zval(result->cursor.prefetch_buf.start, Z_ARRVAL_P(result->result) TSRMLS_CC);
+	}
+
+	/* the reply is not needed any more */
+	if (result->cursor.prefetch_buf.start) {
+		efree(result->cursor.prefetch_buf.start);
+		result->cursor.prefetch_buf.start = NULL;
+	}
+	result->cursor.prefetch_ready = 0;
+
+	return SUCCESS;
+}
+
+/* {{{ MongoWriteResult::getResult()
+ * Returns the getlasterror document of the write, waiting for it if needed.
+ * Throws a MongoCursorException if the write failed, like a safe write does. */
+PHP_METHOD(MongoWriteResult, getResult)
+{
+	mongo_write_result *result;
+
+	PHP_MONGO_GET_WRITE_RESULT(getThis());
+
+	if (fetch_result(result TSRMLS_CC) == FAILURE) {
+		return;
+	}
+
+	if (php_mongo_cursor_throw_error(mongo_manager_connection_find_by_hash(MonGlo(manager), result->hash), result->result TSRMLS_CC)) {
+		return;
+	}
+
+	RETURN_ZVAL(result->result, 1, 0);
+}
+/* }}} */
+
+/* {{{ MongoWriteResult::isReady()
+ * Returns whether the reply has been read already, so that getResult() does
+ * not have to wait. */
+PHP_METHOD(MongoWriteResult, isReady)
+{
+	mongo_write_result *result;
+
+	PHP_MONGO_GET_WRITE_RESULT(getThis());
+
+	RETURN_BOOL(!result->cursor.prefetch_pending);
+}
+/* }}} */
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_no_parameters, 0, ZEND_RETURN_VALUE, 0)
+ZEND_END_ARG_INFO()
+
+static zend_function_entry MongoWriteResult_methods[] = {
+	PHP_ME(MongoWriteResult, getResult, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	PHP_ME(MongoWriteResult, isReady, arginfo_no_parameters, ZEND_ACC_PUBLIC)
+	{ NULL, NULL, NULL }
+};
+
+static void php_mongo_write_result_free(void *object TSRMLS_DC)
+{
+	mongo_write_result *result = (mongo_write_result*)object;
+
+	if (result) {
+		/* the reply must not be left on the connection for the next reader */
+		if (result_connection(result TSRMLS_CC)) {
+			php_mongo_cursor_discard_pending(&result->cursor TSRMLS_CC);
+		}
+
+		if (result->hash) {
+			efree(result->hash);
+		}
+
+		if (result->cursor.prefetch_buf.start) {
+			efree(result->cursor.prefetch_buf.start);
+		}
+		if (result->result) {
+			zval_ptr_dtor(&result->result);
+		}
+
+		zend_object_std_dtor(&result->std TSRMLS_CC);
+		efree(result);
+	}
+}
+
+static zend_object_value php_mongo_write_result_new(zend_class_entry *class_type TSRMLS_DC)
+{
+	php_mongo_obj_new(mongo_write_result);
+}
+
+void mongo_init_MongoWriteResult(TSRMLS_D)
+{
+	zend_class_entry ce;
+
+	INIT_CLASS_ENTRY(ce, "MongoWriteResult", MongoWriteResult_methods);
+	ce.create_object = php_mongo_write_result_new;
+	mongo_ce_WriteResult = zend_register_internal_class(&ce TSRMLS_CC);
+	mongo_ce_WriteResult->ce_flags |= ZEND_ACC_FINAL_CLASS;
+}
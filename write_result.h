@@ -0,0 +1,32 @@
+/**
+ *  Copyright 2009-2011 10gen, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef MONGO_WRITE_RESULT_H
+#define MONGO_WRITE_RESULT_H 1
+
+/**
+ * Turns zresult into a MongoWriteResult for the getlasterror with the given
+ * request id, which has just been sent on connection. Its reply is read when
+ * the result is asked for, or set aside when the connection is used for
+ * something else first.
+ */
+void php_mongo_write_result_init(zval *zresult, mongo_connection *connection, int request_id, int timeout TSRMLS_DC);
+
+void mongo_init_MongoWriteResult(TSRMLS_D);
+
+PHP_METHOD(MongoWriteResult, getResult);
+PHP_METHOD(MongoWriteResult, isReady);
+
+#endif